@@ -48,6 +48,7 @@ namespace OpenCover.Framework.Communication
     {
         const int GspBufSize = 8000;
         const int GbpBufSize = 2000;
+        const int VcBufSize = 8000;
 
         private readonly IProfilerCommunication _profilerCommunication;
         private readonly IMarshalWrapper _marshalWrapper;
@@ -109,6 +110,18 @@ namespace OpenCover.Framework.Communication
                 case MSG_Type.MSG_TrackProcess:
                     writeSize = HandleTrackProcessMessage(pinnedMemory);
                     break;
+
+                case MSG_Type.MSG_ReportCoverageLevel:
+                    writeSize = HandleReportCoverageLevelMessage(pinnedMemory);
+                    break;
+
+                case MSG_Type.MSG_AllocateUniqueIds:
+                    writeSize = HandleAllocateUniqueIdsMessage(pinnedMemory);
+                    break;
+
+                case MSG_Type.MSG_SendVisitCounts:
+                    writeSize = HandleSendVisitCountsMessage(pinnedMemory);
+                    break;
                 default:
                     throw new InvalidOperationException();
 
@@ -343,6 +356,79 @@ namespace OpenCover.Framework.Communication
             return writeSize;
         }
 
+        private int HandleReportCoverageLevelMessage(IntPtr pinnedMemory)
+        {
+            var response = new MSG_ReportCoverageLevel_Response();
+            var writeSize = Marshal.SizeOf(typeof(MSG_ReportCoverageLevel_Response));
+            try
+            {
+                var request = _marshalWrapper.PtrToStructure<MSG_ReportCoverageLevel_Request>(pinnedMemory);
+                response.done = _profilerCommunication.ReportCoverageLevel(request.modulePath, request.assemblyName,
+                    request.functionToken, request.level, request.probes, request.originalSize, request.instrumentedSize);
+            }
+            catch (Exception ex)
+            {
+                DebugLogger.ErrorFormat("HandleReportCoverageLevelMessage => {0}:{1}", ex.GetType(), ex);
+                response.done = false;
+            }
+            finally
+            {
+                _marshalWrapper.StructureToPtr(response, pinnedMemory, false);
+            }
+            return writeSize;
+        }
+
+        private int HandleAllocateUniqueIdsMessage(IntPtr pinnedMemory)
+        {
+            var response = new MSG_AllocateUniqueIds_Response();
+            var writeSize = Marshal.SizeOf(typeof(MSG_AllocateUniqueIds_Response));
+            try
+            {
+                var request = _marshalWrapper.PtrToStructure<MSG_AllocateUniqueIds_Request>(pinnedMemory);
+                response.allocated = _profilerCommunication.AllocateUniqueIds(request.processPath, request.modulePath, request.assemblyName,
+                    request.functionToken, request.sequencePoints, request.branchPoints, request.pointsHash,
+                    out response.entryPointId, out response.firstSequenceId, out response.firstBranchId);
+            }
+            catch (Exception ex)
+            {
+                DebugLogger.ErrorFormat("HandleAllocateUniqueIdsMessage => {0}:{1}", ex.GetType(), ex);
+                response.allocated = false;
+            }
+            finally
+            {
+                _marshalWrapper.StructureToPtr(response, pinnedMemory, false);
+            }
+            return writeSize;
+        }
+
+        private int HandleSendVisitCountsMessage(IntPtr pinnedMemory)
+        {
+            var response = new MSG_SendVisitCounts_Response();
+            var writeSize = Marshal.SizeOf(typeof(MSG_SendVisitCounts_Response));
+            try
+            {
+                var request = _marshalWrapper.PtrToStructure<MSG_SendVisitCounts_Request>(pinnedMemory);
+                var offset = Marshal.SizeOf(typeof(MSG_SendVisitCounts_Request));
+                var chunk = Marshal.SizeOf(typeof(MSG_VisitCount));
+                response.done = true;
+                for (var i = 0; i < Math.Min(request.count, VcBufSize); i++, offset += chunk)
+                {
+                    var count = _marshalWrapper.PtrToStructure<MSG_VisitCount>(pinnedMemory + offset);
+                    response.done &= _profilerCommunication.AddVisitCount(count.uniqueId, count.visits);
+                }
+            }
+            catch (Exception ex)
+            {
+                DebugLogger.ErrorFormat("HandleSendVisitCountsMessage => {0}:{1}", ex.GetType(), ex);
+                response.done = false;
+            }
+            finally
+            {
+                _marshalWrapper.StructureToPtr(response, pinnedMemory, false);
+            }
+            return writeSize;
+        }
+
         private int _readSize;
 
         /// <summary>
@@ -366,7 +452,13 @@ namespace OpenCover.Framework.Communication
                         Marshal.SizeOf(typeof(MSG_AllocateBuffer_Request)), 
                         Marshal.SizeOf(typeof(MSG_AllocateBuffer_Response)), 
                         Marshal.SizeOf(typeof(MSG_CloseChannel_Request)), 
-                        Marshal.SizeOf(typeof(MSG_CloseChannel_Response)) 
+                        Marshal.SizeOf(typeof(MSG_CloseChannel_Response)), 
+                        Marshal.SizeOf(typeof(MSG_ReportCoverageLevel_Request)), 
+                        Marshal.SizeOf(typeof(MSG_ReportCoverageLevel_Response)), 
+                        Marshal.SizeOf(typeof(MSG_AllocateUniqueIds_Request)), 
+                        Marshal.SizeOf(typeof(MSG_AllocateUniqueIds_Response)), 
+                        Marshal.SizeOf(typeof(MSG_SendVisitCounts_Request)) + VcBufSize * Marshal.SizeOf(typeof(MSG_VisitCount)), 
+                        Marshal.SizeOf(typeof(MSG_SendVisitCounts_Response)) 
                     }).Max();
                 }
                 return _readSize;
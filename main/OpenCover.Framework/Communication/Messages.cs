@@ -52,6 +52,21 @@ namespace OpenCover.Framework.Communication
         /// Do we track this process
         /// </summary>
         MSG_TrackProcess = 7,
+
+        /// <summary>
+        /// Report a method that was given coarser coverage than asked for
+        /// </summary>
+        MSG_ReportCoverageLevel = 8,
+
+        /// <summary>
+        /// Allocate the ids of the points of a method the profiler found from its symbols
+        /// </summary>
+        MSG_AllocateUniqueIds = 9,
+
+        /// <summary>
+        /// The number of times each of a set of points was visited
+        /// </summary>
+        MSG_SendVisitCounts = 10,
     }
 
     /// <summary>
@@ -446,6 +461,193 @@ namespace OpenCover.Framework.Communication
         [MarshalAs(UnmanagedType.Bool)]
         public bool track;
     }
+
+    /// <summary>
+    /// Report a method that exceeded its probe budget
+    /// </summary>
+    [StructLayout(LayoutKind.Sequential, Pack = 1, CharSet = CharSet.Unicode)]
+    public struct MSG_ReportCoverageLevel_Request
+    {
+        /// <summary>
+        /// The message type
+        /// </summary>
+        public MSG_Type type;
+
+        /// <summary>
+        /// The metadata token of the method
+        /// </summary>
+        public int functionToken;
+
+        /// <summary>
+        /// The path to the module hosting the method
+        /// </summary>
+        [MarshalAs(UnmanagedType.ByValTStr, SizeConst = 512)]
+        public string modulePath;
+
+        /// <summary>
+        /// The name of the assembly hosting the method
+        /// </summary>
+        [MarshalAs(UnmanagedType.ByValTStr, SizeConst = 512)]
+        public string assemblyName;
+
+        /// <summary>
+        /// The coverage the method was given; 0 - branch, 1 - sequence, 2 - entry only
+        /// </summary>
+        public uint level;
+
+        /// <summary>
+        /// The number of probes inserted
+        /// </summary>
+        public uint probes;
+
+        /// <summary>
+        /// The size of the IL before instrumentation
+        /// </summary>
+        public uint originalSize;
+
+        /// <summary>
+        /// The size of the IL after instrumentation
+        /// </summary>
+        public uint instrumentedSize;
+    }
+
+    /// <summary>
+    /// The response to a <see cref="MSG_ReportCoverageLevel_Request"/>
+    /// </summary>
+    [StructLayout(LayoutKind.Sequential, Pack = 1)]
+    public struct MSG_ReportCoverageLevel_Response
+    {
+        /// <summary>
+        /// True - if the report was accepted
+        /// </summary>
+        [MarshalAs(UnmanagedType.Bool)]
+        public bool done;
+    }
+
+    /// <summary>
+    /// Allocate the ids of the points of a method the profiler found from its symbols
+    /// </summary>
+    [StructLayout(LayoutKind.Sequential, Pack = 1, CharSet = CharSet.Unicode)]
+    public struct MSG_AllocateUniqueIds_Request
+    {
+        /// <summary>
+        /// The message type
+        /// </summary>
+        public MSG_Type type;
+
+        /// <summary>
+        /// The metadata token of the method
+        /// </summary>
+        public int functionToken;
+
+        /// <summary>
+        /// The path to the process
+        /// </summary>
+        [MarshalAs(UnmanagedType.ByValTStr, SizeConst = 512)]
+        public string processPath;
+
+        /// <summary>
+        /// The path to the module hosting the method
+        /// </summary>
+        [MarshalAs(UnmanagedType.ByValTStr, SizeConst = 512)]
+        public string modulePath;
+
+        /// <summary>
+        /// The name of the assembly hosting the method
+        /// </summary>
+        [MarshalAs(UnmanagedType.ByValTStr, SizeConst = 512)]
+        public string assemblyName;
+
+        /// <summary>
+        /// The number of sequence points the profiler found (not counting an entry point)
+        /// </summary>
+        public uint sequencePoints;
+
+        /// <summary>
+        /// The number of branch points the profiler found
+        /// </summary>
+        public uint branchPoints;
+
+        /// <summary>
+        /// The hash of the offsets of the points, see <see cref="OpenCover.Framework.Service.PointsHash"/>
+        /// </summary>
+        public uint pointsHash;
+    }
+
+    /// <summary>
+    /// The response to a <see cref="MSG_AllocateUniqueIds_Request"/>
+    /// </summary>
+    [StructLayout(LayoutKind.Sequential, Pack = 1)]
+    public struct MSG_AllocateUniqueIds_Response
+    {
+        /// <summary>
+        /// True - the points are those of the host and the ids follow
+        /// </summary>
+        [MarshalAs(UnmanagedType.Bool)]
+        public bool allocated;
+
+        /// <summary>
+        /// The id of the entry point the host added, if it added one
+        /// </summary>
+        public uint entryPointId;
+
+        /// <summary>
+        /// The id of the first sequence point, the rest follow on
+        /// </summary>
+        public uint firstSequenceId;
+
+        /// <summary>
+        /// The id of the first branch point, the rest follow on
+        /// </summary>
+        public uint firstBranchId;
+    }
+
+    /// <summary>
+    /// The number of times a point was visited
+    /// </summary>
+    [StructLayout(LayoutKind.Sequential, Pack = 1)]
+    public struct MSG_VisitCount
+    {
+        /// <summary>
+        /// The identifier of the point
+        /// </summary>
+        public uint uniqueId;
+
+        /// <summary>
+        /// The number of times the point was visited
+        /// </summary>
+        public uint visits;
+    }
+
+    /// <summary>
+    /// Send the number of times each of a set of points was visited, the counts follow
+    /// </summary>
+    [StructLayout(LayoutKind.Sequential, Pack = 1)]
+    public struct MSG_SendVisitCounts_Request
+    {
+        /// <summary>
+        /// The message type
+        /// </summary>
+        public MSG_Type type;
+
+        /// <summary>
+        /// The number of counts that follow
+        /// </summary>
+        public int count;
+    }
+
+    /// <summary>
+    /// The response to a <see cref="MSG_SendVisitCounts_Request"/>
+    /// </summary>
+    [StructLayout(LayoutKind.Sequential, Pack = 1)]
+    public struct MSG_SendVisitCounts_Response
+    {
+        /// <summary>
+        /// True - if the counts were added
+        /// </summary>
+        [MarshalAs(UnmanagedType.Bool)]
+        public bool done;
+    }
     // ReSharper restore InconsistentNaming
 
 }
@@ -65,5 +65,44 @@ namespace OpenCover.Framework.Service
         /// <param name="processPath"></param>
         /// <returns></returns>
         bool TrackProcess(string processPath);
+
+        /// <summary>
+        /// The profiler gave a method coarser coverage than asked for as 
+        /// instrumenting it fully would have exceeded the probe budget
+        /// </summary>
+        /// <param name="modulePath">the path of the module hosting the method</param>
+        /// <param name="assemblyName">the name of the assembly hosting the method</param>
+        /// <param name="functionToken">the metadata token of the method</param>
+        /// <param name="level">0 - branch, 1 - sequence, 2 - entry only</param>
+        /// <param name="probes">the number of probes inserted</param>
+        /// <param name="originalSize">the size of the IL before instrumentation</param>
+        /// <param name="instrumentedSize">the size of the IL after instrumentation</param>
+        /// <returns></returns>
+        bool ReportCoverageLevel(string modulePath, string assemblyName, int functionToken, uint level, uint probes, uint originalSize, uint instrumentedSize);
+
+        /// <summary>
+        /// The profiler found the points of a method from its symbols and only needs their ids
+        /// </summary>
+        /// <param name="processPath">the path of the process</param>
+        /// <param name="modulePath">the path of the module hosting the method</param>
+        /// <param name="assemblyName">the name of the assembly hosting the method</param>
+        /// <param name="functionToken">the metadata token of the method</param>
+        /// <param name="sequencePoints">the number of sequence points the profiler found (not counting an entry point)</param>
+        /// <param name="branchPoints">the number of branch points the profiler found</param>
+        /// <param name="pointsHash">the hash of the points the profiler found, see <see cref="PointsHash"/></param>
+        /// <param name="entryPointId">the id of the entry point, if the method has one that is not a sequence point</param>
+        /// <param name="firstSequenceId">the id of the first sequence point</param>
+        /// <param name="firstBranchId">the id of the first branch point</param>
+        /// <returns>false if the method should not be instrumented or its points are not the ones the profiler found</returns>
+        bool AllocateUniqueIds(string processPath, string modulePath, string assemblyName, int functionToken, uint sequencePoints, uint branchPoints, uint pointsHash,
+            out uint entryPointId, out uint firstSequenceId, out uint firstBranchId);
+
+        /// <summary>
+        /// The profiler counted the visits to a point itself (inline counters) and sends the count at shutdown
+        /// </summary>
+        /// <param name="uniqueId">the id of the point</param>
+        /// <param name="visits">the number of times the point was visited</param>
+        /// <returns>false if there is no such point</returns>
+        bool AddVisitCount(uint uniqueId, uint visits);
     }
 }
@@ -0,0 +1,51 @@
+﻿//
+// OpenCover - S Wilde
+//
+// This source code is released under the MIT License; see the accompanying license file.
+//
+using System.Collections.Generic;
+using OpenCover.Framework.Model;
+
+namespace OpenCover.Framework.Service
+{
+    /// <summary>
+    /// The hash the profiler sends of the points it found of a method from its symbols, so 
+    /// that ids are only given to points that are the same as the host's
+    /// </summary>
+    /// <remarks>
+    /// FNV-1a over 32 bit values: the offsets of the sequence points (not the entry point),
+    /// a separator, then the offset and path of each branch point; see HashLocalPoints 
+    /// in the profiler.
+    /// </remarks>
+    public static class PointsHash
+    {
+        private const uint Basis = 2166136261;
+        private const uint Prime = 16777619;
+        private const uint Separator = 0xFFFFFFFF;
+
+        /// <summary>
+        /// Hash the points of a method
+        /// </summary>
+        /// <param name="sequencePoints">the sequence points, without the entry point</param>
+        /// <param name="branchPoints">the branch points</param>
+        /// <returns>the hash</returns>
+        public static uint Compute(IEnumerable<InstrumentationPoint> sequencePoints, IEnumerable<BranchPoint> branchPoints)
+        {
+            var hash = Basis;
+            foreach (var point in sequencePoints)
+                hash = Add(hash, (uint)point.Offset);
+            hash = Add(hash, Separator);
+            foreach (var point in branchPoints)
+                hash = Add(Add(hash, (uint)point.Offset), (uint)point.Path);
+            return hash;
+        }
+
+        private static uint Add(uint hash, uint value)
+        {
+            unchecked
+            {
+                return (hash ^ value) * Prime;
+            }
+        }
+    }
+}
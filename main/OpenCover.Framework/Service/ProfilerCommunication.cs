@@ -4,8 +4,10 @@
 // This source code is released under the MIT License; see the accompanying license file.
 //
 using System;
+using System.Collections.Generic;
 using System.IO;
 using System.Linq;
+using log4net;
 using OpenCover.Framework.Model;
 using OpenCover.Framework.Persistance;
 
@@ -13,6 +15,9 @@ namespace OpenCover.Framework.Service
 {
     internal class ProfilerCommunication : IProfilerCommunication
     {
+        private static readonly ILog Logger = LogManager.GetLogger("OpenCover");
+        private static readonly string[] CoverageLevels = { "branch", "sequence", "entry" };
+
         private readonly IFilter _filter;
         private readonly IPersistance _persistance;
         private readonly IInstrumentationModelBuilderFactory _instrumentationModelBuilderFactory;
@@ -112,5 +117,61 @@ namespace OpenCover.Framework.Service
         {
             return _filter.InstrumentProcess(Path.GetFileNameWithoutExtension (processPath));
         }
+
+        public bool ReportCoverageLevel(string modulePath, string assemblyName, int functionToken, uint level, uint probes, uint originalSize, uint instrumentedSize)
+        {
+            var className = _persistance.GetClassFullName(modulePath, functionToken);
+            Logger.WarnFormat("Method 0x{0:X8} of {1} in {2} exceeded the probe budget and was given {3} coverage ({4} probes, {5} -> {6} bytes)",
+                functionToken, className, assemblyName,
+                level < CoverageLevels.Length ? CoverageLevels[level] : level.ToString(),
+                probes, originalSize, instrumentedSize);
+            return true;
+        }
+
+        public bool AllocateUniqueIds(string processPath, string modulePath, string assemblyName, int functionToken, uint sequencePoints, uint branchPoints, uint pointsHash,
+            out uint entryPointId, out uint firstSequenceId, out uint firstBranchId)
+        {
+            entryPointId = firstSequenceId = firstBranchId = 0;
+            if (!CanReturnPoints(processPath, modulePath, assemblyName, functionToken))
+                return false;
+
+            InstrumentationPoint[] points;
+            BranchPoint[] branches;
+            if (!_persistance.GetSequencePointsForFunction(modulePath, functionToken, out points))
+                return false;
+            _persistance.GetBranchPointsForFunction(modulePath, functionToken, out branches);
+
+            // the method point is only sent ahead of the sequence points when it is not one of them
+            var entryPoint = points.FirstOrDefault(point => !(point is SequencePoint));
+            var seqPoints = points.Where(point => point is SequencePoint).ToArray();
+            if (seqPoints.Length != sequencePoints || branches.Length != branchPoints 
+                || PointsHash.Compute(seqPoints, branches) != pointsHash)
+            {
+                Logger.DebugFormat("Method 0x{0:X8} in {1} has points other than the profiler found, they will be sent", functionToken, assemblyName);
+                return false;
+            }
+
+            if (!HasConsecutiveIds(seqPoints) || !HasConsecutiveIds(branches))
+                return false;
+
+            entryPointId = entryPoint?.UniqueSequencePoint ?? 0;
+            firstSequenceId = seqPoints.Length > 0 ? seqPoints[0].UniqueSequencePoint : 0;
+            firstBranchId = branches.Length > 0 ? branches[0].UniqueSequencePoint : 0;
+            return true;
+        }
+
+        public bool AddVisitCount(uint uniqueId, uint visits)
+        {
+            if (InstrumentationPoint.AddVisitCount(uniqueId, 0, (int)Math.Min(visits, int.MaxValue)))
+                return true;
+            Logger.ErrorFormat("Failed to add {0} visits to {1}. Max point count is {2}",
+                visits, uniqueId, InstrumentationPoint.Count);
+            return false;
+        }
+
+        private static bool HasConsecutiveIds(IList<InstrumentationPoint> points)
+        {
+            return !points.Where((point, index) => point.UniqueSequencePoint != points[0].UniqueSequencePoint + index).Any();
+        }
     }
 }
\ No newline at end of file
@@ -0,0 +1,153 @@
+#include "stdafx.h"
+#include "Arena.h"
+
+#include <memory>
+
+#define ARENA_BLOCK_SIZE 16384
+#define ARENA_MAX_BLOCK_SIZE (1024 * 1024)
+#define ARENA_RETAIN_SIZE (256 * 1024)
+#define ARENA_POOL_SIZE 4
+
+namespace Instrumentation
+{
+	Arena::Arena()
+	{
+		m_blocks = nullptr;
+		m_destructors = nullptr;
+		m_current = nullptr;
+		m_end = nullptr;
+		m_bytesAllocated = 0;
+		m_bytesReserved = 0;
+	}
+
+	Arena::~Arena()
+	{
+		Reset();
+		while (m_blocks != nullptr)
+		{
+			auto pNext = m_blocks->m_next;
+			::operator delete(m_blocks);
+			m_blocks = pNext;
+		}
+	}
+
+	/// <summary>Allocate a chunk of uninitialised memory from the arena.</summary>
+	/// <param name="size">The number of bytes required.</param>
+	/// <param name="alignment">The alignment required (a power of 2).</param>
+	void* Arena::Allocate(size_t size, size_t alignment)
+	{
+		auto mask = static_cast<uintptr_t>(alignment - 1);
+		auto aligned = (reinterpret_cast<uintptr_t>(m_current) + mask) & ~mask;
+		if (m_current == nullptr || aligned + size > reinterpret_cast<uintptr_t>(m_end))
+		{
+			AddBlock(size + alignment);
+			aligned = (reinterpret_cast<uintptr_t>(m_current) + mask) & ~mask;
+		}
+		m_current = reinterpret_cast<BYTE*>(aligned + size);
+		m_bytesAllocated += size;
+		return reinterpret_cast<void*>(aligned);
+	}
+
+	/// <summary>Destroy all the objects and release all the memory that has been allocated.</summary>
+	/// <remarks>The largest block is retained (if not too large) for the next user of the arena</remarks>
+	void Arena::Reset()
+	{
+		while (m_destructors != nullptr)
+		{
+			m_destructors->m_destroy(m_destructors->m_object);
+			m_destructors = m_destructors->m_next;
+		}
+
+		Block* pRetain = nullptr;
+		while (m_blocks != nullptr)
+		{
+			auto pNext = m_blocks->m_next;
+			if (m_blocks->m_size <= ARENA_RETAIN_SIZE && (pRetain == nullptr || m_blocks->m_size > pRetain->m_size))
+			{
+				if (pRetain != nullptr) ::operator delete(pRetain);
+				pRetain = m_blocks;
+			}
+			else
+			{
+				::operator delete(m_blocks);
+			}
+			m_blocks = pNext;
+		}
+
+		m_blocks = pRetain;
+		m_bytesAllocated = 0;
+		m_bytesReserved = 0;
+		m_current = nullptr;
+		m_end = nullptr;
+		if (m_blocks != nullptr)
+		{
+			m_blocks->m_next = nullptr;
+			m_current = BlockData(m_blocks);
+			m_end = m_current + m_blocks->m_size;
+			m_bytesReserved = m_blocks->m_size;
+		}
+	}
+
+	void Arena::RegisterDestructor(void* pObject, void(*destroy)(void*))
+	{
+		auto pDestructor = static_cast<Destructor*>(Allocate(sizeof(Destructor), alignof(Destructor)));
+		pDestructor->m_destroy = destroy;
+		pDestructor->m_object = pObject;
+		pDestructor->m_next = m_destructors;
+		m_destructors = pDestructor;
+	}
+
+	/// <summary>Start a new block; each block is twice the size of the previous one (capped)
+	/// unless a single allocation needs more.</summary>
+	void Arena::AddBlock(size_t minimumSize)
+	{
+		size_t size = m_blocks == nullptr ? ARENA_BLOCK_SIZE : m_blocks->m_size * 2;
+		if (size > ARENA_MAX_BLOCK_SIZE)
+			size = ARENA_MAX_BLOCK_SIZE;
+		if (size < minimumSize)
+			size = minimumSize;
+
+		auto pBlock = static_cast<Block*>(::operator new(sizeof(Block) + size));
+		pBlock->m_size = size;
+		pBlock->m_next = m_blocks;
+		m_blocks = pBlock;
+		m_current = BlockData(pBlock);
+		m_end = m_current + size;
+		m_bytesReserved += size;
+	}
+
+	namespace
+	{
+		// the free list is per thread so no locking is required; arenas are
+		// returned to the pool of whichever thread releases them
+		thread_local std::vector<std::unique_ptr<Arena>> t_arenaPool;
+	}
+
+	/// <summary>Get an empty arena, reusing one previously released on this thread if possible.</summary>
+	Arena* ArenaPool::Acquire()
+	{
+		if (t_arenaPool.empty())
+			return new Arena();
+
+		auto pArena = t_arenaPool.back().release();
+		t_arenaPool.pop_back();
+		return pArena;
+	}
+
+	/// <summary>Reset an arena and keep it for the next <c>Acquire</c> on this thread.</summary>
+	void ArenaPool::Release(Arena* pArena)
+	{
+		if (pArena == nullptr)
+			return;
+
+		pArena->Reset();
+		if (t_arenaPool.size() < ARENA_POOL_SIZE)
+		{
+			t_arenaPool.emplace_back(pArena);
+		}
+		else
+		{
+			delete pArena;
+		}
+	}
+}
@@ -0,0 +1,87 @@
+#pragma once
+
+#include <new>
+#include <type_traits>
+#include <utility>
+
+namespace Instrumentation
+{
+	/// <summary>A bump allocator that owns all the objects of a single <c>Method</c> model</summary>
+	/// <remarks><para>Allocation is a pointer increment; nothing is released individually. <c>Reset</c>
+	/// runs the destructors of any objects created through <c>Create</c> (in reverse order) and
+	/// releases everything in one step.</para>
+	/// <para>After a reset the arena keeps its largest block (up to <c>ARENA_RETAIN_SIZE</c>) so that
+	/// a reused arena does not need to go back to the heap for the next, similarly sized, method.</para></remarks>
+	class Arena
+	{
+	public:
+		Arena();
+		~Arena();
+
+	private:
+		Arena(const Arena&) = delete;
+		Arena& operator = (const Arena&) = delete;
+
+	public:
+		void* Allocate(size_t size, size_t alignment);
+		void Reset();
+
+		/// <summary>Construct an object in the arena</summary>
+		/// <remarks>Objects that are not trivially destructible are destroyed by <c>Reset</c></remarks>
+		template<typename T, typename... Args>
+		T* Create(Args&&... args)
+		{
+			auto pObject = new (Allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+			if (!std::is_trivially_destructible<T>::value)
+			{
+				RegisterDestructor(pObject, &Destroy<T>);
+			}
+			return pObject;
+		}
+
+		size_t GetBytesAllocated() const { return m_bytesAllocated; }
+		size_t GetBytesReserved() const { return m_bytesReserved; }
+
+	private:
+		struct Block
+		{
+			Block* m_next;
+			size_t m_size;
+		};
+
+		struct Destructor
+		{
+			void(*m_destroy)(void*);
+			void* m_object;
+			Destructor* m_next;
+		};
+
+		template<typename T>
+		static void Destroy(void* pObject)
+		{
+			static_cast<T*>(pObject)->~T();
+		}
+
+		void RegisterDestructor(void* pObject, void(*destroy)(void*));
+		void AddBlock(size_t minimumSize);
+		static BYTE* BlockData(Block* pBlock) { return reinterpret_cast<BYTE*>(pBlock + 1); }
+
+	private:
+		Block* m_blocks;
+		Destructor* m_destructors;
+		BYTE* m_current;
+		BYTE* m_end;
+		size_t m_bytesAllocated;
+		size_t m_bytesReserved;
+	};
+
+	/// <summary>Hands out <c>Arena</c>s and takes them back</summary>
+	/// <remarks>Released arenas are kept on a per-thread free list so that consecutive JIT callbacks
+	/// on the same thread reuse the same memory without contending on the process heap</remarks>
+	class ArenaPool
+	{
+	public:
+		static Arena* Acquire();
+		static void Release(Arena* pArena);
+	};
+}
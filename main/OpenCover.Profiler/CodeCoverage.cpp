@@ -51,6 +51,43 @@ void GetVersion(LPTSTR szVersionFile, DWORD *dwVersionHigh, DWORD *dwVersionLow)
 	}
 }
 
+/// <summary>Read one of the profiler's settings from the environment</summary>
+/// <returns>false if the variable is not set or is empty; <paramref name="value"/> is then left as it was.</returns>
+bool CCodeCoverage::GetEnvironmentSetting(LPCTSTR name, tstring& value)
+{
+    auto length = ::GetEnvironmentVariable(name, nullptr, 0);
+    if (length == 0)
+        return false;
+
+    std::vector<TCHAR> buffer(length);
+    length = ::GetEnvironmentVariable(name, buffer.data(), static_cast<DWORD>(buffer.size()));
+    if (length == 0 || length >= buffer.size())
+        return false;
+
+    value.assign(buffer.data(), length);
+    return true;
+}
+
+/// <summary>Read one of the profiler's numeric settings from the environment</summary>
+/// <returns>false if the variable is not set or is empty; <paramref name="value"/> is then left as it was.</returns>
+bool CCodeCoverage::GetEnvironmentSetting(LPCTSTR name, ULONG& value)
+{
+    tstring text;
+    if (!GetEnvironmentSetting(name, text))
+        return false;
+    value = _tcstoul(text.c_str(), nullptr, 10);
+    return true;
+}
+
+bool CCodeCoverage::GetEnvironmentSetting(LPCTSTR name, double& value)
+{
+    tstring text;
+    if (!GetEnvironmentSetting(name, text))
+        return false;
+    value = _tcstod(text.c_str(), nullptr);
+    return true;
+}
+
 #pragma warning (suppress : 6262) // Function uses '17528' bytes of stack; heap not wanted
 HRESULT CCodeCoverage::OpenCoverInitialise(IUnknown *pICorProfilerInfoUnk){
 	ATLTRACE(_T("::OpenCoverInitialise"));
@@ -127,6 +164,45 @@ HRESULT CCodeCoverage::OpenCoverInitialise(IUnknown *pICorProfilerInfoUnk){
     safe_mode_ = m_tracingEnabled || (_tcslen(safeMode) != 0);
     ATLTRACE(_T("    ::Initialize(...) => safeMode = %s (%s)"), safe_mode_ ? _T("true") : _T("false"), safeMode);
 
+    // the derived visits are only known at shutdown, too late to be attributed to a test
+    TCHAR deriveBranches[1024] = { 0 };
+    ::GetEnvironmentVariable(_T("OpenCover_Profiler_DeriveBranches"), deriveBranches, 1024);
+    m_deriveBranches = !m_tracingEnabled && (_tcslen(deriveBranches) != 0);
+    ATLTRACE(_T("    ::Initialize(...) => deriveBranches = %s (%s)"), m_deriveBranches ? _T("true") : _T("false"), deriveBranches);
+
+    TCHAR coldBranchProbes[1024] = { 0 };
+    ::GetEnvironmentVariable(_T("OpenCover_Profiler_ColdBranchProbes"), coldBranchProbes, 1024);
+    m_coldBranchProbes = _tcslen(coldBranchProbes) != 0;
+    ATLTRACE(_T("    ::Initialize(...) => coldBranchProbes = %s (%s)"), m_coldBranchProbes ? _T("true") : _T("false"), coldBranchProbes);
+
+    TCHAR switchProbes[1024] = { 0 };
+    ::GetEnvironmentVariable(_T("OpenCover_Profiler_SwitchProbes"), switchProbes, 1024);
+    m_switchProbes = _tcslen(switchProbes) != 0;
+    ATLTRACE(_T("    ::Initialize(...) => switchProbes = %s (%s)"), m_switchProbes ? _T("true") : _T("false"), switchProbes);
+
+    TCHAR valueBranchProbes[1024] = { 0 };
+    ::GetEnvironmentVariable(_T("OpenCover_Profiler_ValueBranchProbes"), valueBranchProbes, 1024);
+    m_valueBranchProbes = _tcslen(valueBranchProbes) != 0;
+    ATLTRACE(_T("    ::Initialize(...) => valueBranchProbes = %s (%s)"), m_valueBranchProbes ? _T("true") : _T("false"), valueBranchProbes);
+
+    // never released, as the instrumented code may still be running when the profiler shuts down
+    if (m_switchProbes || m_valueBranchProbes)
+        m_pSwitchTables = new Instrumentation::SwitchTables();
+
+    // a point gains nothing from its probe once it has reached the threshold, unless branches are
+    // derived from its visits (they are only counted at shutdown, so their points would never be covered)
+    TCHAR removeCoveredProbes[1024] = { 0 };
+    ::GetEnvironmentVariable(_T("OpenCover_Profiler_RemoveCoveredProbes"), removeCoveredProbes, 1024);
+    m_removeCoveredProbes = m_threshold != 0 && !m_tracingEnabled && !m_deriveBranches && m_profilerInfo4 != nullptr
+        && (_tcslen(removeCoveredProbes) != 0);
+    ATLTRACE(_T("    ::Initialize(...) => removeCoveredProbes = %s (%s)"), m_removeCoveredProbes ? _T("true") : _T("false"), removeCoveredProbes);
+
+    // a method is compiled again for each AppDomain and, with tiered compilation, each tier
+    TCHAR reuseBodies[1024] = { 0 };
+    ::GetEnvironmentVariable(_T("OpenCover_Profiler_ReuseInstrumentedBodies"), reuseBodies, 1024);
+    m_reuseBodies = _tcslen(reuseBodies) != 0;
+    ATLTRACE(_T("    ::Initialize(...) => reuseInstrumentedBodies = %s (%s)"), m_reuseBodies ? _T("true") : _T("false"), reuseBodies);
+
     TCHAR commwait[1024] = { 0 };
     if (::GetEnvironmentVariable(_T("OpenCover_Profiler_CommWait"), commwait, 1024) > 0) {
         _commwait = _tcstoul(commwait, nullptr, 10);
@@ -140,7 +216,15 @@ HRESULT CCodeCoverage::OpenCoverInitialise(IUnknown *pICorProfilerInfoUnk){
 	DWORD dwVersionHigh, dwVersionLow;
 	GetVersion(szModuleName, &dwVersionHigh, &dwVersionLow);
 
+	OpenMethodCache(dwVersionHigh, dwVersionLow);
+
+	OpenCounters();
+
 	m_useOldStyle = (tstring(instrumentation) == _T("oldSchool"));
+	ChooseProbeKind();
+	ReadProbeBudget();
+	ReadLocalSymbols();
+	ReadPathProfile();
 
 	enableDiagnostics_ = (tstring(diagnostics) == _T("true"));
 
@@ -181,6 +265,9 @@ HRESULT CCodeCoverage::OpenCoverInitialise(IUnknown *pICorProfilerInfoUnk){
         _FunctionEnter2, _FunctionLeave2, _FunctionTailcall2), 
         _T("    ::Initialize(...) => SetEnterLeaveFunctionHooks2 => 0x%X"));
 
+	StartPreInstrumentation();
+	StartReJitCoveredMethods();
+
 	RELTRACE(_T("::Initialize - Done!"));
     
     return S_OK; 
@@ -207,6 +294,9 @@ DWORD CCodeCoverage::AppendProfilerEventMask(DWORD currentEventMask)
 		dwMask |= COR_PRF_DISABLE_ALL_NGEN_IMAGES;
 	}
 
+    if (m_removeCoveredProbes)
+        dwMask |= COR_PRF_ENABLE_REJIT;
+
     dwMask |= COR_PRF_MONITOR_THREADS;
 
 	return dwMask;
@@ -223,8 +313,19 @@ HRESULT STDMETHODCALLTYPE CCodeCoverage::Shutdown( void)
 		if (chained_module_ != nullptr)
 			FreeLibrary(chained_module_);
 
+		StopPreInstrumentation();
+		StopReJitCoveredMethods();
+
+		HarvestCounters();
+		EmitDerivedBranchPoints();
+		ReportDowngrades();
+		WriteBloatReport();
+		WritePathProfile();
+
 		_host->CloseChannel(safe_mode_);
 
+		CloseMethodCache();
+
 		WCHAR szExeName[MAX_PATH];
 		GetModuleFileNameW(nullptr, szExeName, MAX_PATH);
 		RELTRACE(_T("::Shutdown - Nothing left to do but return S_OK(%s)"), W2CT(szExeName));
@@ -246,12 +347,46 @@ static void __fastcall InstrumentPointVisit(ULONG seq)
 void __fastcall CCodeCoverage::AddVisitPoint(ULONG uniqueId)
 { 
     if (uniqueId == 0) return;
+    if ((uniqueId & SWITCH_PROBE_FLAG) != 0)
+    {
+        // the slot of the path the switch took (see CoverageInstrumentation::InsertSwitchProbe)
+        uniqueId = m_pSwitchTables != nullptr ? m_pSwitchTables->GetId(uniqueId & ~SWITCH_PROBE_FLAG) : 0;
+        if (uniqueId == 0) return;
+    }
+    if ((uniqueId & COUNTED_PROBE_FLAG) != 0)
+    {
+        // the probe's visits are needed to derive those of a branch point (see DeriveBranchPoints)
+        uniqueId &= ~COUNTED_PROBE_FLAG;
+        auto it = m_pointCounts.find(uniqueId & ~MERGED_PROBE_FLAG);
+        if (it != m_pointCounts.end())
+            ++(*it->second);
+    }
+    if ((uniqueId & MERGED_PROBE_FLAG) == 0)
+    {
+        RecordVisitPoint(uniqueId);
+        return;
+    }
+
+    // the probe also records the points merged into it
+    uniqueId &= ~MERGED_PROBE_FLAG;
+    RecordVisitPoint(uniqueId);
+    auto it = m_mergedPoints.find(uniqueId);
+    if (it != m_mergedPoints.end())
+    {
+        for (auto mergedId : it->second)
+            RecordVisitPoint(mergedId);
+    }
+}
+
+void CCodeCoverage::RecordVisitPoint(ULONG uniqueId)
+{
     if (m_threshold != 0)
     {
         ULONG& threshold = m_thresholds.at(uniqueId);
         if (threshold >= m_threshold)
             return;
-        threshold++;
+        if (++threshold == m_threshold && m_removeCoveredProbes)
+            PointCovered(uniqueId);
     }
 
     if (safe_mode_) {
@@ -262,6 +397,78 @@ void __fastcall CCodeCoverage::AddVisitPoint(ULONG uniqueId)
     }
 }
 
+/// <summary>Record which points are merged into which probes (see <c>CoverageInstrumentation::MergeSequenceProbes</c>)</summary>
+/// <remarks>Must be done before the method with those probes can run</remarks>
+void CCodeCoverage::RegisterMergedPoints(const ULONG* pMerged, ULONG mergedSize)
+{
+    ULONG i = 0;
+    while (i + 1 < mergedSize)
+    {
+        auto probeId = pMerged[i];
+        std::vector<ULONG> merged;
+        for (; i + 1 < mergedSize && pMerged[i] == probeId; i += 2)
+            merged.push_back(pMerged[i + 1]);
+        m_mergedPoints.insert(std::make_pair(probeId, std::move(merged)));
+    }
+}
+
+/// <summary>Record how the visits of the branch points without probes are derived (see
+/// <c>CoverageInstrumentation::DeriveBranchPoints</c>)</summary>
+/// <remarks>Must be done before the method with those probes can run</remarks>
+void CCodeCoverage::RegisterDerivedBranchPoints(const CoverageInstrumentation::DerivedBranchPoints& derived)
+{
+    if (derived.empty())
+        return;
+
+    std::lock_guard<std::mutex> lock(m_mutexDerivedBranches);
+    for (const auto& point : derived)
+    {
+        if (!m_derivedBranchPoints.insert(std::make_pair(point.uniqueId, point)).second)
+            continue;
+        m_pointCounts.insert(std::make_pair(point.nodeId, std::make_shared<std::atomic<ULONGLONG>>(0)));
+        for (auto pathId : point.pathIds)
+            m_pointCounts.insert(std::make_pair(pathId, std::make_shared<std::atomic<ULONGLONG>>(0)));
+    }
+}
+
+ULONGLONG CCodeCoverage::GetPointCount(ULONG uniqueId)
+{
+    ULONGLONG count = GetCounter(uniqueId);
+    auto it = m_pointCounts.find(uniqueId);
+    if (it != m_pointCounts.end())
+        count += it->second->load();
+    return count;
+}
+
+/// <summary>Send the visits of the branch points without probes</summary>
+/// <remarks>Each point is sent with its count (see <c>ProfilerCommunication::SendVisitCounts</c>), as the
+/// inline counters are, rather than as that many visits.</remarks>
+void CCodeCoverage::EmitDerivedBranchPoints()
+{
+    std::vector<VisitCount> counts;
+    counts.reserve(VC_BUFFER_SIZE);
+
+    std::lock_guard<std::mutex> lock(m_mutexDerivedBranches);
+    for (const auto& entry : m_derivedBranchPoints)
+    {
+        const auto& point = entry.second;
+        auto visits = GetPointCount(point.nodeId);
+        for (auto pathId : point.pathIds)
+        {
+            auto pathVisits = GetPointCount(pathId);
+            // a thread may still be running the method (or an exception was thrown while the branch was executed)
+            visits = pathVisits < visits ? visits - pathVisits : 0;
+        }
+        if (m_threshold != 0 && visits > m_threshold)
+            visits = m_threshold;
+        if (visits > ULONG_MAX)
+            visits = ULONG_MAX;
+        if (visits != 0)
+            AddVisitCount(counts, point.uniqueId, static_cast<ULONG>(visits));
+    }
+    SendVisitCounts(counts);
+}
+
 void CCodeCoverage::Resize(ULONG minSize) {
     if (minSize > m_thresholds.size()){
         ULONG newSize = ((minSize / BUFFER_SIZE) + 1) * BUFFER_SIZE;
@@ -293,12 +500,9 @@ HRESULT STDMETHODCALLTYPE CCodeCoverage::ModuleAttachedToAssembly(
 		moduleId, W2CT(modulePath.c_str()),
 		assemblyId, W2CT(assemblyName.c_str()));*/
 		m_allowModules[modulePath] = _host->TrackAssembly(const_cast<LPWSTR>(modulePath.c_str()), const_cast<LPWSTR>(assemblyName.c_str()));
-		m_allowModulesAssemblyMap[modulePath] = assemblyName;
-
-		if (m_allowModules[modulePath]) {
-			ATLTRACE(_T("::ModuleAttachedToAssembly(...) => (%X => %s, %X => %s)"),
-				moduleId, W2CT(modulePath.c_str()),
-				assemblyId, W2CT(assemblyName.c_str()));
+		{
+			std::lock_guard<std::mutex> lock(m_mutexAllowModulesAssemblyMap);
+			m_allowModulesAssemblyMap[modulePath] = assemblyName;
 		}
 
 		if (MSCORLIB_NAME == assemblyName || DNCORLIB_NAME == assemblyName) {
@@ -306,10 +510,26 @@ HRESULT STDMETHODCALLTYPE CCodeCoverage::ModuleAttachedToAssembly(
 			RELTRACE(_T("cuckoo nest => %s"), W2CT(cuckoo_module_.c_str()));
 		}
 
+		if (m_allowModules[modulePath]) {
+			ATLTRACE(_T("::ModuleAttachedToAssembly(...) => (%X => %s, %X => %s)"),
+				moduleId, W2CT(modulePath.c_str()),
+				assemblyId, W2CT(assemblyName.c_str()));
+			PreInstrumentModule(moduleId, modulePath, assemblyName);
+			TrackInstrumentedBodies(moduleId, modulePath);
+		}
+
 		return S_OK;
 	});
 }
 
+/// <summary>Handle <c>ICorProfilerCallback::ModuleUnloadStarted</c></summary>
+HRESULT STDMETHODCALLTYPE CCodeCoverage::ModuleUnloadStarted(
+	/* [in] */ ModuleID moduleId)
+{
+	return ChainCall([&]() { return CProfilerBase::ModuleUnloadStarted(moduleId); },
+		[&]() { DiscardPreparedModule(moduleId); DiscardModuleSymbols(moduleId); m_coveredMethods.Forget(moduleId); return S_OK; });
+}
+
 /// <summary>Handle <c>ICorProfilerCallback::JITCompilationStarted</c></summary>
 /// <remarks>The 'workhorse' </remarks>
 HRESULT STDMETHODCALLTYPE CCodeCoverage::JITCompilationStarted( 
@@ -332,123 +552,283 @@ HRESULT STDMETHODCALLTYPE CCodeCoverage::JITCompilationStarted(
         {
             RELTRACE(_T("::JITCompilationStarted(%" PRIxPTR ", ...) => %d, %" PRIxPTR " => %s"), functionId, functionToken, moduleId, W2CT(modulePath.c_str()));
 
-            std::vector<SequencePoint> seqPoints;
-            std::vector<BranchPoint> brPoints;
-
-            if (_host->GetPoints(functionToken, const_cast<LPWSTR>(modulePath.c_str()),
-                const_cast<LPWSTR>(m_allowModulesAssemblyMap[modulePath].c_str()), seqPoints, brPoints))
+            HRESULT hr = ApplyPreparedMethod(functionId, functionToken, moduleId);
+            if (hr == S_FALSE)
+                hr = ApplyInstrumentedBody(functionId, functionToken, moduleId);
+            if (hr == S_FALSE)
+                hr = InstrumentWithLocalPoints(functionId, functionToken, moduleId, modulePath);
+            if (hr == S_FALSE)
             {
-                if (seqPoints.size() != 0)
+                hr = S_OK;
+                auto assemblyName = GetModuleAssemblyName(modulePath);
+                _host->GetPoints(functionToken, const_cast<LPWSTR>(modulePath.c_str()),
+                    const_cast<LPWSTR>(assemblyName.c_str()), 
+                    [this, functionId, functionToken, moduleId, &hr](SequencePointSpan seqPoints, BranchPointSpan brPoints)
                 {
-                    IMAGE_COR_ILMETHOD* pMethodHeader = nullptr;
-                    ULONG iMethodSize = 0;
-                    COM_FAIL_MSG_RETURN_ERROR(m_profilerInfo2->GetILFunctionBody(moduleId, functionToken, (LPCBYTE*)&pMethodHeader, &iMethodSize),
-                        _T("    ::JITCompilationStarted(...) => GetILFunctionBody => 0x%X"));
-
-                    Instrumentation::Method instumentedMethod(pMethodHeader);
-                    instumentedMethod.IncrementStackSize(2);
-
-                    ATLTRACE(_T("::JITCompilationStarted(...) => Instrumenting..."));
-
-                    // Instrument method
-					instumentedMethod.DumpIL(enableDiagnostics_);
-					if (enableDiagnostics_)
-					{
-						RELTRACE(_T("Sequence points:"));
-						for (auto seq_point : seqPoints)
-						{
-							RELTRACE(_T("IL_%04X %ld"), seq_point.Offset, seq_point.UniqueId);
-						}
-
-						RELTRACE(_T("Branch points:"));
-						for (auto br_point : brPoints)
-						{
-							RELTRACE(_T("IL_%04X (%ld) %ld"), br_point.Offset, br_point.Path, br_point.UniqueId);
-						}
-					}
-					InstrumentMethod(moduleId, instumentedMethod, seqPoints, brPoints);
-                    instumentedMethod.DumpIL(enableDiagnostics_);
-
-                    CComPtr<IMethodMalloc> methodMalloc;
-                    COM_FAIL_MSG_RETURN_ERROR(m_profilerInfo2->GetILFunctionBodyAllocator(moduleId, &methodMalloc),
-                        _T("    ::JITCompilationStarted(...) => GetILFunctionBodyAllocator=> 0x%X"));
-
-                    auto pNewMethod = static_cast<IMAGE_COR_ILMETHOD*>(methodMalloc->Alloc(instumentedMethod.GetMethodSize()));
-                    instumentedMethod.WriteMethod(pNewMethod);
-                    COM_FAIL_MSG_RETURN_ERROR(m_profilerInfo2->SetILFunctionBody(moduleId, functionToken, (LPCBYTE)pNewMethod),
-                        _T("    ::JITCompilationStarted(...) => SetILFunctionBody => 0x%X"));
-
-                    ULONG mapSize = instumentedMethod.GetILMapSize();
-                    COR_IL_MAP * pMap = static_cast<COR_IL_MAP *>(CoTaskMemAlloc(mapSize * sizeof(COR_IL_MAP)));
-                    instumentedMethod.PopulateILMap(mapSize, pMap);
-                    COM_FAIL_MSG_RETURN_ERROR(m_profilerInfo2->SetILInstrumentedCodeMap(functionId, TRUE, mapSize, pMap),
-                        _T("    ::JITCompilationStarted(...) => SetILInstrumentedCodeMap => 0x%X"));
-
-                    // only do this for .NET4 and above as there are issues with earlier runtimes (Access Violations)
-                    if (m_runtimeVersion.usMajorVersion >= 4)
-                        CoTaskMemFree(pMap);
-
-                    // resize the threshold array 
-                    if (m_threshold != 0)
-                    {
-                        if (seqPoints.size() > 0)
-                            Resize(seqPoints.back().UniqueId + 1);
-                        if (brPoints.size() > 0)
-                            Resize(brPoints.back().UniqueId + 1);
-                    }
-                }
+                    hr = InstrumentFunction(functionId, functionToken, moduleId, seqPoints, brPoints);
+                });
             }
+            ReportDowngrades();
+            if (!SUCCEEDED(hr))
+                return hr;
         }
     }
     
     return CProfilerBase::JITCompilationStarted(functionId, fIsSafeToBlock); 
 }
 
+/// <summary>Instrument a method with the points supplied by the host</summary>
+/// <remarks>Called (by <c>ProfilerCommunication::GetPoints</c>) with the points still in the buffers
+/// they were received into, so nothing here should hold on to them</remarks>
+HRESULT CCodeCoverage::InstrumentFunction(FunctionID functionId, mdToken functionToken, ModuleID moduleId, SequencePointSpan seqPoints, BranchPointSpan brPoints)
+{
+    IMAGE_COR_ILMETHOD* pMethodHeader = nullptr;
+    ULONG iMethodSize = 0;
+    COM_FAIL_MSG_RETURN_ERROR(m_profilerInfo2->GetILFunctionBody(moduleId, functionToken, (LPCBYTE*)&pMethodHeader, &iMethodSize),
+        _T("    ::JITCompilationStarted(...) => GetILFunctionBody => 0x%X"));
+
+    // resize the threshold array 
+    if (m_threshold != 0)
+    {
+        if (seqPoints.size() > 0)
+            Resize(seqPoints.back().UniqueId + 1);
+        if (brPoints.size() > 0)
+            Resize(brPoints.back().UniqueId + 1);
+    }
+
+    TrackCoveredMethod(moduleId, functionToken, pMethodHeader, iMethodSize, seqPoints, brPoints);
+
+    Instrumentation::MethodCacheKey cacheKey;
+    auto cacheable = GetMethodCacheKey(moduleId, functionToken, pMethodHeader, iMethodSize, seqPoints, brPoints, cacheKey);
+    if (cacheable)
+    {
+        auto hr = ApplyCachedMethod(functionId, moduleId, functionToken, cacheKey);
+        if (hr != S_FALSE)
+            return hr;
+    }
+
+    Instrumentation::Method instumentedMethod(pMethodHeader);
+    instumentedMethod.IncrementStackSize(2);
+
+    ATLTRACE(_T("::JITCompilationStarted(...) => Instrumenting..."));
+
+    // Instrument method
+	instumentedMethod.DumpIL(enableDiagnostics_);
+	if (enableDiagnostics_)
+	{
+		RELTRACE(_T("Sequence points:"));
+		for (auto seq_point : seqPoints)
+		{
+			RELTRACE(_T("IL_%04X %ld"), seq_point.Offset, seq_point.UniqueId);
+		}
+
+		RELTRACE(_T("Branch points:"));
+		for (auto br_point : brPoints)
+		{
+			RELTRACE(_T("IL_%04X (%ld) %ld"), br_point.Offset, br_point.Path, br_point.UniqueId);
+		}
+	}
+    Instrumentation::MethodRegistration registration;
+    InstrumentMethod(moduleId, functionToken, instumentedMethod, seqPoints, brPoints, CanUseInlineCounters(moduleId),
+        GetCallProbeToken(moduleId), registration);
+    instumentedMethod.DumpIL(enableDiagnostics_);
+
+    auto newMethodSize = instumentedMethod.GetMethodSize();
+    std::vector<BYTE> newMethod(newMethodSize);
+    auto pNewMethod = reinterpret_cast<IMAGE_COR_ILMETHOD*>(newMethod.data());
+    instumentedMethod.WriteMethod(pNewMethod);
+
+    ULONG mapSize = instumentedMethod.GetILMapSize();
+    std::vector<COR_IL_MAP> map(mapSize);
+    instumentedMethod.PopulateILMap(mapSize, map.data());
+
+    auto hr = SetInstrumentedBody(functionId, moduleId, functionToken, pNewMethod, newMethodSize, map.data(), mapSize);
+    if (FAILED(hr))
+        return hr;
+
+    RegisterInstrumentation(moduleId, functionToken, registration, newMethodSize);
+
+    // a method that already had its probes is left without a cost, and is not cached
+    if (cacheable && registration.cost.originalSize != 0)
+        AddCachedMethod(cacheKey, pNewMethod, newMethodSize, map.data(), mapSize, registration.mergedPoints, registration.cost);
+    AddInstrumentedBody(moduleId, functionToken, registration.probeToken, pNewMethod, newMethodSize, map.data(), mapSize, seqPoints, brPoints);
+    return S_OK;
+}
+
+/// <summary>Replace the body of a method that is about to be compiled, and map its offsets back to
+/// those of the original body</summary>
+/// <remarks>The body and the map are copied, the runtime owns the copies.</remarks>
+HRESULT CCodeCoverage::SetInstrumentedBody(FunctionID functionId, ModuleID moduleId, mdToken functionToken, const void* pBody, ULONG bodySize,
+    const COR_IL_MAP* pMap, ULONG mapSize)
+{
+    CComPtr<IMethodMalloc> methodMalloc;
+    COM_FAIL_MSG_RETURN_ERROR(m_profilerInfo2->GetILFunctionBodyAllocator(moduleId, &methodMalloc),
+        _T("    ::SetInstrumentedBody(...) => GetILFunctionBodyAllocator=> 0x%X"));
+
+    auto pNewMethod = methodMalloc->Alloc(bodySize);
+    memcpy(pNewMethod, pBody, bodySize);
+    COM_FAIL_MSG_RETURN_ERROR(m_profilerInfo2->SetILFunctionBody(moduleId, functionToken, (LPCBYTE)pNewMethod),
+        _T("    ::SetInstrumentedBody(...) => SetILFunctionBody => 0x%X"));
+
+    auto pNewMap = static_cast<COR_IL_MAP *>(CoTaskMemAlloc(mapSize * sizeof(COR_IL_MAP)));
+    memcpy(pNewMap, pMap, mapSize * sizeof(COR_IL_MAP));
+    COM_FAIL_MSG_RETURN_ERROR(m_profilerInfo2->SetILInstrumentedCodeMap(functionId, TRUE, mapSize, pNewMap),
+        _T("    ::SetInstrumentedBody(...) => SetILInstrumentedCodeMap => 0x%X"));
+
+    // only do this for .NET4 and above as there are issues with earlier runtimes (Access Violations)
+    if (m_runtimeVersion.usMajorVersion >= 4)
+        CoTaskMemFree(pNewMap);
+
+    return S_OK;
+}
+
 ipv CCodeCoverage::GetInstrumentPointVisit(){
 	return &InstrumentPointVisit;
 }
 
-void CCodeCoverage::InstrumentMethod(ModuleID moduleId, Instrumentation::Method& method,  std::vector<SequencePoint> seqPoints, std::vector<BranchPoint> brPoints)
+/// <summary>The token (of the module) the call probes call through</summary>
+/// <remarks>Emits into the metadata of the module so it is not to be called by the workers preparing methods.</remarks>
+mdToken CCodeCoverage::GetCallProbeToken(ModuleID moduleId)
 {
-    if (m_useOldStyle)
+    if (m_callProbeKind == CoverageInstrumentation::PK_Calli)
+        return GetMethodSignatureToken_I4(moduleId);
+    return RegisterSafeCuckooMethod(moduleId, cuckoo_module_.c_str());
+}
+
+/// <param name="inlineCounters">Whether the module can use the inline counters (see <c>CanUseInlineCounters</c>).</param>
+/// <param name="callProbeToken">The token the call probes call through (see <c>GetCallProbeToken</c>).</param>
+/// <param name="registration">Receives what has to be registered once the body is in use (see
+/// <c>RegisterInstrumentation</c>); it is left empty for a method that already has its probes.</param>
+/// <remarks>A method over the probe budget is given coarser coverage (see <c>ReadProbeBudget</c>); the
+/// method is left optimized (see <c>Method::OptimizeEncoding</c>) so that its cost can be recorded.
+/// A method that already has its probes is left as it is.
+/// Apart from the path probes (which are never prepared ahead, see <c>StartPreInstrumentation</c>)
+/// nothing is registered here so that the workers can build bodies that may never be used.</remarks>
+void CCodeCoverage::InstrumentMethod(ModuleID moduleId, mdToken functionToken, Instrumentation::Method& method, SequencePointSpan seqPoints,
+    BranchPointSpan brPoints, bool inlineCounters, mdToken callProbeToken, Instrumentation::MethodRegistration& registration)
+{
+    ULONG lastUniqueId = 0;
+    if (seqPoints.size() > 0)
+        lastUniqueId = seqPoints.back().UniqueId;
+    if (brPoints.size() > 0 && brPoints.back().UniqueId > lastUniqueId)
+        lastUniqueId = brPoints.back().UniqueId;
+
+    auto probeKind = m_probeKind;
+    if ((probeKind == CoverageInstrumentation::PK_Counter || probeKind == CoverageInstrumentation::PK_Set)
+        && !(inlineCounters && EnsureCounters(lastUniqueId)))
+        probeKind = m_callProbeKind;
+
+    // the analysis is of the original method so it has to be done before anything is inserted
+    auto originalSize = method.GetCodeSize();
+    std::vector<ULONG> mergedPoints;
+    auto probes = CoverageInstrumentation::MergeSequenceProbes(method, seqPoints, mergedPoints);
+    if (!probes.empty() && IsInstrumentedMethod(probeKind, callProbeToken, method, probes[0]))
     {
-        auto pvsig = GetMethodSignatureToken_I4(moduleId);
-        auto pt = GetInstrumentPointVisit();
+        ATLTRACE(_T("    ::InstrumentMethod(...) => 0x%X is already instrumented"), functionToken);
+        return;
+    }
 
-        InstructionList instructions;
-        if (seqPoints.size() > 0)
-            CoverageInstrumentation::InsertFunctionCall(instructions, pvsig, (FPTR)pt, seqPoints[0].UniqueId);
-        if (method.IsInstrumented(0, instructions)) return;
-  
-        CoverageInstrumentation::AddBranchCoverage([pvsig, pt](InstructionList& brinstructions, ULONG uniqueId)->Instruction*
-        {
-            return CoverageInstrumentation::InsertFunctionCall(brinstructions, pvsig, (FPTR)pt, uniqueId);
-        }, method, brPoints, seqPoints);
+    auto derived = m_deriveBranches ? CoverageInstrumentation::DeriveBranchPoints(method, brPoints, seqPoints, probes)
+        : CoverageInstrumentation::DerivedBranchPoints();
 
-        CoverageInstrumentation::AddSequenceCoverage([pvsig, pt](InstructionList& seqinstructions, ULONG uniqueId)->Instruction*
-        {
-            return CoverageInstrumentation::InsertFunctionCall(seqinstructions, pvsig, (FPTR)pt, uniqueId);
-        }, method, seqPoints);
+    ULONG probeCount;
+    auto level = CoverageInstrumentation::ChooseCoverageLevel(m_probeBudget, originalSize, CoverageInstrumentation::GetProbeMaxSize(probeKind),
+        seqPoints, brPoints, probes, derived, probeCount);
+    if (level != CoverageInstrumentation::CL_Branch)
+    {
+        // the points left out are never visited, as the host is told (see ReportDowngrades)
+        brPoints = BranchPointSpan();
+        derived.clear();
+        if (level == CoverageInstrumentation::CL_Entry)
+            seqPoints = CoverageInstrumentation::GetEntryPoint(seqPoints);
+        mergedPoints.clear();
+        probes = CoverageInstrumentation::MergeSequenceProbes(method, seqPoints, mergedPoints);
     }
-    else
+
+    auto pSwitchTables = m_switchProbes ? m_pSwitchTables : nullptr;
+    auto pValueTables = m_valueBranchProbes ? m_pSwitchTables : nullptr;
+
+    // the paths are numbered on the original method, the coverage probes are then added around the path probes
+    InstrumentPaths(moduleId, functionToken, method);
+
+    mdToken probeToken = mdTokenNil;
+    switch (probeKind)
     {
-        auto injectedVisitedMethod = RegisterSafeCuckooMethod(moduleId, cuckoo_module_.c_str());
+    case CoverageInstrumentation::PK_Counter:
+        CoverageInstrumentation::AddCoverage(CoverageInstrumentation::CounterProbe(m_pCounters), method, seqPoints, brPoints, probes, derived, m_coldBranchProbes, pSwitchTables, pValueTables);
+        break;
+    case CoverageInstrumentation::PK_Set:
+        CoverageInstrumentation::AddCoverage(CoverageInstrumentation::SetProbe(m_pCounters), method, seqPoints, brPoints, probes, derived, m_coldBranchProbes, pSwitchTables, pValueTables);
+        break;
+    case CoverageInstrumentation::PK_Calli:
+        probeToken = callProbeToken;
+        CoverageInstrumentation::AddCoverage(CoverageInstrumentation::CalliProbe(probeToken, (FPTR)GetInstrumentPointVisit()), method, seqPoints, brPoints, probes, derived, m_coldBranchProbes, pSwitchTables, pValueTables);
+        break;
+    default:
+        probeToken = callProbeToken;
+        CoverageInstrumentation::AddCoverage(CoverageInstrumentation::CallProbe(probeToken), method, seqPoints, brPoints, probes, derived, m_coldBranchProbes, pSwitchTables, pValueTables);
+        break;
+    }
 
-        InstructionList instructions;
-        if (seqPoints.size() > 0)
-            CoverageInstrumentation::InsertInjectedMethod(instructions, injectedVisitedMethod, seqPoints[0].UniqueId);
-        if (method.IsInstrumented(0, instructions)) return;
-  
-        CoverageInstrumentation::AddBranchCoverage([injectedVisitedMethod](InstructionList& brinstructions, ULONG uniqueId)->Instruction*
-        {
-            return CoverageInstrumentation::InsertInjectedMethod(brinstructions, injectedVisitedMethod, uniqueId);
-        }, method, brPoints, seqPoints);
-        
-        CoverageInstrumentation::AddSequenceCoverage([injectedVisitedMethod](InstructionList& seqinstructions, ULONG uniqueId)->Instruction*
+    method.OptimizeEncoding();
+    registration.mergedPoints = std::move(mergedPoints);
+    registration.derived = std::move(derived);
+    registration.cost.level = level;
+    registration.cost.probes = probeCount;
+    registration.cost.originalSize = originalSize;
+    registration.probeToken = probeToken;
+}
+
+/// <summary>Register the merged and derived points of an instrumented body, and record its cost</summary>
+/// <remarks>Only once the body is in use, and before the method can run.</remarks>
+void CCodeCoverage::RegisterInstrumentation(ModuleID moduleId, mdToken functionToken, const Instrumentation::MethodRegistration& registration,
+    ULONG instrumentedSize)
+{
+    if (registration.cost.originalSize == 0)
+        return;
+
+    RegisterMergedPoints(registration.mergedPoints.data(), static_cast<ULONG>(registration.mergedPoints.size()));
+    RegisterDerivedBranchPoints(registration.derived);
+    RecordInstrumentationCost(moduleId, functionToken, static_cast<CoverageInstrumentation::CoverageLevel>(registration.cost.level),
+        registration.cost.probes, registration.cost.originalSize, instrumentedSize);
+}
+
+/// <summary>Whether a method that is compiled again already has the probes it would be given</summary>
+/// <param name="firstProbeId">The id passed by the probe of the first sequence point, as merged (see
+/// <c>CoverageInstrumentation::MergeSequenceProbes</c>).</param>
+/// <remarks>The probe is looked for at the start of the method or, when paths are profiled, after the
+/// code that sets the path register (see <c>Instrumentation::FindPathSetEnd</c>).
+/// Whether the probe was flagged with <c>COUNTED_PROBE_FLAG</c> (see <c>CoverageInstrumentation::DeriveBranchPoints</c>)
+/// is not known until the method has been analysed, so it is looked for with and without the flag.</remarks>
+bool CCodeCoverage::IsInstrumentedMethod(CoverageInstrumentation::ProbeKind probeKind, mdToken callProbeToken, Instrumentation::Method& method,
+    ULONG firstProbeId)
+{
+    long pathSetEnd;
+    auto pathsProfiled = !m_pathProfilePath.empty() && Instrumentation::FindPathSetEnd(method, pathSetEnd);
+
+    for (auto probeId : { firstProbeId & ~COUNTED_PROBE_FLAG, firstProbeId | COUNTED_PROBE_FLAG })
+    {
+        Instrumentation::InstructionList instructions;
+        switch (probeKind)
         {
-            return CoverageInstrumentation::InsertInjectedMethod(seqinstructions, injectedVisitedMethod, uniqueId);
-        }, method, seqPoints);
+        case CoverageInstrumentation::PK_Counter:
+            CoverageInstrumentation::CounterProbe(m_pCounters).Emit(method, instructions, probeId);
+            break;
+        case CoverageInstrumentation::PK_Set:
+            CoverageInstrumentation::SetProbe(m_pCounters).Emit(method, instructions, probeId);
+            break;
+        case CoverageInstrumentation::PK_Calli:
+            CoverageInstrumentation::CalliProbe(callProbeToken, (FPTR)GetInstrumentPointVisit()).Emit(method, instructions, probeId);
+            break;
+        default:
+            CoverageInstrumentation::CallProbe(callProbeToken).Emit(method, instructions, probeId);
+            break;
+        }
+
+        if (method.IsInstrumented(0, instructions) || (pathsProfiled && method.IsInstrumented(pathSetEnd, instructions)))
+            return true;
     }
+    return false;
 }
 
 HRESULT CCodeCoverage::InstrumentMethodWith(ModuleID moduleId, mdToken functionToken, InstructionList &instructions){
@@ -464,6 +844,8 @@ HRESULT CCodeCoverage::InstrumentMethodWith(ModuleID moduleId, mdToken functionT
 
 	instumentedMethod.InsertInstructionsAtOriginalOffset(0, instructions);
 
+	instumentedMethod.OptimizeEncoding();
+
 	//instumentedMethod.DumpIL();
 
 	// now to write the method back
@@ -8,6 +8,7 @@
 #include "ProfilerInfo.h"
 
 #include <unordered_map>
+#include <concurrent_unordered_map.h>
 
 #include <memory>
 
@@ -19,6 +20,20 @@
 #define DNCORLIB_NAME L"System.Private.CoreLib"
 
 #include "CoverageInstrumentation.h"
+#include "ProbePolicies.h"
+#include "MethodCache.h"
+#include "PreparedMethods.h"
+#include "CoveredMethods.h"
+#include "InstrumentedBodyCache.h"
+#include "InstrumentationReport.h"
+#include "ModuleSymbols.h"
+#include "PathProfile.h"
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <atomic>
 
 typedef void(__fastcall *ipv)(ULONG);
 
@@ -39,6 +54,21 @@ public:
         m_useOldStyle = false;
 		m_threshold = 0U;
         m_tracingEnabled = false;
+        m_deriveBranches = false;
+        m_coldBranchProbes = false;
+        m_switchProbes = false;
+        m_valueBranchProbes = false;
+        m_pSwitchTables = nullptr;
+        m_pCounters = nullptr;
+        m_probeKind = CoverageInstrumentation::PK_Call;
+        m_callProbeKind = CoverageInstrumentation::PK_Call;
+        m_removeCoveredProbes = false;
+        m_reuseBodies = false;
+        m_localSymbols = false;
+        m_maxPathsPerMethod = DEFAULT_MAX_PATHS_PER_METHOD;
+        m_reJitStopping = false;
+        m_reJitRequested = false;
+        m_committedCounters = 0;
         m_cuckooCriticalToken = 0;
         m_cuckooSafeToken = 0;
         m_infoHook = nullptr;
@@ -46,6 +76,11 @@ public:
         chained_module_ = nullptr;
         enableDiagnostics_ = false;
         safe_mode_ = true;
+        m_hMethodCacheFile = nullptr;
+        m_hMethodCacheMapping = nullptr;
+        m_pMethodCacheView = nullptr;
+        m_methodCacheVersion = 0;
+        m_preInstrumentStopping = false;
     }
 
 DECLARE_REGISTRY_RESOURCEID(IDR_CODECOVERAGE)
@@ -89,6 +124,7 @@ public:
     BOOL GetTokenAndModule(FunctionID funcId, mdToken& functionToken, ModuleID& moduleId, std::wstring &modulePath, AssemblyID *pAssemblyId);
 	std::wstring GetTypeAndMethodName(FunctionID functionId);
     void __fastcall AddVisitPoint(ULONG uniqueId);
+    void RecordVisitPoint(ULONG uniqueId);
 
 private:
 	DWORD AppendProfilerEventMask(DWORD currentEventMask) override;
@@ -97,6 +133,9 @@ private:
     std::shared_ptr<Communication::ProfilerCommunication> _host;
     ULONG _commwait;
 	HRESULT OpenCoverInitialise(IUnknown *pICorProfilerInfoUnk);
+    static bool GetEnvironmentSetting(LPCTSTR name, tstring& value);
+    static bool GetEnvironmentSetting(LPCTSTR name, ULONG& value);
+    static bool GetEnvironmentSetting(LPCTSTR name, double& value);
 
 	ipv static GetInstrumentPointVisit();
 
@@ -125,6 +164,8 @@ public:
 private:
     std::unordered_map<std::wstring, bool> m_allowModules;
     std::unordered_map<std::wstring, std::wstring> m_allowModulesAssemblyMap;
+    std::mutex m_mutexAllowModulesAssemblyMap;
+    std::wstring GetModuleAssemblyName(const std::wstring& modulePath);
 
     COR_PRF_RUNTIME_TYPE m_runtimeType;
     ASSEMBLYMETADATA m_runtimeVersion = {};
@@ -132,6 +173,10 @@ private:
     bool m_useOldStyle;
 	ULONG m_threshold;
     bool m_tracingEnabled;
+    bool m_deriveBranches;
+    bool m_coldBranchProbes;
+    bool m_removeCoveredProbes;
+    bool m_reuseBodies;
     bool safe_mode_;
 	bool enableDiagnostics_;
 
@@ -139,6 +184,70 @@ private:
     std::vector<ULONG> m_thresholds;
     void Resize(ULONG minSize);
 
+    Concurrency::concurrent_unordered_map<ULONG, std::vector<ULONG>> m_mergedPoints;
+    void RegisterMergedPoints(const ULONG* pMerged, ULONG mergedSize);
+
+    // the visits of the points that derived branch points are calculated from
+    Concurrency::concurrent_unordered_map<ULONG, std::shared_ptr<std::atomic<ULONGLONG>>> m_pointCounts;
+    std::mutex m_mutexDerivedBranches;
+    std::unordered_map<ULONG, CoverageInstrumentation::DerivedBranchPoint> m_derivedBranchPoints;
+    void RegisterDerivedBranchPoints(const CoverageInstrumentation::DerivedBranchPoints& derived);
+    ULONGLONG GetPointCount(ULONG uniqueId);
+    void EmitDerivedBranchPoints();
+
+    // the visit counters incremented by the inline probes (see CodeCoverage_Counters.cpp)
+    ULONG* m_pCounters;
+    std::atomic<ULONG> m_committedCounters;
+    std::mutex m_mutexCounters;
+    Concurrency::concurrent_unordered_map<ModuleID, bool> m_unverifiableProbeModules;
+    void OpenCounters();
+    bool EnsureCounters(ULONG lastUniqueId);
+    ULONG GetCounter(ULONG uniqueId);
+    bool CanUseInlineCounters(ModuleID moduleId);
+    bool CanUseUnverifiableProbes(ModuleID moduleId);
+    void HarvestCounters();
+    void AddVisitCount(std::vector<VisitCount>& counts, ULONG uniqueId, ULONG visits);
+    void SendVisitCounts(std::vector<VisitCount>& counts);
+
+    // the probes chosen at Initialize, and those used where the counters cannot be
+    CoverageInstrumentation::ProbeKind m_probeKind;
+    CoverageInstrumentation::ProbeKind m_callProbeKind;
+    void ChooseProbeKind();
+
+    // the tables of the switches that are probed once (see CoverageInstrumentation::InsertSwitchProbe), and of
+    // the branches that are probed by the value they test (see CoverageInstrumentation::InsertValueProbe)
+    bool m_switchProbes;
+    bool m_valueBranchProbes;
+    Instrumentation::SwitchTables* m_pSwitchTables;
+
+    // the most a method can be grown by its probes, and what each method cost (see CodeCoverage_Budget.cpp)
+    CoverageInstrumentation::ProbeBudget m_probeBudget;
+    tstring m_bloatReportPath;
+    Instrumentation::InstrumentationReport m_instrumentationReport;
+    void ReadProbeBudget();
+    void RecordInstrumentationCost(ModuleID moduleId, mdToken functionToken, CoverageInstrumentation::CoverageLevel level,
+        ULONG probes, ULONG originalSize, ULONG instrumentedSize);
+    void ReportDowngrades();
+    void WriteBloatReport();
+
+    // the points found from the portable PDB of each module rather than asked of the host (see CodeCoverage_Symbols.cpp)
+    bool m_localSymbols;
+    std::mutex m_mutexModuleSymbols;
+    std::unordered_map<ModuleID, std::shared_ptr<const Instrumentation::ModuleSymbols>> m_moduleSymbols;
+    void ReadLocalSymbols();
+    std::shared_ptr<const Instrumentation::ModuleSymbols> GetModuleSymbols(ModuleID moduleId, const std::wstring& modulePath);
+    void DiscardModuleSymbols(ModuleID moduleId);
+    HRESULT InstrumentWithLocalPoints(FunctionID functionId, mdToken functionToken, ModuleID moduleId, const std::wstring& modulePath);
+
+    // the acyclic paths counted for each method (see CodeCoverage_Paths.cpp)
+    tstring m_pathProfilePath;
+    ULONG m_maxPathsPerMethod;
+    Instrumentation::PathProfile m_pathProfile;
+    void ReadPathProfile();
+    HRESULT AddPathRegister(ModuleID moduleId, Instrumentation::Method& method, USHORT& pathRegister);
+    void InstrumentPaths(ModuleID moduleId, mdToken functionToken, Instrumentation::Method& method);
+    void WritePathProfile();
+
 
 
 private:
@@ -156,13 +265,78 @@ private:
     HRESULT AddCriticalCuckooBody(ModuleID moduleId);
     HRESULT AddSafeCuckooBody(ModuleID moduleId);
     mdMemberRef RegisterSafeCuckooMethod(ModuleID moduleId, const WCHAR* moduleName);
-    void InstrumentMethod(ModuleID moduleId, Instrumentation::Method& method,  std::vector<SequencePoint> seqPoints, std::vector<BranchPoint> brPoints);
+    HRESULT InstrumentFunction(FunctionID functionId, mdToken functionToken, ModuleID moduleId, SequencePointSpan seqPoints, BranchPointSpan brPoints);
+    HRESULT SetInstrumentedBody(FunctionID functionId, ModuleID moduleId, mdToken functionToken, const void* pBody, ULONG bodySize,
+        const COR_IL_MAP* pMap, ULONG mapSize);
+    mdToken GetCallProbeToken(ModuleID moduleId);
+    void InstrumentMethod(ModuleID moduleId, mdToken functionToken, Instrumentation::Method& method, SequencePointSpan seqPoints,
+        BranchPointSpan brPoints, bool inlineCounters, mdToken callProbeToken, Instrumentation::MethodRegistration& registration);
+    void RegisterInstrumentation(ModuleID moduleId, mdToken functionToken, const Instrumentation::MethodRegistration& registration,
+        ULONG instrumentedSize);
+    bool IsInstrumentedMethod(CoverageInstrumentation::ProbeKind probeKind, mdToken callProbeToken, Instrumentation::Method& method,
+        ULONG firstProbeId);
 	HRESULT CuckooSupportCompilation(
 		AssemblyID assemblyId,
 		mdToken functionToken,
 		ModuleID moduleId);
 	std::wstring cuckoo_module_;
 
+private:
+    Instrumentation::MethodCache m_methodCache;
+    Synchronization::CMutex m_mutexMethodCache;
+    HANDLE m_hMethodCacheFile;
+    HANDLE m_hMethodCacheMapping;
+    void* m_pMethodCacheView;
+    ULONGLONG m_methodCacheVersion;
+    void OpenMethodCache(DWORD dwVersionHigh, DWORD dwVersionLow);
+    void CloseMethodCache();
+    bool GetMethodCacheKey(ModuleID moduleId, mdToken functionToken, const IMAGE_COR_ILMETHOD* pMethodHeader, ULONG methodSize, 
+        SequencePointSpan seqPoints, BranchPointSpan brPoints, Instrumentation::MethodCacheKey &key);
+    HRESULT ApplyCachedMethod(FunctionID functionId, ModuleID moduleId, mdToken functionToken, const Instrumentation::MethodCacheKey &key);
+    void AddCachedMethod(const Instrumentation::MethodCacheKey &key, const IMAGE_COR_ILMETHOD* pBody, ULONG bodySize, const COR_IL_MAP* pMap, ULONG mapSize,
+        const std::vector<ULONG> &mergedPoints, const Instrumentation::MethodCacheCost &cost);
+
+private:
+    struct PreparedModule;
+    std::vector<std::thread> m_preInstrumentWorkers;
+    std::mutex m_mutexPreInstrument;
+    std::condition_variable m_preInstrumentQueued;
+    std::deque<std::shared_ptr<PreparedModule>> m_preInstrumentQueue;
+    std::unordered_map<ModuleID, std::shared_ptr<PreparedModule>> m_preparedModules;
+    bool m_preInstrumentStopping;
+    void StartPreInstrumentation();
+    void StopPreInstrumentation();
+    void PreInstrumentModule(ModuleID moduleId, const std::wstring& modulePath, const std::wstring& assemblyName);
+    void DiscardPreparedModule(ModuleID moduleId);
+    void PreInstrumentWorker();
+    void PreInstrumentMethod(PreparedModule& module, mdMethodDef functionToken);
+    HRESULT ApplyPreparedMethod(FunctionID functionId, mdToken functionToken, ModuleID moduleId);
+
+private:
+    Instrumentation::CoveredMethods m_coveredMethods;
+    std::thread m_reJitWorker;
+    std::mutex m_mutexReJit;
+    std::condition_variable m_reJitQueued;
+    bool m_reJitStopping;
+    bool m_reJitRequested;
+    void StartReJitCoveredMethods();
+    void StopReJitCoveredMethods();
+    void TrackCoveredMethod(ModuleID moduleId, mdToken functionToken, const IMAGE_COR_ILMETHOD* pOriginalBody, ULONG originalSize,
+        SequencePointSpan seqPoints, BranchPointSpan brPoints);
+    void TrackCoveredMethod(ModuleID moduleId, mdToken functionToken, const IMAGE_COR_ILMETHOD* pOriginalBody, ULONG originalSize,
+        std::vector<ULONG> pointIds);
+    void PointCovered(ULONG uniqueId);
+    void QueueReJit();
+    void ReJitWorker();
+
+private:
+    // the instrumented bodies reused when a method is compiled again (see CodeCoverage_Bodies.cpp)
+    Instrumentation::InstrumentedBodyCache m_bodyCache;
+    void TrackInstrumentedBodies(ModuleID moduleId, const std::wstring& modulePath);
+    void AddInstrumentedBody(ModuleID moduleId, mdToken functionToken, mdToken probeToken, const IMAGE_COR_ILMETHOD* pBody, ULONG bodySize,
+        const COR_IL_MAP* pMap, ULONG mapSize, SequencePointSpan seqPoints, BranchPointSpan brPoints);
+    HRESULT ApplyInstrumentedBody(FunctionID functionId, mdToken functionToken, ModuleID moduleId);
+
 private:
 	HMODULE chained_module_;
 
@@ -205,10 +379,28 @@ public:
         /* [in] */ ModuleID moduleId,
         /* [in] */ HRESULT hrStatus) override;
 
+    virtual HRESULT STDMETHODCALLTYPE ModuleUnloadStarted( 
+        /* [in] */ ModuleID moduleId) override;
+
+    virtual HRESULT STDMETHODCALLTYPE ModuleUnloadFinished( 
+        /* [in] */ ModuleID moduleId,
+        /* [in] */ HRESULT hrStatus) override;
+
     virtual HRESULT STDMETHODCALLTYPE JITCompilationStarted( 
         /* [in] */ FunctionID functionId,
         /* [in] */ BOOL fIsSafeToBlock) override;
 
+    virtual HRESULT STDMETHODCALLTYPE GetReJITParameters(
+        /* [in] */ ModuleID moduleId,
+        /* [in] */ mdMethodDef methodId,
+        /* [in] */ ICorProfilerFunctionControl *pFunctionControl) override;
+
+    virtual HRESULT STDMETHODCALLTYPE ReJITError(
+        /* [in] */ ModuleID moduleId,
+        /* [in] */ mdMethodDef methodId,
+        /* [in] */ FunctionID functionId,
+        /* [in] */ HRESULT hrStatus) override;
+
     virtual HRESULT STDMETHODCALLTYPE ThreadDestroyed(
         /* [in] */ ThreadID threadId) override;
 
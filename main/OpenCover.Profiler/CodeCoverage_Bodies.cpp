@@ -0,0 +1,109 @@
+#include "stdafx.h"
+#include "CodeCoverage.h"
+
+using namespace Instrumentation;
+
+/// <summary>Record a tracked module so that the bodies of its methods can be reused</summary>
+/// <remarks>Only if <c>OpenCover_Profiler_ReuseInstrumentedBodies</c> is set; the module is
+/// identified by its MVID and path so that every AppDomain that loads it shares the bodies.</remarks>
+void CCodeCoverage::TrackInstrumentedBodies(ModuleID moduleId, const std::wstring& modulePath)
+{
+    if (!m_reuseBodies)
+        return;
+
+    CComPtr<IMetaDataImport> metaDataImport;
+    GUID moduleVersionId;
+    auto hr = m_profilerInfo->GetModuleMetaData(moduleId, ofRead, IID_IMetaDataImport, (IUnknown**)&metaDataImport);
+    if (SUCCEEDED(hr))
+        hr = metaDataImport->GetScopeProps(nullptr, 0, nullptr, &moduleVersionId);
+    if (!SUCCEEDED(hr)) {
+        RELTRACE(_T("    ::TrackInstrumentedBodies(...) => GetScopeProps => 0x%X"), hr);
+        return;
+    }
+
+    m_bodyCache.AddModule(moduleId, moduleVersionId, modulePath);
+}
+
+/// <summary>Keep the instrumented body of a method for when it is compiled again</summary>
+/// <param name="probeToken">The token of the module the probes reference (see <c>InstrumentMethod</c>).</param>
+/// <remarks>The points are only kept when they are needed to track the method (see <c>TrackCoveredMethod</c>);
+/// the body is not kept if they are needed but not supplied.</remarks>
+void CCodeCoverage::AddInstrumentedBody(ModuleID moduleId, mdToken functionToken, mdToken probeToken, const IMAGE_COR_ILMETHOD* pBody, ULONG bodySize,
+    const COR_IL_MAP* pMap, ULONG mapSize, SequencePointSpan seqPoints, BranchPointSpan brPoints)
+{
+    if (!m_reuseBodies)
+        return;
+    if (m_removeCoveredProbes && seqPoints.empty() && brPoints.empty())
+        return;
+
+    auto body = std::make_shared<InstrumentedBody>();
+    body->moduleId = moduleId;
+    body->probeToken = probeToken;
+    body->body.assign(reinterpret_cast<const BYTE*>(pBody), reinterpret_cast<const BYTE*>(pBody) + bodySize);
+    body->map.assign(pMap, pMap + mapSize);
+    if (m_removeCoveredProbes)
+    {
+        body->pointIds.reserve(seqPoints.size() + brPoints.size());
+        for (const auto& point : seqPoints)
+            body->pointIds.push_back(point.UniqueId);
+        for (const auto& point : brPoints)
+            body->pointIds.push_back(point.UniqueId);
+    }
+
+    m_bodyCache.Add(moduleId, functionToken, std::move(body));
+}
+
+/// <summary>Replace the body of a method that is being compiled again with the body it was instrumented with</summary>
+/// <returns>S_FALSE if there is no body to reuse.</returns>
+/// <remarks>Nothing is asked of the host; the merged and derived points, the thresholds and the
+/// counters were all set up when the body was first built. A body built for another <c>ModuleID</c>
+/// is only used if its probes reference the same token in this one, and not at all when profiling paths
+/// as the path register is a local of a signature that is only known to the module it was added to.</remarks>
+HRESULT CCodeCoverage::ApplyInstrumentedBody(FunctionID functionId, mdToken functionToken, ModuleID moduleId)
+{
+    if (!m_reuseBodies)
+        return S_FALSE;
+
+    auto body = m_bodyCache.Find(moduleId, functionToken);
+    if (!body)
+        return S_FALSE;
+
+    if (body->moduleId != moduleId)
+    {
+        if (!m_pathProfilePath.empty())
+            return S_FALSE;
+
+        if (body->probeToken != mdTokenNil)
+        {
+            if (GetCallProbeToken(moduleId) != body->probeToken)
+                return S_FALSE;
+        }
+
+        if (m_removeCoveredProbes)
+        {
+            IMAGE_COR_ILMETHOD* pMethodHeader = nullptr;
+            ULONG iMethodSize = 0;
+            COM_FAIL_MSG_RETURN_ERROR(m_profilerInfo2->GetILFunctionBody(moduleId, functionToken, (LPCBYTE*)&pMethodHeader, &iMethodSize),
+                _T("    ::ApplyInstrumentedBody(...) => GetILFunctionBody => 0x%X"));
+            TrackCoveredMethod(moduleId, functionToken, pMethodHeader, iMethodSize, body->pointIds);
+        }
+    }
+
+    return SetInstrumentedBody(functionId, moduleId, functionToken, body->body.data(), static_cast<ULONG>(body->body.size()),
+        body->map.data(), static_cast<ULONG>(body->map.size()));
+}
+
+/// <summary>Handle <c>ICorProfilerCallback::ModuleUnloadFinished</c></summary>
+/// <remarks>The bodies are released once no other AppDomain has the module loaded.</remarks>
+HRESULT STDMETHODCALLTYPE CCodeCoverage::ModuleUnloadFinished(
+    /* [in] */ ModuleID moduleId,
+    /* [in] */ HRESULT hrStatus)
+{
+    return ChainCall([&]() { return CProfilerBase::ModuleUnloadFinished(moduleId, hrStatus); },
+        [&]()
+    {
+        if (m_bodyCache.RemoveModule(moduleId))
+            ATLTRACE(_T("::ModuleUnloadFinished(%" PRIxPTR ") => bodies released"), moduleId);
+        return S_OK;
+    });
+}
@@ -0,0 +1,76 @@
+#include "stdafx.h"
+#include "CodeCoverage.h"
+
+#include <fstream>
+
+using namespace Instrumentation;
+
+/// <summary>Read the most each method can be grown by its probes</summary>
+/// <remarks><para><c>OpenCover_Profiler_MaxProbesPerMethod</c> limits the number of probes and
+/// <c>OpenCover_Profiler_MaxCodeGrowth</c> the instrumented size as a multiple of the original; a method
+/// over either is given coarser coverage (see <c>CoverageInstrumentation::ChooseCoverageLevel</c>).</para>
+/// <para><c>OpenCover_Profiler_BloatReport</c> is the file the cost of each method is written to at
+/// shutdown.</para></remarks>
+void CCodeCoverage::ReadProbeBudget()
+{
+    GetEnvironmentSetting(_T("OpenCover_Profiler_MaxProbesPerMethod"), m_probeBudget.maxProbes);
+    ATLTRACE(_T("    ::Initialize(...) => maxProbesPerMethod = %lu"), m_probeBudget.maxProbes);
+
+    GetEnvironmentSetting(_T("OpenCover_Profiler_MaxCodeGrowth"), m_probeBudget.maxCodeGrowth);
+    if (m_probeBudget.maxCodeGrowth < 1.0)
+        m_probeBudget.maxCodeGrowth = 0.0;
+    ATLTRACE(_T("    ::Initialize(...) => maxCodeGrowth = %f"), m_probeBudget.maxCodeGrowth);
+
+    GetEnvironmentSetting(_T("OpenCover_Profiler_BloatReport"), m_bloatReportPath);
+    RELTRACE(_T("    ::Initialize(...) => bloatReport = %s"), m_bloatReportPath.c_str());
+}
+
+/// <summary>Record what instrumenting a method cost</summary>
+/// <remarks>Only the methods that were over the budget are recorded unless there is a bloat report.</remarks>
+void CCodeCoverage::RecordInstrumentationCost(ModuleID moduleId, mdToken functionToken, CoverageInstrumentation::CoverageLevel level,
+    ULONG probes, ULONG originalSize, ULONG instrumentedSize)
+{
+    if (m_bloatReportPath.empty() && level == CoverageInstrumentation::CL_Branch)
+        return;
+
+    MethodCost cost;
+    cost.modulePath = GetModulePath(moduleId);
+    cost.assemblyName = GetModuleAssemblyName(cost.modulePath);
+    cost.functionToken = functionToken;
+    cost.level = level;
+    cost.probes = probes;
+    cost.originalSize = originalSize;
+    cost.instrumentedSize = instrumentedSize;
+    m_instrumentationReport.Add(cost);
+
+    if (level != CoverageInstrumentation::CL_Branch)
+        RELTRACE(_T("    ::InstrumentMethod(...) => 0x%X over the probe budget, coverage level %d"), functionToken, level);
+}
+
+/// <summary>Tell the host which methods were given coarser coverage than asked for</summary>
+/// <remarks>The methods are instrumented while the points are still in the communication buffer so they are
+/// reported afterwards.</remarks>
+void CCodeCoverage::ReportDowngrades()
+{
+    for (auto& downgrade : m_instrumentationReport.TakeDowngrades())
+    {
+        _host->ReportCoverageLevel(downgrade.functionToken, const_cast<LPWSTR>(downgrade.modulePath.c_str()),
+            const_cast<LPWSTR>(downgrade.assemblyName.c_str()), downgrade.level, downgrade.probes,
+            downgrade.originalSize, downgrade.instrumentedSize);
+    }
+}
+
+/// <summary>Write the cost of each method that was instrumented, those that grew the most first</summary>
+void CCodeCoverage::WriteBloatReport()
+{
+    if (m_bloatReportPath.empty())
+        return;
+
+    std::wofstream report(m_bloatReportPath.c_str());
+    if (!report)
+    {
+        RELTRACE(_T("    ::WriteBloatReport() => unable to write %s"), m_bloatReportPath.c_str());
+        return;
+    }
+    m_instrumentationReport.Write(report);
+}
@@ -0,0 +1,171 @@
+#include "stdafx.h"
+#include "CodeCoverage.h"
+
+#define METHOD_CACHE_DEFAULT_SIZE_MB 64
+#define METHOD_CACHE_MAXIMUM_SIZE_MB 1024
+
+using namespace Instrumentation;
+
+/// <summary>Open (creating it if need be) the method cache named by <c>OpenCover_Profiler_MethodCache</c></summary>
+/// <remarks><para>The cache is a file mapped into every profiled process that uses it; access is
+/// serialized by a mutex named after the file. The mutex is global so that processes in other sessions
+/// (e.g. services) share it; where a global mutex cannot be created (without <c>SeCreateGlobalPrivilege</c>)
+/// it is local to the session. The cache is capped at the size of the file, which is
+/// <c>OpenCover_Profiler_MethodCacheSize</c> MB (default 64) when the file is created; an existing
+/// file keeps its size so that all the processes sharing it agree on the layout.</para>
+/// <para>Entries never need to be invalidated as the key covers everything that goes into the
+/// instrumented body (see <c>GetMethodCacheKey</c>); the oldest entries are evicted when it is full.</para></remarks>
+void CCodeCoverage::OpenMethodCache(DWORD dwVersionHigh, DWORD dwVersionLow)
+{
+    tstring path;
+    if (!GetEnvironmentSetting(_T("OpenCover_Profiler_MethodCache"), path))
+        return;
+
+    ULONG sizeMB = METHOD_CACHE_DEFAULT_SIZE_MB;
+    if (GetEnvironmentSetting(_T("OpenCover_Profiler_MethodCacheSize"), sizeMB)) {
+        if (sizeMB < 1)
+            sizeMB = 1;
+        if (sizeMB > METHOD_CACHE_MAXIMUM_SIZE_MB)
+            sizeMB = METHOD_CACHE_MAXIMUM_SIZE_MB;
+    }
+
+    auto pathHash = MethodCache::Hash(path.c_str(), path.size() * sizeof(TCHAR));
+    TCHAR mutexName[MAX_PATH] = { 0 };
+    _stprintf_s(mutexName, _T("Global\\OpenCover_Profiler_MethodCache_%016I64X"), pathHash);
+    m_mutexMethodCache.Initialise(mutexName);
+    if (!m_mutexMethodCache.IsValid() && ::GetLastError() == ERROR_ACCESS_DENIED) {
+        _stprintf_s(mutexName, _T("Local\\OpenCover_Profiler_MethodCache_%016I64X"), pathHash);
+        m_mutexMethodCache.Initialise(mutexName);
+    }
+    if (!m_mutexMethodCache.IsValid()) {
+        RELTRACE(_T("    ::OpenMethodCache(...) => CreateMutex(%s) => %d"), mutexName, ::GetLastError());
+        return;
+    }
+    Synchronization::CScopedLock<Synchronization::CMutex> lock(m_mutexMethodCache);
+
+    m_hMethodCacheFile = ::CreateFile(path.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE,
+        nullptr, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (m_hMethodCacheFile == INVALID_HANDLE_VALUE) {
+        RELTRACE(_T("    ::OpenMethodCache(...) => CreateFile(%s) => %d"), path.c_str(), ::GetLastError());
+        m_hMethodCacheFile = nullptr;
+        return;
+    }
+
+    LARGE_INTEGER fileSize;
+    if (!::GetFileSizeEx(m_hMethodCacheFile, &fileSize) || fileSize.QuadPart == 0)
+        fileSize.QuadPart = static_cast<LONGLONG>(sizeMB) * 1024 * 1024;
+
+    m_hMethodCacheMapping = ::CreateFileMapping(m_hMethodCacheFile, nullptr, PAGE_READWRITE, fileSize.HighPart, fileSize.LowPart, nullptr);
+    if (m_hMethodCacheMapping != nullptr)
+        m_pMethodCacheView = ::MapViewOfFile(m_hMethodCacheMapping, FILE_MAP_ALL_ACCESS, 0, 0, static_cast<SIZE_T>(fileSize.QuadPart));
+
+    if (m_pMethodCacheView == nullptr || !m_methodCache.Attach(m_pMethodCacheView, static_cast<size_t>(fileSize.QuadPart))) {
+        RELTRACE(_T("    ::OpenMethodCache(...) => Unable to map %s => %d"), path.c_str(), ::GetLastError());
+        CloseMethodCache();
+        return;
+    }
+
+    m_methodCacheVersion = (static_cast<ULONGLONG>(dwVersionHigh) << 32) | dwVersionLow;
+    RELTRACE(_T("    ::Initialize(...) => method cache = %s (%I64d bytes)"), path.c_str(), fileSize.QuadPart);
+}
+
+void CCodeCoverage::CloseMethodCache()
+{
+    m_methodCache.Attach(nullptr, 0);
+    if (m_pMethodCacheView != nullptr) {
+        ::UnmapViewOfFile(m_pMethodCacheView);
+        m_pMethodCacheView = nullptr;
+    }
+    if (m_hMethodCacheMapping != nullptr) {
+        ::CloseHandle(m_hMethodCacheMapping);
+        m_hMethodCacheMapping = nullptr;
+    }
+    if (m_hMethodCacheFile != nullptr) {
+        ::CloseHandle(m_hMethodCacheFile);
+        m_hMethodCacheFile = nullptr;
+    }
+}
+
+/// <summary>Build the key of the instrumented body of a method</summary>
+/// <returns>false if the method cannot be cached.</returns>
+/// <remarks>The key covers the module (MVID), the original body and everything injected into it: the
+/// points, the token of the visit method, the layout of the branch probes and the build of the profiler
+/// (which determines the rewriting).
+/// The old style probes embed the address of the visit callback, and the inline probes the address of
+/// their counter, so they are never cached, nor are methods with derived branch points as the cache
+/// does not record how they are derived, nor the switch or value probes as their tables are of this process,
+/// nor the path probes as they embed the address of their counters.</remarks>
+bool CCodeCoverage::GetMethodCacheKey(ModuleID moduleId, mdToken functionToken, const IMAGE_COR_ILMETHOD* pMethodHeader, ULONG methodSize,
+    SequencePointSpan seqPoints, BranchPointSpan brPoints, MethodCacheKey &key)
+{
+    if (!m_methodCache.IsAttached() || m_useOldStyle || m_pCounters != nullptr || m_deriveBranches || m_pSwitchTables != nullptr
+        || !m_pathProfilePath.empty())
+        return false;
+
+    memset(&key, 0, sizeof(key));
+
+    CComPtr<IMetaDataImport> metaDataImport;
+    COM_FAIL_MSG_RETURN_OTHER(m_profilerInfo->GetModuleMetaData(moduleId, ofRead, IID_IMetaDataImport, (IUnknown**)&metaDataImport), false,
+        _T("    ::GetMethodCacheKey(...) => GetModuleMetaData => 0x%X"));
+    COM_FAIL_MSG_RETURN_OTHER(metaDataImport->GetScopeProps(nullptr, 0, nullptr, &key.moduleVersionId), false,
+        _T("    ::GetMethodCacheKey(...) => GetScopeProps => 0x%X"));
+
+    key.functionToken = functionToken;
+    key.originalSize = methodSize;
+    key.originalHash = MethodCache::Hash(pMethodHeader, methodSize);
+
+    auto injectedVisitedMethod = RegisterSafeCuckooMethod(moduleId, cuckoo_module_.c_str());
+    auto seqCount = static_cast<ULONG>(seqPoints.size());
+    auto hash = MethodCache::Hash(&m_methodCacheVersion, sizeof(m_methodCacheVersion));
+    hash = MethodCache::Hash(&injectedVisitedMethod, sizeof(injectedVisitedMethod), hash);
+    hash = MethodCache::Hash(&m_coldBranchProbes, sizeof(m_coldBranchProbes), hash);
+    hash = MethodCache::Hash(&m_probeBudget.maxProbes, sizeof(m_probeBudget.maxProbes), hash);
+    hash = MethodCache::Hash(&m_probeBudget.maxCodeGrowth, sizeof(m_probeBudget.maxCodeGrowth), hash);
+    hash = MethodCache::Hash(&seqCount, sizeof(seqCount), hash);
+    hash = MethodCache::Hash(seqPoints.begin(), seqPoints.size() * sizeof(SequencePoint), hash);
+    hash = MethodCache::Hash(brPoints.begin(), brPoints.size() * sizeof(BranchPoint), hash);
+    key.instrumentationHash = hash;
+    return true;
+}
+
+/// <summary>Replace the body of a method with the instrumented body held in the method cache</summary>
+/// <returns>S_FALSE if the method is not in the cache.</returns>
+/// <remarks>The cost the method was cached with is recorded, so a method over the probe budget is
+/// reported (see <c>ReportDowngrades</c>) as it would have been had it been instrumented.</remarks>
+HRESULT CCodeCoverage::ApplyCachedMethod(FunctionID functionId, ModuleID moduleId, mdToken functionToken, const MethodCacheKey &key)
+{
+    std::vector<BYTE> body;
+    std::vector<COR_IL_MAP> map;
+    std::vector<ULONG> mergedPoints;
+    MethodCacheCost cost;
+    {
+        Synchronization::CScopedLock<Synchronization::CMutex> lock(m_mutexMethodCache);
+        const BYTE* pCachedBody;
+        ULONG bodySize;
+        const COR_IL_MAP* pCachedMap;
+        ULONG mapSize;
+        const ULONG* pCachedMerged;
+        ULONG mergedSize;
+        if (!m_methodCache.Find(key, pCachedBody, bodySize, pCachedMap, mapSize, pCachedMerged, mergedSize, cost))
+            return S_FALSE;
+
+        body.assign(pCachedBody, pCachedBody + bodySize);
+        map.assign(pCachedMap, pCachedMap + mapSize);
+        mergedPoints.assign(pCachedMerged, pCachedMerged + mergedSize);
+    }
+
+    RegisterMergedPoints(mergedPoints.data(), static_cast<ULONG>(mergedPoints.size()));
+    RecordInstrumentationCost(moduleId, functionToken, static_cast<CoverageInstrumentation::CoverageLevel>(cost.level), cost.probes,
+        cost.originalSize, static_cast<ULONG>(body.size()));
+
+    return SetInstrumentedBody(functionId, moduleId, functionToken, body.data(), static_cast<ULONG>(body.size()),
+        map.data(), static_cast<ULONG>(map.size()));
+}
+
+void CCodeCoverage::AddCachedMethod(const MethodCacheKey &key, const IMAGE_COR_ILMETHOD* pBody, ULONG bodySize, const COR_IL_MAP* pMap, ULONG mapSize,
+    const std::vector<ULONG> &mergedPoints, const MethodCacheCost &cost)
+{
+    Synchronization::CScopedLock<Synchronization::CMutex> lock(m_mutexMethodCache);
+    m_methodCache.Add(key, reinterpret_cast<const BYTE*>(pBody), bodySize, pMap, mapSize,
+        mergedPoints.data(), static_cast<ULONG>(mergedPoints.size()), cost);
+}
@@ -17,8 +17,9 @@ UINT_PTR CCodeCoverage::FunctionMapper2(FunctionID functionId, void* clientData,
     if (profiler->GetTokenAndModule(functionId, functionToken, moduleId, modulePath, &assemblyId))
     {
         ULONG uniqueId;
+        auto assemblyName = profiler->GetModuleAssemblyName(modulePath);
         if (profiler->_host->TrackMethod(functionToken, (LPWSTR)modulePath.c_str(), 
-            (LPWSTR)profiler->m_allowModulesAssemblyMap[modulePath].c_str(), uniqueId))
+            (LPWSTR)assemblyName.c_str(), uniqueId))
         {
             *pbHookFunction = TRUE;
             retVal = uniqueId;
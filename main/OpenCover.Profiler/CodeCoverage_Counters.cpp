@@ -0,0 +1,163 @@
+#include "stdafx.h"
+#include "CodeCoverage.h"
+
+// a multiple of BUFFER_SIZE
+#define COUNTERS_MAXIMUM_POINTS (1024 * BUFFER_SIZE)
+
+using namespace Instrumentation;
+
+/// <summary>Reserve the visit counters that the inline probes increment</summary>
+/// <remarks><para>Only if <c>OpenCover_Profiler_InlineCounters</c> is set; it is ignored when tracing
+/// by test as the visits are only sent at shutdown, too late to be attributed to a test.</para>
+/// <para>The counters are indexed by unique id and their addresses are embedded in the probes so the
+/// region is reserved up front and committed as ids are seen (see <c>EnsureCounters</c>); it is never
+/// released as instrumented code may still be running when the profiler shuts down.</para></remarks>
+void CCodeCoverage::OpenCounters()
+{
+    tstring inlineCounters;
+    if (!GetEnvironmentSetting(_T("OpenCover_Profiler_InlineCounters"), inlineCounters))
+        return;
+
+    if (m_tracingEnabled) {
+        RELTRACE(_T("    ::Initialize(...) => inline counters are not used when tracing by test"));
+        return;
+    }
+
+    m_pCounters = static_cast<ULONG*>(::VirtualAlloc(nullptr, COUNTERS_MAXIMUM_POINTS * sizeof(ULONG), MEM_RESERVE, PAGE_READWRITE));
+    if (m_pCounters == nullptr) {
+        RELTRACE(_T("    ::Initialize(...) => Unable to reserve inline counters => %d"), ::GetLastError());
+        return;
+    }
+
+    RELTRACE(_T("    ::Initialize(...) => inline counters = %d points"), COUNTERS_MAXIMUM_POINTS);
+}
+
+/// <summary>Choose the probes the methods are instrumented with</summary>
+/// <remarks><para>The counters are used wherever they can be (see <c>CanUseInlineCounters</c>), otherwise
+/// the probes call the profiler, through the cuckoo methods or directly for <c>oldSchool</c>.</para>
+/// <para>With a threshold of 1 only whether a point was visited is reported, so the counter can be
+/// set rather than incremented; not when branches are derived as they need every visit.</para></remarks>
+void CCodeCoverage::ChooseProbeKind()
+{
+    m_callProbeKind = m_useOldStyle ? CoverageInstrumentation::PK_Calli : CoverageInstrumentation::PK_Call;
+    m_probeKind = m_callProbeKind;
+    if (m_pCounters != nullptr)
+        m_probeKind = (m_threshold == 1 && !m_deriveBranches) ? CoverageInstrumentation::PK_Set : CoverageInstrumentation::PK_Counter;
+    ATLTRACE(_T("    ::Initialize(...) => probeKind = %d"), m_probeKind);
+}
+
+/// <summary>Make sure there is a counter for every id up to and including <paramref name="lastUniqueId"/></summary>
+/// <returns>false if inline counters cannot be used for those ids.</returns>
+bool CCodeCoverage::EnsureCounters(ULONG lastUniqueId)
+{
+    if (m_pCounters == nullptr || lastUniqueId >= COUNTERS_MAXIMUM_POINTS)
+        return false;
+    if (lastUniqueId < m_committedCounters)
+        return true;
+
+    std::lock_guard<std::mutex> lock(m_mutexCounters);
+    ULONG committed = m_committedCounters;
+    if (lastUniqueId < committed)
+        return true;
+
+    ULONG newCount = ((lastUniqueId / BUFFER_SIZE) + 1) * BUFFER_SIZE;
+    if (::VirtualAlloc(m_pCounters + committed, (newCount - committed) * sizeof(ULONG), MEM_COMMIT, PAGE_READWRITE) == nullptr) {
+        RELTRACE(_T("    ::EnsureCounters(...) => Unable to commit %d counters => %d"), newCount, ::GetLastError());
+        return false;
+    }
+
+    m_committedCounters = newCount;
+    return true;
+}
+
+ULONG CCodeCoverage::GetCounter(ULONG uniqueId)
+{
+    return (m_pCounters != nullptr && uniqueId < m_committedCounters) ? m_pCounters[uniqueId] : 0;
+}
+
+/// <summary>Whether the methods of a module can be instrumented with inline counters</summary>
+bool CCodeCoverage::CanUseInlineCounters(ModuleID moduleId)
+{
+    return m_pCounters != nullptr && CanUseUnverifiableProbes(moduleId);
+}
+
+/// <summary>Whether the methods of a module can be instrumented with probes that are not verifiable,
+/// i.e. the inline counters and the path probes</summary>
+/// <remarks>The desktop CLR does not allow unverifiable code in security transparent code, so those
+/// assemblies (and any that allow partially trusted callers) keep the probes that call the profiler
+/// through the cuckoo methods and their paths are not counted. Runtimes without CAS need no check.</remarks>
+bool CCodeCoverage::CanUseUnverifiableProbes(ModuleID moduleId)
+{
+    if (m_runtimeType != COR_PRF_DESKTOP_CLR)
+        return true;
+
+    auto it = m_unverifiableProbeModules.find(moduleId);
+    if (it != m_unverifiableProbeModules.end())
+        return it->second;
+
+    auto canUse = false;
+    CComPtr<IMetaDataAssemblyImport> metaDataAssemblyImport;
+    mdAssembly assembly;
+    if (SUCCEEDED(m_profilerInfo->GetModuleMetaData(moduleId, ofRead, IID_IMetaDataAssemblyImport, (IUnknown**)&metaDataAssemblyImport))
+        && SUCCEEDED(metaDataAssemblyImport->GetAssemblyFromScope(&assembly)))
+    {
+        CComQIPtr<IMetaDataImport> metaDataImport(metaDataAssemblyImport);
+        canUse = metaDataImport != nullptr
+            && metaDataImport->GetCustomAttributeByName(assembly, L"System.Security.SecurityTransparentAttribute", nullptr, nullptr) != S_OK
+            && metaDataImport->GetCustomAttributeByName(assembly, L"System.Security.AllowPartiallyTrustedCallersAttribute", nullptr, nullptr) != S_OK;
+    }
+
+    m_unverifiableProbeModules.insert(std::make_pair(moduleId, canUse));
+    return canUse;
+}
+
+/// <summary>Send the visits held in the inline counters</summary>
+/// <remarks><para>Each point is sent with its count (see <c>ProfilerCommunication::SendVisitCounts</c>) rather
+/// than as that many visits, a count is limited by the threshold as the visits would have been.</para>
+/// <para>The probe of a merged point (see <c>CoverageInstrumentation::MergeSequenceProbes</c>) counts
+/// the points merged into it as well.</para></remarks>
+void CCodeCoverage::HarvestCounters()
+{
+    if (m_pCounters == nullptr)
+        return;
+
+    std::vector<VisitCount> counts;
+    counts.reserve(VC_BUFFER_SIZE);
+    auto add = [&](ULONG uniqueId, ULONG visits) { AddVisitCount(counts, uniqueId, visits); };
+
+    ULONG committed = m_committedCounters;
+    for (ULONG uniqueId = 1; uniqueId < committed; uniqueId++)
+    {
+        auto visits = m_pCounters[uniqueId];
+        if (visits == 0)
+            continue;
+        if (m_threshold != 0 && visits > m_threshold)
+            visits = m_threshold;
+
+        add(uniqueId, visits);
+        auto merged = m_mergedPoints.find(uniqueId);
+        if (merged != m_mergedPoints.end())
+        {
+            for (auto mergedId : merged->second)
+                add(mergedId, visits);
+        }
+    }
+    SendVisitCounts(counts);
+}
+
+/// <summary>Add the count of a point to those to be sent, sending them once there is a buffer full</summary>
+void CCodeCoverage::AddVisitCount(std::vector<VisitCount>& counts, ULONG uniqueId, ULONG visits)
+{
+    VisitCount count = { uniqueId, visits };
+    counts.push_back(count);
+    if (counts.size() == VC_BUFFER_SIZE)
+        SendVisitCounts(counts);
+}
+
+/// <summary>Send the counts that have been added (see <c>AddVisitCount</c>)</summary>
+void CCodeCoverage::SendVisitCounts(std::vector<VisitCount>& counts)
+{
+    if (!counts.empty() && !_host->SendVisitCounts(counts.data(), static_cast<ULONG>(counts.size())))
+        RELTRACE(_T("    ::SendVisitCounts() => unable to send %lu counts"), static_cast<ULONG>(counts.size()));
+    counts.clear();
+}
@@ -0,0 +1,96 @@
+#include "stdafx.h"
+#include "CodeCoverage.h"
+
+#include <fstream>
+
+using namespace Instrumentation;
+
+/// <summary>Read whether the acyclic paths of the methods are counted</summary>
+/// <remarks><para>Only if <c>OpenCover_Profiler_PathProfile</c> is set, it is the file the paths are written to
+/// at shutdown (see <c>PathProfile::Write</c>); <c>OpenCover_Profiler_MaxPathsPerMethod</c> limits the number
+/// of paths a method can have for them to be counted.</para>
+/// <para>Covered probes are not removed as the methods would lose their path probes with them.</para></remarks>
+void CCodeCoverage::ReadPathProfile()
+{
+    GetEnvironmentSetting(_T("OpenCover_Profiler_PathProfile"), m_pathProfilePath);
+    RELTRACE(_T("    ::Initialize(...) => pathProfile = %s"), m_pathProfilePath.c_str());
+    if (m_pathProfilePath.empty())
+        return;
+
+    GetEnvironmentSetting(_T("OpenCover_Profiler_MaxPathsPerMethod"), m_maxPathsPerMethod);
+    ATLTRACE(_T("    ::Initialize(...) => maxPathsPerMethod = %lu"), m_maxPathsPerMethod);
+
+    if (m_removeCoveredProbes) {
+        RELTRACE(_T("    ::Initialize(...) => covered probes are not removed when profiling paths"));
+        m_removeCoveredProbes = false;
+    }
+}
+
+/// <summary>Add the path register to the locals of a method</summary>
+/// <param name="pathRegister">Receives the index of the local.</param>
+HRESULT CCodeCoverage::AddPathRegister(ModuleID moduleId, Method& method, USHORT& pathRegister)
+{
+    CComPtr<IMetaDataImport> metaDataImport;
+    COM_FAIL_MSG_RETURN_ERROR(m_profilerInfo->GetModuleMetaData(moduleId, ofRead | ofWrite, IID_IMetaDataImport, (IUnknown**)&metaDataImport),
+        _T("    ::AddPathRegister(...) => GetModuleMetaData => 0x%X"));
+
+    PCCOR_SIGNATURE pLocals = nullptr;
+    ULONG localsSize = 0;
+    if (method.GetLocalVarSigToken() != mdTokenNil) {
+        COM_FAIL_MSG_RETURN_ERROR(metaDataImport->GetSigFromToken(method.GetLocalVarSigToken(), &pLocals, &localsSize),
+            _T("    ::AddPathRegister(...) => GetSigFromToken => 0x%X"));
+    }
+
+    std::vector<BYTE> locals;
+    if (!AppendLocal(pLocals, localsSize, ELEMENT_TYPE_I4, locals, pathRegister))
+        return E_FAIL;
+
+    CComPtr<IMetaDataEmit> metaDataEmit;
+    COM_FAIL_MSG_RETURN_ERROR(m_profilerInfo->GetModuleMetaData(moduleId, ofRead | ofWrite, IID_IMetaDataEmit, (IUnknown**)&metaDataEmit),
+        _T("    ::AddPathRegister(...) => GetModuleMetaData => 0x%X"));
+
+    mdSignature localsToken;
+    COM_FAIL_MSG_RETURN_ERROR(metaDataEmit->GetTokenFromSig(locals.data(), static_cast<ULONG>(locals.size()), &localsToken),
+        _T("    ::AddPathRegister(...) => GetTokenFromSig => 0x%X"));
+    method.SetLocalVarSigToken(localsToken);
+    return S_OK;
+}
+
+/// <summary>Count the acyclic paths a method runs, numbered as by Ball and Larus (see <c>PathGraph</c>)</summary>
+/// <remarks><para>This has to be done before the coverage probes are added as the paths are of the original
+/// method.</para>
+/// <para>The path probes are not verifiable, so only the modules that could have inline counters are profiled
+/// (see <c>CanUseUnverifiableProbes</c>).</para></remarks>
+void CCodeCoverage::InstrumentPaths(ModuleID moduleId, mdToken functionToken, Method& method)
+{
+    if (m_pathProfilePath.empty() || !CanUseUnverifiableProbes(moduleId))
+        return;
+
+    auto graph = std::make_shared<PathGraph>();
+    if (!graph->Build(method, m_maxPathsPerMethod)) {
+        ATLTRACE(_T("    ::InstrumentPaths(...) => 0x%X paths are not counted"), functionToken);
+        return;
+    }
+
+    USHORT pathRegister;
+    if (!SUCCEEDED(AddPathRegister(moduleId, method, pathRegister)))
+        return;
+
+    auto modulePath = GetModulePath(moduleId);
+    auto pCounters = m_pathProfile.Add(modulePath, GetModuleAssemblyName(modulePath), functionToken, graph);
+    AddPathProfile(method, *graph, PathProbe(pathRegister, pCounters));
+}
+
+void CCodeCoverage::WritePathProfile()
+{
+    if (m_pathProfilePath.empty())
+        return;
+
+    std::wofstream profile(m_pathProfilePath.c_str());
+    if (!profile)
+    {
+        RELTRACE(_T("    ::WritePathProfile() => unable to write %s"), m_pathProfilePath.c_str());
+        return;
+    }
+    m_pathProfile.Write(profile);
+}
@@ -0,0 +1,256 @@
+#include "stdafx.h"
+#include "CodeCoverage.h"
+
+#define PRE_INSTRUMENT_MAXIMUM_WORKERS 8
+
+using namespace Instrumentation;
+
+/// <summary>A tracked module whose methods are being prepared by the workers</summary>
+/// <remarks>What needs the metadata of the module written to is found before the workers start on it.</remarks>
+struct CCodeCoverage::PreparedModule
+{
+    PreparedModule(ModuleID id, const std::wstring& path, const std::wstring& assembly, ULONG methodCount)
+        : moduleId(id), modulePath(path), assemblyName(assembly), table(methodCount), inlineCounters(false),
+        callProbeToken(mdTokenNil), lastRow(0), unloaded(false) {}
+
+    ModuleID moduleId;
+    std::wstring modulePath;
+    std::wstring assemblyName;
+    PreparedMethodTable table;
+
+    bool inlineCounters;
+    mdToken callProbeToken;
+
+    // the last MethodDef row claimed by a worker
+    std::atomic<ULONG> lastRow;
+    std::atomic<bool> unloaded;
+};
+
+/// <summary>Start the workers that prepare instrumented bodies ahead of the JIT</summary>
+/// <remarks>Only if <c>OpenCover_Profiler_PreInstrument</c> holds the number of workers to use, and
+/// not when paths are profiled as the path probes are registered as they are built.</remarks>
+void CCodeCoverage::StartPreInstrumentation()
+{
+    ULONG workerCount = 0;
+    if (!GetEnvironmentSetting(_T("OpenCover_Profiler_PreInstrument"), workerCount))
+        return;
+
+    if (!m_pathProfilePath.empty())
+    {
+        RELTRACE(_T("    ::Initialize(...) => preInstrument ignored as paths are profiled"));
+        return;
+    }
+
+    if (workerCount > PRE_INSTRUMENT_MAXIMUM_WORKERS)
+        workerCount = PRE_INSTRUMENT_MAXIMUM_WORKERS;
+
+    m_preInstrumentStopping = false;
+    for (ULONG i = 0; i < workerCount; i++)
+        m_preInstrumentWorkers.push_back(std::thread([this]() { PreInstrumentWorker(); }));
+
+    RELTRACE(_T("    ::Initialize(...) => preInstrument = %d workers"), workerCount);
+}
+
+void CCodeCoverage::StopPreInstrumentation()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutexPreInstrument);
+        m_preInstrumentStopping = true;
+        m_preInstrumentQueue.clear();
+        m_preparedModules.clear();
+    }
+    m_preInstrumentQueued.notify_all();
+
+    for (auto& worker : m_preInstrumentWorkers)
+        worker.join();
+}
+
+/// <summary>Queue a tracked module so that its methods are prepared before they are JIT compiled</summary>
+/// <remarks>The table is created here, rather than by a worker, so that the JIT always finds it and
+/// no method can be prepared after it has already been compiled.</remarks>
+void CCodeCoverage::PreInstrumentModule(ModuleID moduleId, const std::wstring& modulePath, const std::wstring& assemblyName)
+{
+    if (m_preInstrumentWorkers.empty())
+        return;
+
+    CComPtr<IMetaDataTables> metaDataTables;
+    auto hr = m_profilerInfo->GetModuleMetaData(moduleId, ofRead, IID_IMetaDataTables, (IUnknown**)&metaDataTables);
+    if (!SUCCEEDED(hr)) {
+        RELTRACE(_T("    ::PreInstrumentModule(...) => GetModuleMetaData => 0x%X"), hr);
+        return;
+    }
+
+    // the metadata table index is the token type
+    ULONG methodCount = 0;
+    hr = metaDataTables->GetNumRows(mdtMethodDef >> 24, &methodCount);
+    if (!SUCCEEDED(hr) || methodCount == 0)
+        return;
+
+    auto module = std::make_shared<PreparedModule>(moduleId, modulePath, assemblyName, methodCount);
+    module->inlineCounters = CanUseInlineCounters(moduleId);
+    module->callProbeToken = GetCallProbeToken(moduleId);
+    {
+        std::lock_guard<std::mutex> lock(m_mutexPreInstrument);
+        m_preparedModules[moduleId] = module;
+        m_preInstrumentQueue.push_back(module);
+    }
+    m_preInstrumentQueued.notify_all();
+}
+
+/// <summary>Stop preparing the methods of a module that is being unloaded</summary>
+void CCodeCoverage::DiscardPreparedModule(ModuleID moduleId)
+{
+    if (m_preInstrumentWorkers.empty())
+        return;
+
+    std::lock_guard<std::mutex> lock(m_mutexPreInstrument);
+    auto it = m_preparedModules.find(moduleId);
+    if (it == m_preparedModules.end())
+        return;
+
+    it->second->unloaded = true;
+    m_preparedModules.erase(it);
+}
+
+/// <summary>Prepare the methods of the queued modules</summary>
+/// <remarks>Methods are prepared in declaration (<c>MethodDef</c> row) order as there is nothing
+/// to tell us the order they are likely to be called in; all the workers share the module at the
+/// front of the queue until each of its rows has been claimed.</remarks>
+void CCodeCoverage::PreInstrumentWorker()
+{
+    while (true)
+    {
+        std::shared_ptr<PreparedModule> module;
+        {
+            std::unique_lock<std::mutex> lock(m_mutexPreInstrument);
+            m_preInstrumentQueued.wait(lock, [this]() { return m_preInstrumentStopping || !m_preInstrumentQueue.empty(); });
+            if (m_preInstrumentStopping)
+                return;
+            module = m_preInstrumentQueue.front();
+        }
+
+        auto row = ++module->lastRow;
+        if (row > module->table.GetMethodCount() || module->unloaded)
+        {
+            std::lock_guard<std::mutex> lock(m_mutexPreInstrument);
+            if (!m_preInstrumentQueue.empty() && m_preInstrumentQueue.front() == module)
+                m_preInstrumentQueue.pop_front();
+            continue;
+        }
+
+        PreInstrumentMethod(*module, TokenFromRid(row, mdtMethodDef));
+    }
+}
+
+/// <summary>Build the instrumented body of a method and publish it for the JIT</summary>
+/// <remarks>Only the body is built; nothing is tracked, registered or recorded until it is used (see
+/// <c>ApplyPreparedMethod</c>). Anything that goes wrong just leaves the method to be instrumented by the
+/// JIT callback, as does a method that already has its probes.</remarks>
+void CCodeCoverage::PreInstrumentMethod(PreparedModule& module, mdMethodDef functionToken)
+{
+    try
+    {
+        if (module.table.IsTaken(functionToken))
+            return;
+
+        // abstract and extern methods have no body
+        IMAGE_COR_ILMETHOD* pMethodHeader = nullptr;
+        ULONG iMethodSize = 0;
+        if (!SUCCEEDED(m_profilerInfo2->GetILFunctionBody(module.moduleId, functionToken, (LPCBYTE*)&pMethodHeader, &iMethodSize)))
+            return;
+
+        // the points are copied so that the communication channel is released before instrumenting
+        std::vector<SequencePoint> seqPoints;
+        std::vector<BranchPoint> brPoints;
+        if (!_host->GetPoints(functionToken, const_cast<LPWSTR>(module.modulePath.c_str()),
+            const_cast<LPWSTR>(module.assemblyName.c_str()),
+            [&seqPoints, &brPoints](SequencePointSpan seqSpan, BranchPointSpan brSpan)
+        {
+            seqPoints.assign(seqSpan.begin(), seqSpan.end());
+            brPoints.assign(brSpan.begin(), brSpan.end());
+        }))
+            return;
+
+        if (seqPoints.empty() || module.table.IsTaken(functionToken))
+            return;
+
+        std::unique_ptr<PreparedMethod> prepared(new PreparedMethod());
+        prepared->originalSize = iMethodSize;
+        prepared->originalHash = MethodCache::Hash(pMethodHeader, iMethodSize);
+        prepared->lastUniqueId = seqPoints.back().UniqueId;
+        if (!brPoints.empty() && brPoints.back().UniqueId > prepared->lastUniqueId)
+            prepared->lastUniqueId = brPoints.back().UniqueId;
+
+        Instrumentation::Method instumentedMethod(pMethodHeader);
+        instumentedMethod.IncrementStackSize(2);
+        InstrumentMethod(module.moduleId, functionToken, instumentedMethod, seqPoints, brPoints, module.inlineCounters,
+            module.callProbeToken, prepared->registration);
+        if (prepared->registration.cost.originalSize == 0)
+            return;
+
+        prepared->body.resize(instumentedMethod.GetMethodSize());
+        instumentedMethod.WriteMethod(reinterpret_cast<IMAGE_COR_ILMETHOD*>(prepared->body.data()));
+        prepared->map.resize(instumentedMethod.GetILMapSize());
+        instumentedMethod.PopulateILMap(static_cast<ULONG>(prepared->map.size()), prepared->map.data());
+        prepared->seqPoints = std::move(seqPoints);
+        prepared->brPoints = std::move(brPoints);
+
+        module.table.Publish(functionToken, std::move(prepared));
+    }
+    catch (...)
+    {
+        RELTRACE(_T("    ::PreInstrumentMethod(...) => unable to prepare 0x%X"), functionToken);
+    }
+}
+
+/// <summary>Replace the body of a method with the body prepared for it by the workers</summary>
+/// <returns>S_FALSE if nothing usable was prepared for the method.</returns>
+/// <remarks>The prepared body is only used if the original body is the one that was instrumented,
+/// e.g. a chained profiler may have rewritten it since. Once it is in use the method is tracked, its
+/// points registered and its cost recorded, and the body is cached as if the JIT callback had built it.</remarks>
+HRESULT CCodeCoverage::ApplyPreparedMethod(FunctionID functionId, mdToken functionToken, ModuleID moduleId)
+{
+    if (m_preInstrumentWorkers.empty())
+        return S_FALSE;
+
+    std::shared_ptr<PreparedModule> module;
+    {
+        std::lock_guard<std::mutex> lock(m_mutexPreInstrument);
+        auto it = m_preparedModules.find(moduleId);
+        if (it == m_preparedModules.end())
+            return S_FALSE;
+        module = it->second;
+    }
+
+    auto prepared = module->table.Take(functionToken);
+    if (!prepared)
+        return S_FALSE;
+
+    IMAGE_COR_ILMETHOD* pMethodHeader = nullptr;
+    ULONG iMethodSize = 0;
+    COM_FAIL_MSG_RETURN_ERROR(m_profilerInfo2->GetILFunctionBody(moduleId, functionToken, (LPCBYTE*)&pMethodHeader, &iMethodSize),
+        _T("    ::ApplyPreparedMethod(...) => GetILFunctionBody => 0x%X"));
+    if (iMethodSize != prepared->originalSize || MethodCache::Hash(pMethodHeader, iMethodSize) != prepared->originalHash)
+        return S_FALSE;
+
+    // resize the threshold array
+    if (m_threshold != 0)
+        Resize(prepared->lastUniqueId + 1);
+
+    auto pBody = reinterpret_cast<const IMAGE_COR_ILMETHOD*>(prepared->body.data());
+    auto bodySize = static_cast<ULONG>(prepared->body.size());
+    auto mapSize = static_cast<ULONG>(prepared->map.size());
+    auto hr = SetInstrumentedBody(functionId, moduleId, functionToken, pBody, bodySize, prepared->map.data(), mapSize);
+    if (FAILED(hr))
+        return hr;
+
+    TrackCoveredMethod(moduleId, functionToken, pMethodHeader, iMethodSize, prepared->seqPoints, prepared->brPoints);
+    RegisterInstrumentation(moduleId, functionToken, prepared->registration, bodySize);
+
+    Instrumentation::MethodCacheKey cacheKey;
+    if (GetMethodCacheKey(moduleId, functionToken, pMethodHeader, iMethodSize, prepared->seqPoints, prepared->brPoints, cacheKey))
+        AddCachedMethod(cacheKey, pBody, bodySize, prepared->map.data(), mapSize, prepared->registration.mergedPoints, prepared->registration.cost);
+    AddInstrumentedBody(moduleId, functionToken, prepared->registration.probeToken, pBody, bodySize, prepared->map.data(), mapSize,
+        prepared->seqPoints, prepared->brPoints);
+    return S_OK;
+}
@@ -37,6 +37,18 @@ std::wstring CCodeCoverage::GetAssemblyName(AssemblyID assemblyId)
     return std::wstring(szAssemblyName);
 }
 
+/// <summary>
+/// Get the name of the assembly a module was attached to
+/// </summary>
+/// <remarks>The modules are attached while methods are being compiled (and prepared) so the map is only
+/// read under its lock.</remarks>
+std::wstring CCodeCoverage::GetModuleAssemblyName(const std::wstring& modulePath)
+{
+    std::lock_guard<std::mutex> lock(m_mutexAllowModulesAssemblyMap);
+    auto it = m_allowModulesAssemblyMap.find(modulePath);
+    return it != m_allowModulesAssemblyMap.end() ? it->second : std::wstring();
+}
+
 /// <summary>
 /// Get the function token, module ID and module name for a supplied FunctionID
 /// </summary>
@@ -0,0 +1,143 @@
+#include "stdafx.h"
+#include "CodeCoverage.h"
+
+// how long the covered methods are gathered for before they are sent in a single request
+#define REJIT_BATCH_INTERVAL_MS 250
+
+using namespace Instrumentation;
+
+/// <summary>Start the worker that restores the original bodies of the methods that are fully covered</summary>
+/// <remarks>Only if <c>OpenCover_Profiler_RemoveCoveredProbes</c> is set along with a threshold, as a
+/// point gains nothing from its probe once it has reached the threshold; it is ignored when tracing
+/// by test, where every visit is attributed, when branches are derived (see <c>CoverageInstrumentation::DeriveBranchPoints</c>), as
+/// they need every visit of their points, and on runtimes without ReJIT.</remarks>
+void CCodeCoverage::StartReJitCoveredMethods()
+{
+    if (!m_removeCoveredProbes)
+        return;
+
+    m_reJitStopping = false;
+    m_reJitRequested = false;
+    m_reJitWorker = std::thread([this]() { ReJitWorker(); });
+
+    RELTRACE(_T("    ::Initialize(...) => removeCoveredProbes = true"));
+}
+
+void CCodeCoverage::StopReJitCoveredMethods()
+{
+    if (!m_reJitWorker.joinable())
+        return;
+
+    {
+        std::lock_guard<std::mutex> lock(m_mutexReJit);
+        m_reJitStopping = true;
+    }
+    m_reJitQueued.notify_all();
+    m_reJitWorker.join();
+}
+
+/// <summary>Track the points of a method so that its probes are removed once they are all covered</summary>
+/// <param name="pOriginalBody">The body before it was instrumented, which is restored; it is held
+/// until the module is unloaded.</param>
+void CCodeCoverage::TrackCoveredMethod(ModuleID moduleId, mdToken functionToken, const IMAGE_COR_ILMETHOD* pOriginalBody, ULONG originalSize,
+    SequencePointSpan seqPoints, BranchPointSpan brPoints)
+{
+    if (!m_removeCoveredProbes)
+        return;
+
+    std::vector<ULONG> pointIds;
+    pointIds.reserve(seqPoints.size() + brPoints.size());
+    for (const auto& point : seqPoints)
+        pointIds.push_back(point.UniqueId);
+    for (const auto& point : brPoints)
+        pointIds.push_back(point.UniqueId);
+    TrackCoveredMethod(moduleId, functionToken, pOriginalBody, originalSize, std::move(pointIds));
+}
+
+void CCodeCoverage::TrackCoveredMethod(ModuleID moduleId, mdToken functionToken, const IMAGE_COR_ILMETHOD* pOriginalBody, ULONG originalSize,
+    std::vector<ULONG> pointIds)
+{
+    // the points may all have been covered already, by the method as loaded into another module
+    if (m_coveredMethods.Track(moduleId, functionToken, reinterpret_cast<LPCBYTE>(pOriginalBody), originalSize, std::move(pointIds))
+        && m_coveredMethods.GetPendingCount() != 0)
+        QueueReJit();
+}
+
+/// <summary>A point has reached the threshold</summary>
+void CCodeCoverage::PointCovered(ULONG uniqueId)
+{
+    if (m_coveredMethods.PointCovered(uniqueId))
+        QueueReJit();
+}
+
+/// <summary>Wake the worker to ReJIT the pending methods</summary>
+void CCodeCoverage::QueueReJit()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutexReJit);
+        m_reJitRequested = true;
+    }
+    m_reJitQueued.notify_all();
+}
+
+/// <summary>Request a ReJIT of the methods that have become fully covered</summary>
+/// <remarks>The requests are made off the thread that covered the method, and batched, as each
+/// request suspends the runtime.</remarks>
+void CCodeCoverage::ReJitWorker()
+{
+    std::unique_lock<std::mutex> lock(m_mutexReJit);
+    while (true)
+    {
+        m_reJitQueued.wait(lock, [this]() { return m_reJitStopping || m_reJitRequested; });
+        if (m_reJitStopping)
+            return;
+
+        m_reJitQueued.wait_for(lock, std::chrono::milliseconds(REJIT_BATCH_INTERVAL_MS), [this]() { return m_reJitStopping; });
+        if (m_reJitStopping)
+            return;
+        m_reJitRequested = false;
+
+        lock.unlock();
+        auto hr = m_coveredMethods.RequestReJIT(m_profilerInfo4);
+        if (!SUCCEEDED(hr))
+            RELTRACE(_T("    ::ReJitWorker() => RequestReJIT => 0x%X"), hr);
+        lock.lock();
+    }
+}
+
+/// <summary>Handle <c>ICorProfilerCallback4::GetReJITParameters</c></summary>
+/// <remarks>The methods are only ReJIT-ed to restore their original bodies.</remarks>
+HRESULT STDMETHODCALLTYPE CCodeCoverage::GetReJITParameters(
+    /* [in] */ ModuleID moduleId,
+    /* [in] */ mdMethodDef methodId,
+    /* [in] */ ICorProfilerFunctionControl *pFunctionControl)
+{
+    return ChainCall([&]() { return CProfilerBase::GetReJITParameters(moduleId, methodId, pFunctionControl); },
+        [&]()
+    {
+        LPCBYTE pOriginalBody = nullptr;
+        ULONG originalSize = 0;
+        if (!m_coveredMethods.GetOriginalBody(moduleId, methodId, pOriginalBody, originalSize))
+            return S_OK;
+
+        COM_FAIL_MSG_RETURN_ERROR(pFunctionControl->SetILFunctionBody(originalSize, pOriginalBody),
+            _T("    ::GetReJITParameters(...) => SetILFunctionBody => 0x%X"));
+        return S_OK;
+    });
+}
+
+/// <summary>Handle <c>ICorProfilerCallback4::ReJITError</c></summary>
+/// <remarks>The method just keeps its probes.</remarks>
+HRESULT STDMETHODCALLTYPE CCodeCoverage::ReJITError(
+    /* [in] */ ModuleID moduleId,
+    /* [in] */ mdMethodDef methodId,
+    /* [in] */ FunctionID functionId,
+    /* [in] */ HRESULT hrStatus)
+{
+    return ChainCall([&]() { return CProfilerBase::ReJITError(moduleId, methodId, functionId, hrStatus); },
+        [&]()
+    {
+        RELTRACE(_T("::ReJITError(%" PRIxPTR ", 0x%X, ...) => 0x%X"), moduleId, methodId, hrStatus);
+        return S_OK;
+    });
+}
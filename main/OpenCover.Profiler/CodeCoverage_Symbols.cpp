@@ -0,0 +1,102 @@
+#include "stdafx.h"
+#include "CodeCoverage.h"
+#include "LocalPoints.h"
+
+using namespace Instrumentation;
+
+/// <summary>Read whether the points of a method are found from the module's portable PDB</summary>
+/// <remarks>Only if <c>OpenCover_Profiler_LocalSymbols</c> is set; otherwise (and for any module without a
+/// portable PDB) the points are asked of the host.</remarks>
+void CCodeCoverage::ReadLocalSymbols()
+{
+    tstring localSymbols;
+    m_localSymbols = GetEnvironmentSetting(_T("OpenCover_Profiler_LocalSymbols"), localSymbols);
+    ATLTRACE(_T("    ::Initialize(...) => localSymbols = %s (%s)"), m_localSymbols ? _T("true") : _T("false"), localSymbols.c_str());
+}
+
+/// <summary>Get the symbols of a module, they are opened the first time a method of the module is compiled</summary>
+/// <returns>nullptr if the module has no portable PDB; this is remembered so it is only looked for once.</returns>
+std::shared_ptr<const ModuleSymbols> CCodeCoverage::GetModuleSymbols(ModuleID moduleId, const std::wstring& modulePath)
+{
+    std::lock_guard<std::mutex> lock(m_mutexModuleSymbols);
+    auto it = m_moduleSymbols.find(moduleId);
+    if (it != m_moduleSymbols.end())
+        return it->second;
+
+    auto symbols = std::make_shared<ModuleSymbols>();
+    if (!symbols->Open(modulePath)) {
+        RELTRACE(_T("    ::GetModuleSymbols(...) => no portable PDB for %s"), W2CT(modulePath.c_str()));
+        symbols.reset();
+    }
+    m_moduleSymbols[moduleId] = symbols;
+    return symbols;
+}
+
+void CCodeCoverage::DiscardModuleSymbols(ModuleID moduleId)
+{
+    if (!m_localSymbols)
+        return;
+
+    std::lock_guard<std::mutex> lock(m_mutexModuleSymbols);
+    m_moduleSymbols.erase(moduleId);
+}
+
+/// <summary>Instrument a method with the points found from its portable PDB, the host only allocates their ids</summary>
+/// <returns>S_FALSE if the points have to be asked of the host instead, i.e. the module has no portable PDB, the
+/// class is filtered out or the host's points are not the same (see <c>ProfilerCommunication::AllocateUniqueIds</c>).</returns>
+/// <remarks>The host still builds its model of the module (when it is tracked) so that it can report on the
+/// points; this saves sending them across for each method that is compiled.</remarks>
+HRESULT CCodeCoverage::InstrumentWithLocalPoints(FunctionID functionId, mdToken functionToken, ModuleID moduleId, const std::wstring& modulePath)
+{
+    if (!m_localSymbols)
+        return S_FALSE;
+
+    auto symbols = GetModuleSymbols(moduleId, modulePath);
+    std::vector<PdbSequencePoint> pdbPoints;
+    if (!symbols || !symbols->GetPdb().GetSequencePoints(functionToken, pdbPoints))
+        return S_FALSE;
+
+    IMAGE_COR_ILMETHOD* pMethodHeader = nullptr;
+    ULONG iMethodSize = 0;
+    if (!SUCCEEDED(m_profilerInfo2->GetILFunctionBody(moduleId, functionToken, (LPCBYTE*)&pMethodHeader, &iMethodSize)))
+        return S_FALSE;
+
+    CComPtr<IMetaDataImport> metaDataImport;
+    COM_FAIL_MSG_RETURN_ERROR(m_profilerInfo->GetModuleMetaData(moduleId, ofRead, IID_IMetaDataImport, (IUnknown**)&metaDataImport),
+        _T("    ::InstrumentWithLocalPoints(...) => GetModuleMetaData => 0x%X"));
+
+    LocalPoints points;
+    {
+        Method method(pMethodHeader);
+        FindLocalPoints(method, pdbPoints, [&metaDataImport](mdToken fieldToken, std::wstring& name)
+        {
+            WCHAR szName[512] = { 0 };
+            ULONG nameLength = 0;
+            mdTypeDef parent;
+            HRESULT hr = E_FAIL;
+            if (TypeFromToken(fieldToken) == mdtFieldDef)
+                hr = metaDataImport->GetFieldProps(fieldToken, &parent, szName, 512, &nameLength,
+                    nullptr, nullptr, nullptr, nullptr, nullptr, nullptr);
+            else if (TypeFromToken(fieldToken) == mdtMemberRef)
+                hr = metaDataImport->GetMemberRefProps(fieldToken, &parent, szName, 512, &nameLength, nullptr, nullptr);
+            if (!SUCCEEDED(hr))
+                return false;
+            name = szName;
+            return true;
+        }, points);
+    }
+
+    // the host would not instrument a method without any (visible) sequence points either
+    if (points.seqPoints.empty())
+        return S_OK;
+
+    ULONG entryPointId = 0, firstSequenceId = 0, firstBranchId = 0;
+    auto assemblyName = GetModuleAssemblyName(modulePath);
+    if (!_host->AllocateUniqueIds(functionToken, const_cast<LPWSTR>(modulePath.c_str()),
+        const_cast<LPWSTR>(assemblyName.c_str()), points.GetSequencePointCount(), points.GetBranchPointCount(),
+        HashLocalPoints(points), entryPointId, firstSequenceId, firstBranchId))
+        return S_FALSE;
+
+    AssignUniqueIds(points, entryPointId, firstSequenceId, firstBranchId);
+    return InstrumentFunction(functionId, functionToken, moduleId, points.seqPoints, points.brPoints);
+}
@@ -2,30 +2,382 @@
 #include "CoverageInstrumentation.h"
 
 #include <algorithm>
+#include <unordered_map>
 
 namespace CoverageInstrumentation
 {
 	using namespace Instrumentation;
 
-	Instruction* InsertInjectedMethod(InstructionList &instructions, mdMethodDef injectedMethodDef, ULONG uniqueId)
+	/// <remarks>The probe instructions are allocated from (and owned by) the supplied method</remarks>
+	Instruction* InsertInjectedMethod(Method& method, InstructionList &instructions, mdMethodDef injectedMethodDef, ULONG uniqueId)
 	{
-		Instruction *firstInstruction = new Instruction(CEE_LDC_I4, uniqueId);
+		Instruction *firstInstruction = method.CreateInstruction(CEE_LDC_I4, uniqueId);
 		instructions.push_back(firstInstruction);
-		instructions.push_back(new Instruction(CEE_CALL, injectedMethodDef));
+		instructions.push_back(method.CreateInstruction(CEE_CALL, injectedMethodDef));
 		return firstInstruction;
 	}
 
-	Instruction* InsertFunctionCall(InstructionList &instructions, mdSignature pvsig, FPTR pt, ULONGLONG uniqueId)
+	/// <remarks>The probe instructions are allocated from (and owned by) the supplied method</remarks>
+	Instruction* InsertFunctionCall(Method& method, InstructionList &instructions, mdSignature pvsig, FPTR pt, ULONGLONG uniqueId)
 	{
-		Instruction *firstInstruction = new Instruction(CEE_LDC_I4, uniqueId);
+		Instruction *firstInstruction = method.CreateInstruction(CEE_LDC_I4, uniqueId);
 		instructions.push_back(firstInstruction);
 #ifdef _WIN64
-		instructions.push_back(new Instruction(CEE_LDC_I8, (ULONGLONG)pt));
+		instructions.push_back(method.CreateInstruction(CEE_LDC_I8, (ULONGLONG)pt));
 #else
-		instructions.push_back(new Instruction(CEE_LDC_I4, (ULONG)pt));
+		instructions.push_back(method.CreateInstruction(CEE_LDC_I4, (ULONG)pt));
 #endif
-		instructions.push_back(new Instruction(CEE_CALLI, pvsig));
+		instructions.push_back(method.CreateInstruction(CEE_CALLI, pvsig));
 
 		return firstInstruction;
 	}
+
+	/// <summary>Increment a visit counter in place, i.e. <c>++*pCounter</c> with no call</summary>
+	/// <remarks><para>The probe instructions are allocated from (and owned by) the supplied method.</para>
+	/// <para>The probe needs 3 stack slots and is not verifiable. The increment is not atomic so
+	/// visits that race on the same counter may be lost, but never all of them.</para></remarks>
+	Instruction* InsertCounterIncrement(Method& method, InstructionList &instructions, ULONG* pCounter)
+	{
+#ifdef _WIN64
+		Instruction *firstInstruction = method.CreateInstruction(CEE_LDC_I8, (ULONGLONG)pCounter);
+#else
+		Instruction *firstInstruction = method.CreateInstruction(CEE_LDC_I4, (ULONG)pCounter);
+#endif
+		instructions.push_back(firstInstruction);
+		instructions.push_back(method.CreateInstruction(CEE_CONV_U));
+		instructions.push_back(method.CreateInstruction(CEE_DUP));
+		instructions.push_back(method.CreateInstruction(CEE_LDIND_U4));
+		instructions.push_back(method.CreateInstruction(CEE_LDC_I4_1));
+		instructions.push_back(method.CreateInstruction(CEE_ADD));
+		instructions.push_back(method.CreateInstruction(CEE_STIND_I4));
+		return firstInstruction;
+	}
+
+	/// <summary>Set a visit counter to 1 in place, i.e. <c>*pCounter = 1</c> with no call</summary>
+	/// <remarks><para>The probe instructions are allocated from (and owned by) the supplied method.</para>
+	/// <para>The probe needs 2 stack slots and is not verifiable; unlike the increment it does not read
+	/// the counter so racing visits are harmless.</para></remarks>
+	Instruction* InsertCounterSet(Method& method, InstructionList &instructions, ULONG* pCounter)
+	{
+#ifdef _WIN64
+		Instruction *firstInstruction = method.CreateInstruction(CEE_LDC_I8, (ULONGLONG)pCounter);
+#else
+		Instruction *firstInstruction = method.CreateInstruction(CEE_LDC_I4, (ULONG)pCounter);
+#endif
+		instructions.push_back(firstInstruction);
+		instructions.push_back(method.CreateInstruction(CEE_CONV_U));
+		instructions.push_back(method.CreateInstruction(CEE_LDC_I4_1));
+		instructions.push_back(method.CreateInstruction(CEE_STIND_I4));
+		return firstInstruction;
+	}
+
+	/// <summary>Copy the index of a switch, that is on the stack, for a switch probe</summary>
+	/// <param name="count">The number of targets of the switch; an index that is not below it (unsigned, as
+	/// the switch compares it) is replaced by <paramref name="count"/>, the default path.</param>
+	/// <returns>The branch taken when the index is in range; its target is the first instruction of the
+	/// probe, which is to be added next and consumes the copy.</returns>
+	/// <remarks>Needs <c>SWITCH_PROBE_STACK_SIZE</c> more stack slots than the switch.</remarks>
+	Instruction* InsertSwitchIndex(Method& method, InstructionList &instructions, ULONG count)
+	{
+		instructions.push_back(method.CreateInstruction(CEE_DUP));
+		instructions.push_back(method.CreateInstruction(CEE_DUP));
+		instructions.push_back(method.CreateInstruction(CEE_LDC_I4, count));
+		auto pInRange = method.CreateInstruction(CEE_BLT_UN);
+		pInRange->m_isBranch = true;
+		instructions.push_back(pInRange);
+		instructions.push_back(method.CreateInstruction(CEE_POP));
+		instructions.push_back(method.CreateInstruction(CEE_LDC_I4, count));
+		return pInRange;
+	}
+
+	/// <summary>Update the visit counter of the id at an index of a table, i.e. <c>++pCounters[pTable[index]]</c>
+	/// (or <c>pCounters[pTable[index]] = 1</c>), where the index is on the stack</summary>
+	/// <remarks>The ids are masked with <c>PROBE_FLAGS</c>; an id of 0 is for a path that is not probed
+	/// and updates the unused counter 0.</remarks>
+	Instruction* InsertTableCounterUpdate(Method& method, InstructionList &instructions, const ULONG* pTable, ULONG* pCounters, bool increment)
+	{
+		Instruction *firstInstruction = method.CreateInstruction(CEE_LDC_I4_4);
+		instructions.push_back(firstInstruction);
+		instructions.push_back(method.CreateInstruction(CEE_MUL));
+#ifdef _WIN64
+		instructions.push_back(method.CreateInstruction(CEE_LDC_I8, (ULONGLONG)pTable));
+#else
+		instructions.push_back(method.CreateInstruction(CEE_LDC_I4, (ULONG)pTable));
+#endif
+		instructions.push_back(method.CreateInstruction(CEE_CONV_U));
+		instructions.push_back(method.CreateInstruction(CEE_ADD));
+		instructions.push_back(method.CreateInstruction(CEE_LDIND_U4));
+		instructions.push_back(method.CreateInstruction(CEE_LDC_I4, static_cast<ULONG>(~PROBE_FLAGS)));
+		instructions.push_back(method.CreateInstruction(CEE_AND));
+		instructions.push_back(method.CreateInstruction(CEE_LDC_I4_4));
+		instructions.push_back(method.CreateInstruction(CEE_MUL));
+#ifdef _WIN64
+		instructions.push_back(method.CreateInstruction(CEE_LDC_I8, (ULONGLONG)pCounters));
+#else
+		instructions.push_back(method.CreateInstruction(CEE_LDC_I4, (ULONG)pCounters));
+#endif
+		instructions.push_back(method.CreateInstruction(CEE_CONV_U));
+		instructions.push_back(method.CreateInstruction(CEE_ADD));
+		if (increment)
+		{
+			instructions.push_back(method.CreateInstruction(CEE_DUP));
+			instructions.push_back(method.CreateInstruction(CEE_LDIND_U4));
+			instructions.push_back(method.CreateInstruction(CEE_LDC_I4_1));
+			instructions.push_back(method.CreateInstruction(CEE_ADD));
+		}
+		else
+		{
+			instructions.push_back(method.CreateInstruction(CEE_LDC_I4_1));
+		}
+		instructions.push_back(method.CreateInstruction(CEE_STIND_I4));
+		return firstInstruction;
+	}
+
+	/// <summary>The compare, and the test of its result, that a compare and branch is made of</summary>
+	/// <returns>false if the branch is not one that can be split whatever the type of its operands; <c>bge</c>,
+	/// <c>ble</c> and their unsigned forms test the opposite of a compare that differs for integers and floats.</returns>
+	bool SplitCompareBranch(CanonicalName branch, CanonicalName& compare, CanonicalName& test)
+	{
+		switch (branch)
+		{
+		case CEE_BEQ:
+		case CEE_BEQ_S:
+			compare = CEE_CEQ;
+			test = CEE_BRTRUE;
+			return true;
+		case CEE_BNE_UN:
+		case CEE_BNE_UN_S:
+			compare = CEE_CEQ;
+			test = CEE_BRFALSE;
+			return true;
+		case CEE_BGT:
+		case CEE_BGT_S:
+			compare = CEE_CGT;
+			test = CEE_BRTRUE;
+			return true;
+		case CEE_BGT_UN:
+		case CEE_BGT_UN_S:
+			compare = CEE_CGT_UN;
+			test = CEE_BRTRUE;
+			return true;
+		case CEE_BLT:
+		case CEE_BLT_S:
+			compare = CEE_CLT;
+			test = CEE_BRTRUE;
+			return true;
+		case CEE_BLT_UN:
+		case CEE_BLT_UN_S:
+			compare = CEE_CLT_UN;
+			test = CEE_BRTRUE;
+			return true;
+		default:
+			return false;
+		}
+	}
+
+	/// <summary>Is the operation a compare, that leaves 0 or 1 on the stack</summary>
+	bool IsCompare(CanonicalName operation)
+	{
+		return operation == CEE_CEQ || operation == CEE_CGT || operation == CEE_CGT_UN || operation == CEE_CLT || operation == CEE_CLT_UN;
+	}
+
+	/// <summary>Share a probe between the sequence points that always execute together</summary>
+	/// <param name="mergedPoints">Receives (probe point id, merged point id) pairs for the points that
+	/// are recorded by the probe of another point.</param>
+	/// <returns>The id passed by the probe that records each point; <c>MERGED_PROBE_FLAG</c> is set
+	/// on the id of a probe that also records merged points.</returns>
+	/// <remarks><para>Points in the same straight-line run (see <c>Method::GetStraightLineRuns</c>)
+	/// are recorded by the probe of the first of them, as reaching it means reaching the rest; the
+	/// profiler expands a flagged visit into the points merged into it so coverage is unchanged.</para>
+	/// <para>Must be called before the method is instrumented.</para></remarks>
+	std::vector<ULONG> MergeSequenceProbes(Method& method, SequencePointSpan points, std::vector<ULONG>& mergedPoints)
+	{
+		std::vector<ULONG> probes(points.size());
+		if (points.size() == 0)
+			return probes;
+
+		std::vector<size_t> order(points.size());
+		for (size_t i = 0; i < order.size(); i++)
+			order[i] = i;
+		std::stable_sort(order.begin(), order.end(), [&points](size_t left, size_t right) { return points[left].Offset < points[right].Offset; });
+
+		auto runs = method.GetStraightLineRuns();
+		auto runOf = [&runs](long offset)->long
+		{
+			auto it = std::lower_bound(runs.begin(), runs.end(), offset, [](const std::pair<long, long>& run, long value) { return run.first < value; });
+			return (it != runs.end() && it->first == offset) ? it->second : -1;
+		};
+
+		// the first point (by offset) of each run records the others
+		std::vector<size_t> recordedBy(points.size());
+		auto probe = order[0];
+		auto probeRun = runOf(points[probe].Offset);
+		recordedBy[probe] = probe;
+		for (size_t i = 1; i < order.size(); i++)
+		{
+			auto point = order[i];
+			auto run = runOf(points[point].Offset);
+			if (run == -1 || run != probeRun)
+			{
+				probe = point;
+				probeRun = run;
+			}
+			recordedBy[point] = probe;
+		}
+
+		for (size_t i = 0; i < points.size(); i++)
+			probes[i] = points[i].UniqueId;
+		for (auto point : order)
+		{
+			auto probePoint = recordedBy[point];
+			if (probePoint == point)
+				continue;
+			probes[probePoint] = points[probePoint].UniqueId | MERGED_PROBE_FLAG;
+			mergedPoints.push_back(points[probePoint].UniqueId);
+			mergedPoints.push_back(points[point].UniqueId);
+		}
+		for (size_t i = 0; i < points.size(); i++)
+			probes[i] = probes[recordedBy[i]];
+		return probes;
+	}
+
+	/// <summary>Choose the finest coverage of a method that is within the budget</summary>
+	/// <param name="codeSize">The size of the code of the method before it is instrumented.</param>
+	/// <param name="probeSize">The most bytes a probe can take (the <c>MaxSize</c> of the probe policy).</param>
+	/// <param name="probes">The probes of the sequence points (see <c>MergeSequenceProbes</c>).</param>
+	/// <param name="probeCount">Receives the number of probes at the level chosen.</param>
+	/// <remarks><para>The growth is estimated before instrumenting, from the probes each level adds and, for the
+	/// branches, the long jump each probe of a path needs.</para>
+	/// <para>Method entry coverage is one probe and is always within the budget.</para></remarks>
+	CoverageLevel ChooseCoverageLevel(const ProbeBudget& budget, ULONG codeSize, ULONG probeSize, SequencePointSpan seqPoints, BranchPointSpan brPoints,
+		const std::vector<ULONG>& probes, const DerivedBranchPoints& derived, ULONG& probeCount)
+	{
+		ULONG seqProbes = 0;
+		for (size_t i = 0; i < seqPoints.size(); i++)
+		{
+			if ((probes[i] & ~PROBE_FLAGS) == seqPoints[i].UniqueId)
+				seqProbes++;
+		}
+		auto brProbes = static_cast<ULONG>(brPoints.size() - derived.size());
+
+		auto withinBudget = [&budget, codeSize](ULONG count, double added)
+		{
+			return (budget.maxProbes == 0 || count <= budget.maxProbes)
+				&& (budget.maxCodeGrowth == 0.0 || codeSize + added <= codeSize * budget.maxCodeGrowth);
+		};
+
+		probeCount = seqProbes + brProbes;
+		if (withinBudget(probeCount, (static_cast<double>(seqProbes) * probeSize) + (static_cast<double>(brProbes) * (probeSize + 5))))
+			return CL_Branch;
+
+		probeCount = seqProbes;
+		if (withinBudget(probeCount, static_cast<double>(seqProbes) * probeSize))
+			return CL_Sequence;
+
+		probeCount = seqPoints.size() > 0 ? 1 : 0;
+		return CL_Entry;
+	}
+
+	/// <summary>The sequence point at the start of a method, the only point probed for method entry coverage</summary>
+	SequencePointSpan GetEntryPoint(SequencePointSpan seqPoints)
+	{
+		if (seqPoints.size() == 0)
+			return seqPoints;
+		auto entry = std::min_element(seqPoints.begin(), seqPoints.end(),
+			[](const SequencePoint& left, const SequencePoint& right) { return left.Offset < right.Offset; });
+		return SequencePointSpan(entry, 1);
+	}
+
+	/// <summary>Choose the branch points that need no probe as their visits can be derived from those of
+	/// the other points of the branch</summary>
+	/// <remarks><para>Every entry to a straight-line run reaches the conditional branch that ends it, so when
+	/// a sequence point probe is in that run the branch is executed exactly as often as that probe is visited;
+	/// one path of the branch is then left unprobed and its visits are the difference between the two (flow
+	/// conservation). A backward (loop) path is preferred as it is usually the hottest, otherwise the
+	/// fall through path.</para>
+	/// <para>The probes whose visits take part are flagged with <c>COUNTED_PROBE_FLAG</c>; for the
+	/// sequence points this is done to the supplied probes (see <c>MergeSequenceProbes</c>).</para>
+	/// <para>Must be called before the method is instrumented.</para></remarks>
+	DerivedBranchPoints DeriveBranchPoints(Method& method, BranchPointSpan points, SequencePointSpan seqPoints, std::vector<ULONG>& probes)
+	{
+		DerivedBranchPoints derived;
+		if (points.size() == 0 || seqPoints.size() == 0)
+			return derived;
+
+		auto runs = method.GetStraightLineRuns();
+		auto runOf = [&runs](long offset)->long
+		{
+			auto it = std::lower_bound(runs.begin(), runs.end(), offset, [](const std::pair<long, long>& run, long value) { return run.first < value; });
+			return (it != runs.end() && it->first == offset) ? it->second : -1;
+		};
+
+		auto byOffsetAndPath = [](const BranchPoint& left, const BranchPoint& right)
+		{
+			return left.Offset < right.Offset || (left.Offset == right.Offset && left.Path < right.Path);
+		};
+		std::vector<BranchPoint> sorted(points.begin(), points.end());
+		std::stable_sort(sorted.begin(), sorted.end(), byOffsetAndPath);
+
+		// the sequence point probe (if any) of each run
+		std::unordered_map<long, size_t> runProbes;
+		for (size_t i = 0; i < seqPoints.size(); i++)
+		{
+			auto run = runOf(seqPoints[i].Offset);
+			if (run != -1)
+				runProbes.emplace(run, i);
+		}
+
+		for (auto it = method.m_instructions.begin(); it != method.m_instructions.end(); ++it)
+		{
+			auto *pCurrent = *it;
+			if (!pCurrent->m_isBranch || (pCurrent->m_origOffset == -1) || (it + 1) == method.m_instructions.end())
+				continue;
+			if (Operations::GetOperationDetails(pCurrent->m_operation).controlFlow != COND_BRANCH)
+				continue;
+
+			auto runProbe = runProbes.find(runOf(pCurrent->m_origOffset));
+			if (runProbe == runProbes.end())
+				continue;
+
+			// every path must have a point to derive one of them
+			std::vector<ULONG> pathIds(pCurrent->m_branches.size() + 1, 0);
+			BranchPoint first = { 0, pCurrent->m_origOffset, 0 };
+			for (auto bp = std::lower_bound(sorted.begin(), sorted.end(), first, byOffsetAndPath);
+				bp != sorted.end() && (*bp).Offset == pCurrent->m_origOffset; ++bp)
+			{
+				if ((*bp).Path >= 0 && (*bp).Path < static_cast<long>(pathIds.size()))
+					pathIds[(*bp).Path] = (*bp).UniqueId;
+			}
+			if (std::find(pathIds.begin(), pathIds.end(), 0) != pathIds.end())
+				continue;
+
+			size_t elided = 0;
+			for (size_t idx = 1; idx < pathIds.size(); idx++)
+			{
+				if (pCurrent->m_branches[idx - 1]->m_origOffset <= pCurrent->m_origOffset)
+				{
+					elided = idx;
+					break;
+				}
+			}
+
+			DerivedBranchPoint point;
+			point.uniqueId = pathIds[elided];
+			point.offset = pCurrent->m_origOffset;
+			point.nodeId = probes[runProbe->second] & ~PROBE_FLAGS;
+			for (size_t idx = 0; idx < pathIds.size(); idx++)
+			{
+				if (idx != elided)
+					point.pathIds.push_back(pathIds[idx]);
+			}
+			derived.push_back(point);
+
+			for (auto& probe : probes)
+			{
+				if ((probe & ~PROBE_FLAGS) == point.nodeId)
+					probe |= COUNTED_PROBE_FLAG;
+			}
+		}
+		return derived;
+	}
 }
\ No newline at end of file
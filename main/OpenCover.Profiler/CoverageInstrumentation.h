@@ -2,6 +2,7 @@
 
 #include "method.h"
 #include "Messages.h"
+#include "PointSpan.h"
 #include <algorithm>
 
 #ifdef _WIN64
@@ -10,100 +11,390 @@ typedef unsigned __int64 FPTR;
 typedef unsigned long FPTR;
 #endif
 
+// set on the id passed by a probe that also records the points merged into it (see MergeSequenceProbes)
+#define MERGED_PROBE_FLAG 0x80000000
+// set on the id passed by a probe whose visits are also counted by the profiler (see DeriveBranchPoints)
+#define COUNTED_PROBE_FLAG 0x40000000
+#define PROBE_FLAGS (MERGED_PROBE_FLAG | COUNTED_PROBE_FLAG)
+// set on the value passed by a switch probe, the slot of the path taken in the switch tables (see SwitchTables)
+#define SWITCH_PROBE_FLAG 0x20000000
+// the stack slots a switch probe needs above those of the switch (see InsertSwitchIndex)
+#define SWITCH_PROBE_STACK_SIZE 3
+// the stack slots a value probe needs above those of the branch (see AddBranchCoverage)
+#define VALUE_PROBE_STACK_SIZE 2
+
 namespace CoverageInstrumentation
 {
+    /// <summary>A branch point that has no probe; its visits are derived from those of the other points
+    /// of the branch</summary>
+    /// <remarks>visits(uniqueId) = visits(nodeId) - the sum of visits(pathIds)</remarks>
+    struct DerivedBranchPoint
+    {
+        ULONG uniqueId;
+        long offset;
+        ULONG nodeId;
+        std::vector<ULONG> pathIds;
+    };
+
+    typedef std::vector<DerivedBranchPoint> DerivedBranchPoints;
+
+    /// <summary>How much of a method is probed, from the finest to the coarsest</summary>
+    /// <remarks>There is no separate block level as the sequence probes are already shared by the points
+    /// of each straight-line run (see <c>MergeSequenceProbes</c>).</remarks>
+    enum CoverageLevel
+    {
+        CL_Branch = 0,
+        CL_Sequence = 1,
+        CL_Entry = 2,
+    };
+
+    /// <summary>The most a method can be grown by its probes; 0 for no limit</summary>
+    struct ProbeBudget
+    {
+        ProbeBudget() : maxProbes(0), maxCodeGrowth(0.0) {}
+
+        ULONG maxProbes;
+        // the instrumented code size as a multiple of the original
+        double maxCodeGrowth;
+    };
+
+    /// <summary>Leaves every switch to be probed per path (see <c>AddBranchCoverage</c>)</summary>
+    struct NoSwitchProbes
+    {
+        bool operator()(Instrumentation::InstructionList&, const std::vector<ULONG>&) const { return false; }
+    };
+
+    /// <summary>Leaves every conditional branch to be probed per path (see <c>AddBranchCoverage</c>)</summary>
+    struct NoValueProbes
+    {
+        bool operator()(Instrumentation::InstructionList&, const std::vector<ULONG>&) const { return false; }
+    };
+
+    bool SplitCompareBranch(CanonicalName branch, CanonicalName& compare, CanonicalName& test);
+    bool IsCompare(CanonicalName operation);
+
     template<class IM>
-    inline void AddSequenceCoverage(IM instrumentMethod, Instrumentation::Method& method, std::vector<SequencePoint> points)
+    inline void AddSequenceCoverage(IM instrumentMethod, Instrumentation::Method& method, SequencePointSpan points)
     {
         if (points.size() == 0) return;
+        Instrumentation::OriginalOffsetInstructionLists insertions;
+        insertions.reserve(points.size());
         for (auto it = points.begin(); it != points.end(); ++it)
         {
 	        Instrumentation::InstructionList instructions;
             instrumentMethod(instructions, (*it).UniqueId);
-            method.InsertInstructionsAtOriginalOffset((*it).Offset, instructions);
+            insertions.emplace_back((*it).Offset, std::move(instructions));
         }
+        method.InsertInstructionsAtOriginalOffsets(insertions);
     }
 
+    /// <summary>Add the probes chosen by <c>MergeSequenceProbes</c></summary>
+    /// <param name="probes">The id passed by the probe that records each point.</param>
+    /// <remarks>Only the points whose probe records them first get a probe of their own.</remarks>
     template<class IM>
-    void AddBranchCoverage(IM instrumentMethod, Instrumentation::Method& method, std::vector<BranchPoint> points, std::vector<SequencePoint> seqPoints)
+    inline void AddSequenceCoverage(IM instrumentMethod, Instrumentation::Method& method, SequencePointSpan points, const std::vector<ULONG>& probes)
     {
         if (points.size() == 0) return;
+        Instrumentation::OriginalOffsetInstructionLists insertions;
+        insertions.reserve(points.size());
+        for (size_t i = 0; i < points.size(); i++)
+        {
+            if ((probes[i] & ~PROBE_FLAGS) != points[i].UniqueId)
+                continue;
+            Instrumentation::InstructionList instructions;
+            instrumentMethod(instructions, probes[i]);
+            insertions.emplace_back(points[i].Offset, std::move(instructions));
+        }
+        method.InsertInstructionsAtOriginalOffsets(insertions);
+    }
 
-        for (auto it = method.m_instructions.begin(); it != method.m_instructions.end(); ++it)
+    std::vector<ULONG> MergeSequenceProbes(Instrumentation::Method& method, SequencePointSpan points, std::vector<ULONG>& mergedPoints);
+    DerivedBranchPoints DeriveBranchPoints(Instrumentation::Method& method, BranchPointSpan points, SequencePointSpan seqPoints, std::vector<ULONG>& probes);
+    CoverageLevel ChooseCoverageLevel(const ProbeBudget& budget, ULONG codeSize, ULONG probeSize, SequencePointSpan seqPoints, BranchPointSpan brPoints,
+        const std::vector<ULONG>& probes, const DerivedBranchPoints& derived, ULONG& probeCount);
+    SequencePointSpan GetEntryPoint(SequencePointSpan seqPoints);
+
+    /// <summary>Find the unique id of a branch point</summary>
+    /// <param name="first">The first point at the branch's offset (the points are ordered by offset and path).</param>
+    /// <param name="last">The end of the points.</param>
+    /// <param name="uniqueId">The unique id found.</param>
+    /// <returns>false if there is no point for that path.</returns>
+    inline bool FindBranchPoint(BranchPointSpan::const_iterator first, BranchPointSpan::const_iterator last, long offset, long path, ULONG& uniqueId)
+    {
+        for (auto it = first; it != last && (*it).Offset == offset && (*it).Path <= path; ++it)
         {
+            if ((*it).Path == path)
+            {
+                uniqueId = (*it).UniqueId;
+                return true;
+            }
+        }
+        return false;
+    }
 
-            if ((*it)->m_isBranch && ((*it)->m_origOffset != -1))
+    /// <param name="derived">The branch points that are not to be probed (see <c>DeriveBranchPoints</c>); the
+    /// other points of those branches are probed with <c>COUNTED_PROBE_FLAG</c> set.</param>
+    /// <param name="coldPaths">Move the probes of the taken paths to the end of the method so that the
+    /// fall through path runs straight into its probe; only for branches outside of any try block or
+    /// handler, as their code cannot be moved out of it.</param>
+    /// <param name="instrumentSwitch">Adds a single probe, run before a switch, that is given the id of each
+    /// path by the index of the switch (the last for the default path); if it does not the switch is
+    /// probed per path like any other branch.</param>
+    /// <param name="instrumentValue">Adds a single probe, run before a two way branch, that is given the id of
+    /// the path taken by the value (0 or 1) the branch tests; if it does not the branch is probed per path.</param>
+    /// <remarks>A value probe is only added where the value is known to be 0 or 1, i.e. to a compare and branch
+    /// (<c>blt</c> etc.), which is first split into its compare (<c>clt</c> etc.) and <c>brtrue</c>/<c>brfalse</c>, or
+    /// to a <c>brtrue</c>/<c>brfalse</c> that only a compare runs into (and that does not start or end an exception
+    /// clause); the branch then runs as it was and no jumps are added.</remarks>
+    template<class IM, class ISM = NoSwitchProbes, class IVM = NoValueProbes>
+    void AddBranchCoverage(IM instrumentMethod, Instrumentation::Method& method, BranchPointSpan points, SequencePointSpan seqPoints,
+        const DerivedBranchPoints& derived = DerivedBranchPoints(), bool coldPaths = false, ISM instrumentSwitch = ISM(),
+        IVM instrumentValue = IVM())
+    {
+        if (points.size() == 0) return;
+
+        // index the points by (offset, path); the branches are visited in offset order so
+        // a single cursor through the points is all that is needed
+        auto byOffsetAndPath = [](const BranchPoint& left, const BranchPoint& right)
+        {
+            return left.Offset < right.Offset || (left.Offset == right.Offset && left.Path < right.Path);
+        };
+        // the host supplies them in that order; the points are only copied if it does not
+        std::vector<BranchPoint> sorted;
+        if (!std::is_sorted(points.begin(), points.end(), byOffsetAndPath))
+        {
+            sorted.assign(points.begin(), points.end());
+            std::stable_sort(sorted.begin(), sorted.end(), byOffsetAndPath);
+            points = BranchPointSpan(sorted);
+        }
+
+        auto cursor = points.begin();
+        auto derivedCursor = derived.begin();
+
+        Instrumentation::InstructionList result;
+        result.reserve(method.m_instructions.size() + (points.size() * 4));
+
+        // the offsets before the first probe are unchanged
+        auto first = method.m_instructions.size();
+
+        // the switches that are probed once, before the switch
+        Instrumentation::OriginalOffsetInstructionLists switchInsertions;
+
+        // the instructions that are branched to, only needed (and so found) for a brtrue/brfalse after a compare
+        std::vector<Instrumentation::Instruction*> targets;
+        auto isTarget = [&method, &targets](Instrumentation::Instruction* pInstruction)
+        {
+            if (targets.empty())
             {
-                OperationDetails &details = Instrumentation::Operations::m_mapNameOperationDetails[(*it)->m_operation];
-                if (details.controlFlow == COND_BRANCH)
-                {
-					auto *pCurrent = *it;
-                    ++it;
-					auto *pNext = *it;
+                targets.push_back(nullptr);
+                for (auto pBranch : method.m_instructions)
+                    targets.insert(targets.end(), pBranch->m_branches.begin(), pBranch->m_branches.end());
+                std::sort(targets.begin(), targets.end());
+            }
+            return std::binary_search(targets.begin(), targets.end(), pInstruction);
+        };
+        auto valueProbes = false;
 
-                    int idx = 0;
+        // the probes of the taken paths that are moved to the end of the method
+        Instrumentation::InstructionList cold;
+        auto regions = coldPaths ? method.GetExceptionRegions() : Instrumentation::ExceptionRegions();
 
-					Instrumentation::InstructionList instructions;
+        for (auto it = method.m_instructions.begin(); it != method.m_instructions.end(); ++it)
+        {
+            auto *pCurrent = *it;
+            result.push_back(pCurrent);
+
+            if (!pCurrent->m_isBranch || (pCurrent->m_origOffset == -1))
+                continue;
 
-					auto bpp = std::find_if(points.begin(), points.end(), [pCurrent, idx](BranchPoint &bp){return bp.Offset == pCurrent->m_origOffset && bp.Path == idx;});
-					if (bpp == points.end()) // we can't find information on a branch to instrument (this may happen if it was skipped/ignored during initial investigation by the host process)
-						continue;
+            auto &details = Instrumentation::Operations::GetOperationDetails(pCurrent->m_operation);
+            if (details.controlFlow != COND_BRANCH || (it + 1) == method.m_instructions.end())
+                continue;
 
-                    ULONG uniqueId = (*bpp).UniqueId;
-                    ULONG storedId = uniqueId; // store branch 0 ID (default/else)
+            while (cursor != points.end() && (*cursor).Offset < pCurrent->m_origOffset)
+                ++cursor;
 
-                    auto pJumpNext = new Instrumentation::Instruction(CEE_BR);
-                    pJumpNext->m_isBranch = true;
-                    pJumpNext->m_branches.push_back(pNext);
+            ULONG storedId; // store branch 0 ID (default/else)
+            if (!FindBranchPoint(cursor, points.end(), pCurrent->m_origOffset, 0, storedId)) // we can't find information on a branch to instrument (this may happen if it was skipped/ignored during initial investigation by the host process)
+                continue;
 
-                    instructions.push_back(pJumpNext);
+            while (derivedCursor != derived.end() && (*derivedCursor).offset < pCurrent->m_origOffset)
+                ++derivedCursor;
+            auto isDerived = derivedCursor != derived.end() && (*derivedCursor).offset == pCurrent->m_origOffset;
+            auto derivedId = isDerived ? (*derivedCursor).uniqueId : 0;
+            auto probeFlags = isDerived ? COUNTED_PROBE_FLAG : 0;
+
+            if (pCurrent->m_operation == CEE_SWITCH)
+            {
+                // the id of the path for each index, the default path for those out of range is last
+                std::vector<ULONG> pathIds(pCurrent->m_branches.size() + 1, 0);
+                for (size_t index = 0; index < pathIds.size(); index++)
+                {
+                    ULONG uniqueId;
+                    auto path = static_cast<long>((index + 1) % pathIds.size());
+                    if (FindBranchPoint(cursor, points.end(), pCurrent->m_origOffset, path, uniqueId) && !(isDerived && uniqueId == derivedId))
+                        pathIds[index] = uniqueId | probeFlags;
+                }
 
-                    // collect branches instrumentation
-                    for(auto sbit = pCurrent->m_branches.begin(); sbit != pCurrent->m_branches.end(); ++sbit)
+                Instrumentation::InstructionList instructions;
+                if (instrumentSwitch(instructions, pathIds))
+                {
+                    switchInsertions.emplace_back(pCurrent->m_origOffset, std::move(instructions));
+                    continue;
+                }
+            }
+            else
+            {
+                CanonicalName compare, test = pCurrent->m_operation;
+                auto isSplit = SplitCompareBranch(pCurrent->m_operation, compare, test);
+                auto *pPrevious = result.size() > 1 ? result[result.size() - 2] : nullptr;
+                if (isSplit || (pPrevious != nullptr && pPrevious->m_origOffset != -1 && IsCompare(pPrevious->m_operation) && !isTarget(pCurrent)
+                    && !method.IsExceptionBoundary(pCurrent)))
+                {
+                    // the id of the path for each value, brtrue takes path 1 for a value of 1
+                    std::vector<ULONG> pathIds(2, 0);
+                    for (long path = 0; path < 2; path++)
                     {
-                        idx++;
-                        uniqueId = (*std::find_if(points.begin(), points.end(), [pCurrent, idx](BranchPoint &bp){return bp.Offset == pCurrent->m_origOffset && bp.Path == idx;})).UniqueId;
-                        auto pBranchInstrument = instrumentMethod(instructions, uniqueId);
-                        auto pBranchJump = new Instrumentation::Instruction(CEE_BR);
-                        pBranchJump->m_isBranch = true;
-                        pBranchJump->m_branches.push_back(*sbit);
-                        instructions.push_back(pBranchJump);
-                        *sbit = pBranchInstrument; // rewire conditional branch to instrumentation
-                        
+                        ULONG uniqueId;
+                        auto value = (test == CEE_BRTRUE || test == CEE_BRTRUE_S) ? path : 1 - path;
+                        if (FindBranchPoint(cursor, points.end(), pCurrent->m_origOffset, path, uniqueId) && !(isDerived && uniqueId == derivedId))
+                            pathIds[value] = uniqueId | probeFlags;
                     }
-                    
-                    // now instrument "default:" or "else" branch
-                    // insert all instrumentation at pNext
-                    // ----------------------------------------
-                    //        IL_xx Conditional Branch instruction with arguments (at BranchPoint.Offset)
-                    //        IL_xx BR pNext -> rewired to pElse (Path 0)
-                    //        IL_xx Path 1 Instrument
-                    //        IL_xx pBranchJump back to original Path 1 Instruction
-                    //        IL_xx Path 2 Instrument
-                    //        IL_xx pBranchJump back to original Path 2 Instruction
-                    //        IL_xx Path N.. Instrument
-                    //        IL_xx pBranchJump back to original Path N.. Instruction
-                    // pElse: IL_xx Path 0 Instrument 
-                    // pNext: IL_xx Whatever it is 
-                    
-                    auto pElse = instrumentMethod(instructions, storedId);
-                    pJumpNext->m_branches[0] = pElse; // rewire pJumpNext
 
-                    // ReSharper disable once CppPossiblyErroneousEmptyStatements
-                    for (it = method.m_instructions.begin(); *it != pNext; ++it);
-
-                    method.m_instructions.insert(it, instructions.begin(), instructions.end());
-                    
-                    // restore 'it' position
-                    for (it = method.m_instructions.begin(); *it != pNext; ++it);
+                    Instrumentation::InstructionList instructions;
+                    if (instrumentValue(instructions, pathIds))
+                    {
+                        // ----------------------------------------
+                        //        IL_xx Compare (the compare and branch at BranchPoint.Offset, split, or the one before it)
+                        //        IL_xx dup
+                        //        IL_xx Value Instrument
+                        //        IL_xx brtrue/brfalse to the original target
+                        // pNext: IL_xx Whatever it is
+                        if (isSplit)
+                        {
+                            auto pTest = method.CreateInstruction(test);
+                            pTest->m_isBranch = true;
+                            pTest->m_branches.swap(pCurrent->m_branches);
+                            pCurrent->m_operation = compare;
+                            pCurrent->m_operand = 0;
+                            pCurrent->m_isBranch = false;
+                            first = std::min(first, result.size() - 1);
+                            result.push_back(method.CreateInstruction(CEE_DUP));
+                            result.insert(result.end(), instructions.begin(), instructions.end());
+                            result.push_back(pTest);
+                        }
+                        else
+                        {
+                            result.pop_back();
+                            first = std::min(first, result.size());
+                            result.push_back(method.CreateInstruction(CEE_DUP));
+                            result.insert(result.end(), instructions.begin(), instructions.end());
+                            result.push_back(pCurrent);
+                        }
+                        valueProbes = true;
+                        continue;
+                    }
                 }
             }
+
+            auto *pNext = *(it + 1);
+
+            auto offset = pCurrent->m_offset;
+            auto isCold = coldPaths && std::none_of(regions.begin(), regions.end(),
+                [offset](const std::pair<long, long>& region) { return offset >= region.first && offset < region.second; });
+
+            Instrumentation::InstructionList instructions;
+            auto& paths = isCold ? cold : instructions;
+
+            Instrumentation::Instruction* pJumpNext = nullptr;
+            if (!isCold)
+            {
+                pJumpNext = method.CreateInstruction(CEE_BR);
+                pJumpNext->m_isBranch = true;
+                pJumpNext->m_branches.push_back(pNext);
+                instructions.push_back(pJumpNext);
+            }
+
+            // collect branches instrumentation
+            long idx = 0;
+            for(auto sbit = pCurrent->m_branches.begin(); sbit != pCurrent->m_branches.end(); ++sbit)
+            {
+                idx++;
+                ULONG uniqueId;
+                if (!FindBranchPoint(cursor, points.end(), pCurrent->m_origOffset, idx, uniqueId) || (isDerived && uniqueId == derivedId))
+                    continue; // leave this path as it is
+                auto pBranchInstrument = instrumentMethod(paths, uniqueId | probeFlags);
+                auto pBranchJump = method.CreateInstruction(CEE_BR);
+                pBranchJump->m_isBranch = true;
+                pBranchJump->m_branches.push_back(*sbit);
+                paths.push_back(pBranchJump);
+                *sbit = pBranchInstrument; // rewire conditional branch to instrumentation
+                
+            }
+            
+            // now instrument "default:" or "else" branch
+            // insert all instrumentation at pNext
+            // ----------------------------------------
+            //        IL_xx Conditional Branch instruction with arguments (at BranchPoint.Offset)
+            //        IL_xx BR pNext -> rewired to pElse (Path 0)
+            //        IL_xx Path 1 Instrument
+            //        IL_xx pBranchJump back to original Path 1 Instruction
+            //        IL_xx Path 2 Instrument
+            //        IL_xx pBranchJump back to original Path 2 Instruction
+            //        IL_xx Path N.. Instrument
+            //        IL_xx pBranchJump back to original Path N.. Instruction
+            // pElse: IL_xx Path 0 Instrument 
+            // pNext: IL_xx Whatever it is 
+            //
+            // or, with cold paths, the fall through is not interrupted
+            // ----------------------------------------
+            //        IL_xx Conditional Branch instruction with arguments (at BranchPoint.Offset)
+            // pElse: IL_xx Path 0 Instrument
+            // pNext: IL_xx Whatever it is
+            //        ...
+            //        IL_xx Path 1 Instrument (after the last instruction of the method)
+            //        IL_xx pBranchJump back to original Path 1 Instruction
+            
+            if (!isDerived || storedId != derivedId)
+            {
+                auto pElse = instrumentMethod(instructions, storedId | probeFlags);
+                if (pJumpNext != nullptr)
+                    pJumpNext->m_branches[0] = pElse; // rewire pJumpNext
+            }
+
+            if (instructions.empty())
+                continue;
+            first = std::min(first, result.size());
+            result.insert(result.end(), instructions.begin(), instructions.end());
+        }
+
+        // the method cannot fall through its last instruction so nothing runs into them
+        if (!cold.empty())
+        {
+            first = std::min(first, result.size());
+            result.insert(result.end(), cold.begin(), cold.end());
+        }
+
+        method.m_instructions.swap(result);
+        if (first < method.m_instructions.size())
+            method.UpdateOffsets(first, method.m_instructions.size());
+
+        if (valueProbes)
+            method.IncrementStackSize(VALUE_PROBE_STACK_SIZE);
+
+        if (!switchInsertions.empty())
+        {
+            method.IncrementStackSize(SWITCH_PROBE_STACK_SIZE);
+            method.InsertInstructionsAtOriginalOffsets(switchInsertions);
         }
-        method.RecalculateOffsets();
     }
 
-	Instrumentation::Instruction* InsertInjectedMethod(Instrumentation::InstructionList &instructions, mdMethodDef injectedMethodDef, ULONG uniqueId);
-	Instrumentation::Instruction* InsertFunctionCall(Instrumentation::InstructionList &instructions, mdSignature pvsig, FPTR pt, ULONGLONG uniqueId);
+	Instrumentation::Instruction* InsertInjectedMethod(Instrumentation::Method& method, Instrumentation::InstructionList &instructions, mdMethodDef injectedMethodDef, ULONG uniqueId);
+	Instrumentation::Instruction* InsertFunctionCall(Instrumentation::Method& method, Instrumentation::InstructionList &instructions, mdSignature pvsig, FPTR pt, ULONGLONG uniqueId);
+	Instrumentation::Instruction* InsertCounterIncrement(Instrumentation::Method& method, Instrumentation::InstructionList &instructions, ULONG* pCounter);
+	Instrumentation::Instruction* InsertCounterSet(Instrumentation::Method& method, Instrumentation::InstructionList &instructions, ULONG* pCounter);
+	Instrumentation::Instruction* InsertSwitchIndex(Instrumentation::Method& method, Instrumentation::InstructionList &instructions, ULONG count);
+	Instrumentation::Instruction* InsertTableCounterUpdate(Instrumentation::Method& method, Instrumentation::InstructionList &instructions, const ULONG* pTable, ULONG* pCounters, bool increment);
 
 }
 
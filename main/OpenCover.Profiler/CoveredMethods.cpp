@@ -0,0 +1,137 @@
+#include "stdafx.h"
+#include "CoveredMethods.h"
+
+#include <algorithm>
+
+namespace Instrumentation
+{
+	/// <summary>Start tracking the points of an instrumented method</summary>
+	/// <param name="pOriginalBody">The body before it was instrumented; it must remain valid until the
+	/// module is forgotten.</param>
+	/// <returns>false if the method is already tracked (in that module) or has no points.</returns>
+	/// <remarks>A method that is compiled again (another tier, or another JIT of the module) is handed the body
+	/// it was instrumented with, so the body first tracked is kept as the original. A method whose points
+	/// have all been covered already, in another module, is pending straight away.</remarks>
+	bool CoveredMethods::Track(ModuleID moduleId, mdMethodDef functionToken, LPCBYTE pOriginalBody, ULONG originalSize, std::vector<ULONG> pointIds)
+	{
+		std::sort(pointIds.begin(), pointIds.end());
+		pointIds.erase(std::unique(pointIds.begin(), pointIds.end()), pointIds.end());
+		pointIds.erase(std::remove(pointIds.begin(), pointIds.end(), 0u), pointIds.end());
+		if (pointIds.empty())
+			return false;
+
+		std::lock_guard<std::mutex> lock(m_mutex);
+		auto key = std::make_pair(moduleId, functionToken);
+		auto existing = m_methodIndex.find(key);
+		if (existing != m_methodIndex.end())
+			return false;
+
+		auto index = m_methods.size();
+		TrackedMethod method = { moduleId, functionToken, pOriginalBody, originalSize, 0, false };
+		for (auto uniqueId : pointIds)
+		{
+			if (m_coveredPoints.find(uniqueId) != m_coveredPoints.end())
+				continue;
+			m_points[uniqueId].push_back(index);
+			method.uncovered++;
+		}
+
+		m_methods.push_back(method);
+		m_methodIndex[key] = index;
+		if (method.uncovered == 0)
+			m_pending.push_back(index);
+		return true;
+	}
+
+	/// <summary>Record that a point has been covered</summary>
+	/// <returns>true if that was the last uncovered point of any of its methods.</returns>
+	bool CoveredMethods::PointCovered(ULONG uniqueId)
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_coveredPoints.insert(uniqueId);
+		auto it = m_points.find(uniqueId);
+		if (it == m_points.end())
+			return false;
+
+		auto indexes = std::move(it->second);
+		m_points.erase(it);
+		auto pending = false;
+		for (auto index : indexes)
+		{
+			auto& method = m_methods[index];
+			if (method.forgotten || --method.uncovered != 0)
+				continue;
+			m_pending.push_back(index);
+			pending = true;
+		}
+		return pending;
+	}
+
+	/// <summary>Ask the runtime to ReJIT the pending methods in a single request</summary>
+	/// <returns>S_FALSE if nothing was pending.</returns>
+	HRESULT CoveredMethods::RequestReJIT(ICorProfilerInfo4* pProfilerInfo)
+	{
+		std::vector<ModuleID> moduleIds;
+		std::vector<mdMethodDef> methodIds;
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			for (auto index : m_pending)
+			{
+				if (m_methods[index].forgotten)
+					continue;
+				moduleIds.push_back(m_methods[index].moduleId);
+				methodIds.push_back(m_methods[index].functionToken);
+			}
+			m_pending.clear();
+		}
+
+		if (moduleIds.empty())
+			return S_FALSE;
+		return pProfilerInfo->RequestReJIT(static_cast<ULONG>(moduleIds.size()), moduleIds.data(), methodIds.data());
+	}
+
+	/// <summary>The body of a tracked method before it was instrumented</summary>
+	bool CoveredMethods::GetOriginalBody(ModuleID moduleId, mdMethodDef functionToken, LPCBYTE& pOriginalBody, ULONG& originalSize)
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		auto it = m_methodIndex.find(std::make_pair(moduleId, functionToken));
+		if (it == m_methodIndex.end())
+			return false;
+
+		pOriginalBody = m_methods[it->second].pOriginalBody;
+		originalSize = m_methods[it->second].originalSize;
+		return true;
+	}
+
+	/// <summary>Stop tracking the methods of a module that is being unloaded</summary>
+	void CoveredMethods::Forget(ModuleID moduleId)
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		for (auto it = m_methodIndex.begin(); it != m_methodIndex.end();)
+		{
+			if (it->first.first != moduleId)
+			{
+				++it;
+				continue;
+			}
+			m_methods[it->second].forgotten = true;
+			it = m_methodIndex.erase(it);
+		}
+		for (auto it = m_points.begin(); it != m_points.end();)
+		{
+			auto& indexes = it->second;
+			indexes.erase(std::remove_if(indexes.begin(), indexes.end(), [this](size_t index) { return m_methods[index].forgotten; }),
+				indexes.end());
+			if (indexes.empty())
+				it = m_points.erase(it);
+			else
+				++it;
+		}
+	}
+
+	size_t CoveredMethods::GetPendingCount()
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		return m_pending.size();
+	}
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <map>
+#include <mutex>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+namespace Instrumentation
+{
+	/// <summary>The instrumented methods that are waiting for all their points to be covered</summary>
+	/// <remarks><para>A point is covered when it can gain nothing more from being visited, i.e. it has
+	/// reached the threshold; once every point of a method is covered the method is pending until its
+	/// original body is restored by a ReJIT.</para>
+	/// <para>A method is tracked for each module it is loaded into (e.g. an assembly loaded into several
+	/// AppDomains), which share its points, so that each of them is ReJIT-ed.</para>
+	/// <para>All access is serialized as the only frequent call, <c>PointCovered</c>, is made at most
+	/// once or twice per point.</para></remarks>
+	class CoveredMethods
+	{
+	public:
+		CoveredMethods() {}
+
+	private:
+		CoveredMethods(const CoveredMethods&) = delete;
+		CoveredMethods& operator = (const CoveredMethods&) = delete;
+
+	public:
+		bool Track(ModuleID moduleId, mdMethodDef functionToken, LPCBYTE pOriginalBody, ULONG originalSize, std::vector<ULONG> pointIds);
+		bool PointCovered(ULONG uniqueId);
+		HRESULT RequestReJIT(ICorProfilerInfo4* pProfilerInfo);
+		bool GetOriginalBody(ModuleID moduleId, mdMethodDef functionToken, LPCBYTE& pOriginalBody, ULONG& originalSize);
+		void Forget(ModuleID moduleId);
+		size_t GetPendingCount();
+
+	private:
+		struct TrackedMethod
+		{
+			ModuleID moduleId;
+			mdMethodDef functionToken;
+			LPCBYTE pOriginalBody;
+			ULONG originalSize;
+			ULONG uncovered;
+			bool forgotten;
+		};
+
+		std::mutex m_mutex;
+		std::vector<TrackedMethod> m_methods;
+		std::map<std::pair<ModuleID, mdMethodDef>, size_t> m_methodIndex;
+		// the uncovered points and the methods they belong to, and the points that have been covered
+		std::unordered_map<ULONG, std::vector<size_t>> m_points;
+		std::unordered_set<ULONG> m_coveredPoints;
+		std::vector<size_t> m_pending;
+	};
+}
@@ -0,0 +1,295 @@
+#include "stdafx.h"
+#include "Inflate.h"
+
+namespace Instrumentation
+{
+	namespace
+	{
+		const int MAX_BITS = 15;
+		const int MAX_LITERAL_CODES = 288;
+		const int MAX_DISTANCE_CODES = 32;
+
+		const USHORT LENGTH_BASE[] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+			35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+		const BYTE LENGTH_EXTRA[] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+			3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+		const USHORT DISTANCE_BASE[] = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+			257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+		const BYTE DISTANCE_EXTRA[] = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+			7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+
+		// the order the code lengths of the code length alphabet are sent in
+		const BYTE CODE_LENGTH_ORDER[] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+
+		/// <summary>A canonical Huffman code, decoded a bit at a time (RFC 1951 3.2.2)</summary>
+		struct Huffman
+		{
+			USHORT counts[MAX_BITS + 1];
+			USHORT symbols[MAX_LITERAL_CODES];
+
+			bool Build(const BYTE* lengths, int count)
+			{
+				memset(counts, 0, sizeof(counts));
+				for (auto symbol = 0; symbol < count; symbol++)
+					counts[lengths[symbol]]++;
+				counts[0] = 0;
+
+				// an over-subscribed set of lengths is not a code
+				auto left = 1;
+				for (auto bits = 1; bits <= MAX_BITS; bits++)
+				{
+					left = (left << 1) - counts[bits];
+					if (left < 0)
+						return false;
+				}
+
+				USHORT offsets[MAX_BITS + 1];
+				offsets[1] = 0;
+				for (auto bits = 1; bits < MAX_BITS; bits++)
+					offsets[bits + 1] = offsets[bits] + counts[bits];
+				for (auto symbol = 0; symbol < count; symbol++)
+				{
+					if (lengths[symbol] != 0)
+						symbols[offsets[lengths[symbol]]++] = static_cast<USHORT>(symbol);
+				}
+				return true;
+			}
+		};
+
+		class Inflater
+		{
+		public:
+			Inflater(const BYTE* pData, ULONG size, std::vector<BYTE>& output)
+				: m_pData(pData), m_size(size), m_position(0), m_bitBuffer(0), m_bitCount(0), m_output(output) {}
+
+			bool Run()
+			{
+				ULONG final;
+				do
+				{
+					ULONG type;
+					if (!Bits(1, final) || !Bits(2, type))
+						return false;
+
+					bool ok;
+					switch (type)
+					{
+					case 0: ok = Stored(); break;
+					case 1: ok = Fixed(); break;
+					case 2: ok = Dynamic(); break;
+					default: ok = false; break;
+					}
+					if (!ok)
+						return false;
+				} while (final == 0);
+				return true;
+			}
+
+		private:
+			bool Bits(int count, ULONG& value)
+			{
+				while (m_bitCount < count)
+				{
+					if (m_position >= m_size)
+						return false;
+					m_bitBuffer |= static_cast<ULONG>(m_pData[m_position++]) << m_bitCount;
+					m_bitCount += 8;
+				}
+				value = m_bitBuffer & ((1UL << count) - 1);
+				m_bitBuffer >>= count;
+				m_bitCount -= count;
+				return true;
+			}
+
+			bool Decode(const Huffman& huffman, int& symbol)
+			{
+				int code = 0, first = 0, index = 0;
+				for (auto bits = 1; bits <= MAX_BITS; bits++)
+				{
+					ULONG bit;
+					if (!Bits(1, bit))
+						return false;
+					code |= static_cast<int>(bit);
+					auto count = huffman.counts[bits];
+					if (code - count < first)
+					{
+						symbol = huffman.symbols[index + (code - first)];
+						return true;
+					}
+					index += count;
+					first += count;
+					first <<= 1;
+					code <<= 1;
+				}
+				return false;
+			}
+
+			bool Stored()
+			{
+				// the length is byte aligned
+				m_bitBuffer = 0;
+				m_bitCount = 0;
+				if (m_size - m_position < 4)
+					return false;
+				auto length = static_cast<ULONG>(m_pData[m_position] | (m_pData[m_position + 1] << 8));
+				auto complement = static_cast<ULONG>(m_pData[m_position + 2] | (m_pData[m_position + 3] << 8));
+				m_position += 4;
+				if (length != (~complement & 0xFFFF) || m_size - m_position < length)
+					return false;
+				m_output.insert(m_output.end(), m_pData + m_position, m_pData + m_position + length);
+				m_position += length;
+				return true;
+			}
+
+			bool Codes(const Huffman& literals, const Huffman& distances)
+			{
+				for (;;)
+				{
+					int symbol;
+					if (!Decode(literals, symbol))
+						return false;
+					if (symbol < 256)
+					{
+						m_output.push_back(static_cast<BYTE>(symbol));
+						continue;
+					}
+					if (symbol == 256)
+						return true;
+
+					symbol -= 257;
+					if (symbol >= 29)
+						return false;
+					ULONG extra;
+					if (!Bits(LENGTH_EXTRA[symbol], extra))
+						return false;
+					auto length = LENGTH_BASE[symbol] + extra;
+
+					if (!Decode(distances, symbol) || symbol >= 30)
+						return false;
+					if (!Bits(DISTANCE_EXTRA[symbol], extra))
+						return false;
+					auto distance = DISTANCE_BASE[symbol] + extra;
+					if (distance > m_output.size())
+						return false;
+
+					// the copy may overlap what it is copying
+					auto from = m_output.size() - distance;
+					for (ULONG i = 0; i < length; i++)
+						m_output.push_back(m_output[from + i]);
+				}
+			}
+
+			bool Fixed()
+			{
+				BYTE lengths[MAX_LITERAL_CODES];
+				auto symbol = 0;
+				for (; symbol < 144; symbol++) lengths[symbol] = 8;
+				for (; symbol < 256; symbol++) lengths[symbol] = 9;
+				for (; symbol < 280; symbol++) lengths[symbol] = 7;
+				for (; symbol < MAX_LITERAL_CODES; symbol++) lengths[symbol] = 8;
+				Huffman literals;
+				literals.Build(lengths, MAX_LITERAL_CODES);
+
+				for (symbol = 0; symbol < 30; symbol++) lengths[symbol] = 5;
+				Huffman distances;
+				distances.Build(lengths, 30);
+
+				return Codes(literals, distances);
+			}
+
+			bool Dynamic()
+			{
+				ULONG literalCount, distanceCount, codeLengthCount;
+				if (!Bits(5, literalCount) || !Bits(5, distanceCount) || !Bits(4, codeLengthCount))
+					return false;
+				literalCount += 257;
+				distanceCount += 1;
+				codeLengthCount += 4;
+				if (literalCount > 286 || distanceCount > 30)
+					return false;
+
+				BYTE lengths[MAX_LITERAL_CODES + MAX_DISTANCE_CODES] = {};
+				for (ULONG i = 0; i < codeLengthCount; i++)
+				{
+					ULONG length;
+					if (!Bits(3, length))
+						return false;
+					lengths[CODE_LENGTH_ORDER[i]] = static_cast<BYTE>(length);
+				}
+				Huffman codeLengths;
+				if (!codeLengths.Build(lengths, 19))
+					return false;
+
+				// the literal/length and distance code lengths are one sequence, repeats may cross from one to the other
+				ULONG index = 0;
+				while (index < literalCount + distanceCount)
+				{
+					int symbol;
+					if (!Decode(codeLengths, symbol))
+						return false;
+					if (symbol < 16)
+					{
+						lengths[index++] = static_cast<BYTE>(symbol);
+						continue;
+					}
+
+					BYTE length = 0;
+					ULONG repeat;
+					if (symbol == 16)
+					{
+						if (index == 0 || !Bits(2, repeat))
+							return false;
+						length = lengths[index - 1];
+						repeat += 3;
+					}
+					else if (symbol == 17)
+					{
+						if (!Bits(3, repeat))
+							return false;
+						repeat += 3;
+					}
+					else
+					{
+						if (!Bits(7, repeat))
+							return false;
+						repeat += 11;
+					}
+					if (index + repeat > literalCount + distanceCount)
+						return false;
+					while (repeat-- != 0)
+						lengths[index++] = length;
+				}
+
+				// there has to be an end of block code
+				if (lengths[256] == 0)
+					return false;
+
+				Huffman literals, distances;
+				if (!literals.Build(lengths, literalCount) || !distances.Build(lengths + literalCount, distanceCount))
+					return false;
+				return Codes(literals, distances);
+			}
+
+		private:
+			const BYTE* m_pData;
+			ULONG m_size;
+			ULONG m_position;
+			ULONG m_bitBuffer;
+			int m_bitCount;
+			std::vector<BYTE>& m_output;
+		};
+	}
+
+	/// <summary>Decompress raw DEFLATE (RFC 1951) data, e.g. an embedded portable PDB</summary>
+	/// <param name="uncompressedSize">The size the data is expected to decompress to.</param>
+	/// <returns>false if the data is corrupt, or does not decompress to the size expected.</returns>
+	/// <remarks>The data is decompressed once, up front, so the decoder is written for brevity rather than
+	/// speed; codes are decoded a bit at a time.</remarks>
+	bool Inflate(const BYTE* pData, ULONG size, ULONG uncompressedSize, std::vector<BYTE>& output)
+	{
+		output.clear();
+		output.reserve(uncompressedSize);
+		Inflater inflater(pData, size, output);
+		return inflater.Run() && output.size() == uncompressedSize;
+	}
+}
@@ -0,0 +1,8 @@
+#pragma once
+
+#include <vector>
+
+namespace Instrumentation
+{
+	bool Inflate(const BYTE* pData, ULONG size, ULONG uncompressedSize, std::vector<BYTE>& output);
+}
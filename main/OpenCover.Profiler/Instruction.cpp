@@ -29,22 +29,6 @@ namespace Instrumentation
 		m_origOffset = -1;
 	}
 
-	Instruction& Instruction::operator = (const Instruction& rhs)
-	{
-		if (this != &rhs)
-		{
-			m_offset = rhs.m_offset;
-			m_operation = rhs.m_operation;
-			m_operand = rhs.m_operand;
-			m_isBranch = rhs.m_isBranch;
-			m_branchOffsets = rhs.m_branchOffsets;
-			m_branches = rhs.m_branches;
-			m_joins = rhs.m_joins;
-			m_origOffset = rhs.m_origOffset;
-		}
-		return *this;
-	}
-
 	bool Instruction::Equivalent(const Instruction& rhs)
 	{
 		if (this != &rhs)
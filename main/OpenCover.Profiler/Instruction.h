@@ -7,6 +7,7 @@
 namespace Instrumentation {
 	class Instruction;
 	class Method;
+	class Arena;
 
 	typedef std::vector<Instruction*> InstructionList;
 
@@ -19,7 +20,7 @@ namespace Instrumentation {
 
 		protected:
 		Instruction();
-		Instruction& operator = (const Instruction& b);
+		Instruction& operator = (const Instruction& b) = delete;
 		bool Equivalent(const Instruction& b);
 
 #ifdef TEST_FRAMEWORK
@@ -28,18 +29,16 @@ namespace Instrumentation {
 	public:
 #endif
 		long m_offset;
+		long m_origOffset;
 		CanonicalName m_operation;
-		ULONGLONG m_operand;
 		bool m_isBranch;
+		ULONGLONG m_operand;
 
-		std::vector<long> m_branchOffsets;
 		InstructionList m_branches;
-		InstructionList m_joins;
-
-		long m_origOffset;
 
 	public:
 
 		friend class Method;
+		friend class Arena;
 	};
 }
\ No newline at end of file
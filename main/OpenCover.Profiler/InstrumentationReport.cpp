@@ -0,0 +1,67 @@
+#include "stdafx.h"
+#include "InstrumentationReport.h"
+
+#include <algorithm>
+#include <iomanip>
+
+namespace Instrumentation
+{
+	namespace
+	{
+		const wchar_t* GetLevelName(CoverageInstrumentation::CoverageLevel level)
+		{
+			switch (level)
+			{
+			case CoverageInstrumentation::CL_Sequence:
+				return L"sequence";
+			case CoverageInstrumentation::CL_Entry:
+				return L"entry";
+			default:
+				return L"branch";
+			}
+		}
+	}
+
+	void InstrumentationReport::Add(const MethodCost& cost)
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_costs.push_back(cost);
+		if (cost.level != CoverageInstrumentation::CL_Branch)
+			m_downgrades.push_back(cost);
+	}
+
+	/// <summary>The methods given coarser coverage than asked for since the last call</summary>
+	std::vector<MethodCost> InstrumentationReport::TakeDowngrades()
+	{
+		std::vector<MethodCost> downgrades;
+		std::lock_guard<std::mutex> lock(m_mutex);
+		downgrades.swap(m_downgrades);
+		return downgrades;
+	}
+
+	/// <summary>The methods, those that grew the most first</summary>
+	std::vector<MethodCost> InstrumentationReport::GetCosts() const
+	{
+		std::vector<MethodCost> costs;
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			costs = m_costs;
+		}
+		std::stable_sort(costs.begin(), costs.end(),
+			[](const MethodCost& left, const MethodCost& right) { return left.GetBytesAdded() > right.GetBytesAdded(); });
+		return costs;
+	}
+
+	/// <summary>Write the bloat report, a line (of comma separated values) per method, those that grew the most first</summary>
+	void InstrumentationReport::Write(std::wostream& out) const
+	{
+		out << L"BytesAdded,OriginalSize,InstrumentedSize,Probes,Coverage,Token,Assembly,Module" << std::endl;
+		for (const auto& cost : GetCosts())
+		{
+			out << cost.GetBytesAdded() << L"," << cost.originalSize << L"," << cost.instrumentedSize << L","
+				<< cost.probes << L"," << GetLevelName(cost.level) << L","
+				<< L"0x" << std::hex << std::setw(8) << std::setfill(L'0') << cost.functionToken << std::dec << std::setfill(L' ') << L","
+				<< L"\"" << cost.assemblyName << L"\",\"" << cost.modulePath << L"\"" << std::endl;
+		}
+	}
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include "CoverageInstrumentation.h"
+
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <vector>
+
+namespace Instrumentation
+{
+	/// <summary>What instrumenting a method cost</summary>
+	struct MethodCost
+	{
+		MethodCost() : functionToken(0), level(CoverageInstrumentation::CL_Branch), probes(0), originalSize(0), instrumentedSize(0) {}
+
+		std::wstring modulePath;
+		std::wstring assemblyName;
+		mdToken functionToken;
+
+		// the coverage the method was given, coarser than branch coverage if it was over the budget
+		CoverageInstrumentation::CoverageLevel level;
+		ULONG probes;
+
+		// the size of the code before, and of the whole method (header and sections) after
+		ULONG originalSize;
+		ULONG instrumentedSize;
+
+		long GetBytesAdded() const { return static_cast<long>(instrumentedSize) - static_cast<long>(originalSize); }
+	};
+
+	/// <summary>The cost of the methods that have been instrumented, for the bloat report, and those given coarser
+	/// coverage than asked for, for the host</summary>
+	/// <remarks>The methods are added as they are instrumented, from any thread.</remarks>
+	class InstrumentationReport
+	{
+	public:
+		InstrumentationReport() {}
+
+	private:
+		InstrumentationReport(const InstrumentationReport&) = delete;
+		InstrumentationReport& operator = (const InstrumentationReport&) = delete;
+
+	public:
+		void Add(const MethodCost& cost);
+		std::vector<MethodCost> TakeDowngrades();
+		std::vector<MethodCost> GetCosts() const;
+		void Write(std::wostream& out) const;
+
+	private:
+		mutable std::mutex m_mutex;
+		std::vector<MethodCost> m_costs;
+		std::vector<MethodCost> m_downgrades;
+	};
+}
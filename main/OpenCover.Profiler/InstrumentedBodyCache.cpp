@@ -0,0 +1,85 @@
+#include "stdafx.h"
+#include "InstrumentedBodyCache.h"
+
+namespace Instrumentation
+{
+	bool InstrumentedBodyCache::ModuleIdentity::operator < (const ModuleIdentity& other) const
+	{
+		auto compare = memcmp(&moduleVersionId, &other.moduleVersionId, sizeof(GUID));
+		if (compare != 0)
+			return compare < 0;
+		return modulePath < other.modulePath;
+	}
+
+	/// <summary>Record a loaded module so that its methods can use (and add to) the bodies of its identity</summary>
+	void InstrumentedBodyCache::AddModule(ModuleID moduleId, const GUID& moduleVersionId, const std::wstring& modulePath)
+	{
+		ModuleIdentity identity = { moduleVersionId, modulePath };
+
+		std::lock_guard<std::mutex> lock(m_mutex);
+		if (m_modules.find(moduleId) != m_modules.end())
+			return;
+
+		auto& bodies = m_identities[identity];
+		if (!bodies)
+			bodies = std::make_shared<ModuleBodies>();
+		bodies->loadCount++;
+		m_modules[moduleId] = std::make_pair(identity, bodies);
+	}
+
+	/// <summary>Forget a module that has been unloaded</summary>
+	/// <returns>true if it was the last module of its identity and its bodies were released.</returns>
+	bool InstrumentedBodyCache::RemoveModule(ModuleID moduleId)
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		auto it = m_modules.find(moduleId);
+		if (it == m_modules.end())
+			return false;
+
+		auto identity = it->second.first;
+		auto bodies = it->second.second;
+		m_modules.erase(it);
+		if (--bodies->loadCount != 0)
+			return false;
+
+		m_identities.erase(identity);
+		return true;
+	}
+
+	/// <summary>Add the instrumented body of a method</summary>
+	/// <returns>false if the module is not known; a body already held for the method is replaced.</returns>
+	bool InstrumentedBodyCache::Add(ModuleID moduleId, mdMethodDef functionToken, std::shared_ptr<const InstrumentedBody> body)
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		auto it = m_modules.find(moduleId);
+		if (it == m_modules.end())
+			return false;
+
+		it->second.second->bodies[functionToken] = std::move(body);
+		return true;
+	}
+
+	/// <summary>Find the instrumented body of a method of a module (or any other module of the same identity)</summary>
+	std::shared_ptr<const InstrumentedBody> InstrumentedBodyCache::Find(ModuleID moduleId, mdMethodDef functionToken) const
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		auto it = m_modules.find(moduleId);
+		if (it == m_modules.end())
+			return nullptr;
+
+		auto& bodies = it->second.second->bodies;
+		auto body = bodies.find(functionToken);
+		if (body == bodies.end())
+			return nullptr;
+		return body->second;
+	}
+
+	size_t InstrumentedBodyCache::GetBodyCount() const
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		size_t count = 0;
+		for (auto& identity : m_identities)
+			count += identity.second->bodies.size();
+		return count;
+	}
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace Instrumentation
+{
+	/// <summary>A finished instrumented method body (and IL map)</summary>
+	struct InstrumentedBody
+	{
+		InstrumentedBody() : moduleId(0), probeToken(0) {}
+
+		// the module the body was built for, the probes reference this token of it (0 if they
+		// only refer to addresses in this process)
+		ModuleID moduleId;
+		mdToken probeToken;
+
+		std::vector<BYTE> body;
+		std::vector<COR_IL_MAP> map;
+
+		// the points of the method (only recorded when they are needed to reuse the body)
+		std::vector<ULONG> pointIds;
+	};
+
+	/// <summary>The instrumented bodies of the methods that have been JIT compiled in this process</summary>
+	/// <remarks><para>A method is compiled again for each AppDomain that loads its module (unless it is
+	/// shared) and, with tiered compilation, for each tier; rather than asking the host for the points
+	/// and rewriting the method every time the body is reused.</para>
+	/// <para>Bodies are held per module identity (MVID and path) so that every <c>ModuleID</c> of the same
+	/// module shares them; they are released when the last of those is unloaded.</para>
+	/// <para>All access is serialized but the lock is only held to look a body up; the bodies
+	/// themselves are immutable and shared.</para></remarks>
+	class InstrumentedBodyCache
+	{
+	public:
+		InstrumentedBodyCache() {}
+
+	private:
+		InstrumentedBodyCache(const InstrumentedBodyCache&) = delete;
+		InstrumentedBodyCache& operator = (const InstrumentedBodyCache&) = delete;
+
+	public:
+		void AddModule(ModuleID moduleId, const GUID& moduleVersionId, const std::wstring& modulePath);
+		bool RemoveModule(ModuleID moduleId);
+		bool Add(ModuleID moduleId, mdMethodDef functionToken, std::shared_ptr<const InstrumentedBody> body);
+		std::shared_ptr<const InstrumentedBody> Find(ModuleID moduleId, mdMethodDef functionToken) const;
+		size_t GetBodyCount() const;
+
+	private:
+		struct ModuleIdentity
+		{
+			GUID moduleVersionId;
+			std::wstring modulePath;
+
+			bool operator < (const ModuleIdentity& other) const;
+		};
+
+		struct ModuleBodies
+		{
+			ModuleBodies() : loadCount(0) {}
+
+			// the number of ModuleIDs loaded with this identity
+			ULONG loadCount;
+			std::unordered_map<mdMethodDef, std::shared_ptr<const InstrumentedBody>> bodies;
+		};
+
+		mutable std::mutex m_mutex;
+		std::map<ModuleIdentity, std::shared_ptr<ModuleBodies>> m_identities;
+		std::unordered_map<ModuleID, std::pair<ModuleIdentity, std::shared_ptr<ModuleBodies>>> m_modules;
+	};
+}
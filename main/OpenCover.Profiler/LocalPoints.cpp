@@ -0,0 +1,281 @@
+#include "stdafx.h"
+#include "LocalPoints.h"
+
+#include <algorithm>
+#include <unordered_map>
+#include <unordered_set>
+
+// FNV-1a, over 32 bit values rather than bytes
+#define POINTS_HASH_BASIS 2166136261UL
+#define POINTS_HASH_PRIME 16777619UL
+#define POINTS_HASH_SEPARATOR 0xFFFFFFFFUL
+
+namespace Instrumentation
+{
+	namespace
+	{
+		// the test of a lambda's delegate cached in a static field
+		const CanonicalName CACHED_DELEGATE_SEQUENCE[] = { CEE_BRTRUE_S, CEE_POP, CEE_LDSFLD, CEE_LDFTN, CEE_NEWOBJ, CEE_DUP, CEE_STSFLD };
+		const size_t CACHED_DELEGATE_SEQUENCE_SIZE = sizeof(CACHED_DELEGATE_SEQUENCE) / sizeof(CACHED_DELEGATE_SEQUENCE[0]);
+
+		ULONG HashValue(ULONG hash, ULONG value)
+		{
+			return (hash ^ value) * POINTS_HASH_PRIME;
+		}
+
+		/// <summary>Finds the points of a method as the host does (see <c>CecilSymbolManager</c>)</summary>
+		/// <remarks>The rules, including their oddities, are those of the host so that the points are the
+		/// same as the ones it has already given ids to.</remarks>
+		class PointFinder
+		{
+		public:
+			PointFinder(Method& method, const std::vector<PdbSequencePoint>& pdbPoints, const FieldNameResolver& getFieldName)
+				: m_instructions(method.m_instructions), m_pdbPoints(pdbPoints), m_getFieldName(getFieldName)
+			{
+				for (size_t i = 0; i < m_instructions.size(); i++)
+					m_indexes[m_instructions[i]] = i;
+			}
+
+			void FindSequencePoints(LocalPoints& points)
+			{
+				// the points inside an empty branch are left out
+				std::unordered_set<long> ignored;
+				for (size_t i = 0; i < m_instructions.size(); i++)
+				{
+					if (!IsEmptyBranch(i))
+						continue;
+					auto destination = m_instructions[i]->m_branches[0]->m_origOffset;
+					for (auto next = i + 1; next < m_instructions.size() && m_instructions[next]->m_origOffset < destination; next++)
+						ignored.insert(m_instructions[next]->m_origOffset);
+				}
+
+				// a point is matched to the instructions that follow the last one matched
+				auto sorted = m_pdbPoints;
+				std::stable_sort(sorted.begin(), sorted.end(),
+					[](const PdbSequencePoint& left, const PdbSequencePoint& right) { return left.offset < right.offset; });
+				size_t next = 0;
+				for (auto& point : sorted)
+				{
+					while (next < m_instructions.size())
+					{
+						auto offset = m_instructions[next++]->m_origOffset;
+						if (offset != static_cast<long>(point.offset))
+							continue;
+						if (!point.IsHidden() && ignored.find(offset) == ignored.end())
+						{
+							SequencePoint seqPoint = { 0, offset };
+							points.seqPoints.push_back(seqPoint);
+						}
+						break;
+					}
+				}
+			}
+
+			void FindBranchPoints(LocalPoints& points)
+			{
+				auto instrumented = GetInstrumentedInstructions();
+				for (size_t i = 0; i < m_instructions.size(); i++)
+				{
+					auto pInstruction = m_instructions[i];
+					if (Operations::GetOperationDetails(pInstruction->m_operation).controlFlow != COND_BRANCH)
+						continue;
+
+					if (!instrumented[i] && std::none_of(pInstruction->m_branches.begin(), pInstruction->m_branches.end(),
+						[&](Instruction* pTarget) { return instrumented[m_indexes.at(pTarget)]; }))
+						continue;
+
+					// the host stops at the first branch it cannot follow
+					if (i + 1 == m_instructions.size() || pInstruction->m_branches.empty())
+						return;
+					if (pInstruction->m_operation != CEE_SWITCH)
+					{
+						if (IsCachedDelegateTest(i))
+							return;
+						if (IsEmptyBranch(i))
+							continue;
+					}
+
+					for (size_t path = 0; path <= pInstruction->m_branches.size(); path++)
+					{
+						BranchPoint brPoint = { 0, pInstruction->m_origOffset, static_cast<long>(path) };
+						points.brPoints.push_back(brPoint);
+					}
+				}
+			}
+
+		private:
+			/// <summary>The operation as it was before the short branches were made long</summary>
+			CanonicalName GetOriginalOperation(size_t index) const
+			{
+				auto pInstruction = m_instructions[index];
+				if (pInstruction->m_operation == CEE_BRTRUE && index + 1 < m_instructions.size() &&
+					m_instructions[index + 1]->m_origOffset - pInstruction->m_origOffset == 2)
+					return CEE_BRTRUE_S;
+				return pInstruction->m_operation;
+			}
+
+			/// <summary>A brtrue.s over nothing but nops, or backwards</summary>
+			bool IsEmptyBranch(size_t index) const
+			{
+				if (GetOriginalOperation(index) != CEE_BRTRUE_S)
+					return false;
+				auto destination = m_instructions[index]->m_branches[0]->m_origOffset;
+				for (auto next = index + 1; next < m_instructions.size() && m_instructions[next]->m_origOffset < destination; next++)
+				{
+					if (m_instructions[next]->m_operation != CEE_NOP)
+						return false;
+				}
+				return true;
+			}
+
+			/// <summary>Each instruction from a visible sequence point up to the next point</summary>
+			std::vector<bool> GetInstrumentedInstructions() const
+			{
+				std::unordered_map<long, bool> hidden;
+				for (auto& point : m_pdbPoints)
+					hidden.emplace(static_cast<long>(point.offset), point.IsHidden());
+
+				std::vector<bool> instrumented(m_instructions.size(), false);
+				auto inBlock = false;
+				for (size_t i = 0; i < m_instructions.size(); i++)
+				{
+					auto it = hidden.find(m_instructions[i]->m_origOffset);
+					if (it != hidden.end())
+						inBlock = !it->second;
+					instrumented[i] = inBlock;
+				}
+				return instrumented;
+			}
+
+			/// <summary>The offset a path ends at once any unconditional branches have been followed</summary>
+			long GetPathEnd(size_t index) const
+			{
+				auto pInstruction = m_instructions[index];
+				for (size_t followed = 0; followed < m_instructions.size(); followed++)
+				{
+					if (pInstruction->m_operation != CEE_BR || pInstruction->m_branches.empty())
+						break;
+					pInstruction = pInstruction->m_branches[0];
+				}
+				return pInstruction->m_origOffset;
+			}
+
+			bool IsCachedDelegateTest(size_t index) const
+			{
+				if (GetOriginalOperation(index) != CEE_BRTRUE_S)
+					return false;
+
+				auto pInstruction = m_instructions[index];
+				auto pathEnd = GetPathEnd(index + 1);
+				auto targetEnd = GetPathEnd(m_indexes.at(pInstruction->m_branches[0]));
+				auto first = std::min({ pInstruction->m_origOffset, pathEnd, targetEnd });
+				auto last = std::max({ pInstruction->m_origOffset, pathEnd, targetEnd });
+
+				auto start = static_cast<size_t>(std::lower_bound(m_instructions.begin(), m_instructions.end(), first,
+					[](const Instruction* pLeft, long offset) { return pLeft->m_origOffset < offset; }) - m_instructions.begin());
+				for (size_t i = 0; i < CACHED_DELEGATE_SEQUENCE_SIZE; i++)
+				{
+					auto position = start + i;
+					if (position >= m_instructions.size() || m_instructions[position]->m_origOffset > last ||
+						GetOriginalOperation(position) != CACHED_DELEGATE_SEQUENCE[i])
+						return false;
+				}
+
+				// only if the field tested is one the compiler caches a lambda in
+				if (index < 2 || m_instructions[index - 2]->m_operation != CEE_LDSFLD || !m_getFieldName)
+					return false;
+				std::wstring name;
+				return m_getFieldName(static_cast<mdToken>(m_instructions[index - 2]->m_operand), name) &&
+					IsCachedDelegateFieldName(name);
+			}
+
+		private:
+			const InstructionList& m_instructions;
+			const std::vector<PdbSequencePoint>& m_pdbPoints;
+			const FieldNameResolver& m_getFieldName;
+			std::unordered_map<Instruction*, size_t> m_indexes;
+		};
+	}
+
+	/// <summary>Find the points of a method from the sequence points in its PDB</summary>
+	/// <param name="method">The method as it was read, before it is instrumented.</param>
+	/// <param name="pdbPoints">The points decoded from the PDB, see <c>PortablePdb::GetSequencePoints</c>.</param>
+	/// <param name="getFieldName">Gets the name of the field a branch tests, a branch that tests the delegate of
+	/// a lambda is left out.</param>
+	/// <param name="points">Receives the points; there are none if the method has no visible sequence
+	/// points, as the host would not instrument it.</param>
+	void FindLocalPoints(Method& method, const std::vector<PdbSequencePoint>& pdbPoints, const FieldNameResolver& getFieldName,
+		LocalPoints& points)
+	{
+		points.hasEntryPoint = false;
+		points.seqPoints.clear();
+		points.brPoints.clear();
+
+		PointFinder finder(method, pdbPoints, getFieldName);
+		finder.FindSequencePoints(points);
+		if (points.seqPoints.empty())
+			return;
+
+		finder.FindBranchPoints(points);
+		if (points.seqPoints[0].Offset != 0)
+		{
+			SequencePoint entryPoint = { 0, 0 };
+			points.seqPoints.insert(points.seqPoints.begin(), entryPoint);
+			points.hasEntryPoint = true;
+		}
+	}
+
+	/// <summary>Hash the offsets of the points (and the paths of the branch points)</summary>
+	/// <remarks>The host hashes its points in the same way and only allocates ids to the points if they agree,
+	/// see <c>ProfilerCommunication.AllocateUniqueIds</c>.</remarks>
+	ULONG HashLocalPoints(const LocalPoints& points)
+	{
+		ULONG hash = POINTS_HASH_BASIS;
+		for (auto it = points.seqPoints.begin() + (points.hasEntryPoint ? 1 : 0); it != points.seqPoints.end(); ++it)
+			hash = HashValue(hash, static_cast<ULONG>(it->Offset));
+		hash = HashValue(hash, POINTS_HASH_SEPARATOR);
+		for (auto& brPoint : points.brPoints)
+			hash = HashValue(HashValue(hash, static_cast<ULONG>(brPoint.Offset)), static_cast<ULONG>(brPoint.Path));
+		return hash;
+	}
+
+	/// <summary>Give the points the ids the host allocated them</summary>
+	/// <param name="entryPointId">The id of the entry point, if the host added one.</param>
+	/// <param name="firstSequenceId">The id of the first sequence point in the PDB, the rest follow on.</param>
+	/// <param name="firstBranchId">The id of the first branch point, the rest follow on.</param>
+	void AssignUniqueIds(LocalPoints& points, ULONG entryPointId, ULONG firstSequenceId, ULONG firstBranchId)
+	{
+		auto it = points.seqPoints.begin();
+		if (points.hasEntryPoint && it != points.seqPoints.end())
+			(it++)->UniqueId = entryPointId;
+		for (auto id = firstSequenceId; it != points.seqPoints.end(); ++it)
+			it->UniqueId = id++;
+		auto id = firstBranchId;
+		for (auto& brPoint : points.brPoints)
+			brPoint.UniqueId = id++;
+	}
+
+	/// <summary>Is this the name of a field the compiler caches the delegate of a lambda in, e.g. &lt;&gt;9__0_0</summary>
+	bool IsCachedDelegateFieldName(const std::wstring& name)
+	{
+		size_t position = 0;
+		auto digits = [&]()
+		{
+			auto start = position;
+			while (position < name.size() && name[position] >= L'0' && name[position] <= L'9')
+				position++;
+			return position > start;
+		};
+
+		if (name.compare(0, 2, L"<>") != 0)
+			return false;
+		position = 2;
+		if (!digits() || name.compare(position, 2, L"__") != 0)
+			return false;
+		position += 2;
+		if (!digits() || position >= name.size() || name[position] != L'_')
+			return false;
+		position++;
+		return digits() && position == name.size();
+	}
+}
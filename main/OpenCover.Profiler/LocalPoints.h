@@ -0,0 +1,35 @@
+#pragma once
+
+#include "Method.h"
+#include "Messages.h"
+#include "PortablePdb.h"
+
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace Instrumentation
+{
+	/// <summary>Gets the name of a field, for the branches the host leaves out by the field they test</summary>
+	typedef std::function<bool(mdToken fieldToken, std::wstring& name)> FieldNameResolver;
+
+	/// <summary>The points of a method worked out from its portable PDB and IL rather than asked of the host</summary>
+	/// <remarks>The points are in the order the host creates them in; their ids are only known once the host
+	/// has allocated them (see <c>AssignUniqueIds</c>).</remarks>
+	struct LocalPoints
+	{
+		// the first sequence point is the entry point the host adds when there is no point at offset 0
+		bool hasEntryPoint;
+		std::vector<SequencePoint> seqPoints;
+		std::vector<BranchPoint> brPoints;
+
+		ULONG GetSequencePointCount() const { return static_cast<ULONG>(seqPoints.size()) - (hasEntryPoint ? 1 : 0); }
+		ULONG GetBranchPointCount() const { return static_cast<ULONG>(brPoints.size()); }
+	};
+
+	void FindLocalPoints(Method& method, const std::vector<PdbSequencePoint>& pdbPoints, const FieldNameResolver& getFieldName,
+		LocalPoints& points);
+	ULONG HashLocalPoints(const LocalPoints& points);
+	void AssignUniqueIds(LocalPoints& points, ULONG entryPointId, ULONG firstSequenceId, ULONG firstBranchId);
+	bool IsCachedDelegateFieldName(const std::wstring& name);
+}
@@ -3,6 +3,7 @@
 #define SEQ_BUFFER_SIZE 8000
 #define BRANCH_BUFFER_SIZE 2000
 #define VP_BUFFER_SIZE 16000
+#define VC_BUFFER_SIZE 8000
 #define MAX_MSG_SIZE 65536
 
 #pragma pack(push)
@@ -26,6 +27,12 @@ struct VisitPoint
     ULONG UniqueId;
 };
 
+struct VisitCount
+{
+    ULONG UniqueId;
+    ULONG Visits;
+};
+
 #pragma pack(pop)
 
 enum MSG_Type : int
@@ -38,6 +45,9 @@ enum MSG_Type : int
     MSG_AllocateMemoryBuffer = 5,
     MSG_CloseChannel = 6,
     MSG_TrackProcess = 7,
+    MSG_ReportCoverageLevel = 8,
+    MSG_AllocateUniqueIds = 9,
+    MSG_SendVisitCounts = 10,
 };
 
 enum MSG_IdType : ULONG
@@ -159,6 +169,55 @@ typedef struct _MSG_TrackProcess_Response
     BOOL bResponse;
 } MSG_TrackProcess_Response;
 
+typedef struct _MSG_ReportCoverageLevel_Request
+{
+    MSG_Type type;
+    int functionToken;
+    WCHAR szModulePath[512];
+    WCHAR szAssemblyName[512];
+    ULONG ulLevel;
+    ULONG ulProbes;
+    ULONG ulOriginalSize;
+    ULONG ulInstrumentedSize;
+} MSG_ReportCoverageLevel_Request;
+
+typedef struct _MSG_ReportCoverageLevel_Response
+{
+    BOOL bResponse;
+} MSG_ReportCoverageLevel_Response;
+
+typedef struct _MSG_AllocateUniqueIds_Request
+{
+    MSG_Type type;
+    int functionToken;
+    WCHAR szProcessName[512];
+    WCHAR szModulePath[512];
+    WCHAR szAssemblyName[512];
+    ULONG ulSequencePoints;
+    ULONG ulBranchPoints;
+    ULONG ulPointsHash;
+} MSG_AllocateUniqueIds_Request;
+
+typedef struct _MSG_AllocateUniqueIds_Response
+{
+    BOOL bResponse;
+    ULONG ulEntryPointId;
+    ULONG ulFirstSequenceId;
+    ULONG ulFirstBranchId;
+} MSG_AllocateUniqueIds_Response;
+
+typedef struct _MSG_SendVisitCounts_Request
+{
+    MSG_Type type;
+    int count;
+    VisitCount points[VC_BUFFER_SIZE];
+} MSG_SendVisitCounts_Request;
+
+typedef struct _MSG_SendVisitCounts_Response
+{
+    BOOL bResponse;
+} MSG_SendVisitCounts_Response;
+
 #pragma pack(pop)
 
 typedef union _MSG_Union
@@ -178,5 +237,11 @@ typedef union _MSG_Union
     MSG_CloseChannel_Response closeChannelResponse;
     MSG_TrackProcess_Request trackProcessRequest;
     MSG_TrackProcess_Response trackProcessResponse;
+    MSG_ReportCoverageLevel_Request reportCoverageLevelRequest;
+    MSG_ReportCoverageLevel_Response reportCoverageLevelResponse;
+    MSG_AllocateUniqueIds_Request allocateUniqueIdsRequest;
+    MSG_AllocateUniqueIds_Response allocateUniqueIdsResponse;
+    MSG_SendVisitCounts_Request sendVisitCountsRequest;
+    MSG_SendVisitCounts_Response sendVisitCountsResponse;
 } MSG_Union;
 
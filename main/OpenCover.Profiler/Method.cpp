@@ -2,9 +2,50 @@
 #include "Method.h"
 #include "ReleaseTrace.h"
 
+#include <algorithm>
+#include <climits>
+#include <unordered_set>
+
 namespace Instrumentation
 {
+	namespace
+	{
+		/// <summary>Does the operation always fall through to the next instruction</summary>
+		/// <remarks>Deliberately conservative; anything that may branch, return, call or throw
+		/// (including by triggering a type load) is excluded</remarks>
+		bool AlwaysFallsThrough(CanonicalName operation)
+		{
+			switch (operation)
+			{
+			case CEE_NOP:
+			case CEE_LDARG_0: case CEE_LDARG_1: case CEE_LDARG_2: case CEE_LDARG_3:
+			case CEE_LDLOC_0: case CEE_LDLOC_1: case CEE_LDLOC_2: case CEE_LDLOC_3:
+			case CEE_STLOC_0: case CEE_STLOC_1: case CEE_STLOC_2: case CEE_STLOC_3:
+			case CEE_LDARG_S: case CEE_LDARGA_S: case CEE_STARG_S:
+			case CEE_LDLOC_S: case CEE_LDLOCA_S: case CEE_STLOC_S:
+			case CEE_LDARG: case CEE_LDARGA: case CEE_STARG:
+			case CEE_LDLOC: case CEE_LDLOCA: case CEE_STLOC:
+			case CEE_LDNULL:
+			case CEE_LDC_I4_M1: case CEE_LDC_I4_0: case CEE_LDC_I4_1: case CEE_LDC_I4_2: case CEE_LDC_I4_3:
+			case CEE_LDC_I4_4: case CEE_LDC_I4_5: case CEE_LDC_I4_6: case CEE_LDC_I4_7: case CEE_LDC_I4_8:
+			case CEE_LDC_I4_S: case CEE_LDC_I4: case CEE_LDC_I8: case CEE_LDC_R4: case CEE_LDC_R8:
+			case CEE_DUP: case CEE_POP:
+			case CEE_ADD: case CEE_SUB: case CEE_MUL:
+			case CEE_AND: case CEE_OR: case CEE_XOR: case CEE_SHL: case CEE_SHR: case CEE_SHR_UN:
+			case CEE_NEG: case CEE_NOT:
+			case CEE_CONV_I1: case CEE_CONV_I2: case CEE_CONV_I4: case CEE_CONV_I8:
+			case CEE_CONV_U1: case CEE_CONV_U2: case CEE_CONV_U4: case CEE_CONV_U8:
+			case CEE_CONV_I: case CEE_CONV_U: case CEE_CONV_R4: case CEE_CONV_R8: case CEE_CONV_R_UN:
+			case CEE_CEQ: case CEE_CGT: case CEE_CGT_UN: case CEE_CLT: case CEE_CLT_UN:
+				return true;
+			default:
+				return false;
+			}
+		}
+	}
+
 	Method::Method(IMAGE_COR_ILMETHOD* pMethod)
+		: m_arena(ArenaPool::Acquire()), m_optimizeEncoding(false), m_staleOperandsFrom(LONG_MAX)
 	{
 		memset(&m_header, 0, 3 * sizeof(DWORD));
 		m_header.Size = 3;
@@ -14,17 +55,11 @@ namespace Instrumentation
 		ReadMethod(pMethod);
 	}
 
+	/// <remarks>All instructions (including any that were inserted) and exception handlers are
+	/// released in one step when the arena is handed back to the pool</remarks>
 	Method::~Method()
 	{
-		for (auto it = m_instructions.begin(); it != m_instructions.end(); ++it)
-		{
-			delete *it;
-		}
-
-		for (auto it = m_exceptions.begin(); it != m_exceptions.end(); ++it)
-		{
-			delete *it;
-		}
+		ArenaPool::Release(m_arena);
 	}
 
 	/// <summary>Read the full method from the supplied buffer.</summary>
@@ -52,28 +87,40 @@ namespace Instrumentation
 
 	/// <summary>Write the method to a supplied buffer</summary>
 	/// <remarks><para>The buffer must be of the size supplied by <c>GetMethodSize</c>.</para>
-	/// <para>Currently only write methods with 'Fat' headers and 'Fat' Sections - simpler.</para>
+	/// <para>Methods are written with 'Fat' headers and 'Fat' Sections unless <c>OptimizeEncoding</c>
+	/// has been used, in which case 'Tiny' headers and 'Small' sections are used where possible.</para>
 	/// <para>The buffer will normally be allocated by a call to <c>IMethodMalloc::Alloc</c></para></remarks>
 	void Method::WriteMethod(IMAGE_COR_ILMETHOD* pMethod)
 	{
-		BYTE* pCode;
-		auto fatImage = static_cast<COR_ILMETHOD_FAT*>(&pMethod->Fat);
+		UpdateBranchOperands();
 
-		m_header.Flags &= ~CorILMethod_MoreSects;
-		if (m_exceptions.size() > 0)
+		BYTE* pCode;
+		if (CanUseTinyHeader())
 		{
-			m_header.Flags |= CorILMethod_MoreSects;
+			auto pTiny = reinterpret_cast<BYTE*>(pMethod);
+			*pTiny = static_cast<BYTE>(CorILMethod_TinyFormat | (m_header.CodeSize << 2));
+			pCode = pTiny + 1;
 		}
+		else
+		{
+			auto fatImage = static_cast<COR_ILMETHOD_FAT*>(&pMethod->Fat);
 
-		memcpy(fatImage, &m_header, m_header.Size * sizeof(DWORD));
+			m_header.Flags &= ~CorILMethod_MoreSects;
+			if (m_exceptions.size() > 0)
+			{
+				m_header.Flags |= CorILMethod_MoreSects;
+			}
 
-		pCode = fatImage->GetCode();
+			memcpy(fatImage, &m_header, m_header.Size * sizeof(DWORD));
+
+			pCode = fatImage->GetCode();
+		}
 
 		SetBuffer(pCode);
 
 		for (auto it = m_instructions.begin(); it != m_instructions.end(); ++it)
 		{
-			auto& details = Operations::m_mapNameOperationDetails[(*it)->m_operation];
+			auto& details = Operations::GetOperationDetails((*it)->m_operation);
 			if (details.op1 == REFPRE)
 			{
 				Write<BYTE>(details.op2);
@@ -110,9 +157,10 @@ namespace Instrumentation
 
 			if ((*it)->m_operation == CEE_SWITCH)
 			{
-				for (auto offsetIter = (*it)->m_branchOffsets.begin(); offsetIter != (*it)->m_branchOffsets.end(); ++offsetIter)
+				auto baseOffset = (*it)->m_offset + details.length + details.operandSize + (4 * static_cast<long>((*it)->m_operand));
+				for (auto bit = (*it)->m_branches.begin(); bit != (*it)->m_branches.end(); ++bit)
 				{
-					Write<long>(*offsetIter);
+					Write<long>((*bit)->m_offset - baseOffset);
 				}
 			}
 		}
@@ -120,37 +168,87 @@ namespace Instrumentation
 		WriteSections();
 	}
 
-	/// <summary>Write out the FAT sections</summary>
+	/// <summary>Write out the FAT sections (or SMALL sections if they are allowed)</summary>
 	void Method::WriteSections()
 	{
 		if (m_exceptions.size() > 0)
 		{
 			Align<DWORD>();
-			IMAGE_COR_ILMETHOD_SECT_FAT section{};
-			section.Kind = CorILMethod_Sect_FatFormat;
-			section.Kind |= CorILMethod_Sect_EHTable;
-			section.DataSize = (m_exceptions.size() * 24) + 4;
-			Write<IMAGE_COR_ILMETHOD_SECT_FAT>(section);
-			for (auto it = m_exceptions.begin(); it != m_exceptions.end(); ++it)
-			{
-				Write<ULONG>((*it)->m_handlerType);
-				Write<long>((*it)->m_tryStart->m_offset);
-				Write<long>((*it)->m_tryEnd->m_offset - (*it)->m_tryStart->m_offset);
-				Write<long>((*it)->m_handlerStart->m_offset);
-				Write<long>((*it)->m_handlerEnd->m_offset - (*it)->m_handlerStart->m_offset);
-
-				if (COR_ILEXCEPTION_CLAUSE_FILTER == (*it)->m_handlerType)
-				{
-					Write<long>((*it)->m_filterStart->m_offset);
-				}
-				else
-				{
-					Write<ULONG>((*it)->m_token);
-				}
+			if (CanUseSmallSections())
+			{
+				IMAGE_COR_ILMETHOD_SECT_SMALL section{};
+				section.Kind = CorILMethod_Sect_EHTable;
+				section.DataSize = static_cast<BYTE>((m_exceptions.size() * 12) + 4);
+				Write<IMAGE_COR_ILMETHOD_SECT_SMALL>(section);
+				Write<USHORT>(0); // padding
+				WriteExceptionHandlers<USHORT, USHORT, BYTE>();
+			}
+			else
+			{
+				IMAGE_COR_ILMETHOD_SECT_FAT section{};
+				section.Kind = CorILMethod_Sect_FatFormat;
+				section.Kind |= CorILMethod_Sect_EHTable;
+				section.DataSize = (m_exceptions.size() * 24) + 4;
+				Write<IMAGE_COR_ILMETHOD_SECT_FAT>(section);
+				WriteExceptionHandlers<ULONG, long, long>();
 			}
 		}
 	}
 
+	template<class flag, class start, class end>
+	void Method::WriteExceptionHandlers()
+	{
+		for (auto it = m_exceptions.begin(); it != m_exceptions.end(); ++it)
+		{
+			Write<flag>(static_cast<flag>((*it)->m_handlerType));
+			Write<start>(static_cast<start>((*it)->m_tryStart->m_offset));
+			Write<end>(static_cast<end>((*it)->m_tryEnd->m_offset - (*it)->m_tryStart->m_offset));
+			Write<start>(static_cast<start>((*it)->m_handlerStart->m_offset));
+			Write<end>(static_cast<end>((*it)->m_handlerEnd->m_offset - (*it)->m_handlerStart->m_offset));
+
+			if (COR_ILEXCEPTION_CLAUSE_FILTER == (*it)->m_handlerType)
+			{
+				Write<long>((*it)->m_filterStart->m_offset);
+			}
+			else
+			{
+				Write<ULONG>((*it)->m_token);
+			}
+		}
+	}
+
+	/// <summary>Can the method be written with a 'Tiny' header</summary>
+	/// <remarks>Only after <c>OptimizeEncoding</c> and <c>GetMethodSize</c> (which 
+	/// calculates the code size) have been called</remarks>
+	bool Method::CanUseTinyHeader()
+	{
+		return m_optimizeEncoding
+			&& m_exceptions.empty()
+			&& m_header.CodeSize < 64
+			&& m_header.MaxStack <= 8
+			&& m_header.LocalVarSigTok == 0
+			&& (m_header.Flags & CorILMethod_InitLocals) == 0;
+	}
+
+	/// <summary>Can the exception handlers be written as a 'Small' section</summary>
+	/// <remarks>Only after <c>OptimizeEncoding</c> has been called</remarks>
+	bool Method::CanUseSmallSections()
+	{
+		if (!m_optimizeEncoding || ((m_exceptions.size() * 12) + 4) > 0xFF)
+			return false;
+
+		for (auto it = m_exceptions.begin(); it != m_exceptions.end(); ++it)
+		{
+			if ((*it)->m_handlerType > 0xFFFF
+				|| (*it)->m_tryStart->m_offset > 0xFFFF
+				|| (*it)->m_tryEnd->m_offset - (*it)->m_tryStart->m_offset > 0xFF
+				|| (*it)->m_handlerStart->m_offset > 0xFFFF
+				|| (*it)->m_handlerEnd->m_offset - (*it)->m_handlerStart->m_offset > 0xFF)
+				return false;
+		}
+		return true;
+	}
+
 	/// <summary>Read in a method body and any section handlers.</summary>
 	/// <remarks>Also converts all short branches to long branches and calls <c>RecalculateOffsets</c></remarks>
 	void Method::ReadBody()
@@ -158,9 +256,12 @@ namespace Instrumentation
 		_ASSERTE(m_header.CodeSize != 0);
 		_ASSERTE(GetPosition() == 0);
 
+		// the relative targets of the branches, in instruction order, until they are resolved
+		std::vector<long> branchOffsets;
+
 		while (GetPosition() < m_header.CodeSize)
 		{
-			Instruction* pInstruction = new Instruction();
+			Instruction* pInstruction = m_arena->Create<Instruction>();
 			pInstruction->m_offset = GetPosition();
 			pInstruction->m_origOffset = pInstruction->m_offset;
 
@@ -172,7 +273,8 @@ namespace Instrumentation
 				op2 = Read<BYTE>();
 			}
 
-			OperationDetails &details = Operations::m_mapOpsOperationDetails[MAKEWORD(op1, op2)];
+			const OperationDetails &details = Operations::GetOperationDetails(op1, op2);
+			_ASSERTE(details.canonicalName != CEE_ILLEGAL);
 			pInstruction->m_operation = details.canonicalName;
 			switch (details.operandSize)
 			{
@@ -201,18 +303,18 @@ namespace Instrumentation
 			{
 				if (details.operandSize == 1)
 				{
-					pInstruction->m_branchOffsets.push_back(static_cast<char>(static_cast<BYTE>(pInstruction->m_operand)));
+					branchOffsets.push_back(static_cast<char>(static_cast<BYTE>(pInstruction->m_operand)));
 				}
 				else
 				{
-					pInstruction->m_branchOffsets.push_back(static_cast<ULONG>(pInstruction->m_operand));
+					branchOffsets.push_back(static_cast<ULONG>(pInstruction->m_operand));
 				}
 			}
 
 			if (pInstruction->m_operation == CEE_SWITCH)
 			{
 				auto numbranches = static_cast<DWORD>(pInstruction->m_operand);
-				while (numbranches-- != 0) pInstruction->m_branchOffsets.push_back(Read<long>());
+				while (numbranches-- != 0) branchOffsets.push_back(Read<long>());
 			}
 
 			m_instructions.push_back(pInstruction);
@@ -222,11 +324,42 @@ namespace Instrumentation
 
 		SetBuffer(nullptr);
 
-		ResolveBranches();
+		ResolveBranches(branchOffsets);
 
 		ConvertShortBranches();
 
 		RecalculateOffsets();
+
+		IndexOriginalInstructions();
+
+		IndexTryHandlerStarts();
+	}
+
+	/// <summary>Record the instructions read from the method body, ordered by their original offset</summary>
+	void Method::IndexOriginalInstructions()
+	{
+		m_originalInstructions.clear();
+		m_originalInstructions.reserve(m_instructions.size());
+		for (auto it = m_instructions.begin(); it != m_instructions.end(); ++it)
+		{
+			if ((*it)->m_origOffset != -1)
+				m_originalInstructions.push_back(*it);
+		}
+	}
+
+	/// <summary>Record the handler start of every <c>COR_ILEXCEPTION_CLAUSE_NONE</c> clause</summary>
+	/// <remarks>Used by <c>DoesTryHandlerPointToInstruction</c> so that the exception handlers
+	/// do not have to be walked for every insertion</remarks>
+	void Method::IndexTryHandlerStarts()
+	{
+		m_tryHandlerStarts.clear();
+		for (auto it = m_exceptions.begin(); it != m_exceptions.end(); ++it)
+		{
+			if ((*it)->m_handlerType == COR_ILEXCEPTION_CLAUSE_NONE && (*it)->m_handlerStart != nullptr)
+				m_tryHandlerStarts.push_back((*it)->m_handlerStart);
+		}
+		std::sort(m_tryHandlerStarts.begin(), m_tryHandlerStarts.end());
+		m_tryHandlerStarts.erase(std::unique(m_tryHandlerStarts.begin(), m_tryHandlerStarts.end()), m_tryHandlerStarts.end());
 	}
 
 	ExceptionHandler* Method::ReadExceptionHandler(
@@ -235,7 +368,7 @@ namespace Instrumentation
 		long handlerStart, long handlerEnd,
 		long filterStart, ULONG token) {
 
-		auto pSection = new ExceptionHandler();
+		auto pSection = m_arena->Create<ExceptionHandler>();
 		pSection->m_handlerType = type;
 		pSection->m_tryStart = GetInstructionAtOffset(tryStart);
 		pSection->m_tryEnd = GetInstructionAtOffset(tryStart + tryEnd);
@@ -313,12 +446,10 @@ namespace Instrumentation
 	/// beforehand</remarks>
 	Instruction * Method::GetInstructionAtOffset(long offset)
 	{
-		for (auto it = m_instructions.begin(); it != m_instructions.end(); ++it)
+		auto it = FindInstructionAtOffset(offset);
+		if (it != m_instructions.end())
 		{
-			if ((*it)->m_offset == offset)
-			{
-				return (*it);
-			}
+			return (*it);
 		}
 		_ASSERTE(FALSE);
 		return nullptr;
@@ -345,22 +476,20 @@ namespace Instrumentation
 	/// </example>
 	Instruction * Method::GetInstructionAtOffset(long offset, bool isFinally, bool isFault, bool isFilter, bool isTyped)
 	{
-		for (auto it = m_instructions.begin(); it != m_instructions.end(); ++it)
+		auto it = FindInstructionAtOffset(offset);
+		if (it != m_instructions.end())
 		{
-			if ((*it)->m_offset == offset)
-			{
-				return (*it);
-			}
+			return (*it);
 		}
 
 		if (isFinally || isFault || isFilter || isTyped)
 		{
 			auto pLast = m_instructions.back();
-			auto& details = Operations::m_mapNameOperationDetails[pLast->m_operation];
+			auto& details = Operations::GetOperationDetails(pLast->m_operation);
 			if (offset == pLast->m_offset + details.length + details.operandSize)
 			{
 				// add a code label to hang the clause handler end off
-				auto pInstruction = new Instruction(CEE_CODE_LABEL);
+				auto pInstruction = CreateInstruction(CEE_CODE_LABEL);
 				pInstruction->m_offset = offset;
 				m_instructions.push_back(pInstruction);
 				return pInstruction;
@@ -370,24 +499,81 @@ namespace Instrumentation
 		return nullptr;
 	}
 
+	/// <summary>Locate the (first) instruction at the specified offset.</summary>
+	/// <param name="offset">The offset to look for.</param>
+	/// <returns>The position of the instruction or <c>m_instructions.end()</c> if there is none.</returns>
+	/// <remarks>A binary search; the instructions are always in offset order whilst the method is 
+	/// being read and after <c>RecalculateOffsets</c></remarks>
+	InstructionList::iterator Method::FindInstructionAtOffset(long offset)
+	{
+		auto it = std::lower_bound(m_instructions.begin(), m_instructions.end(), offset, 
+			[](const Instruction* pInstruction, long value) { return pInstruction->m_offset < value; });
+		if (it != m_instructions.end() && (*it)->m_offset == offset)
+		{
+			return it;
+		}
+		return m_instructions.end();
+	}
+
+	/// <summary>Locate an instruction in the instruction list.</summary>
+	/// <param name="pInstruction">The instruction to look for.</param>
+	/// <returns>The position of the instruction or <c>m_instructions.end()</c> if it is not in the list.</returns>
+	/// <remarks>Uses the offset of the instruction to go straight to it; falls back to a scan if 
+	/// the offsets are not current</remarks>
+	InstructionList::iterator Method::FindInstruction(Instruction* pInstruction)
+	{
+		for (auto it = FindInstructionAtOffset(pInstruction->m_offset); 
+			it != m_instructions.end() && (*it)->m_offset == pInstruction->m_offset; ++it)
+		{
+			if (*it == pInstruction)
+			{
+				return it;
+			}
+		}
+		return std::find(m_instructions.begin(), m_instructions.end(), pInstruction);
+	}
+
+	/// <summary>Locate the original instruction at the specified original offset.</summary>
+	/// <param name="origOffset">The original (as in before any instrumentation) offset to look for.</param>
+	/// <returns>The position in <c>m_originalInstructions</c> or <c>m_originalInstructions.end()</c> 
+	/// if there is no instruction at that offset.</returns>
+	InstructionList::iterator Method::FindOriginalInstruction(long origOffset)
+	{
+		auto it = std::lower_bound(m_originalInstructions.begin(), m_originalInstructions.end(), origOffset,
+			[](const Instruction* pInstruction, long value) { return pInstruction->m_origOffset < value; });
+		if (it != m_originalInstructions.end() && (*it)->m_origOffset == origOffset)
+		{
+			return it;
+		}
+		return m_originalInstructions.end();
+	}
+
 	/// <summary>Uses the current offsets and locates the instructions that reside that offset to 
 	/// build a new list</summary>
+	/// <param name="branchOffsets">The relative targets of every branch (in instruction order) as read.</param>
 	/// <remarks>This allows us to insert (or modify) instructions without losing the intended 'goto' 
 	/// point. <c>RecalculateOffsets</c> is used to rebuild the new required operand(s) based on the
 	/// offsets of the instructions being referenced</remarks>
-	void Method::ResolveBranches()
+	void Method::ResolveBranches(const std::vector<long> &branchOffsets)
 	{
+		auto offsetIter = branchOffsets.begin();
 		for (auto it = m_instructions.begin(); it != m_instructions.end(); ++it)
 		{
 			(*it)->m_branches.clear();
-			auto& details = Operations::m_mapNameOperationDetails[(*it)->m_operation];
+			if (!(*it)->m_isBranch)
+				continue;
+
+			auto& details = Operations::GetOperationDetails((*it)->m_operation);
 			auto baseOffset = (*it)->m_offset + details.length + details.operandSize;
+			auto count = 1L;
 			if ((*it)->m_operation == CEE_SWITCH)
 			{
-				baseOffset += (4 * static_cast<long>((*it)->m_operand));
+				count = static_cast<long>((*it)->m_operand);
+				baseOffset += (4 * count);
 			}
 
-			for (auto offsetIter = (*it)->m_branchOffsets.begin(); offsetIter != (*it)->m_branchOffsets.end(); ++offsetIter)
+			(*it)->m_branches.reserve(count);
+			for (; count != 0 && offsetIter != branchOffsets.end(); --count, ++offsetIter)
 			{
 				auto offset = baseOffset + (*offsetIter);
 				auto instruction = GetInstructionAtOffset(offset);
@@ -396,7 +582,7 @@ namespace Instrumentation
 					(*it)->m_branches.push_back(instruction);
 				}
 			}
-			_ASSERTE((*it)->m_branchOffsets.size() == (*it)->m_branches.size());
+			_ASSERTE(count == 0);
 		}
 	}
 
@@ -416,14 +602,14 @@ namespace Instrumentation
 	{
 		for (auto it = m_instructions.begin(); it != m_instructions.end(); ++it)
 		{
-			auto& details = Operations::m_mapNameOperationDetails[(*it)->m_operation];
+			auto& details = Operations::GetOperationDetails((*it)->m_operation);
 			if (details.operandSize == Null)
 			{
 				RELTRACE(_T("(IL_%04X) IL_%04X %s"), (*it)->m_origOffset, (*it)->m_offset, details.stringName);
 			}
 			else if (details.operandParam == ShortInlineBrTarget || details.operandParam == InlineBrTarget)
 			{
-				auto offset = (*it)->m_offset + (*it)->m_branchOffsets[0] + details.length + details.operandSize;
+				auto offset = (*it)->m_branches[0]->m_offset;
 				RELTRACE(_T("(IL_%04X) IL_%04X %s IL_%04X"),
 					(*it)->m_origOffset, (*it)->m_offset, details.stringName, offset);
 			}
@@ -457,12 +643,11 @@ namespace Instrumentation
 					(*it)->m_origOffset, (*it)->m_offset, details.stringName, (*it)->m_operand);
 			}
 			
-			for (auto offsetIter = (*it)->m_branchOffsets.begin(); offsetIter != (*it)->m_branchOffsets.end(); ++offsetIter)
+			if ((*it)->m_operation == CEE_SWITCH)
 			{
-				if ((*it)->m_operation == CEE_SWITCH)
+				for (auto bit = (*it)->m_branches.begin(); bit != (*it)->m_branches.end(); ++bit)
 				{
-					auto offset = (*it)->m_offset + (4 * static_cast<long>((*it)->m_operand)) + (*offsetIter) + details.length + details.operandSize;
-					RELTRACE(_T("    IL_%04X"), offset);
+					RELTRACE(_T("    IL_%04X"), (*bit)->m_offset);
 				}
 			}
 		}
@@ -491,13 +676,13 @@ namespace Instrumentation
 	/// <summary>Converts all short branches to long branches.</summary>
 	/// <remarks><para>After instrumentation most short branches will not have the capacity for
 	/// the new required offset. Save time/effort and make all branches long ones.</para> 
-	/// <para>Could add the capability to optimise long to short at a later date but consider 
-	/// the benefits dubious after all the new instrumentation has been added.</para></remarks>
+	/// <para>Once all the instrumentation has been added <c>OptimizeEncoding</c> converts back
+	/// to short branches wherever they fit.</para></remarks>
 	void Method::ConvertShortBranches()
 	{
 		for (auto it = m_instructions.begin(); it != m_instructions.end(); ++it)
 		{
-			OperationDetails &details = Operations::m_mapNameOperationDetails[(*it)->m_operation];
+			const OperationDetails &details = Operations::GetOperationDetails((*it)->m_operation);
 			if ((*it)->m_isBranch && details.operandSize == 1)
 			{
 				CanonicalName newOperation = (*it)->m_operation;
@@ -551,49 +736,185 @@ namespace Instrumentation
 				(*it)->m_operation = newOperation;
 				(*it)->m_operand = UNSAFE_BRANCH_OPERAND;
 			}
+		}
+	}
 
-			(*it)->m_branchOffsets.clear();
+	/// <summary>Encode the method as compactly as possible once all the instrumentation has been added</summary>
+	/// <remarks><para>Branches are relaxed back to their short forms wherever the target is in range,
+	/// repeating until no more can be converted (converting a branch never moves any target further 
+	/// away), and <c>GetMethodSize</c>/<c>WriteMethod</c> will then use a 'Tiny' header and 'Small' 
+	/// exception sections if the method qualifies.</para>
+	/// <para>No further instructions should be inserted afterwards as the short branches may no 
+	/// longer reach their targets.</para></remarks>
+	void Method::OptimizeEncoding()
+	{
+		size_t first;
+		while (ConvertLongBranches(first))
+		{
+			UpdateOffsets(first, m_instructions.size());
 		}
+		m_optimizeEncoding = true;
 	}
 
-	/// <summary>Recalculate the offsets of each instruction taking into account the instruction
-	/// size, the operand size and any extra datablocks CEE_SWITCH</summary>
-	void Method::RecalculateOffsets()
+	/// <summary>Converts the long branches that can reach their target to short branches.</summary>
+	/// <param name="first">The index of the first branch converted.</param>
+	/// <returns>true if any branches were converted.</returns>
+	/// <remarks>Uses the current offsets; the operands are updated by <c>UpdateBranchOperands</c></remarks>
+	bool Method::ConvertLongBranches(size_t& first)
 	{
-		int position = 0;
+		auto converted = false;
 		for (auto it = m_instructions.begin(); it != m_instructions.end(); ++it)
 		{
-			auto& details = Operations::m_mapNameOperationDetails[(*it)->m_operation];
-			(*it)->m_offset = position;
-			position += details.length;
-			position += details.operandSize;
-			if ((*it)->m_operation == CEE_SWITCH)
+			const OperationDetails &details = Operations::GetOperationDetails((*it)->m_operation);
+			if (!(*it)->m_isBranch || (*it)->m_operation == CEE_SWITCH || details.operandSize != Dword)
+				continue;
+
+			// the short form is 3 bytes smaller; a target after the branch moves with it
+			auto pTarget = (*it)->m_branches[0];
+			long distance = pTarget->m_offset - ((*it)->m_offset + details.length + 1);
+			if (pTarget->m_offset > (*it)->m_offset)
+				distance -= 3;
+			if (distance < -128 || distance > 127)
+				continue;
+
+			CanonicalName newOperation = (*it)->m_operation;
+			switch ((*it)->m_operation)
 			{
-				position += 4 * static_cast<long>((*it)->m_operand);
+			case CEE_BR:
+				newOperation = CEE_BR_S;
+				break;
+			case CEE_BRFALSE:
+				newOperation = CEE_BRFALSE_S;
+				break;
+			case CEE_BRTRUE:
+				newOperation = CEE_BRTRUE_S;
+				break;
+			case CEE_BEQ:
+				newOperation = CEE_BEQ_S;
+				break;
+			case CEE_BGE:
+				newOperation = CEE_BGE_S;
+				break;
+			case CEE_BGT:
+				newOperation = CEE_BGT_S;
+				break;
+			case CEE_BLE:
+				newOperation = CEE_BLE_S;
+				break;
+			case CEE_BLT:
+				newOperation = CEE_BLT_S;
+				break;
+			case CEE_BNE_UN:
+				newOperation = CEE_BNE_UN_S;
+				break;
+			case CEE_BGE_UN:
+				newOperation = CEE_BGE_UN_S;
+				break;
+			case CEE_BGT_UN:
+				newOperation = CEE_BGT_UN_S;
+				break;
+			case CEE_BLE_UN:
+				newOperation = CEE_BLE_UN_S;
+				break;
+			case CEE_BLT_UN:
+				newOperation = CEE_BLT_UN_S;
+				break;
+			case CEE_LEAVE:
+				newOperation = CEE_LEAVE_S;
+				break;
+			default:
+				break;
+			}
+
+			if (newOperation != (*it)->m_operation)
+			{
+				(*it)->m_operation = newOperation;
+				if (!converted)
+					first = it - m_instructions.begin();
+				converted = true;
 			}
 		}
+		return converted;
+	}
 
-		for (auto it = m_instructions.begin(); it != m_instructions.end(); ++it)
+	/// <summary>Recalculate the offsets of each instruction taking into account the instruction
+	/// size, the operand size and any extra datablocks CEE_SWITCH, and the operands of the branches</summary>
+	void Method::RecalculateOffsets()
+	{
+		UpdateOffsets(0, m_instructions.size());
+		UpdateBranchOperands();
+	}
+
+	/// <summary>Recalculate the offsets after the instructions in the range [first, last) have been
+	/// inserted or changed</summary>
+	/// <remarks><para>The instructions before the range keep their offsets and those after it are
+	/// moved by the same amount, so only the range itself needs to be sized; use
+	/// <c>m_instructions.size()</c> for <paramref name="last"/> when the changes are spread out.</para>
+	/// <para>The branch operands are left until the method is sized or written, only those of the 
+	/// branches that (or whose targets) moved are then recalculated.</para></remarks>
+	void Method::UpdateOffsets(size_t first, size_t last)
+	{
+		auto size = [](const Instruction* pInstruction)
 		{
-			auto& details = Operations::m_mapNameOperationDetails[(*it)->m_operation];
-			if ((*it)->m_isBranch)
+			auto& details = Operations::GetOperationDetails(pInstruction->m_operation);
+			long length = details.length + details.operandSize;
+			if (pInstruction->m_operation == CEE_SWITCH)
 			{
-				(*it)->m_branchOffsets.clear();
-				if ((*it)->m_operation == CEE_SWITCH)
-				{
-					auto offset = ((*it)->m_offset + details.length + details.operandSize + (4 * static_cast<long>((*it)->m_operand)));
-					for (auto bit = (*it)->m_branches.begin(); bit != (*it)->m_branches.end(); ++bit)
-					{
-						(*it)->m_branchOffsets.push_back((*bit)->m_offset - offset);
-					}
-				}
-				else
-				{
-					(*it)->m_operand = (*it)->m_branches[0]->m_offset - ((*it)->m_offset + details.length + details.operandSize);
-					(*it)->m_branchOffsets.push_back(static_cast<long>((*it)->m_operand));
-				}
+				length += 4 * static_cast<long>(pInstruction->m_operand);
 			}
+			return length;
+		};
+
+		long position = 0;
+		if (first > 0)
+		{
+			auto pPrevious = m_instructions[first - 1];
+			position = pPrevious->m_offset + size(pPrevious);
+		}
+		m_staleOperandsFrom = std::min(m_staleOperandsFrom, position);
+
+		last = std::min(last, m_instructions.size());
+		for (auto index = first; index < last; ++index)
+		{
+			m_instructions[index]->m_offset = position;
+			position += size(m_instructions[index]);
+		}
+
+		if (last == m_instructions.size())
+			return;
+
+		auto delta = position - m_instructions[last]->m_offset;
+		if (delta == 0)
+			return;
+		for (auto it = m_instructions.begin() + last; it != m_instructions.end(); ++it)
+		{
+			(*it)->m_offset += delta;
+		}
+	}
+
+	/// <summary>Recalculate the operands of the branches that (or whose targets) have moved since they 
+	/// were last calculated</summary>
+	/// <remarks>An offset never moves below the point of the change that moved it so a branch 
+	/// where both ends are before the earliest change is still current.</remarks>
+	void Method::UpdateBranchOperands()
+	{
+		if (m_staleOperandsFrom == LONG_MAX)
+			return;
+
+		// the switch targets are calculated as they are written
+		for (auto it = m_instructions.begin(); it != m_instructions.end(); ++it)
+		{
+			if (!(*it)->m_isBranch || (*it)->m_operation == CEE_SWITCH)
+				continue;
+			if ((*it)->m_offset < m_staleOperandsFrom && (*it)->m_branches[0]->m_offset < m_staleOperandsFrom)
+				continue;
+
+			auto& details = Operations::GetOperationDetails((*it)->m_operation);
+			(*it)->m_operand = (*it)->m_branches[0]->m_offset - ((*it)->m_offset + details.length + details.operandSize);
+			_ASSERTE(details.operandSize != Byte 
+				|| (static_cast<long>((*it)->m_operand) >= -128 && static_cast<long>((*it)->m_operand) <= 127));
 		}
+		m_staleOperandsFrom = LONG_MAX;
 	}
 
 	/// <summary>Calculates the size of the method which include the header size, 
@@ -604,10 +925,17 @@ namespace Instrumentation
 	/// beforehand if any instrumentation has been done</remarks>
 	long Method::GetMethodSize()
 	{
+		UpdateBranchOperands();
+
 		auto lastInstruction = m_instructions.back();
-		auto& details = Operations::m_mapNameOperationDetails[lastInstruction->m_operation];
+		auto& details = Operations::GetOperationDetails(lastInstruction->m_operation);
 
 		m_header.CodeSize = lastInstruction->m_offset + details.length + details.operandSize;
+		if (CanUseTinyHeader())
+		{
+			return sizeof(IMAGE_COR_ILMETHOD_TINY) + m_header.CodeSize;
+		}
+
 		long size = sizeof(IMAGE_COR_ILMETHOD_FAT) + m_header.CodeSize;
 
 		m_header.Flags &= ~CorILMethod_MoreSects;
@@ -616,7 +944,14 @@ namespace Instrumentation
 			m_header.Flags |= CorILMethod_MoreSects;
 			long align = sizeof(DWORD) - 1;
 			size = ((size + align) & ~align);
-			size += ((static_cast<long>(m_exceptions.size()) * 6) + 1) * sizeof(long);
+			if (CanUseSmallSections())
+			{
+				size += (static_cast<long>(m_exceptions.size()) * 12) + sizeof(long);
+			}
+			else
+			{
+				size += ((static_cast<long>(m_exceptions.size()) * 6) + 1) * sizeof(long);
+			}
 		}
 
 		return size;
@@ -627,134 +962,257 @@ namespace Instrumentation
 	/// <param name="instructions">The list of instructions to compare with at that location.</param>
 	bool Method::IsInstrumented(long offset, const InstructionList &instructions)
 	{
-		bool foundInstructionAtOffset = false;
-		for (auto it = m_instructions.begin(); it != m_instructions.end(); ++it)
+		auto orig = FindOriginalInstruction(offset);
+		if (orig == m_originalInstructions.end())
+			return false;
+
+		auto it = FindInstruction(*orig);
+		for (auto it2 = instructions.begin(); it2 != instructions.end(); ++it2)
 		{
-			if ((*it)->m_origOffset == offset)
-			{
-				foundInstructionAtOffset = true;
-				for (auto it2 = instructions.begin(); it2 != instructions.end(); ++it2)
-				{
-					if (!(*it2)->Equivalent(*(*it)))
-						return false;
-					++it;
-				}
-				break;
-			}
+			if (it == m_instructions.end() || !(*it2)->Equivalent(*(*it)))
+				return false;
+			++it;
 		}
 
-		return foundInstructionAtOffset;
+		return true;
 	}
 
 	/// <summary>Insert a sequence of instructions at a specific offset</summary>
 	/// <param name="offset">The offset to look for.</param>
 	/// <param name="instructions">The list of instructions to insert at that location.</param>
-	/// <remarks>Original pointer references are maintained by inserting the sequence of instructions 
-	/// after the intended target and then using a copy operator on the <c>Instruction</c> objects to 
-	/// copy the data between them</remarks>
+	/// <remarks>The instructions are inserted before the instruction at that offset and any branches 
+	/// or exception handlers that referred to it are redirected to the first of them. The supplied 
+	/// instructions are copied into the method's arena and are not retained.</remarks>
 	void Method::InsertInstructionsAtOffset(long offset, const InstructionList &instructions)
 	{
+		auto it = FindInstructionAtOffset(offset);
+		if (it == m_instructions.end() || instructions.empty())
+			return;
+
 		InstructionList clone;
-		for (auto it = instructions.begin(); it != instructions.end(); ++it)
+		CopyInstructions(instructions, clone);
+
+		auto pInstruction = *it;
+		auto first = static_cast<size_t>(it - m_instructions.begin());
+		m_instructions.insert(it, clone.begin(), clone.end());
+
+		std::vector<InstructionRedirect> redirects(1, InstructionRedirect(pInstruction, clone.front()));
+		RedirectReferences(redirects);
+
+		UpdateOffsets(first, first + clone.size());
+	}
+
+	/// <summary>Insert a sequence of instructions at a sequence point</summary>
+	/// <param name="origOffset">The original (as in before any instrumentation) offset to look for.</param>
+	/// <param name="instructions">The list of instructions to insert at that location.</param>
+	/// <remarks>The instructions are inserted before the intended target and any branches or 
+	/// exception handlers that referred to the target are redirected to the first of them; the 
+	/// <c>Instruction</c> objects already in the method are left untouched. The supplied 
+	/// instructions are copied into the method's arena and are not retained.</remarks>
+	void Method::InsertInstructionsAtOriginalOffset(long origOffset, const InstructionList &instructions)
+	{
+		auto orig = FindOriginalInstruction(origOffset);
+		if (orig == m_originalInstructions.end())
+			return;
+
+		InstructionList clone;
+		CopyInstructions(instructions, clone);
+
+		auto pInstruction = *orig;
+		auto it = FindInstruction(pInstruction);
+		auto first = static_cast<size_t>(it - m_instructions.begin());
+		if (DoesTryHandlerPointToInstruction(pInstruction))
 		{
-			clone.push_back(new Instruction(*(*it)));
+			m_instructions.insert(it + 1, clone.begin(), clone.end());
+			++first;
 		}
-
-		for (auto it = m_instructions.begin(); it != m_instructions.end(); ++it)
+		else
 		{
-			if ((*it)->m_offset == offset)
+			m_instructions.insert(it, clone.begin(), clone.end());
+			if (!clone.empty())
 			{
-				++it;
-				m_instructions.insert(it, clone.begin(), clone.end());
-				break;
+				std::vector<InstructionRedirect> redirects(1, InstructionRedirect(pInstruction, clone.front()));
+				RedirectReferences(redirects);
 			}
 		}
 
+		UpdateOffsets(first, first + clone.size());
+	}
+
+	/// <summary>Insert sequences of instructions at many sequence points in a single pass</summary>
+	/// <param name="insertions">The original offsets and the instructions to insert at each of them.</param>
+	/// <remarks><para>Produces the same result as calling <c>InsertInstructionsAtOriginalOffset</c> for 
+	/// each entry in turn (entries for the same offset are applied in the order supplied) but builds the 
+	/// new instruction stream with one merge over the existing instructions, redirects the references 
+	/// in one pass and recalculates the offsets once, rather than once per insertion.</para>
+	/// <para>The entries are expected to be sorted by offset; they are (stable) sorted if they are not.
+	/// The supplied instructions are copied into the method's arena and are not retained.</para></remarks>
+	void Method::InsertInstructionsAtOriginalOffsets(const OriginalOffsetInstructionLists &insertions)
+	{
+		if (insertions.empty())
+			return;
+
+		auto byOffset = [](const OriginalOffsetInstructionList* left, const OriginalOffsetInstructionList* right)
+		{
+			return left->first < right->first;
+		};
+
+		std::vector<const OriginalOffsetInstructionList*> pending;
+		pending.reserve(insertions.size());
+		size_t insertedCount = 0;
+		for (auto it = insertions.begin(); it != insertions.end(); ++it)
+		{
+			pending.push_back(&(*it));
+			insertedCount += it->second.size();
+		}
+		if (!std::is_sorted(pending.begin(), pending.end(), byOffset))
+		{
+			std::stable_sort(pending.begin(), pending.end(), byOffset);
+		}
+
+		InstructionList instructions;
+		instructions.reserve(m_instructions.size() + insertedCount);
+
+		std::vector<InstructionRedirect> redirects;
+
+		// the offsets before the first insertion are unchanged
+		auto first = m_instructions.size();
+
+		auto next = pending.begin();
 		for (auto it = m_instructions.begin(); it != m_instructions.end(); ++it)
 		{
-			if ((*it)->m_origOffset == offset)
+			auto pInstruction = *it;
+
+			auto origOffset = pInstruction->m_origOffset;
+			if (origOffset != -1)
+			{
+				// offsets that do not match any instruction are ignored
+				while (next != pending.end() && (*next)->first < origOffset)
+					++next;
+			}
+
+			if (origOffset == -1 || next == pending.end() || (*next)->first != origOffset)
+			{
+				instructions.push_back(pInstruction);
+				continue;
+			}
+
+			auto groupEnd = next;
+			while (groupEnd != pending.end() && (*groupEnd)->first == origOffset)
+				++groupEnd;
+
+			first = std::min(first, instructions.size());
+
+			// see DoesTryHandlerPointToInstruction; when it applies the instructions follow the target
+			// (the latest insertion first) otherwise they go before it (in the order supplied)
+			if (DoesTryHandlerPointToInstruction(pInstruction))
 			{
-				auto orig = *(*it);
-				for (unsigned int i = 0; i < clone.size(); i++)
+				instructions.push_back(pInstruction);
+				for (auto group = groupEnd; group != next; )
 				{
-					auto temp = it;
-					++it;
-					*(*temp) = *(*it);
+					--group;
+					CopyInstructions((*group)->second, instructions);
 				}
-				*(*it) = orig;
-				break;
 			}
+			else
+			{
+				auto first = instructions.size();
+				for (auto group = next; group != groupEnd; ++group)
+				{
+					CopyInstructions((*group)->second, instructions);
+				}
+				if (instructions.size() != first)
+				{
+					redirects.push_back(InstructionRedirect(pInstruction, instructions[first]));
+				}
+				instructions.push_back(pInstruction);
+			}
+
+			next = groupEnd;
 		}
 
-		RecalculateOffsets();
+		m_instructions.swap(instructions);
+		RedirectReferences(redirects);
+		if (first < m_instructions.size())
+			UpdateOffsets(first, m_instructions.size());
 	}
 
-	/// <summary>Insert a sequence of instructions at a sequence point</summary>
-	/// <param name="origOffset">The original (as in before any instrumentation) offset to look for.</param>
-	/// <param name="instructions">The list of instructions to insert at that location.</param>
-	/// <remarks>Original pointer references are maintained by inserting the sequence of instructions 
-	/// after the intended target and then using a copy operator on the <c>Instruction</c> objects to 
-	/// copy the data between them</remarks>
-	void Method::InsertInstructionsAtOriginalOffset(long origOffset, const InstructionList &instructions)
+	/// <summary>Copy instructions into the method's arena</summary>
+	/// <param name="instructions">The instructions to copy.</param>
+	/// <param name="copies">The list the copies are appended to.</param>
+	/// <remarks>A branch from one of the instructions to another (e.g. within a probe) is made
+	/// between their copies; any other branch keeps its target.</remarks>
+	void Method::CopyInstructions(const InstructionList &instructions, InstructionList &copies)
 	{
-		InstructionList clone;
+		auto start = copies.size();
 		for (auto it = instructions.begin(); it != instructions.end(); ++it)
 		{
-			clone.push_back(new Instruction(*(*it)));
+			copies.push_back(m_arena->Create<Instruction>(*(*it)));
 		}
 
-		long actualOffset = 0;
-		Instruction* actualInstruction = nullptr;
-		for (auto it = m_instructions.begin(); it != m_instructions.end(); ++it)
+		for (auto index = start; index < copies.size(); ++index)
 		{
-			if ((*it)->m_origOffset == origOffset)
+			if (!copies[index]->m_isBranch)
+				continue;
+			for (auto bit = copies[index]->m_branches.begin(); bit != copies[index]->m_branches.end(); ++bit)
 			{
-				actualInstruction = *it;
-				actualOffset = (actualInstruction)->m_offset;
-				++it;
-				m_instructions.insert(it, clone.begin(), clone.end());
-				break;
+				auto found = std::find(instructions.begin(), instructions.end(), *bit);
+				if (found != instructions.end())
+					*bit = copies[start + (found - instructions.begin())];
 			}
 		}
+	}
+
+	/// <summary>Make every branch and exception handler that refers to one of the supplied 
+	/// instructions refer to its replacement instead</summary>
+	/// <param name="redirects">The instructions and their replacements.</param>
+	void Method::RedirectReferences(std::vector<InstructionRedirect> &redirects)
+	{
+		if (redirects.empty())
+			return;
+
+		std::sort(redirects.begin(), redirects.end());
 
-		if (!DoesTryHandlerPointToOffset(actualOffset))
+		auto redirect = [&redirects](Instruction*& pInstruction)
 		{
-			for (auto it = m_instructions.begin(); it != m_instructions.end(); ++it)
+			auto it = std::lower_bound(redirects.begin(), redirects.end(), InstructionRedirect(pInstruction, nullptr));
+			if (it == redirects.end() || it->first != pInstruction)
+				return false;
+			pInstruction = it->second;
+			return true;
+		};
+
+		for (auto it = m_instructions.begin(); it != m_instructions.end(); ++it)
+		{
+			for (auto bit = (*it)->m_branches.begin(); bit != (*it)->m_branches.end(); ++bit)
 			{
-				if (*it == actualInstruction)
-				{
-					Instruction orig = *(*it);
-					for (unsigned int i = 0; i < clone.size(); i++)
-					{
-						auto temp = it;
-						++it;
-						*(*temp) = *(*it);
-					}
-					*(*it) = orig;
-					break;
-				}
+				redirect(*bit);
 			}
 		}
 
-		RecalculateOffsets();
+		auto reindex = false;
+		for (auto it = m_exceptions.begin(); it != m_exceptions.end(); ++it)
+		{
+			redirect((*it)->m_tryStart);
+			redirect((*it)->m_tryEnd);
+			reindex |= redirect((*it)->m_handlerStart) && (*it)->m_handlerType == COR_ILEXCEPTION_CLAUSE_NONE;
+			redirect((*it)->m_handlerEnd);
+			if ((*it)->m_filterStart != nullptr)
+				redirect((*it)->m_filterStart);
+		}
+
+		if (reindex)
+			IndexTryHandlerStarts();
 	}
 
 	/// <summary>Test if we have an exception where the handler start points to the 
-	/// instruction at the supplied offset</summary>
-	/// <param name="offset">The offset to look for.</param>
-	/// <returns>An <c>Instruction</c> that exists at that location.</returns>
-	bool Method::DoesTryHandlerPointToOffset(long offset)
+	/// supplied instruction</summary>
+	/// <param name="pInstruction">The instruction to look for.</param>
+	/// <returns>true if the instruction is the start of such a handler.</returns>
+	bool Method::DoesTryHandlerPointToInstruction(Instruction* pInstruction)
 	{
-		for (auto it = m_exceptions.begin(); it != m_exceptions.end(); ++it)
-		{
-			if ((*it)->m_handlerType == COR_ILEXCEPTION_CLAUSE_NONE
-				&& ((*it)->m_handlerStart->m_offset == offset 
-				&& (*it)->m_handlerStart->m_operand == CEE_THROW))
-			{
-				return true;
-			}
-		}
-		return false;
+		return pInstruction->m_operand == CEE_THROW
+			&& std::binary_search(m_tryHandlerStarts.begin(), m_tryHandlerStarts.end(), pInstruction);
 	}
 
 	/// <summary>Get the size of the COR_IL_MAP block</summary>
@@ -796,4 +1254,69 @@ namespace Instrumentation
 			}
 		}
 	}
+
+	/// <summary>Split the original instructions into straight-line runs</summary>
+	/// <returns>For each original instruction (in original offset order) its original offset and the
+	/// original offset of the first instruction of its run.</returns>
+	/// <remarks><para>Once a run has been entered every instruction in it is executed: only its first
+	/// instruction can be the target of a branch or the boundary of a try block or handler and only
+	/// its last instruction can branch, return, call or throw.</para>
+	/// <para>The analysis is of the method as read so it must be done before any instrumentation
+	/// is inserted.</para></remarks>
+	StraightLineRuns Method::GetStraightLineRuns()
+	{
+		std::unordered_set<Instruction*> entries;
+		for (auto it = m_instructions.begin(); it != m_instructions.end(); ++it)
+		{
+			entries.insert((*it)->m_branches.begin(), (*it)->m_branches.end());
+		}
+		for (auto it = m_exceptions.begin(); it != m_exceptions.end(); ++it)
+		{
+			entries.insert((*it)->m_tryStart);
+			entries.insert((*it)->m_tryEnd);
+			entries.insert((*it)->m_handlerStart);
+			entries.insert((*it)->m_handlerEnd);
+			entries.insert((*it)->m_filterStart);
+		}
+
+		StraightLineRuns runs;
+		runs.reserve(m_originalInstructions.size());
+		long runStart = 0;
+		auto fallsThrough = false;
+		for (auto it = m_originalInstructions.begin(); it != m_originalInstructions.end(); ++it)
+		{
+			if (!fallsThrough || entries.find(*it) != entries.end())
+				runStart = (*it)->m_origOffset;
+			runs.emplace_back((*it)->m_origOffset, runStart);
+			fallsThrough = AlwaysFallsThrough((*it)->m_operation);
+		}
+		return runs;
+	}
+
+	/// <summary>Get the code covered by each try block, handler and filter</summary>
+	/// <remarks>Uses the current offsets; a filter is followed by its handler so they are one region.</remarks>
+	ExceptionRegions Method::GetExceptionRegions() const
+	{
+		ExceptionRegions regions;
+		regions.reserve(m_exceptions.size() * 2);
+		for (auto it = m_exceptions.begin(); it != m_exceptions.end(); ++it)
+		{
+			regions.emplace_back((*it)->m_tryStart->m_offset, (*it)->m_tryEnd->m_offset);
+			auto pStart = (*it)->m_filterStart != nullptr ? (*it)->m_filterStart : (*it)->m_handlerStart;
+			regions.emplace_back(pStart->m_offset, (*it)->m_handlerEnd->m_offset);
+		}
+		return regions;
+	}
+
+	/// <summary>Whether an instruction starts or ends a try block, handler or filter</summary>
+	/// <remarks>Anything inserted before such an instruction would end up on the other side of the boundary.</remarks>
+	bool Method::IsExceptionBoundary(const Instruction* pInstruction) const
+	{
+		return std::any_of(m_exceptions.begin(), m_exceptions.end(), [pInstruction](const ExceptionHandler* pHandler)
+		{
+			return pHandler->m_tryStart == pInstruction || pHandler->m_tryEnd == pInstruction
+				|| pHandler->m_handlerStart == pInstruction || pHandler->m_handlerEnd == pInstruction
+				|| pHandler->m_filterStart == pInstruction;
+		});
+	}
 }
@@ -2,9 +2,20 @@
 #include "Instruction.h"
 #include "ExceptionHandler.h"
 #include "MethodBuffer.h"
+#include "Arena.h"
 
 namespace Instrumentation
 {
+	/// <summary>A list of instructions to insert at an original offset</summary>
+	typedef std::pair<long, InstructionList> OriginalOffsetInstructionList;
+	typedef std::vector<OriginalOffsetInstructionList> OriginalOffsetInstructionLists;
+
+	/// <summary>Original offsets paired with the original offset of the start of their straight-line run</summary>
+	typedef std::vector<std::pair<long, long>> StraightLineRuns;
+
+	/// <summary>The [start, end) offsets of the try blocks, handlers and filters</summary>
+	typedef std::vector<std::pair<long, long>> ExceptionRegions;
+
 	/// <summary>The <c>Method</c> entity builds a 'model' of the IL that can then be modified</summary>
 	class Method :
 		public MethodBuffer
@@ -13,17 +24,27 @@ namespace Instrumentation
 		explicit Method(IMAGE_COR_ILMETHOD* pMethod);
 		~Method();
 
+	private:
+		Method(const Method&) = delete;
+		Method& operator = (const Method&) = delete;
+
 	public:
 		long GetMethodSize();
 		void WriteMethod(IMAGE_COR_ILMETHOD* pMethod);
 		void InsertInstructionsAtOriginalOffset(long origOffset, const InstructionList &instructions);
 		void InsertInstructionsAtOffset(long offset, const InstructionList &instructions);
+		void InsertInstructionsAtOriginalOffsets(const OriginalOffsetInstructionLists &insertions);
+		void OptimizeEncoding();
 		void DumpIL(bool enableDump);
 		ULONG GetILMapSize();
 		void PopulateILMap(ULONG mapSize, COR_IL_MAP* maps);
 
 		bool IsInstrumented(long offset, const InstructionList &instructions);
 
+		StraightLineRuns GetStraightLineRuns();
+		ExceptionRegions GetExceptionRegions() const;
+		bool IsExceptionBoundary(const Instruction* pInstruction) const;
+
 	public:
 		void SetMinimumStackSize(unsigned int minimumStackSize)
 		{
@@ -40,20 +61,45 @@ namespace Instrumentation
 
 		DWORD GetCodeSize() const { return m_header.CodeSize; }
 
+		mdSignature GetLocalVarSigToken() const { return m_header.LocalVarSigTok; }
+
+		/// <summary>Replace the signature of the locals, e.g. by one with a local added for the probes</summary>
+		void SetLocalVarSigToken(mdSignature localVarSigToken) { m_header.LocalVarSigTok = localVarSigToken; }
+
+		/// <summary>Create an <c>Instruction</c> that is owned by (and released with) this method</summary>
+		Instruction* CreateInstruction(CanonicalName operation, ULONGLONG operand)
+		{
+			return m_arena->Create<Instruction>(operation, operand);
+		}
+
+		/// <summary>Create an <c>Instruction</c> that is owned by (and released with) this method</summary>
+		Instruction* CreateInstruction(CanonicalName operation)
+		{
+			return m_arena->Create<Instruction>(operation);
+		}
+
 
 	public:
 		void RecalculateOffsets();
+		void UpdateOffsets(size_t first, size_t last);
 
 	private:
 		void ReadMethod(IMAGE_COR_ILMETHOD* pMethod);
 		void ReadBody();
 
 		void ConvertShortBranches();
-		void ResolveBranches();
+		bool ConvertLongBranches(size_t& first);
+		void UpdateBranchOperands();
+		void ResolveBranches(const std::vector<long> &branchOffsets);
 		void DumpExceptionFilters();
 		void DumpInstructions();
 		Instruction * GetInstructionAtOffset(long offset);
 		Instruction * GetInstructionAtOffset(long offset, bool isFinally, bool isFault, bool isFilter, bool isTyped);
+		InstructionList::iterator FindInstructionAtOffset(long offset);
+		InstructionList::iterator FindInstruction(Instruction* pInstruction);
+		InstructionList::iterator FindOriginalInstruction(long origOffset);
+		void IndexOriginalInstructions();
+		void IndexTryHandlerStarts();
 		void ReadSections();
 
 		template<class flag, class start, class end>
@@ -62,10 +108,37 @@ namespace Instrumentation
 		ExceptionHandler* ReadExceptionHandler(enum CorExceptionFlag type, long tryStart, long tryEnd, long handlerStart, long handlerEnd, long filterStart, ULONG token);
 
 		void WriteSections();
-		bool DoesTryHandlerPointToOffset(long offset);
+
+		template<class flag, class start, class end>
+		void WriteExceptionHandlers();
+
+		bool CanUseTinyHeader();
+		bool CanUseSmallSections();
+		bool DoesTryHandlerPointToInstruction(Instruction* pInstruction);
+
+		void CopyInstructions(const InstructionList &instructions, InstructionList &copies);
+
+		typedef std::pair<Instruction*, Instruction*> InstructionRedirect;
+		void RedirectReferences(std::vector<InstructionRedirect> &redirects);
 
 	private:
-		// all instrumented methods will be FAT (with FAT SECTIONS if exist) regardless
+		// owns every Instruction and ExceptionHandler of this method
+		Arena* m_arena;
+
+		// allow 'Tiny' headers and 'Small' sections when writing (see OptimizeEncoding)
+		bool m_optimizeEncoding;
+
+		// the branches at, or targeting, this offset onward may have stale operands (see UpdateOffsets)
+		long m_staleOperandsFrom;
+
+		// the instructions read from the method body (ordered by original offset)
+		InstructionList m_originalInstructions;
+
+		// the handler starts of the COR_ILEXCEPTION_CLAUSE_NONE clauses (ordered by address)
+		InstructionList m_tryHandlerStarts;
+
+		// the header, held as FAT; it is written 'Tiny' (and the EH sections 'Small') where they fit once
+		// OptimizeEncoding is called, otherwise the method is written FAT (with FAT SECTIONS if exist)
 		IMAGE_COR_ILMETHOD_FAT m_header;
 
 #ifdef TEST_FRAMEWORK
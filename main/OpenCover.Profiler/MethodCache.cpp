@@ -0,0 +1,270 @@
+#include "stdafx.h"
+#include "MethodCache.h"
+
+#include <cstring>
+
+#define METHOD_CACHE_MAGIC 0x434D434F // 'OCMC'
+#define METHOD_CACHE_VERSION 3
+#define METHOD_CACHE_WAYS 8
+#define METHOD_CACHE_BYTES_PER_BUCKET (METHOD_CACHE_WAYS * 512)
+#define METHOD_CACHE_MINIMUM_SIZE (64 * 1024)
+
+namespace Instrumentation
+{
+	struct MethodCache::Header
+	{
+		DWORD magic;
+		DWORD version;
+		ULONGLONG size;
+		ULONGLONG bucketCount;
+		ULONGLONG dataOffset;
+		ULONGLONG dataSize;
+		// the total number of bytes ever written to the ring; records are identified by
+		// the (logical) position they were written at
+		ULONGLONG writePosition;
+	};
+
+	struct MethodCache::Slot
+	{
+		ULONGLONG keyHash;
+		ULONGLONG position; // of the record + 1; 0 for an empty slot
+	};
+
+	struct MethodCache::Record
+	{
+		MethodCacheKey key;
+		ULONGLONG position;
+		ULONGLONG checksum;
+		ULONG bodySize;
+		ULONG mapSize;
+		ULONG mergedSize;
+		MethodCacheCost cost;
+		// followed by the body, the map and then the merged points (each 8 byte aligned)
+	};
+
+	namespace
+	{
+		inline size_t Align8(size_t size) { return (size + 7) & ~static_cast<size_t>(7); }
+
+		inline bool IsSameKey(const MethodCacheKey& left, const MethodCacheKey& right)
+		{
+			return memcmp(&left, &right, sizeof(MethodCacheKey)) == 0;
+		}
+
+		inline ULONGLONG Checksum(const BYTE* pBody, ULONG bodySize, const COR_IL_MAP* pMap, ULONG mapSize, const ULONG* pMerged, ULONG mergedSize,
+			const MethodCacheCost& cost)
+		{
+			auto hash = MethodCache::Hash(pMap, mapSize * sizeof(COR_IL_MAP), MethodCache::Hash(pBody, bodySize));
+			hash = MethodCache::Hash(pMerged, mergedSize * sizeof(ULONG), hash);
+			return MethodCache::Hash(&cost, sizeof(MethodCacheCost), hash);
+		}
+	}
+
+	MethodCache::MethodCache() : m_pHeader(nullptr), m_pSlots(nullptr), m_pData(nullptr)
+	{
+	}
+
+	/// <summary>Use a block of memory for the cache, formatting it if it does not already hold a cache
+	/// of this version and size.</summary>
+	/// <returns>false if the block is too small to be used.</returns>
+	bool MethodCache::Attach(void* pBlock, size_t size)
+	{
+		m_pHeader = nullptr;
+		if (pBlock == nullptr || size < METHOD_CACHE_MINIMUM_SIZE)
+			return false;
+
+		m_pHeader = static_cast<Header*>(pBlock);
+		auto valid = m_pHeader->magic == METHOD_CACHE_MAGIC
+			&& m_pHeader->version == METHOD_CACHE_VERSION
+			&& m_pHeader->size == size
+			&& m_pHeader->bucketCount != 0
+			&& m_pHeader->dataOffset == Align8(sizeof(Header) + (m_pHeader->bucketCount * METHOD_CACHE_WAYS * sizeof(Slot)))
+			&& m_pHeader->dataOffset + m_pHeader->dataSize <= size;
+		if (!valid)
+			Format(size);
+
+		m_pSlots = reinterpret_cast<Slot*>(static_cast<BYTE*>(pBlock) + sizeof(Header));
+		m_pData = static_cast<BYTE*>(pBlock) + m_pHeader->dataOffset;
+		return true;
+	}
+
+	void MethodCache::Format(size_t size)
+	{
+		auto bucketCount = size / METHOD_CACHE_BYTES_PER_BUCKET;
+		auto dataOffset = Align8(sizeof(Header) + (bucketCount * METHOD_CACHE_WAYS * sizeof(Slot)));
+
+		// the magic goes last so an interrupted format is never mistaken for a cache
+		m_pHeader->magic = 0;
+		memset(reinterpret_cast<BYTE*>(m_pHeader) + sizeof(Header), 0, dataOffset - sizeof(Header));
+		m_pHeader->version = METHOD_CACHE_VERSION;
+		m_pHeader->size = size;
+		m_pHeader->bucketCount = bucketCount;
+		m_pHeader->dataOffset = dataOffset;
+		m_pHeader->dataSize = (size - dataOffset) & ~static_cast<size_t>(7);
+		m_pHeader->writePosition = 0;
+		m_pHeader->magic = METHOD_CACHE_MAGIC;
+	}
+
+	/// <summary>Has the record written at <c>position</c> not (yet) been overwritten</summary>
+	bool MethodCache::IsLive(ULONGLONG position) const
+	{
+		return position < m_pHeader->writePosition
+			&& (m_pHeader->writePosition <= m_pHeader->dataSize || position >= m_pHeader->writePosition - m_pHeader->dataSize);
+	}
+
+	MethodCache::Slot* MethodCache::GetBucket(ULONGLONG keyHash) const
+	{
+		return m_pSlots + ((keyHash % m_pHeader->bucketCount) * METHOD_CACHE_WAYS);
+	}
+
+	const MethodCache::Record* MethodCache::GetRecord(const Slot& slot, const MethodCacheKey& key) const
+	{
+		if (slot.position == 0 || !IsLive(slot.position - 1))
+			return nullptr;
+
+		auto position = slot.position - 1;
+		auto offset = static_cast<size_t>(position % m_pHeader->dataSize);
+		if (offset + sizeof(Record) > m_pHeader->dataSize)
+			return nullptr;
+
+		auto pRecord = reinterpret_cast<const Record*>(m_pData + offset);
+		if (pRecord->position != position || !IsSameKey(pRecord->key, key))
+			return nullptr;
+
+		if (pRecord->bodySize > m_pHeader->dataSize || pRecord->mapSize > m_pHeader->dataSize / sizeof(COR_IL_MAP)
+			|| pRecord->mergedSize > m_pHeader->dataSize / sizeof(ULONG))
+			return nullptr;
+
+		if (offset + GetRecordSize(pRecord->bodySize, pRecord->mapSize, pRecord->mergedSize) > m_pHeader->dataSize)
+			return nullptr;
+
+		auto pBody = reinterpret_cast<const BYTE*>(pRecord + 1);
+		auto pMap = reinterpret_cast<const COR_IL_MAP*>(pBody + Align8(pRecord->bodySize));
+		auto pMerged = reinterpret_cast<const ULONG*>(reinterpret_cast<const BYTE*>(pMap) + Align8(pRecord->mapSize * sizeof(COR_IL_MAP)));
+		if (Checksum(pBody, pRecord->bodySize, pMap, pRecord->mapSize, pMerged, pRecord->mergedSize, pRecord->cost) != pRecord->checksum)
+			return nullptr;
+
+		return pRecord;
+	}
+
+	/// <summary>Look for the instrumented body of a method</summary>
+	/// <remarks>The body and map returned point into the cache</remarks>
+	bool MethodCache::Find(const MethodCacheKey& key, const BYTE*& pBody, ULONG& bodySize, const COR_IL_MAP*& pMap, ULONG& mapSize) const
+	{
+		const ULONG* pMerged;
+		ULONG mergedSize;
+		MethodCacheCost cost;
+		return Find(key, pBody, bodySize, pMap, mapSize, pMerged, mergedSize, cost);
+	}
+
+	/// <summary>Look for the instrumented body of a method, the points merged into its probes and its cost</summary>
+	/// <remarks>The body, map and merged points returned point into the cache</remarks>
+	bool MethodCache::Find(const MethodCacheKey& key, const BYTE*& pBody, ULONG& bodySize, const COR_IL_MAP*& pMap, ULONG& mapSize,
+		const ULONG*& pMerged, ULONG& mergedSize, MethodCacheCost& cost) const
+	{
+		if (!IsAttached())
+			return false;
+
+		auto keyHash = Hash(&key, sizeof(MethodCacheKey));
+		auto pBucket = GetBucket(keyHash);
+		for (auto way = 0; way < METHOD_CACHE_WAYS; way++)
+		{
+			if (pBucket[way].keyHash != keyHash)
+				continue;
+
+			auto pRecord = GetRecord(pBucket[way], key);
+			if (pRecord == nullptr)
+				continue;
+
+			pBody = reinterpret_cast<const BYTE*>(pRecord + 1);
+			bodySize = pRecord->bodySize;
+			pMap = reinterpret_cast<const COR_IL_MAP*>(pBody + Align8(pRecord->bodySize));
+			mapSize = pRecord->mapSize;
+			pMerged = reinterpret_cast<const ULONG*>(reinterpret_cast<const BYTE*>(pMap) + Align8(mapSize * sizeof(COR_IL_MAP)));
+			mergedSize = pRecord->mergedSize;
+			cost = pRecord->cost;
+			return true;
+		}
+		return false;
+	}
+
+	/// <summary>Add (or replace) the instrumented body of a method</summary>
+	/// <returns>false if the body is too large to be worth caching (over a quarter of the ring).</returns>
+	/// <param name="pMerged">The (probe point, merged point) pairs of the points merged into the probes of the body.</param>
+	/// <param name="cost">What the probe budget made of the method.</param>
+	/// <remarks>The oldest records are overwritten to make room; if the bucket is full the entry
+	/// for the oldest record in it is reused.</remarks>
+	bool MethodCache::Add(const MethodCacheKey& key, const BYTE* pBody, ULONG bodySize, const COR_IL_MAP* pMap, ULONG mapSize,
+		const ULONG* pMerged, ULONG mergedSize, const MethodCacheCost& cost)
+	{
+		if (!IsAttached())
+			return false;
+
+		auto recordSize = GetRecordSize(bodySize, mapSize, mergedSize);
+		if (recordSize > m_pHeader->dataSize / 4)
+			return false;
+
+		// records never wrap; skip what is left of the ring instead
+		auto position = m_pHeader->writePosition;
+		auto offset = static_cast<size_t>(position % m_pHeader->dataSize);
+		if (offset + recordSize > m_pHeader->dataSize)
+		{
+			position += m_pHeader->dataSize - offset;
+			offset = 0;
+		}
+
+		auto pRecord = reinterpret_cast<Record*>(m_pData + offset);
+		auto pRecordBody = reinterpret_cast<BYTE*>(pRecord + 1);
+		auto pRecordMap = reinterpret_cast<COR_IL_MAP*>(pRecordBody + Align8(bodySize));
+		auto pRecordMerged = reinterpret_cast<ULONG*>(reinterpret_cast<BYTE*>(pRecordMap) + Align8(mapSize * sizeof(COR_IL_MAP)));
+		memcpy(pRecordBody, pBody, bodySize);
+		memcpy(pRecordMap, pMap, mapSize * sizeof(COR_IL_MAP));
+		if (mergedSize != 0)
+			memcpy(pRecordMerged, pMerged, mergedSize * sizeof(ULONG));
+		pRecord->key = key;
+		pRecord->position = position;
+		pRecord->bodySize = bodySize;
+		pRecord->mapSize = mapSize;
+		pRecord->mergedSize = mergedSize;
+		pRecord->cost = cost;
+		pRecord->checksum = Checksum(pBody, bodySize, pMap, mapSize, pMerged, mergedSize, cost);
+		m_pHeader->writePosition = position + recordSize;
+
+		auto keyHash = Hash(&key, sizeof(MethodCacheKey));
+		auto pBucket = GetBucket(keyHash);
+		auto pSlot = pBucket;
+		for (auto way = 0; way < METHOD_CACHE_WAYS; way++)
+		{
+			auto& slot = pBucket[way];
+			if (slot.position == 0 || !IsLive(slot.position - 1) || (slot.keyHash == keyHash && GetRecord(slot, key) != nullptr))
+			{
+				pSlot = &slot;
+				break;
+			}
+			if (slot.position < pSlot->position)
+				pSlot = &slot;
+		}
+
+		pSlot->keyHash = keyHash;
+		pSlot->position = position + 1;
+		return true;
+	}
+
+	/// <summary>A 64 bit FNV-1a hash; pass the result of a previous call as <c>hash</c> to continue it</summary>
+	ULONGLONG MethodCache::Hash(const void* pData, size_t size, ULONGLONG hash)
+	{
+		auto pBytes = static_cast<const BYTE*>(pData);
+		for (size_t i = 0; i < size; i++)
+		{
+			hash ^= pBytes[i];
+			hash *= 1099511628211ULL;
+		}
+		return hash;
+	}
+
+	/// <summary>The space a record takes in the ring</summary>
+	size_t MethodCache::GetRecordSize(ULONG bodySize, ULONG mapSize, ULONG mergedSize)
+	{
+		return sizeof(Record) + Align8(bodySize) + Align8(mapSize * sizeof(COR_IL_MAP)) + Align8(mergedSize * sizeof(ULONG));
+	}
+}
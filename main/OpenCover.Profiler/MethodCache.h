@@ -0,0 +1,78 @@
+#pragma once
+
+namespace Instrumentation
+{
+	/// <summary>Identifies an instrumented method body in a <c>MethodCache</c></summary>
+	/// <remarks>Any change to the module (MVID), the original IL (size and hash) or to what was
+	/// injected (the points, the probe tokens and the profiler build; see <c>instrumentationHash</c>)
+	/// produces a different key so a stale body can never be found.</remarks>
+	struct MethodCacheKey
+	{
+		GUID moduleVersionId;
+		mdToken functionToken;
+		ULONG originalSize;
+		ULONGLONG originalHash;
+		ULONGLONG instrumentationHash;
+	};
+
+	/// <summary>What the probe budget made of a cached method (see <c>CoverageInstrumentation::ChooseCoverageLevel</c>),
+	/// so that its cost can be recorded whenever the method is found</summary>
+	struct MethodCacheCost
+	{
+		MethodCacheCost() : level(0), probes(0), originalSize(0) {}
+
+		ULONG level;
+		ULONG probes;
+		// of the code, the instrumented size is that of the body
+		ULONG originalSize;
+	};
+
+	/// <summary>A cache of instrumented method bodies (with their IL maps, merged points and cost) held in a single block of
+	/// memory, normally a view of a file shared by every profiled process</summary>
+	/// <remarks><para>The block holds a header, a set associative index (<c>METHOD_CACHE_WAYS</c> entries
+	/// per bucket) and a ring of records. Records are only ever appended; when the ring wraps the
+	/// oldest records are overwritten, which is the eviction policy, and the size of the block is the
+	/// cap. An index entry whose record has been overwritten is simply treated as empty.</para>
+	/// <para>The cache does no locking; the caller must serialize access to the block and the pointers
+	/// returned by <c>Find</c> are only valid while it does so. Every record carries a checksum so that a
+	/// record left half written (e.g. by a process that died) is ignored rather than used.</para>
+	/// <para>The block is (re)formatted by <c>Attach</c> if it was not written by this version of the
+	/// cache; <c>METHOD_CACHE_VERSION</c> must be changed if the layout changes.</para></remarks>
+	class MethodCache
+	{
+	public:
+		MethodCache();
+
+	private:
+		MethodCache(const MethodCache&) = delete;
+		MethodCache& operator = (const MethodCache&) = delete;
+
+	public:
+		bool Attach(void* pBlock, size_t size);
+		bool IsAttached() const { return m_pHeader != nullptr; }
+
+		bool Find(const MethodCacheKey& key, const BYTE*& pBody, ULONG& bodySize, const COR_IL_MAP*& pMap, ULONG& mapSize) const;
+		bool Find(const MethodCacheKey& key, const BYTE*& pBody, ULONG& bodySize, const COR_IL_MAP*& pMap, ULONG& mapSize,
+			const ULONG*& pMerged, ULONG& mergedSize, MethodCacheCost& cost) const;
+		bool Add(const MethodCacheKey& key, const BYTE* pBody, ULONG bodySize, const COR_IL_MAP* pMap, ULONG mapSize,
+			const ULONG* pMerged = nullptr, ULONG mergedSize = 0, const MethodCacheCost& cost = MethodCacheCost());
+
+		static ULONGLONG Hash(const void* pData, size_t size, ULONGLONG hash = 14695981039346656037ULL);
+		static size_t GetRecordSize(ULONG bodySize, ULONG mapSize, ULONG mergedSize = 0);
+
+	private:
+		struct Header;
+		struct Slot;
+		struct Record;
+
+		void Format(size_t size);
+		bool IsLive(ULONGLONG position) const;
+		const Record* GetRecord(const Slot& slot, const MethodCacheKey& key) const;
+		Slot* GetBucket(ULONGLONG keyHash) const;
+
+	private:
+		Header* m_pHeader;
+		Slot* m_pSlots;
+		BYTE* m_pData;
+	};
+}
@@ -0,0 +1,95 @@
+#include "stdafx.h"
+#include "ModuleSymbols.h"
+#include "Inflate.h"
+
+namespace Instrumentation
+{
+	bool MappedFile::Open(const std::wstring& path)
+	{
+		Close();
+		m_hFile = ::CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE,
+			nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+		if (m_hFile == INVALID_HANDLE_VALUE) {
+			m_hFile = nullptr;
+			return false;
+		}
+
+		LARGE_INTEGER fileSize;
+		if (!::GetFileSizeEx(m_hFile, &fileSize) || fileSize.QuadPart == 0 || fileSize.QuadPart > MAXLONG) {
+			Close();
+			return false;
+		}
+
+		m_hMapping = ::CreateFileMapping(m_hFile, nullptr, PAGE_READONLY, 0, 0, nullptr);
+		if (m_hMapping != nullptr)
+			m_pView = static_cast<const BYTE*>(::MapViewOfFile(m_hMapping, FILE_MAP_READ, 0, 0, 0));
+		if (m_pView == nullptr) {
+			Close();
+			return false;
+		}
+		m_size = static_cast<ULONG>(fileSize.QuadPart);
+		return true;
+	}
+
+	void MappedFile::Close()
+	{
+		if (m_pView != nullptr) {
+			::UnmapViewOfFile(m_pView);
+			m_pView = nullptr;
+		}
+		if (m_hMapping != nullptr) {
+			::CloseHandle(m_hMapping);
+			m_hMapping = nullptr;
+		}
+		if (m_hFile != nullptr) {
+			::CloseHandle(m_hFile);
+			m_hFile = nullptr;
+		}
+		m_size = 0;
+	}
+
+	/// <summary>Find and open the portable PDB of a module</summary>
+	/// <returns>false if the module has no portable PDB (e.g. it has a Windows PDB) or it cannot be read.</returns>
+	bool ModuleSymbols::Open(const std::wstring& modulePath)
+	{
+		MappedFile module;
+		PdbLocation location;
+		if (!module.Open(modulePath) || !FindPortablePdb(module.GetData(), module.GetSize(), location))
+			return false;
+
+		if (location.kind == PDB_EMBEDDED)
+			return Inflate(location.pData, location.size, location.uncompressedSize, m_inflated)
+				&& m_pdb.Open(m_inflated.data(), static_cast<ULONG>(m_inflated.size()));
+
+		return OpenPdbFile(modulePath, location.path)
+			&& m_pdb.Open(m_pdbFile.GetData(), m_pdbFile.GetSize());
+	}
+
+	/// <summary>Map the PDB file; the path the module was built with is tried first, then a file of the same
+	/// name next to the module and finally the module's own name with a .pdb extension</summary>
+	bool ModuleSymbols::OpenPdbFile(const std::wstring& modulePath, const std::string& pdbPath)
+	{
+		std::wstring builtPath;
+		if (!pdbPath.empty()) {
+			auto length = ::MultiByteToWideChar(CP_UTF8, 0, pdbPath.c_str(), static_cast<int>(pdbPath.size()), nullptr, 0);
+			builtPath.resize(length);
+			::MultiByteToWideChar(CP_UTF8, 0, pdbPath.c_str(), static_cast<int>(pdbPath.size()), &builtPath[0], length);
+		}
+
+		auto moduleFolder = modulePath.substr(0, modulePath.find_last_of(L"\\/") + 1);
+		auto extension = modulePath.find_last_of(L'.');
+		std::vector<std::wstring> candidates;
+		if (!builtPath.empty()) {
+			candidates.push_back(builtPath);
+			candidates.push_back(moduleFolder + builtPath.substr(builtPath.find_last_of(L"\\/") + 1));
+		}
+		if (extension != std::wstring::npos && extension >= moduleFolder.size())
+			candidates.push_back(modulePath.substr(0, extension) + L".pdb");
+
+		for (auto& candidate : candidates) {
+			if (m_pdbFile.Open(candidate))
+				return true;
+		}
+		return false;
+	}
+}
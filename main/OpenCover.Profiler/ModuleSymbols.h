@@ -0,0 +1,60 @@
+#pragma once
+
+#include "PortablePdb.h"
+
+#include <string>
+#include <vector>
+
+namespace Instrumentation
+{
+	/// <summary>A file mapped read only into memory</summary>
+	class MappedFile
+	{
+	public:
+		MappedFile() : m_hFile(nullptr), m_hMapping(nullptr), m_pView(nullptr), m_size(0) {}
+		~MappedFile() { Close(); }
+
+	private:
+		MappedFile(const MappedFile&) = delete;
+		MappedFile& operator = (const MappedFile&) = delete;
+
+	public:
+		bool Open(const std::wstring& path);
+		void Close();
+		const BYTE* GetData() const { return m_pView; }
+		ULONG GetSize() const { return m_size; }
+
+	private:
+		HANDLE m_hFile;
+		HANDLE m_hMapping;
+		const BYTE* m_pView;
+		ULONG m_size;
+	};
+
+	/// <summary>The portable PDB of a module, either a file alongside it or embedded in it</summary>
+	/// <remarks><para>A PDB file is mapped rather than read; an embedded PDB is compressed so it is inflated
+	/// into memory, and the module is only mapped while it is found.</para>
+	/// <para>Nothing checks that a PDB file was built with the module; the points found from it are only
+	/// used if the host agrees with them (see <c>ProfilerCommunication::AllocateUniqueIds</c>).</para></remarks>
+	class ModuleSymbols
+	{
+	public:
+		ModuleSymbols() {}
+
+	private:
+		ModuleSymbols(const ModuleSymbols&) = delete;
+		ModuleSymbols& operator = (const ModuleSymbols&) = delete;
+
+	public:
+		bool Open(const std::wstring& modulePath);
+		const PortablePdb& GetPdb() const { return m_pdb; }
+
+	private:
+		bool OpenPdbFile(const std::wstring& modulePath, const std::string& pdbPath);
+
+	private:
+		MappedFile m_pdbFile;
+		std::vector<BYTE> m_inflated;
+		PortablePdb m_pdb;
+	};
+}
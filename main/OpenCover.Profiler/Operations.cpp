@@ -23,21 +23,39 @@
 
 namespace Instrumentation
 {
-	MapCanonicalNameOperationDetails Operations::m_mapNameOperationDetails;
-	MapOpsOperationDetails Operations::m_mapOpsOperationDetails;
-
-	Operations Operations::m_operations;
-
-	/// <summary>Build the static instance</summary>
-	Operations::Operations()
+	/// <summary>The details of every operation in "opcode.def" order i.e. indexed by <c>CanonicalName</c></summary>
+	constexpr OperationDetails Operations::m_operationDetails[] = 
 	{
 #define OPDEF(name, str, decs, incs, args, optp, stdlen, stdop1, stdop2, flow) \
-    { \
-    OperationDetails operation = {name, args, n##args, flow, stdlen, stdop1, stdop2, optp, _T(str)}; \
-    m_mapNameOperationDetails[name] = operation;  \
-    m_mapOpsOperationDetails[MAKEWORD(stdop1,stdop2)] = operation;  \
-    }
+    {name, args, n##args, flow, stdlen, stdop1, stdop2, optp, _T(str)},
 #include "opcode.def"
 #undef OPDEF
+	};
+
+	static_assert(sizeof(Operations::m_operationDetails) / sizeof(OperationDetails) == CANONICAL_NAME_COUNT, 
+		"the operation details must be indexable by CanonicalName");
+
+	namespace
+	{
+		/// <summary>Build the table of operations that are encoded with the supplied first byte</summary>
+		constexpr OpcodeTable BuildOpcodeTable(BYTE op1)
+		{
+			OpcodeTable table = {};
+			for (auto i = 0; i < 256; i++)
+			{
+				table.details[i] = Operations::m_operationDetails[CEE_ILLEGAL];
+			}
+			for (auto i = 0; i < CANONICAL_NAME_COUNT; i++)
+			{
+				if (Operations::m_operationDetails[i].op1 == op1)
+				{
+					table.details[Operations::m_operationDetails[i].op2] = Operations::m_operationDetails[i];
+				}
+			}
+			return table;
+		}
 	}
+
+	constexpr OpcodeTable Operations::m_oneByteOperationDetails = BuildOpcodeTable(REFPRE);
+	constexpr OpcodeTable Operations::m_twoByteOperationDetails = BuildOpcodeTable(STP1);
 }
\ No newline at end of file
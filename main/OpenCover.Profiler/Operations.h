@@ -7,6 +7,7 @@ enum CanonicalName {
 #define OPDEF(name, str, decs, incs, args, optp, stdlen, stdop1, stdop2, flow) name,
 #include <opcode.def>
 #undef OPDEF
+    CANONICAL_NAME_COUNT
 };
 
 /// <summary>A list of control flow types</summary>
@@ -79,25 +80,46 @@ struct OperationDetails
     BYTE op1;
     BYTE op2;
     OpcodeKind opcodeKind;
-    TCHAR *stringName;
+    const TCHAR *stringName;
 };
 
-typedef std::unordered_map<CanonicalName, OperationDetails> MapCanonicalNameOperationDetails;
-typedef std::unordered_map<DWORD, OperationDetails> MapOpsOperationDetails;
+/// <summary>The <c>OperationDetails</c> of every opcode that starts with the same byte, 
+/// indexed by the second byte</summary>
+struct OpcodeTable
+{
+    OperationDetails details[256];
+};
 
 namespace Instrumentation
 {
-	/// <summary>The container of the static lists used for the <c>OperationDetails</c> lookups</summary>
-	/// <remarks>The lists are built when we instantiate our static instance m_operations</remarks>
+	/// <summary>The container of the static tables used for the <c>OperationDetails</c> lookups</summary>
+	/// <remarks>The tables are built from "opcode.def" at compile time so there is nothing to 
+	/// initialise when the profiler is loaded and every lookup is a single indexed load. An unknown 
+	/// opcode resolves to the details of <c>CEE_ILLEGAL</c>.</remarks>
 	class Operations
 	{
 	public:
-		static MapCanonicalNameOperationDetails m_mapNameOperationDetails;
-		static MapOpsOperationDetails m_mapOpsOperationDetails;
-	protected:
-		Operations();
+		/// <summary>Get the details of an operation</summary>
+		static const OperationDetails& GetOperationDetails(CanonicalName operation)
+		{
+			_ASSERTE(operation >= 0 && operation < CANONICAL_NAME_COUNT);
+			return m_operationDetails[operation];
+		}
+
+		/// <summary>Get the details of an operation from its encoding</summary>
+		/// <param name="op1">The first byte, <c>STP1</c> for a two byte opcode otherwise <c>REFPRE</c></param>
+		/// <param name="op2">The second byte</param>
+		static const OperationDetails& GetOperationDetails(BYTE op1, BYTE op2)
+		{
+			return op1 == STP1 ? m_twoByteOperationDetails.details[op2] : m_oneByteOperationDetails.details[op2];
+		}
+
 	private:
-		static Operations m_operations;
+		Operations() = delete;
 
+	public:
+		static const OperationDetails m_operationDetails[CANONICAL_NAME_COUNT];
+		static const OpcodeTable m_oneByteOperationDetails;
+		static const OpcodeTable m_twoByteOperationDetails;
 	};
 }
\ No newline at end of file
@@ -0,0 +1,748 @@
+#include "stdafx.h"
+#include "PathProfile.h"
+
+#include <algorithm>
+#include <deque>
+#include <iomanip>
+#include <numeric>
+
+namespace Instrumentation
+{
+	namespace
+	{
+		const ULONG NoBlock = static_cast<ULONG>(-1);
+
+		ControlFlow GetControlFlow(const Instruction* pInstruction)
+		{
+			return Operations::GetOperationDetails(pInstruction->m_operation).controlFlow;
+		}
+
+		/// <summary>The ways out of a block, the fall through first (even if there is none) and then the targets</summary>
+		size_t GetWayCount(const Instruction* pLast)
+		{
+			return pLast->m_branches.size() + 1;
+		}
+
+		Instruction* CreateLoadConstant(Method& method, LONG value)
+		{
+			if (value >= -128 && value <= 127)
+				return method.CreateInstruction(CEE_LDC_I4_S, static_cast<BYTE>(value));
+			return method.CreateInstruction(CEE_LDC_I4, static_cast<ULONG>(value));
+		}
+
+		Instruction* CreateLoadLocal(Method& method, USHORT index)
+		{
+			return method.CreateInstruction(index < 256 ? CEE_LDLOC_S : CEE_LDLOC, index);
+		}
+
+		Instruction* CreateStoreLocal(Method& method, USHORT index)
+		{
+			return method.CreateInstruction(index < 256 ? CEE_STLOC_S : CEE_STLOC, index);
+		}
+
+		bool ReadCompressed(const BYTE* pData, ULONG size, ULONG& position, ULONG& value)
+		{
+			if (position >= size)
+				return false;
+			auto first = pData[position];
+			if ((first & 0x80) == 0)
+			{
+				value = first;
+				position += 1;
+				return true;
+			}
+			if ((first & 0xC0) == 0x80 && position + 2 <= size)
+			{
+				value = ((first & 0x3F) << 8) | pData[position + 1];
+				position += 2;
+				return true;
+			}
+			if ((first & 0xE0) == 0xC0 && position + 4 <= size)
+			{
+				value = ((first & 0x1F) << 24) | (pData[position + 1] << 16) | (pData[position + 2] << 8) | pData[position + 3];
+				position += 4;
+				return true;
+			}
+			return false;
+		}
+
+		void WriteCompressed(ULONG value, std::vector<BYTE>& data)
+		{
+			if (value < 0x80)
+			{
+				data.push_back(static_cast<BYTE>(value));
+			}
+			else if (value < 0x4000)
+			{
+				data.push_back(static_cast<BYTE>(0x80 | (value >> 8)));
+				data.push_back(static_cast<BYTE>(value));
+			}
+			else
+			{
+				data.push_back(static_cast<BYTE>(0xC0 | (value >> 24)));
+				data.push_back(static_cast<BYTE>(value >> 16));
+				data.push_back(static_cast<BYTE>(value >> 8));
+				data.push_back(static_cast<BYTE>(value));
+			}
+		}
+	}
+
+	/// <summary>Number the acyclic paths of a method and choose where the path register is moved</summary>
+	/// <param name="maxPaths">The most paths the method can have.</param>
+	/// <returns>false if the paths of the method cannot (or are not to) be counted.</returns>
+	bool PathGraph::Build(const Method& method, ULONG maxPaths)
+	{
+		m_pathCount = 0;
+		m_blocks.clear();
+		m_edges.clear();
+		m_backEdges.clear();
+		m_edgesFrom.clear();
+
+		if (!FindBlocks(method) || !FindEdges(method) || !NumberPaths(maxPaths))
+			return false;
+
+		PlaceIncrements();
+		return true;
+	}
+
+	/// <summary>Split the method into basic blocks, a block starts at the first instruction, at a branch target and
+	/// after each branch, ret and throw</summary>
+	bool PathGraph::FindBlocks(const Method& method)
+	{
+		const auto& instructions = method.m_instructions;
+		if (instructions.empty() || method.GetNumberOfExceptions() != 0)
+			return false;
+
+		std::vector<std::pair<Instruction*, size_t>> byAddress;
+		byAddress.reserve(instructions.size());
+		for (size_t index = 0; index < instructions.size(); index++)
+			byAddress.emplace_back(instructions[index], index);
+		std::sort(byAddress.begin(), byAddress.end());
+
+		std::vector<bool> leaders(instructions.size(), false);
+		leaders[0] = true;
+		for (size_t index = 0; index < instructions.size(); index++)
+		{
+			auto pInstruction = instructions[index];
+			if (pInstruction->m_operation == CEE_TAILCALL || pInstruction->m_operation == CEE_JMP)
+				return false;
+
+			for (auto pTarget : pInstruction->m_branches)
+			{
+				auto it = std::lower_bound(byAddress.begin(), byAddress.end(), std::make_pair(pTarget, size_t(0)));
+				if (it == byAddress.end() || it->first != pTarget)
+					return false;
+				leaders[it->second] = true;
+			}
+
+			auto flow = GetControlFlow(pInstruction);
+			if ((flow == BRANCH || flow == COND_BRANCH || flow == RETURN || flow == THROW) && index + 1 < instructions.size())
+				leaders[index + 1] = true;
+		}
+
+		for (size_t index = 0; index < instructions.size(); index++)
+		{
+			if (leaders[index])
+			{
+				PathBlock block;
+				block.first = index;
+				block.offset = instructions[index]->m_origOffset;
+				block.reachable = false;
+				m_blocks.push_back(block);
+			}
+			m_blocks.back().last = index;
+		}
+		return true;
+	}
+
+	ULONG PathGraph::AddEdge(ULONG from, ULONG to, PathEdgeKind kind, ULONG way)
+	{
+		PathEdge edge;
+		edge.from = from;
+		edge.to = to;
+		edge.kind = kind;
+		edge.way = way;
+		edge.value = 0;
+		edge.increment = 0;
+		m_edges.push_back(edge);
+		m_edgesFrom[from].push_back(static_cast<ULONG>(m_edges.size() - 1));
+		return static_cast<ULONG>(m_edges.size() - 1);
+	}
+
+	/// <summary>Find the edges between the blocks, and the back edges by a depth first search from the first block</summary>
+	/// <remarks>The blocks that cannot be reached have no edges, they are left as they are.</remarks>
+	bool PathGraph::FindEdges(const Method& method)
+	{
+		const auto& instructions = method.m_instructions;
+		auto blockCount = static_cast<ULONG>(m_blocks.size());
+		auto exit = GetExit();
+
+		std::vector<std::pair<Instruction*, ULONG>> leaders;
+		leaders.reserve(blockCount);
+		for (ULONG block = 0; block < blockCount; block++)
+			leaders.emplace_back(instructions[m_blocks[block].first], block);
+		std::sort(leaders.begin(), leaders.end());
+		auto blockOf = [&leaders](Instruction* pInstruction)
+		{
+			return std::lower_bound(leaders.begin(), leaders.end(), std::make_pair(pInstruction, ULONG(0)))->second;
+		};
+
+		// the blocks each way out of a block goes to, NoBlock where there is no way
+		std::vector<std::vector<ULONG>> successors(blockCount);
+		for (ULONG block = 0; block < blockCount; block++)
+		{
+			auto pLast = instructions[m_blocks[block].last];
+			auto& ways = successors[block];
+			ways.assign(GetWayCount(pLast), NoBlock);
+			auto flow = GetControlFlow(pLast);
+			if (flow == RETURN || flow == THROW)
+			{
+				ways[0] = exit;
+				continue;
+			}
+			if (flow != BRANCH)
+			{
+				if (block + 1 == blockCount)
+					return false; // runs off the end of the method
+				ways[0] = block + 1;
+			}
+			for (size_t target = 0; target < pLast->m_branches.size(); target++)
+				ways[target + 1] = blockOf(pLast->m_branches[target]);
+		}
+
+		m_edgesFrom.assign(blockCount + 2, std::vector<ULONG>());
+		AddEdge(GetEntry(), 0, PE_Entry, 0);
+
+		// 0 not visited, 1 on the stack, 2 done
+		std::vector<BYTE> state(blockCount, 0);
+		std::vector<std::vector<bool>> isBackEdge(blockCount);
+		std::vector<std::pair<ULONG, size_t>> stack;
+		stack.emplace_back(0, 0);
+		state[0] = 1;
+		while (!stack.empty())
+		{
+			auto block = stack.back().first;
+			auto way = stack.back().second;
+			auto& ways = successors[block];
+			if (way == ways.size())
+			{
+				state[block] = 2;
+				stack.pop_back();
+				continue;
+			}
+			stack.back().second++;
+			isBackEdge[block].resize(ways.size(), false);
+			auto to = ways[way];
+			if (to == NoBlock || to == exit)
+				continue;
+			if (state[to] == 1)
+				isBackEdge[block][way] = true;
+			else if (state[to] == 0)
+			{
+				state[to] = 1;
+				stack.emplace_back(to, 0);
+			}
+		}
+
+		std::map<ULONG, ULONG> loopExits, loopEntries;
+		for (ULONG block = 0; block < blockCount; block++)
+		{
+			m_blocks[block].reachable = state[block] != 0;
+			if (!m_blocks[block].reachable)
+				continue;
+
+			auto& ways = successors[block];
+			for (ULONG way = 0; way < ways.size(); way++)
+			{
+				if (ways[way] == NoBlock)
+					continue;
+				if (!isBackEdge[block][way])
+				{
+					AddEdge(block, ways[way], PE_Edge, way);
+					continue;
+				}
+
+				PathBackEdge backEdge;
+				backEdge.from = block;
+				backEdge.to = ways[way];
+				backEdge.way = way;
+				auto loopExit = loopExits.find(block);
+				backEdge.loopExit = loopExit != loopExits.end() ? loopExit->second
+					: (loopExits[block] = AddEdge(block, exit, PE_LoopExit, way));
+				auto loopEntry = loopEntries.find(backEdge.to);
+				backEdge.loopEntry = loopEntry != loopEntries.end() ? loopEntry->second
+					: (loopEntries[backEdge.to] = AddEdge(GetEntry(), backEdge.to, PE_LoopEntry, 0));
+				m_backEdges.push_back(backEdge);
+			}
+		}
+		return true;
+	}
+
+	/// <summary>Count the paths from each node to the exit, in reverse topological order, giving each edge the
+	/// number of paths before it</summary>
+	bool PathGraph::NumberPaths(ULONG maxPaths)
+	{
+		auto entry = GetEntry();
+		auto exit = GetExit();
+		std::vector<ULONGLONG> paths(m_edgesFrom.size(), 0);
+		std::vector<bool> visited(m_edgesFrom.size(), false);
+		paths[exit] = 1;
+		visited[exit] = true;
+
+		std::vector<std::pair<ULONG, size_t>> stack;
+		stack.emplace_back(entry, 0);
+		visited[entry] = true;
+		while (!stack.empty())
+		{
+			auto node = stack.back().first;
+			auto& edges = m_edgesFrom[node];
+			if (stack.back().second < edges.size())
+			{
+				auto to = m_edges[edges[stack.back().second++]].to;
+				if (!visited[to])
+				{
+					visited[to] = true;
+					stack.emplace_back(to, 0);
+				}
+				continue;
+			}
+
+			// every edge leads to a node whose paths are known, there are no cycles left
+			for (auto edge : edges)
+			{
+				m_edges[edge].value = static_cast<ULONG>(paths[node]);
+				paths[node] += paths[m_edges[edge].to];
+				if (paths[node] > maxPaths)
+					return false;
+			}
+			stack.pop_back();
+		}
+
+		m_pathCount = static_cast<ULONG>(paths[entry]);
+		return m_pathCount != 0;
+	}
+
+	/// <summary>The number of loops each block is in (by the natural loop of each back edge)</summary>
+	std::vector<ULONG> PathGraph::GetLoopDepths() const
+	{
+		auto blockCount = static_cast<ULONG>(m_blocks.size());
+		std::vector<std::vector<ULONG>> predecessors(blockCount);
+		for (auto& edge : m_edges)
+		{
+			if (edge.kind == PE_Edge && edge.to < blockCount)
+				predecessors[edge.to].push_back(edge.from);
+		}
+		for (auto& backEdge : m_backEdges)
+			predecessors[backEdge.to].push_back(backEdge.from);
+
+		std::vector<ULONG> depths(blockCount, 0);
+		std::vector<ULONG> mark(blockCount, NoBlock);
+		for (ULONG loop = 0; loop < m_backEdges.size(); loop++)
+		{
+			auto header = m_backEdges[loop].to;
+			mark[header] = loop;
+			depths[header]++;
+			std::vector<ULONG> pending;
+			if (mark[m_backEdges[loop].from] != loop)
+			{
+				mark[m_backEdges[loop].from] = loop;
+				depths[m_backEdges[loop].from]++;
+				pending.push_back(m_backEdges[loop].from);
+			}
+			while (!pending.empty())
+			{
+				auto block = pending.back();
+				pending.pop_back();
+				for (auto predecessor : predecessors[block])
+				{
+					if (mark[predecessor] == loop)
+						continue;
+					mark[predecessor] = loop;
+					depths[predecessor]++;
+					pending.push_back(predecessor);
+				}
+			}
+		}
+		return depths;
+	}
+
+	/// <summary>Choose a spanning tree of the graph (with an edge from the exit to the entry) and give each edge
+	/// outside it the increment that makes the sum of the increments along any path its number</summary>
+	/// <remarks>The increments of the edges that set or count the register (out of the entry, and into the exit)
+	/// cost nothing so they are put in the tree last; then the edges inside the most loops and the taken ways of
+	/// branches, as the others are cheaper to move the register on.</remarks>
+	void PathGraph::PlaceIncrements()
+	{
+		auto nodeCount = static_cast<ULONG>(m_edgesFrom.size());
+		auto entry = GetEntry();
+		auto exit = GetExit();
+		auto depths = GetLoopDepths();
+
+		std::vector<ULONG> parents(nodeCount);
+		std::iota(parents.begin(), parents.end(), 0);
+		auto find = [&parents](ULONG node)
+		{
+			while (parents[node] != node)
+				node = parents[node] = parents[parents[node]];
+			return node;
+		};
+
+		auto isFree = [entry, exit](const PathEdge& edge) { return edge.from == entry || edge.to == exit; };
+		auto weight = [&depths](const PathEdge& edge) { return depths[edge.from] * 2 + (edge.way != 0 ? 1 : 0); };
+		std::vector<ULONG> order(m_edges.size());
+		std::iota(order.begin(), order.end(), 0);
+		std::stable_sort(order.begin(), order.end(), [this, &isFree, &weight](ULONG left, ULONG right)
+		{
+			auto& leftEdge = m_edges[left];
+			auto& rightEdge = m_edges[right];
+			if (isFree(leftEdge) != isFree(rightEdge))
+				return isFree(leftEdge);
+			return !isFree(leftEdge) && weight(leftEdge) > weight(rightEdge);
+		});
+
+		// the edge from the exit to the entry is always in the tree
+		parents[find(exit)] = find(entry);
+		std::vector<std::vector<ULONG>> tree(nodeCount);
+		for (auto edge : order)
+		{
+			auto from = find(m_edges[edge].from);
+			auto to = find(m_edges[edge].to);
+			if (from == to)
+				continue;
+			parents[from] = to;
+			tree[m_edges[edge].from].push_back(edge);
+			tree[m_edges[edge].to].push_back(edge);
+		}
+
+		// the potential of each node: along a tree edge it goes up by the edge's value
+		std::vector<LONGLONG> potentials(nodeCount, 0);
+		std::vector<bool> reached(nodeCount, false);
+		std::deque<ULONG> pending;
+		pending.push_back(entry);
+		pending.push_back(exit);
+		reached[entry] = reached[exit] = true;
+		while (!pending.empty())
+		{
+			auto node = pending.front();
+			pending.pop_front();
+			for (auto edge : tree[node])
+			{
+				auto& treeEdge = m_edges[edge];
+				auto other = treeEdge.from == node ? treeEdge.to : treeEdge.from;
+				if (reached[other])
+					continue;
+				reached[other] = true;
+				potentials[other] = treeEdge.from == node ? potentials[node] + treeEdge.value : potentials[node] - treeEdge.value;
+				pending.push_back(other);
+			}
+		}
+
+		// the register wraps, so only the low 32 bits of an increment matter
+		for (auto& edge : m_edges)
+			edge.increment = static_cast<LONG>(static_cast<ULONG>(edge.value + potentials[edge.from] - potentials[edge.to]));
+	}
+
+	/// <summary>The number of places the path register is set, moved or counted</summary>
+	ULONG PathGraph::GetProbeCount() const
+	{
+		ULONG probes = 1;
+		for (auto& edge : m_edges)
+		{
+			if (edge.kind == PE_Edge && (edge.to == GetExit() || edge.increment != 0))
+				probes++;
+		}
+		return probes + static_cast<ULONG>(m_backEdges.size());
+	}
+
+	/// <summary>Find the edges of a path, from the entry to the exit, from its number</summary>
+	bool PathGraph::DecodePath(ULONG path, std::vector<ULONG>& edges) const
+	{
+		edges.clear();
+		if (path >= m_pathCount)
+			return false;
+
+		auto node = GetEntry();
+		auto remaining = path;
+		while (node != GetExit())
+		{
+			auto& from = m_edgesFrom[node];
+			auto it = std::upper_bound(from.begin(), from.end(), remaining,
+				[this](ULONG value, ULONG edge) { return value < m_edges[edge].value; });
+			if (it == from.begin())
+				return false;
+			auto edge = *(--it);
+			edges.push_back(edge);
+			remaining -= m_edges[edge].value;
+			node = m_edges[edge].to;
+		}
+		return remaining == 0;
+	}
+
+	/// <summary>Set the path register, i.e. <c>r = value</c></summary>
+	Instruction* PathProbe::EmitSet(Method& method, InstructionList& instructions, LONG value) const
+	{
+		auto pFirst = CreateLoadConstant(method, value);
+		instructions.push_back(pFirst);
+		instructions.push_back(CreateStoreLocal(method, pathRegister));
+		return pFirst;
+	}
+
+	/// <summary>Move the path register, i.e. <c>r += increment</c></summary>
+	Instruction* PathProbe::EmitIncrement(Method& method, InstructionList& instructions, LONG increment) const
+	{
+		auto pFirst = CreateLoadLocal(method, pathRegister);
+		instructions.push_back(pFirst);
+		instructions.push_back(CreateLoadConstant(method, increment));
+		instructions.push_back(method.CreateInstruction(CEE_ADD));
+		instructions.push_back(CreateStoreLocal(method, pathRegister));
+		return pFirst;
+	}
+
+	/// <summary>Count the path that ends here, i.e. <c>pCounters[r + increment]++</c></summary>
+	/// <remarks>As the inline counters, racing visits may be lost.</remarks>
+	Instruction* PathProbe::EmitCount(Method& method, InstructionList& instructions, LONG increment) const
+	{
+		auto pFirst = CreateLoadLocal(method, pathRegister);
+		instructions.push_back(pFirst);
+		if (increment != 0)
+		{
+			instructions.push_back(CreateLoadConstant(method, increment));
+			instructions.push_back(method.CreateInstruction(CEE_ADD));
+		}
+		instructions.push_back(method.CreateInstruction(CEE_LDC_I4_2));
+		instructions.push_back(method.CreateInstruction(CEE_SHL));
+		instructions.push_back(method.CreateInstruction(CEE_CONV_U));
+#ifdef _WIN64
+		instructions.push_back(method.CreateInstruction(CEE_LDC_I8, (ULONGLONG)pCounters));
+#else
+		instructions.push_back(method.CreateInstruction(CEE_LDC_I4, (ULONG)pCounters));
+#endif
+		instructions.push_back(method.CreateInstruction(CEE_CONV_U));
+		instructions.push_back(method.CreateInstruction(CEE_ADD));
+		instructions.push_back(method.CreateInstruction(CEE_DUP));
+		instructions.push_back(method.CreateInstruction(CEE_LDIND_U4));
+		instructions.push_back(method.CreateInstruction(CEE_LDC_I4_1));
+		instructions.push_back(method.CreateInstruction(CEE_ADD));
+		instructions.push_back(method.CreateInstruction(CEE_STIND_I4));
+		return pFirst;
+	}
+
+	/// <summary>Add the probes that count the paths of a method, numbered by the graph built from it</summary>
+	/// <remarks><para>The register is set on entry and moved on the edges outside the spanning tree; each ret and
+	/// throw counts the path that ends there, and each back edge counts the path that ends at it then sets the
+	/// register for the path that starts at the header of its loop.</para>
+	/// <para>The code of the only way out of a block goes before its br, ret or throw (and whatever branched to
+	/// that now branches to the code); the code of a fall through follows the block and that of a taken way of a
+	/// conditional branch (or switch) is put after the end of the method with a jump to the target.</para>
+	/// <para>The coverage probes can then be added as usual, at the original offsets and on the branches, without
+	/// changing the paths.</para></remarks>
+	void AddPathProfile(Method& method, const PathGraph& graph, const PathProbe& probe)
+	{
+		const auto& blocks = graph.GetBlocks();
+		const auto& edges = graph.GetEdges();
+		auto& instructions = method.m_instructions;
+
+		// the code of each way out of each block
+		std::vector<std::vector<InstructionList>> code(blocks.size());
+		for (size_t block = 0; block < blocks.size(); block++)
+			code[block].resize(GetWayCount(instructions[blocks[block].last]));
+
+		LONG initial = 0;
+		for (auto& edge : edges)
+		{
+			if (edge.kind == PE_Entry)
+				initial = edge.increment;
+			if (edge.kind != PE_Edge)
+				continue;
+			if (edge.to == graph.GetExit())
+				probe.EmitCount(method, code[edge.from][edge.way], edge.increment);
+			else if (edge.increment != 0)
+				probe.EmitIncrement(method, code[edge.from][edge.way], edge.increment);
+		}
+		for (auto& backEdge : graph.GetBackEdges())
+		{
+			auto& backCode = code[backEdge.from][backEdge.way];
+			probe.EmitCount(method, backCode, edges[backEdge.loopExit].increment);
+			probe.EmitSet(method, backCode, edges[backEdge.loopEntry].increment);
+		}
+
+		InstructionList result;
+		result.reserve(instructions.size() + (edges.size() * 4));
+		InstructionList jumps;
+		std::vector<std::pair<Instruction*, Instruction*>> redirects;
+
+		// nothing branches to the code that sets the register on entry
+		probe.EmitSet(method, result, initial);
+
+		for (size_t block = 0; block < blocks.size(); block++)
+		{
+			result.insert(result.end(), instructions.begin() + blocks[block].first, instructions.begin() + blocks[block].last);
+			auto pLast = instructions[blocks[block].last];
+			auto& ways = code[block];
+			auto flow = GetControlFlow(pLast);
+			if (flow == BRANCH || flow == RETURN || flow == THROW)
+			{
+				auto& onlyWay = ways[flow == BRANCH ? 1 : 0];
+				if (!onlyWay.empty())
+				{
+					redirects.emplace_back(pLast, onlyWay.front());
+					result.insert(result.end(), onlyWay.begin(), onlyWay.end());
+				}
+				result.push_back(pLast);
+				continue;
+			}
+
+			result.push_back(pLast);
+			result.insert(result.end(), ways[0].begin(), ways[0].end());
+			for (size_t way = 1; way < ways.size(); way++)
+			{
+				if (ways[way].empty())
+					continue;
+				auto pJump = method.CreateInstruction(CEE_BR);
+				pJump->m_isBranch = true;
+				pJump->m_branches.push_back(pLast->m_branches[way - 1]);
+				jumps.insert(jumps.end(), ways[way].begin(), ways[way].end());
+				jumps.push_back(pJump);
+				pLast->m_branches[way - 1] = ways[way].front();
+			}
+		}
+
+		// the method cannot fall through its last instruction so nothing runs into them
+		result.insert(result.end(), jumps.begin(), jumps.end());
+
+		std::sort(redirects.begin(), redirects.end());
+		for (auto pInstruction : result)
+		{
+			for (auto& pTarget : pInstruction->m_branches)
+			{
+				auto it = std::lower_bound(redirects.begin(), redirects.end(), std::make_pair(pTarget, static_cast<Instruction*>(nullptr)));
+				if (it != redirects.end() && it->first == pTarget)
+					pTarget = it->second;
+			}
+		}
+
+		instructions.swap(result);
+		method.UpdateOffsets(0, instructions.size());
+		method.IncrementStackSize(PATH_PROBE_STACK_SIZE);
+	}
+
+	/// <summary>Find where the code that sets the path register on entry ends, if a method (that is read back)
+	/// starts with what could be it</summary>
+	/// <param name="offset">Receives the offset of the instruction after it.</param>
+	/// <remarks>The probes the method was otherwise instrumented with follow it (see <c>AddPathProfile</c>).</remarks>
+	bool FindPathSetEnd(const Method& method, long& offset)
+	{
+		auto& instructions = method.m_instructions;
+		if (instructions.size() < 3
+			|| (instructions[0]->m_operation != CEE_LDC_I4_S && instructions[0]->m_operation != CEE_LDC_I4)
+			|| (instructions[1]->m_operation != CEE_STLOC_S && instructions[1]->m_operation != CEE_STLOC))
+			return false;
+
+		offset = instructions[2]->m_origOffset;
+		return true;
+	}
+
+	/// <summary>Add a local to a signature of locals (<c>LocalVarSig</c>)</summary>
+	/// <param name="pSignature">The signature of the locals, <c>nullptr</c> if there are none.</param>
+	/// <param name="index">Receives the index of the local that was added.</param>
+	/// <returns>false if the signature cannot be read or has no room for another local.</returns>
+	bool AppendLocal(const BYTE* pSignature, ULONG signatureSize, BYTE elementType, std::vector<BYTE>& signature, USHORT& index)
+	{
+		ULONG count = 0;
+		ULONG position = 0;
+		if (pSignature != nullptr && signatureSize != 0)
+		{
+			if (pSignature[0] != IMAGE_CEE_CS_CALLCONV_LOCAL_SIG)
+				return false;
+			position = 1;
+			if (!ReadCompressed(pSignature, signatureSize, position, count))
+				return false;
+		}
+		if (count >= 0xFFFF)
+			return false;
+
+		index = static_cast<USHORT>(count);
+		signature.clear();
+		signature.push_back(IMAGE_CEE_CS_CALLCONV_LOCAL_SIG);
+		WriteCompressed(count + 1, signature);
+		if (position != 0)
+			signature.insert(signature.end(), pSignature + position, pSignature + signatureSize);
+		signature.push_back(elementType);
+		return true;
+	}
+
+	/// <summary>Give a method its path counters</summary>
+	/// <returns>The counters, one for each path of the graph; they live as long as the profile.</returns>
+	ULONG* PathProfile::Add(const std::wstring& modulePath, const std::wstring& assemblyName, mdToken functionToken,
+		const std::shared_ptr<const PathGraph>& graph)
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		auto key = std::make_pair(modulePath, functionToken);
+		auto it = m_index.find(key);
+		if (it != m_index.end() && m_methods[it->second]->graph->GetPathCount() == graph->GetPathCount())
+			return m_methods[it->second]->counters.get();
+
+		std::unique_ptr<MethodPaths> method(new MethodPaths());
+		method->modulePath = modulePath;
+		method->assemblyName = assemblyName;
+		method->functionToken = functionToken;
+		method->graph = graph;
+		method->counters.reset(new ULONG[graph->GetPathCount()]());
+		auto pCounters = method->counters.get();
+		m_index[key] = m_methods.size();
+		m_methods.push_back(std::move(method));
+		return pCounters;
+	}
+
+	/// <summary>Write the paths that were run, a line for each method then a line for each of its paths that ran,
+	/// the most run first</summary>
+	/// <remarks><para>The lines of comma separated values are
+	/// <c>M,token,paths,paths run,"assembly","module"</c> and <c>P,path number,count,blocks</c>.</para>
+	/// <para>The blocks of a path are the IL offsets (in hex) of their first instructions joined by '&gt;'; a path
+	/// that starts at the header of a loop, after a back edge, begins with '~' and a path that ends at a back
+	/// edge ends with '~'.</para></remarks>
+	void PathProfile::Write(std::wostream& out) const
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		for (const auto& method : m_methods)
+		{
+			auto& graph = *method->graph;
+			std::vector<ULONG> run;
+			for (ULONG path = 0; path < graph.GetPathCount(); path++)
+			{
+				if (method->counters[path] != 0)
+					run.push_back(path);
+			}
+			std::stable_sort(run.begin(), run.end(),
+				[&method](ULONG left, ULONG right) { return method->counters[left] > method->counters[right]; });
+
+			out << L"M," << L"0x" << std::hex << std::setw(8) << std::setfill(L'0') << method->functionToken << std::dec << std::setfill(L' ')
+				<< L"," << graph.GetPathCount() << L"," << run.size() << L","
+				<< L"\"" << method->assemblyName << L"\",\"" << method->modulePath << L"\"" << std::endl;
+
+			std::vector<ULONG> edges;
+			for (auto path : run)
+			{
+				out << L"P," << path << L"," << method->counters[path] << L",";
+				graph.DecodePath(path, edges);
+				for (size_t index = 0; index < edges.size(); index++)
+				{
+					auto& edge = graph.GetEdges()[edges[index]];
+					if (edge.kind == PE_LoopEntry)
+						out << L"~";
+					if (edge.to == graph.GetExit())
+					{
+						if (edge.kind == PE_LoopExit)
+							out << L"~";
+						continue;
+					}
+					if (index != 0)
+						out << L">";
+					out << std::hex << std::uppercase << std::setw(4) << std::setfill(L'0') << graph.GetBlocks()[edge.to].offset
+						<< std::dec << std::nouppercase << std::setfill(L' ');
+				}
+				out << std::endl;
+			}
+		}
+	}
+}
@@ -0,0 +1,165 @@
+#pragma once
+
+#include "Method.h"
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <vector>
+
+// the stack slots a path probe needs (see PathProbe)
+#define PATH_PROBE_STACK_SIZE 3
+// the most paths a method can have for them to be counted, unless OpenCover_Profiler_MaxPathsPerMethod says otherwise
+#define DEFAULT_MAX_PATHS_PER_METHOD 4096
+
+namespace Instrumentation
+{
+	/// <summary>What an edge of a <c>PathGraph</c> stands for</summary>
+	enum PathEdgeKind
+	{
+		// from a block to the next block it runs, or to the exit for a ret or throw
+		PE_Edge = 0,
+		// from the entry to the first block
+		PE_Entry = 1,
+		// from the entry to the header of a loop, for the paths that start after a back edge
+		PE_LoopEntry = 2,
+		// from the tail of a loop to the exit, for the paths that end at a back edge
+		PE_LoopExit = 3,
+	};
+
+	/// <summary>An edge of the (acyclic) graph the paths of a method are numbered on</summary>
+	struct PathEdge
+	{
+		ULONG from;
+		ULONG to;
+		PathEdgeKind kind;
+		// how the edge leaves its block: 0 falls through (or is the only way out), n is the n-th target of the branch
+		ULONG way;
+		// the first number of the paths that take the edge, from the number of paths before it (Ball-Larus)
+		ULONG value;
+		// what the path register is moved by when the edge is taken, 0 for the edges of the spanning tree
+		LONG increment;
+	};
+
+	/// <summary>A back edge, it is replaced in the graph by an edge from its tail to the exit and another from
+	/// the entry to its header</summary>
+	struct PathBackEdge
+	{
+		ULONG from;
+		ULONG to;
+		ULONG way;
+		ULONG loopExit;
+		ULONG loopEntry;
+	};
+
+	/// <summary>A basic block, the instructions [first, last] of the method</summary>
+	struct PathBlock
+	{
+		size_t first;
+		size_t last;
+		long offset;
+		bool reachable;
+	};
+
+	/// <summary>The acyclic paths through a method, numbered 0 to <c>GetPathCount() - 1</c> as by Ball and Larus</summary>
+	/// <remarks><para>Each back edge (found by a depth first search from the entry) ends a path and starts another
+	/// at the header of its loop, so a loop that runs n times runs n + 1 paths.</para>
+	/// <para>The path register only needs to be moved on the edges that are not in a spanning tree of the graph;
+	/// the tree is chosen to leave out the edges that are least likely to run, those outside loops and the taken
+	/// ways of branches (as they need a jump to the code of the edge), and the edges whose increment can be folded
+	/// into the code that sets or counts the register.</para>
+	/// <para>Methods with exception handlers, tail calls or <c>jmp</c> are not numbered, nor are methods with more
+	/// paths than the limit.</para></remarks>
+	class PathGraph
+	{
+	public:
+		PathGraph() : m_pathCount(0) {}
+
+	public:
+		bool Build(const Method& method, ULONG maxPaths);
+
+		ULONG GetPathCount() const { return m_pathCount; }
+		ULONG GetEntry() const { return static_cast<ULONG>(m_blocks.size()); }
+		ULONG GetExit() const { return static_cast<ULONG>(m_blocks.size() + 1); }
+
+		const std::vector<PathBlock>& GetBlocks() const { return m_blocks; }
+		const std::vector<PathEdge>& GetEdges() const { return m_edges; }
+		const std::vector<PathBackEdge>& GetBackEdges() const { return m_backEdges; }
+		const std::vector<ULONG>& GetEdgesFrom(ULONG node) const { return m_edgesFrom[node]; }
+
+		ULONG GetProbeCount() const;
+		bool DecodePath(ULONG path, std::vector<ULONG>& edges) const;
+
+	private:
+		bool FindBlocks(const Method& method);
+		bool FindEdges(const Method& method);
+		bool NumberPaths(ULONG maxPaths);
+		void PlaceIncrements();
+		std::vector<ULONG> GetLoopDepths() const;
+		ULONG AddEdge(ULONG from, ULONG to, PathEdgeKind kind, ULONG way);
+
+	private:
+		ULONG m_pathCount;
+		std::vector<PathBlock> m_blocks;
+		std::vector<PathEdge> m_edges;
+		std::vector<PathBackEdge> m_backEdges;
+		// the edges out of each block, then out of the entry and the exit (none)
+		std::vector<std::vector<ULONG>> m_edgesFrom;
+	};
+
+	/// <summary>The probes that number and count the paths of a method; the register is a local (of int32) of the
+	/// method, the counters are indexed by path number</summary>
+	/// <remarks>The probes are stack neutral and need up to <c>PATH_PROBE_STACK_SIZE</c> slots; like the inline
+	/// counters they are not verifiable.</remarks>
+	struct PathProbe
+	{
+		static const unsigned int StackSize = PATH_PROBE_STACK_SIZE;
+
+		PathProbe(USHORT pathRegister, ULONG* pCounters) : pathRegister(pathRegister), pCounters(pCounters) {}
+
+		Instruction* EmitSet(Method& method, InstructionList& instructions, LONG value) const;
+		Instruction* EmitIncrement(Method& method, InstructionList& instructions, LONG increment) const;
+		Instruction* EmitCount(Method& method, InstructionList& instructions, LONG increment) const;
+
+		USHORT pathRegister;
+		ULONG* pCounters;
+	};
+
+	void AddPathProfile(Method& method, const PathGraph& graph, const PathProbe& probe);
+	bool FindPathSetEnd(const Method& method, long& offset);
+	bool AppendLocal(const BYTE* pSignature, ULONG signatureSize, BYTE elementType, std::vector<BYTE>& signature, USHORT& index);
+
+	/// <summary>The path counters of the methods that have been profiled, written at shutdown</summary>
+	/// <remarks>The methods are added as they are instrumented, from any thread; a method that is instrumented
+	/// again (e.g. in another AppDomain) shares the counters it was first given.</remarks>
+	class PathProfile
+	{
+	public:
+		PathProfile() {}
+
+	private:
+		PathProfile(const PathProfile&) = delete;
+		PathProfile& operator = (const PathProfile&) = delete;
+
+	public:
+		ULONG* Add(const std::wstring& modulePath, const std::wstring& assemblyName, mdToken functionToken,
+			const std::shared_ptr<const PathGraph>& graph);
+		void Write(std::wostream& out) const;
+
+	private:
+		struct MethodPaths
+		{
+			std::wstring modulePath;
+			std::wstring assemblyName;
+			mdToken functionToken;
+			std::shared_ptr<const PathGraph> graph;
+			std::unique_ptr<ULONG[]> counters;
+		};
+
+		mutable std::mutex m_mutex;
+		std::vector<std::unique_ptr<MethodPaths>> m_methods;
+		std::map<std::pair<std::wstring, mdToken>, size_t> m_index;
+	};
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include "Messages.h"
+
+#include <vector>
+
+/// <summary>A non-owning view over a contiguous run of points (<c>SequencePoint</c> or <c>BranchPoint</c>)</summary>
+/// <remarks>Lets the points be consumed where they already are, e.g. in the chat buffer shared with
+/// the host, rather than being copied into a <c>std::vector</c> first. The points must outlive the span.</remarks>
+template<typename T>
+class PointSpan
+{
+public:
+	typedef const T* const_iterator;
+
+	PointSpan() : m_pPoints(nullptr), m_count(0) {}
+	PointSpan(const T* pPoints, size_t count) : m_pPoints(pPoints), m_count(count) {}
+	PointSpan(const std::vector<T>& points) : m_pPoints(points.data()), m_count(points.size()) {}
+
+	const_iterator begin() const { return m_pPoints; }
+	const_iterator end() const { return m_pPoints + m_count; }
+	size_t size() const { return m_count; }
+	bool empty() const { return m_count == 0; }
+	const T& operator[](size_t index) const { return m_pPoints[index]; }
+	const T& front() const { return m_pPoints[0]; }
+	const T& back() const { return m_pPoints[m_count - 1]; }
+
+private:
+	const T* m_pPoints;
+	size_t m_count;
+};
+
+typedef PointSpan<SequencePoint> SequencePointSpan;
+typedef PointSpan<BranchPoint> BranchPointSpan;
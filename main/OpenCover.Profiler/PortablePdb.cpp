@@ -0,0 +1,400 @@
+#include "stdafx.h"
+#include "PortablePdb.h"
+
+#include <algorithm>
+
+// see https://github.com/dotnet/runtime/blob/main/docs/design/specs/PortablePdb-Metadata.md
+#define METADATA_SIGNATURE 0x424A5342
+#define TABLE_DOCUMENT 0x30
+#define TABLE_METHOD_DEBUG_INFORMATION 0x31
+
+#define HEAP_GUID_LARGE 0x02
+#define HEAP_BLOB_LARGE 0x04
+#define HEAP_EXTRA_DATA 0x40
+
+#define IMAGE_DIRECTORY_DEBUG 6
+#define IMAGE_DEBUG_CODEVIEW 2
+#define IMAGE_DEBUG_EMBEDDED_PORTABLE_PDB 17
+#define CODEVIEW_SIGNATURE 0x53445352
+#define CODEVIEW_PORTABLE_MINOR 0x504D
+#define EMBEDDED_PDB_SIGNATURE 0x4244504D
+
+namespace Instrumentation
+{
+	namespace
+	{
+		ULONG Read16(const BYTE* p)
+		{
+			return p[0] | (p[1] << 8);
+		}
+
+		ULONG Read32(const BYTE* p)
+		{
+			return p[0] | (p[1] << 8) | (p[2] << 16) | (static_cast<ULONG>(p[3]) << 24);
+		}
+
+		ULONG ReadIndex(const BYTE* p, ULONG size)
+		{
+			return size == 2 ? Read16(p) : Read32(p);
+		}
+
+		/// <summary>Read a compressed unsigned integer (ECMA-335 II.23.2)</summary>
+		bool ReadCompressed(const BYTE*& p, const BYTE* pEnd, ULONG& value, ULONG& length)
+		{
+			if (p >= pEnd)
+				return false;
+			if ((p[0] & 0x80) == 0)
+				length = 1;
+			else if ((p[0] & 0xC0) == 0x80)
+				length = 2;
+			else if ((p[0] & 0xE0) == 0xC0)
+				length = 4;
+			else
+				return false;
+			if (static_cast<ULONG>(pEnd - p) < length)
+				return false;
+
+			switch (length)
+			{
+			case 1: value = p[0]; break;
+			case 2: value = ((p[0] & 0x3F) << 8) | p[1]; break;
+			default: value = ((p[0] & 0x1F) << 24) | (p[1] << 16) | (p[2] << 8) | p[3]; break;
+			}
+			p += length;
+			return true;
+		}
+
+		bool ReadCompressed(const BYTE*& p, const BYTE* pEnd, ULONG& value)
+		{
+			ULONG length;
+			return ReadCompressed(p, pEnd, value, length);
+		}
+
+		/// <summary>Read a compressed signed integer, the sign bit is rotated into the lowest bit</summary>
+		bool ReadCompressedSigned(const BYTE*& p, const BYTE* pEnd, LONG& value)
+		{
+			ULONG raw, length;
+			if (!ReadCompressed(p, pEnd, raw, length))
+				return false;
+			ULONG extend = length == 1 ? 0xFFFFFFC0 : length == 2 ? 0xFFFFE000 : 0xF0000000;
+			auto result = raw >> 1;
+			if ((raw & 1) != 0)
+				result |= extend;
+			value = static_cast<LONG>(result);
+			return true;
+		}
+
+		/// <summary>Find the file offset of an RVA from the section headers</summary>
+		bool RvaToOffset(const BYTE* pImage, ULONG size, ULONG sections, ULONG sectionCount, ULONG rva, ULONG& offset)
+		{
+			for (ULONG i = 0; i < sectionCount; i++)
+			{
+				auto section = sections + (i * 40);
+				if (section + 40 > size)
+					return false;
+				auto virtualSize = Read32(pImage + section + 8);
+				auto virtualAddress = Read32(pImage + section + 12);
+				auto rawSize = Read32(pImage + section + 16);
+				auto rawPointer = Read32(pImage + section + 20);
+				if (rva >= virtualAddress && rva - virtualAddress < std::max(virtualSize, rawSize))
+				{
+					offset = rawPointer + (rva - virtualAddress);
+					return offset < size;
+				}
+			}
+			return false;
+		}
+	}
+
+	PortablePdb::PortablePdb() : m_pBlobs(nullptr), m_blobsSize(0),
+		m_pDocuments(nullptr), m_documentRows(0), m_documentRowSize(0),
+		m_pMethods(nullptr), m_methodRows(0), m_methodRowSize(0),
+		m_blobIndexSize(2), m_documentIndexSize(2)
+	{
+	}
+
+	/// <summary>Find the tables of the PDB</summary>
+	/// <returns>false if the data is not a portable PDB, or it holds tables of the type system (it is not
+	/// a standalone PDB).</returns>
+	bool PortablePdb::Open(const BYTE* pData, ULONG size)
+	{
+		if (size < 20 || Read32(pData) != METADATA_SIGNATURE)
+			return false;
+
+		auto versionLength = Read32(pData + 12);
+		if (versionLength > size - 20)
+			return false;
+		auto position = 16 + versionLength;
+		auto streams = Read16(pData + position + 2);
+		position += 4;
+
+		const BYTE* pTables = nullptr;
+		ULONG tablesSize = 0;
+		auto isPdb = false;
+		for (ULONG i = 0; i < streams; i++)
+		{
+			if (size - position < 9)
+				return false;
+			auto offset = Read32(pData + position);
+			auto streamSize = Read32(pData + position + 4);
+			auto pName = reinterpret_cast<const char*>(pData + position + 8);
+			auto nameLength = strnlen(pName, std::min<size_t>(32, size - position - 8));
+			position += 8 + static_cast<ULONG>((nameLength + 4) & ~3);
+			if (offset > size || streamSize > size - offset)
+				return false;
+
+			std::string name(pName, nameLength);
+			if (name == "#~")
+			{
+				pTables = pData + offset;
+				tablesSize = streamSize;
+			}
+			else if (name == "#Blob")
+			{
+				m_pBlobs = pData + offset;
+				m_blobsSize = streamSize;
+			}
+			else if (name == "#Pdb")
+				isPdb = true;
+		}
+		if (!isPdb || pTables == nullptr || m_pBlobs == nullptr || tablesSize < 24)
+			return false;
+
+		auto heapSizes = pTables[6];
+		auto valid = static_cast<ULONGLONG>(Read32(pTables + 8)) | (static_cast<ULONGLONG>(Read32(pTables + 12)) << 32);
+		if ((valid & ((1ULL << TABLE_DOCUMENT) - 1)) != 0)
+			return false;
+
+		ULONG rows[64] = {};
+		position = 24;
+		for (auto table = 0; table < 64; table++)
+		{
+			if ((valid & (1ULL << table)) == 0)
+				continue;
+			if (tablesSize - position < 4)
+				return false;
+			rows[table] = Read32(pTables + position);
+			position += 4;
+		}
+		if ((heapSizes & HEAP_EXTRA_DATA) != 0)
+			position += 4;
+
+		auto guidIndexSize = (heapSizes & HEAP_GUID_LARGE) != 0 ? 4 : 2;
+		m_blobIndexSize = (heapSizes & HEAP_BLOB_LARGE) != 0 ? 4 : 2;
+		m_documentRows = rows[TABLE_DOCUMENT];
+		m_documentRowSize = (2 * m_blobIndexSize) + (2 * guidIndexSize);
+		m_documentIndexSize = m_documentRows < 0x10000 ? 2 : 4;
+		m_methodRows = rows[TABLE_METHOD_DEBUG_INFORMATION];
+		m_methodRowSize = m_documentIndexSize + m_blobIndexSize;
+
+		// the tables are in the order of their numbers, these are the first two
+		auto documentsSize = static_cast<ULONGLONG>(m_documentRows) * m_documentRowSize;
+		auto methodsSize = static_cast<ULONGLONG>(m_methodRows) * m_methodRowSize;
+		if (position > tablesSize || documentsSize + methodsSize > tablesSize - position)
+			return false;
+		m_pDocuments = pTables + position;
+		m_pMethods = m_pDocuments + documentsSize;
+		return true;
+	}
+
+	bool PortablePdb::GetBlob(ULONG index, const BYTE*& pBlob, ULONG& size) const
+	{
+		if (index >= m_blobsSize)
+			return false;
+		pBlob = m_pBlobs + index;
+		if (!ReadCompressed(pBlob, m_pBlobs + m_blobsSize, size))
+			return false;
+		return size <= static_cast<ULONG>((m_pBlobs + m_blobsSize) - pBlob);
+	}
+
+	/// <summary>Decode the sequence points of a method</summary>
+	/// <param name="functionToken">The method, its row of the MethodDebugInformation table is that of the
+	/// MethodDef table.</param>
+	/// <param name="points">Receives the points in the order they are held, which is that of their offsets;
+	/// hidden points are included.</param>
+	/// <returns>false if the method is not in the PDB or its points cannot be decoded.</returns>
+	bool PortablePdb::GetSequencePoints(mdMethodDef functionToken, std::vector<PdbSequencePoint>& points) const
+	{
+		points.clear();
+		auto row = functionToken & 0x00FFFFFF;
+		if ((functionToken & 0xFF000000) != 0x06000000 || row == 0 || row > m_methodRows)
+			return false;
+
+		auto pRow = m_pMethods + ((row - 1) * m_methodRowSize);
+		auto document = ReadIndex(pRow, m_documentIndexSize);
+		auto index = ReadIndex(pRow + m_documentIndexSize, m_blobIndexSize);
+		if (index == 0)
+			return true;
+
+		const BYTE* p;
+		ULONG size;
+		if (!GetBlob(index, p, size))
+			return false;
+		auto pEnd = p + size;
+
+		// the header, the document is only there if the method has points in more than one
+		ULONG localSignature;
+		if (!ReadCompressed(p, pEnd, localSignature))
+			return false;
+		if (document == 0 && !ReadCompressed(p, pEnd, document))
+			return false;
+
+		ULONG offset = 0, line = 0, column = 0;
+		auto first = true, firstVisible = true;
+		while (p < pEnd)
+		{
+			ULONG delta;
+			if (!ReadCompressed(p, pEnd, delta))
+				return false;
+			if (!first && delta == 0)
+			{
+				if (!ReadCompressed(p, pEnd, document))
+					return false;
+				continue;
+			}
+			offset = first ? delta : offset + delta;
+			first = false;
+
+			ULONG deltaLines;
+			LONG deltaColumns;
+			if (!ReadCompressed(p, pEnd, deltaLines))
+				return false;
+			if (deltaLines == 0)
+			{
+				ULONG value;
+				if (!ReadCompressed(p, pEnd, value))
+					return false;
+				deltaColumns = static_cast<LONG>(value);
+			}
+			else if (!ReadCompressedSigned(p, pEnd, deltaColumns))
+				return false;
+
+			if (deltaLines == 0 && deltaColumns == 0)
+			{
+				PdbSequencePoint hidden = { offset, PDB_HIDDEN_LINE, 0, PDB_HIDDEN_LINE, 0, document };
+				points.push_back(hidden);
+				continue;
+			}
+
+			// the start of the first visible point is absolute, the others are relative to the one before
+			if (firstVisible)
+			{
+				if (!ReadCompressed(p, pEnd, line) || !ReadCompressed(p, pEnd, column))
+					return false;
+				firstVisible = false;
+			}
+			else
+			{
+				LONG deltaLine, deltaColumn;
+				if (!ReadCompressedSigned(p, pEnd, deltaLine) || !ReadCompressedSigned(p, pEnd, deltaColumn))
+					return false;
+				line += deltaLine;
+				column += deltaColumn;
+			}
+
+			PdbSequencePoint point = { offset, line, column, line + deltaLines, column + deltaColumns, document };
+			points.push_back(point);
+		}
+		return true;
+	}
+
+	/// <summary>Get the name of a document, it is held as parts either side of a separator</summary>
+	bool PortablePdb::GetDocumentName(ULONG document, std::string& name) const
+	{
+		name.clear();
+		if (document == 0 || document > m_documentRows)
+			return false;
+
+		const BYTE* p;
+		ULONG size;
+		if (!GetBlob(ReadIndex(m_pDocuments + ((document - 1) * m_documentRowSize), m_blobIndexSize), p, size) || size == 0)
+			return false;
+		auto pEnd = p + size;
+		auto separator = static_cast<char>(*p++);
+
+		auto firstPart = true;
+		while (p < pEnd)
+		{
+			ULONG part;
+			if (!ReadCompressed(p, pEnd, part))
+				return false;
+			if (!firstPart && separator != 0)
+				name += separator;
+			firstPart = false;
+			if (part == 0)
+				continue;
+
+			const BYTE* pPart;
+			ULONG partSize;
+			if (!GetBlob(part, pPart, partSize))
+				return false;
+			name.append(reinterpret_cast<const char*>(pPart), partSize);
+		}
+		return true;
+	}
+
+	/// <summary>Find the portable PDB of a module from its debug directory</summary>
+	/// <param name="pImage">The module as it is on disk (not as it is mapped when loaded).</param>
+	/// <param name="location">Receives the data of an embedded PDB (it is deflated) or the path of the PDB
+	/// the module was built with.</param>
+	/// <returns>false if the module has neither, a Windows PDB is not read.</returns>
+	bool FindPortablePdb(const BYTE* pImage, ULONG size, PdbLocation& location)
+	{
+		location.kind = PDB_NONE;
+		location.path.clear();
+		location.pData = nullptr;
+		location.size = location.uncompressedSize = 0;
+
+		if (size < 0x40 || pImage[0] != 'M' || pImage[1] != 'Z')
+			return false;
+		auto header = Read32(pImage + 0x3C);
+		if (header > size - 24 || Read32(pImage + header) != 0x00004550)
+			return false;
+
+		auto sectionCount = Read16(pImage + header + 6);
+		auto optionalSize = Read16(pImage + header + 20);
+		auto optional = header + 24;
+		if (optional + optionalSize > size || optionalSize < 2)
+			return false;
+		auto directories = optional + (Read16(pImage + optional) == 0x20B ? 112 : 96);
+		auto debug = directories + (IMAGE_DIRECTORY_DEBUG * 8);
+		if (debug + 8 > optional + optionalSize)
+			return false;
+
+		auto debugRva = Read32(pImage + debug);
+		auto debugSize = Read32(pImage + debug + 4);
+		ULONG entries;
+		if (debugRva == 0 || !RvaToOffset(pImage, size, optional + optionalSize, sectionCount, debugRva, entries))
+			return false;
+
+		for (auto entry = entries; entry + 28 <= entries + debugSize && entry + 28 <= size; entry += 28)
+		{
+			auto minorVersion = Read16(pImage + entry + 10);
+			auto type = Read32(pImage + entry + 12);
+			auto dataSize = Read32(pImage + entry + 16);
+			auto dataPointer = Read32(pImage + entry + 24);
+			if (dataPointer > size || dataSize > size - dataPointer)
+				continue;
+			auto pEntry = pImage + dataPointer;
+
+			// an embedded PDB is preferred, the CodeView entry is also there
+			if (type == IMAGE_DEBUG_EMBEDDED_PORTABLE_PDB && dataSize > 8 && Read32(pEntry) == EMBEDDED_PDB_SIGNATURE)
+			{
+				location.kind = PDB_EMBEDDED;
+				location.pData = pEntry + 8;
+				location.size = dataSize - 8;
+				location.uncompressedSize = Read32(pEntry + 4);
+				location.path.clear();
+				return true;
+			}
+			if (type == IMAGE_DEBUG_CODEVIEW && minorVersion == CODEVIEW_PORTABLE_MINOR && dataSize > 24 &&
+				Read32(pEntry) == CODEVIEW_SIGNATURE)
+			{
+				auto pPath = reinterpret_cast<const char*>(pEntry + 24);
+				location.kind = PDB_FILE;
+				location.path.assign(pPath, strnlen(pPath, dataSize - 24));
+			}
+		}
+		return location.kind != PDB_NONE;
+	}
+}
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+// the line of a hidden sequence point
+#define PDB_HIDDEN_LINE 0xFEEFEE
+
+namespace Instrumentation
+{
+	/// <summary>A sequence point as it is held in a portable PDB</summary>
+	struct PdbSequencePoint
+	{
+		ULONG offset;
+		ULONG startLine;
+		ULONG startColumn;
+		ULONG endLine;
+		ULONG endColumn;
+		ULONG document;
+
+		bool IsHidden() const { return startLine == PDB_HIDDEN_LINE; }
+	};
+
+	/// <summary>Reads the sequence points of a portable PDB (or one embedded in a module)</summary>
+	/// <remarks><para>Opening the PDB only finds the tables; the sequence points of a method are decoded from
+	/// its row of the MethodDebugInformation table when they are asked for, so a method that is never
+	/// jitted costs nothing.</para>
+	/// <para>The data is not copied and must outlive the reader; nothing is changed once it has been
+	/// opened so it can be read from any thread.</para></remarks>
+	class PortablePdb
+	{
+	public:
+		PortablePdb();
+
+	public:
+		bool Open(const BYTE* pData, ULONG size);
+		ULONG GetMethodCount() const { return m_methodRows; }
+		ULONG GetDocumentCount() const { return m_documentRows; }
+		bool GetSequencePoints(mdMethodDef functionToken, std::vector<PdbSequencePoint>& points) const;
+		bool GetDocumentName(ULONG document, std::string& name) const;
+
+	private:
+		bool GetBlob(ULONG index, const BYTE*& pBlob, ULONG& size) const;
+
+	private:
+		const BYTE* m_pBlobs;
+		ULONG m_blobsSize;
+		const BYTE* m_pDocuments;
+		ULONG m_documentRows;
+		ULONG m_documentRowSize;
+		const BYTE* m_pMethods;
+		ULONG m_methodRows;
+		ULONG m_methodRowSize;
+		ULONG m_blobIndexSize;
+		ULONG m_documentIndexSize;
+	};
+
+	enum PdbKind
+	{
+		PDB_NONE,
+		PDB_FILE,
+		PDB_EMBEDDED,
+	};
+
+	/// <summary>Where the portable PDB of a module is</summary>
+	struct PdbLocation
+	{
+		PdbKind kind;
+		std::string path;
+		const BYTE* pData;
+		ULONG size;
+		ULONG uncompressedSize;
+	};
+
+	bool FindPortablePdb(const BYTE* pImage, ULONG size, PdbLocation& location);
+}
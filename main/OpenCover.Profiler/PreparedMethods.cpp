@@ -0,0 +1,74 @@
+#include "stdafx.h"
+#include "PreparedMethods.h"
+
+namespace Instrumentation
+{
+	PreparedMethodTable::PreparedMethodTable(ULONG methodCount)
+		: m_methodCount(methodCount), m_slots(new std::atomic<PreparedMethod*>[methodCount])
+	{
+		for (ULONG i = 0; i < methodCount; i++)
+		{
+			m_slots[i].store(nullptr, std::memory_order_relaxed);
+		}
+	}
+
+	PreparedMethodTable::~PreparedMethodTable()
+	{
+		for (ULONG i = 0; i < m_methodCount; i++)
+		{
+			auto pMethod = m_slots[i].load(std::memory_order_acquire);
+			if (pMethod != TakenMarker())
+				delete pMethod;
+		}
+	}
+
+	/// <summary>The value of a slot that has been taken</summary>
+	PreparedMethod* PreparedMethodTable::TakenMarker()
+	{
+		static PreparedMethod taken;
+		return &taken;
+	}
+
+	std::atomic<PreparedMethod*>* PreparedMethodTable::GetSlot(mdMethodDef functionToken) const
+	{
+		auto row = RidFromToken(functionToken);
+		if (TypeFromToken(functionToken) != mdtMethodDef || row == 0 || row > m_methodCount)
+			return nullptr;
+		return &m_slots[row - 1];
+	}
+
+	/// <summary>Make a prepared method available to the JIT</summary>
+	/// <returns>false (and the method is discarded) if the method has already been taken.</returns>
+	bool PreparedMethodTable::Publish(mdMethodDef functionToken, std::unique_ptr<PreparedMethod> method)
+	{
+		auto pSlot = GetSlot(functionToken);
+		if (pSlot == nullptr)
+			return false;
+
+		PreparedMethod* pExpected = nullptr;
+		if (!pSlot->compare_exchange_strong(pExpected, method.get(), std::memory_order_acq_rel))
+			return false;
+
+		method.release();
+		return true;
+	}
+
+	/// <summary>Take the prepared method (if there is one) and stop any more being published for it</summary>
+	std::unique_ptr<PreparedMethod> PreparedMethodTable::Take(mdMethodDef functionToken)
+	{
+		auto pSlot = GetSlot(functionToken);
+		if (pSlot == nullptr)
+			return nullptr;
+
+		auto pMethod = pSlot->exchange(TakenMarker(), std::memory_order_acq_rel);
+		if (pMethod == TakenMarker())
+			return nullptr;
+		return std::unique_ptr<PreparedMethod>(pMethod);
+	}
+
+	bool PreparedMethodTable::IsTaken(mdMethodDef functionToken) const
+	{
+		auto pSlot = GetSlot(functionToken);
+		return pSlot == nullptr || pSlot->load(std::memory_order_acquire) == TakenMarker();
+	}
+}
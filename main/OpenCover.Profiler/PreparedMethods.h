@@ -0,0 +1,80 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <vector>
+
+#include "CoverageInstrumentation.h"
+#include "MethodCache.h"
+
+namespace Instrumentation
+{
+	/// <summary>What has to be registered for an instrumented body once it is in use</summary>
+	/// <remarks>Nothing is registered while the body is built as it may never be used, e.g. a prepared body
+	/// that is discarded.</remarks>
+	struct MethodRegistration
+	{
+		MethodRegistration() : probeToken(mdTokenNil) {}
+
+		// the points merged into the probes of other points, and the branch points whose visits are derived
+		std::vector<ULONG> mergedPoints;
+		CoverageInstrumentation::DerivedBranchPoints derived;
+
+		// what the probe budget made of the method, left empty for a method that already has its probes
+		MethodCacheCost cost;
+
+		// the token (of the module) the probes call through, mdTokenNil if they do not reference the module
+		mdToken probeToken;
+	};
+
+	/// <summary>An instrumented method body (and IL map) built ahead of the method being JIT compiled</summary>
+	struct PreparedMethod
+	{
+		PreparedMethod() : originalSize(0), originalHash(0), lastUniqueId(0) {}
+
+		// identifies the body that was instrumented
+		ULONG originalSize;
+		ULONGLONG originalHash;
+
+		std::vector<BYTE> body;
+		std::vector<COR_IL_MAP> map;
+
+		// the largest unique id of the points that were injected
+		ULONG lastUniqueId;
+
+		// the points the body was built from, and what has to be registered when it is used
+		std::vector<SequencePoint> seqPoints;
+		std::vector<BranchPoint> brPoints;
+		MethodRegistration registration;
+	};
+
+	/// <summary>The prepared methods of a single module, indexed by the row of their <c>MethodDef</c> token</summary>
+	/// <remarks><para>Publishing and taking are lock-free so the JIT callback is never held up by the
+	/// workers preparing the methods.</para>
+	/// <para>Each slot is taken at most once; once a method has been taken (whether or not it had been
+	/// prepared) anything published for it later is discarded as the JIT has already dealt with it.</para></remarks>
+	class PreparedMethodTable
+	{
+	public:
+		explicit PreparedMethodTable(ULONG methodCount);
+		~PreparedMethodTable();
+
+	private:
+		PreparedMethodTable(const PreparedMethodTable&) = delete;
+		PreparedMethodTable& operator = (const PreparedMethodTable&) = delete;
+
+	public:
+		bool Publish(mdMethodDef functionToken, std::unique_ptr<PreparedMethod> method);
+		std::unique_ptr<PreparedMethod> Take(mdMethodDef functionToken);
+		bool IsTaken(mdMethodDef functionToken) const;
+		ULONG GetMethodCount() const { return m_methodCount; }
+
+	private:
+		std::atomic<PreparedMethod*>* GetSlot(mdMethodDef functionToken) const;
+		static PreparedMethod* TakenMarker();
+
+	private:
+		ULONG m_methodCount;
+		std::unique_ptr<std::atomic<PreparedMethod*>[]> m_slots;
+	};
+}
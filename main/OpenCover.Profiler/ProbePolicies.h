@@ -0,0 +1,228 @@
+#pragma once
+
+#include "CoverageInstrumentation.h"
+#include "SwitchTables.h"
+
+namespace CoverageInstrumentation
+{
+    // A probe policy is how a point records a visit; each is a type with
+    //   static const unsigned int StackSize - the stack slots the probe needs
+    //   static const ULONG MaxSize - the most bytes of IL the probe can take
+    //   Instruction* Emit(Method&, InstructionList&, ULONG uniqueId) const - append a probe, returning its first instruction
+    //   Instruction* EmitSwitch(Method&, InstructionList&, const ULONG* pTable, ULONG tableId) const - append a probe
+    //     that records the path of the index on the stack, by the table of the switch (or of a value probe), and
+    //     consumes the index
+    // and is passed to AddCoverage, which instantiates the rewriter for it.
+
+    /// <summary>The probe policies the profiler chooses between</summary>
+    enum ProbeKind
+    {
+        PK_Call = 0,
+        PK_Calli = 1,
+        PK_Counter = 2,
+        PK_Set = 3,
+    };
+
+    /// <summary>Call the cuckoo method injected into the module with the id</summary>
+    struct CallProbe
+    {
+        static const unsigned int StackSize = 1;
+        static const ULONG MaxSize = 10; // ldc.i4 + call
+
+        explicit CallProbe(mdMethodDef injectedMethodDef) : injectedMethodDef(injectedMethodDef) {}
+
+        Instrumentation::Instruction* Emit(Instrumentation::Method& method, Instrumentation::InstructionList& instructions, ULONG uniqueId) const
+        {
+            return InsertInjectedMethod(method, instructions, injectedMethodDef, uniqueId);
+        }
+
+        Instrumentation::Instruction* EmitSwitch(Instrumentation::Method& method, Instrumentation::InstructionList& instructions, const ULONG*, ULONG tableId) const
+        {
+            auto pFirst = method.CreateInstruction(CEE_LDC_I4, tableId);
+            instructions.push_back(pFirst);
+            instructions.push_back(method.CreateInstruction(CEE_ADD));
+            instructions.push_back(method.CreateInstruction(CEE_CALL, injectedMethodDef));
+            return pFirst;
+        }
+
+        mdMethodDef injectedMethodDef;
+    };
+
+    /// <summary>Call the profiler directly with the id (<c>oldSchool</c>)</summary>
+    struct CalliProbe
+    {
+        static const unsigned int StackSize = 2;
+#ifdef _WIN64
+        static const ULONG MaxSize = 19; // ldc.i4 + ldc.i8 + calli
+#else
+        static const ULONG MaxSize = 15; // ldc.i4 + ldc.i4 + calli
+#endif
+
+        CalliProbe(mdSignature pvsig, FPTR pt) : pvsig(pvsig), pt(pt) {}
+
+        Instrumentation::Instruction* Emit(Instrumentation::Method& method, Instrumentation::InstructionList& instructions, ULONG uniqueId) const
+        {
+            return InsertFunctionCall(method, instructions, pvsig, pt, uniqueId);
+        }
+
+        Instrumentation::Instruction* EmitSwitch(Instrumentation::Method& method, Instrumentation::InstructionList& instructions, const ULONG*, ULONG tableId) const
+        {
+            auto pFirst = method.CreateInstruction(CEE_LDC_I4, tableId);
+            instructions.push_back(pFirst);
+            instructions.push_back(method.CreateInstruction(CEE_ADD));
+#ifdef _WIN64
+            instructions.push_back(method.CreateInstruction(CEE_LDC_I8, (ULONGLONG)pt));
+#else
+            instructions.push_back(method.CreateInstruction(CEE_LDC_I4, (ULONG)pt));
+#endif
+            instructions.push_back(method.CreateInstruction(CEE_CALLI, pvsig));
+            return pFirst;
+        }
+
+        mdSignature pvsig;
+        FPTR pt;
+    };
+
+    /// <summary>Increment the visit counter of the point in place</summary>
+    /// <remarks>The counters are indexed by the id without its flags.</remarks>
+    struct CounterProbe
+    {
+        static const unsigned int StackSize = 3;
+#ifdef _WIN64
+        static const ULONG MaxSize = 15; // ldc.i8 + conv.u + dup + ldind.u4 + ldc.i4.1 + add + stind.i4
+#else
+        static const ULONG MaxSize = 11;
+#endif
+
+        explicit CounterProbe(ULONG* pCounters) : pCounters(pCounters) {}
+
+        Instrumentation::Instruction* Emit(Instrumentation::Method& method, Instrumentation::InstructionList& instructions, ULONG uniqueId) const
+        {
+            return InsertCounterIncrement(method, instructions, pCounters + (uniqueId & ~PROBE_FLAGS));
+        }
+
+        Instrumentation::Instruction* EmitSwitch(Instrumentation::Method& method, Instrumentation::InstructionList& instructions, const ULONG* pTable, ULONG) const
+        {
+            return InsertTableCounterUpdate(method, instructions, pTable, pCounters, true);
+        }
+
+        ULONG* pCounters;
+    };
+
+    /// <summary>Set the visit counter of the point to 1</summary>
+    /// <remarks>Only records whether the point was visited, so only of use when no more than one
+    /// visit is reported (a threshold of 1) and no other visits are derived from it.</remarks>
+    struct SetProbe
+    {
+        static const unsigned int StackSize = 2;
+#ifdef _WIN64
+        static const ULONG MaxSize = 12; // ldc.i8 + conv.u + ldc.i4.1 + stind.i4
+#else
+        static const ULONG MaxSize = 8;
+#endif
+
+        explicit SetProbe(ULONG* pCounters) : pCounters(pCounters) {}
+
+        Instrumentation::Instruction* Emit(Instrumentation::Method& method, Instrumentation::InstructionList& instructions, ULONG uniqueId) const
+        {
+            return InsertCounterSet(method, instructions, pCounters + (uniqueId & ~PROBE_FLAGS));
+        }
+
+        Instrumentation::Instruction* EmitSwitch(Instrumentation::Method& method, Instrumentation::InstructionList& instructions, const ULONG* pTable, ULONG) const
+        {
+            return InsertTableCounterUpdate(method, instructions, pTable, pCounters, false);
+        }
+
+        ULONG* pCounters;
+    };
+
+    /// <summary>The most bytes of IL a probe of the kind given can take (see <c>ChooseCoverageLevel</c>)</summary>
+    inline ULONG GetProbeMaxSize(ProbeKind probeKind)
+    {
+        switch (probeKind)
+        {
+        case PK_Calli:
+            return CalliProbe::MaxSize;
+        case PK_Counter:
+            return CounterProbe::MaxSize;
+        case PK_Set:
+            return SetProbe::MaxSize;
+        default:
+            return CallProbe::MaxSize;
+        }
+    }
+
+    /// <summary>Add the probe of a switch, run before it, that records the path the switch takes</summary>
+    /// <param name="pathIds">The id of the path of each index, the default path last (see <c>AddBranchCoverage</c>).</param>
+    /// <returns>false if the switch has no table, it is then probed per path.</returns>
+    /// <remarks>The code added is the same size whatever the number of paths.</remarks>
+    template<class Policy>
+    bool InsertSwitchProbe(const Policy& probe, Instrumentation::Method& method, Instrumentation::InstructionList& instructions,
+        const std::vector<ULONG>& pathIds, Instrumentation::SwitchTables& switchTables)
+    {
+        ULONG slot;
+        if (!switchTables.Add(pathIds, slot))
+            return false;
+
+        auto pInRange = InsertSwitchIndex(method, instructions, static_cast<ULONG>(pathIds.size() - 1));
+        pInRange->m_branches.push_back(probe.EmitSwitch(method, instructions, switchTables.GetTable(slot), SWITCH_PROBE_FLAG | slot));
+        return true;
+    }
+
+    /// <summary>Add the probe of a two way branch, run before it, that records the path taken by the value it tests</summary>
+    /// <param name="pathIds">The id of the path taken for a value of 0 and then of 1 (see <c>AddBranchCoverage</c>).</param>
+    /// <returns>false if there is no room for the table of the branch, it is then probed per path.</returns>
+    /// <remarks>The value is the index into the table so, unlike a switch, needs no check.</remarks>
+    template<class Policy>
+    bool InsertValueProbe(const Policy& probe, Instrumentation::Method& method, Instrumentation::InstructionList& instructions,
+        const std::vector<ULONG>& pathIds, Instrumentation::SwitchTables& switchTables)
+    {
+        ULONG slot;
+        if (!switchTables.Add(pathIds, slot))
+            return false;
+
+        probe.EmitSwitch(method, instructions, switchTables.GetTable(slot), SWITCH_PROBE_FLAG | slot);
+        return true;
+    }
+
+    /// <summary>Add the sequence and branch probes of a method with the probe policy given</summary>
+    /// <param name="probes">The id passed by the probe that records each sequence point (see <c>MergeSequenceProbes</c>).</param>
+    /// <param name="derived">The branch points that are not to be probed (see <c>DeriveBranchPoints</c>).</param>
+    /// <param name="coldPaths">Move the probes of the taken paths to the end of the method (see <c>AddBranchCoverage</c>).</param>
+    /// <param name="pSwitchTables">The tables for probing each switch once (see <c>InsertSwitchProbe</c>), if not
+    /// <c>nullptr</c>.</param>
+    /// <param name="pValueTables">The tables for probing each two way branch by the value it tests (see
+    /// <c>InsertValueProbe</c>), if not <c>nullptr</c>.</param>
+    /// <returns>false if the method has already been instrumented, in which case it is unchanged.</returns>
+    /// <remarks>The caller has already made room on the stack for 2 slots.</remarks>
+    template<class Policy>
+    bool AddCoverage(const Policy& probe, Instrumentation::Method& method, SequencePointSpan seqPoints, BranchPointSpan brPoints,
+        const std::vector<ULONG>& probes, const DerivedBranchPoints& derived = DerivedBranchPoints(), bool coldPaths = false,
+        Instrumentation::SwitchTables* pSwitchTables = nullptr, Instrumentation::SwitchTables* pValueTables = nullptr)
+    {
+        Instrumentation::InstructionList instructions;
+        if (seqPoints.size() > 0)
+            probe.Emit(method, instructions, probes[0]);
+        if (method.IsInstrumented(0, instructions))
+            return false;
+
+        if (Policy::StackSize > 2)
+            method.IncrementStackSize(Policy::StackSize - 2);
+
+        auto emit = [&method, &probe](Instrumentation::InstructionList& probeInstructions, ULONG uniqueId)->Instrumentation::Instruction*
+        {
+            return probe.Emit(method, probeInstructions, uniqueId);
+        };
+        auto emitSwitch = [&method, &probe, pSwitchTables](Instrumentation::InstructionList& probeInstructions, const std::vector<ULONG>& pathIds)
+        {
+            return pSwitchTables != nullptr && InsertSwitchProbe(probe, method, probeInstructions, pathIds, *pSwitchTables);
+        };
+        auto emitValue = [&method, &probe, pValueTables](Instrumentation::InstructionList& probeInstructions, const std::vector<ULONG>& pathIds)
+        {
+            return pValueTables != nullptr && InsertValueProbe(probe, method, probeInstructions, pathIds, *pValueTables);
+        };
+        AddBranchCoverage(emit, method, brPoints, seqPoints, derived, coldPaths, emitSwitch, emitValue);
+        AddSequenceCoverage(emit, method, seqPoints, probes);
+        return true;
+    }
+}
@@ -353,18 +353,34 @@ namespace Communication
 		return;
 	}
 
+	namespace
+	{
+		// reused by every request made on the thread so that once they have grown getting
+		// the points of a method does not allocate
+		thread_local std::vector<SequencePoint> t_sequencePoints;
+		thread_local std::vector<BranchPoint> t_branchPoints;
+	}
+
+	/// <summary>Get the sequence and branch points of a method and pass them to <c>pointsReceived</c></summary>
+	/// <returns>false (and <c>pointsReceived</c> is not called) if the method has no sequence points.</returns>
+	/// <remarks>The branch points are passed while the chat lock is held; if they fit in a single
+	/// response they are not copied out of the chat buffer at all. The sequence points are always
+	/// copied (in bulk) into a per-thread buffer as the branch point response reuses the chat buffer.
+	/// The spans are only valid for the duration of the call.</remarks>
 	bool ProfilerCommunication::GetPoints(mdToken functionToken, WCHAR* pModulePath,
-		WCHAR* pAssemblyName, std::vector<SequencePoint> &seqPoints, std::vector<BranchPoint> &brPoints)
+		WCHAR* pAssemblyName, const PointsReceived &pointsReceived)
 	{
+		auto& seqPoints = t_sequencePoints;
 		seqPoints.clear();
-		brPoints.clear();
-		bool ret = GetSequencePoints(functionToken, pModulePath, pAssemblyName, seqPoints);
+		if (!GetSequencePoints(functionToken, pModulePath, pAssemblyName, seqPoints))
+			return false;
 
-		if (ret) {
-			GetBranchPoints(functionToken, pModulePath, pAssemblyName, brPoints);
+		if (!GetBranchPoints(functionToken, pModulePath, pAssemblyName, SequencePointSpan(seqPoints), pointsReceived)) {
+			// no (usable) branch point response; carry on with just the sequence points
+			pointsReceived(SequencePointSpan(seqPoints), BranchPointSpan());
 		}
 
-		return ret;
+		return true;
 	}
 
 	bool ProfilerCommunication::GetSequencePoints(mdToken functionToken, WCHAR* pModulePath,
@@ -385,15 +401,15 @@ namespace Communication
 		},
 			[=, &points]()->BOOL
 		{
-			if (_pMSG->getSequencePointsResponse.count > SEQ_BUFFER_SIZE) {
+			if (_pMSG->getSequencePointsResponse.count > SEQ_BUFFER_SIZE || _pMSG->getSequencePointsResponse.count < 0) {
 				RELTRACE(_T("Received an abnormal count for sequence points (%d) for token 0x%X"),
 					_pMSG->getSequencePointsResponse.count, functionToken);
 				points.clear();
 				return false;
 			}
 
-			for (int i = 0; i < _pMSG->getSequencePointsResponse.count; i++)
-				points.push_back(_pMSG->getSequencePointsResponse.points[i]);
+			auto pPoints = _pMSG->getSequencePointsResponse.points;
+			points.insert(points.end(), pPoints, pPoints + _pMSG->getSequencePointsResponse.count);
 			BOOL hasMore = _pMSG->getSequencePointsResponse.hasMore;
 			::ZeroMemory(_pMSG, MSG_UNION_SIZE);
 			return hasMore;
@@ -405,11 +421,29 @@ namespace Communication
 	}
 
 	bool ProfilerCommunication::GetBranchPoints(mdToken functionToken, WCHAR* pModulePath,
-		WCHAR* pAssemblyName, std::vector<BranchPoint> &points)
+		WCHAR* pAssemblyName, SequencePointSpan seqPoints, const PointsReceived &pointsReceived)
 	{
 		if (!_hostCommunicationActive)
 			return false;
 
+		auto& points = t_branchPoints;
+		points.clear();
+
+		// anything thrown by pointsReceived is not a communication failure so it is 
+		// rethrown once the chat lock has been released
+		bool received = false;
+		std::exception_ptr error;
+		auto receive = [&](BranchPointSpan brPoints)
+		{
+			received = true;
+			try {
+				pointsReceived(seqPoints, brPoints);
+			}
+			catch (...) {
+				error = std::current_exception();
+			}
+		};
+
 		RequestInformation(
 			[=]
 		{
@@ -420,25 +454,37 @@ namespace Communication
 			wcscpy_s(_pMSG->getBranchPointsRequest.szModulePath, pModulePath);
 			wcscpy_s(_pMSG->getBranchPointsRequest.szAssemblyName, pAssemblyName);
 		},
-			[=, &points]()->BOOL
+			[=, &points, &receive]()->BOOL
 		{
-			if (_pMSG->getBranchPointsResponse.count > BRANCH_BUFFER_SIZE) {
+			if (_pMSG->getBranchPointsResponse.count > BRANCH_BUFFER_SIZE || _pMSG->getBranchPointsResponse.count < 0) {
 				RELTRACE(_T("Received an abnormal count for branch points (%d) for token 0x%X"),
 					_pMSG->getBranchPointsResponse.count, functionToken);
 				points.clear();
 				return false;
 			}
 
-			for (int i = 0; i < _pMSG->getBranchPointsResponse.count; i++)
-				points.push_back(_pMSG->getBranchPointsResponse.points[i]);
+			auto pPoints = _pMSG->getBranchPointsResponse.points;
+			auto count = static_cast<size_t>(_pMSG->getBranchPointsResponse.count);
 			BOOL hasMore = _pMSG->getBranchPointsResponse.hasMore;
+			if (!hasMore && points.empty()) {
+				// a single response; use the points where they are
+				receive(BranchPointSpan(pPoints, count));
+			}
+			else {
+				points.insert(points.end(), pPoints, pPoints + count);
+				if (!hasMore)
+					receive(BranchPointSpan(points));
+			}
 			::ZeroMemory(_pMSG, MSG_UNION_SIZE);
 			return hasMore;
 		}
 			, _comm_wait
 			, _T("GetBranchPoints"));
 
-		return (points.size() != 0);
+		if (error)
+			std::rethrow_exception(error);
+
+		return received;
 	}
 
 	bool ProfilerCommunication::TrackAssembly(WCHAR* pModulePath, WCHAR* pAssemblyName)
@@ -567,6 +613,106 @@ namespace Communication
 		return;
 	}
 
+	/// <summary>Tell the host that a method was given coarser coverage than asked for, as it was over the probe budget</summary>
+	/// <remarks>The points of the method that are left out are never visited.</remarks>
+	bool ProfilerCommunication::ReportCoverageLevel(mdToken functionToken, WCHAR* pModulePath, WCHAR* pAssemblyName, ULONG level, ULONG probes,
+		ULONG originalSize, ULONG instrumentedSize)
+	{
+		if (!_hostCommunicationActive)
+			return false;
+
+		bool response = false;
+		RequestInformation(
+			[=]()
+		{
+			_pMSG->reportCoverageLevelRequest.type = MSG_ReportCoverageLevel;
+			_pMSG->reportCoverageLevelRequest.functionToken = functionToken;
+			wcscpy_s(_pMSG->reportCoverageLevelRequest.szModulePath, pModulePath);
+			wcscpy_s(_pMSG->reportCoverageLevelRequest.szAssemblyName, pAssemblyName);
+			_pMSG->reportCoverageLevelRequest.ulLevel = level;
+			_pMSG->reportCoverageLevelRequest.ulProbes = probes;
+			_pMSG->reportCoverageLevelRequest.ulOriginalSize = originalSize;
+			_pMSG->reportCoverageLevelRequest.ulInstrumentedSize = instrumentedSize;
+		},
+			[=, &response]()->BOOL
+		{
+			response = _pMSG->reportCoverageLevelResponse.bResponse == TRUE;
+			::ZeroMemory(_pMSG, MSG_UNION_SIZE);
+			return FALSE;
+		}
+			, _comm_wait
+			, _T("ReportCoverageLevel"));
+
+		return response;
+	}
+
+	/// <summary>Ask the host for the ids of the points of a method the profiler found itself (see <c>FindLocalPoints</c>)</summary>
+	/// <returns>false if the method is filtered out, or the host's points are not the ones described by the counts and
+	/// hash; the points should then be asked for (see <c>GetPoints</c>).</returns>
+	/// <remarks>The ids of each kind of point follow on from the first; the entry point's id is only set if the host
+	/// added one.</remarks>
+	bool ProfilerCommunication::AllocateUniqueIds(mdToken functionToken, WCHAR* pModulePath, WCHAR* pAssemblyName, ULONG sequencePoints,
+		ULONG branchPoints, ULONG pointsHash, ULONG &entryPointId, ULONG &firstSequenceId, ULONG &firstBranchId)
+	{
+		if (!_hostCommunicationActive)
+			return false;
+
+		bool response = false;
+		RequestInformation(
+			[=]()
+		{
+			_pMSG->allocateUniqueIdsRequest.type = MSG_AllocateUniqueIds;
+			_pMSG->allocateUniqueIdsRequest.functionToken = functionToken;
+			USES_CONVERSION;
+			wcscpy_s(_pMSG->allocateUniqueIdsRequest.szProcessName, T2CW(_processName.c_str()));
+			wcscpy_s(_pMSG->allocateUniqueIdsRequest.szModulePath, pModulePath);
+			wcscpy_s(_pMSG->allocateUniqueIdsRequest.szAssemblyName, pAssemblyName);
+			_pMSG->allocateUniqueIdsRequest.ulSequencePoints = sequencePoints;
+			_pMSG->allocateUniqueIdsRequest.ulBranchPoints = branchPoints;
+			_pMSG->allocateUniqueIdsRequest.ulPointsHash = pointsHash;
+		},
+			[=, &response, &entryPointId, &firstSequenceId, &firstBranchId]()->BOOL
+		{
+			response = _pMSG->allocateUniqueIdsResponse.bResponse == TRUE;
+			entryPointId = _pMSG->allocateUniqueIdsResponse.ulEntryPointId;
+			firstSequenceId = _pMSG->allocateUniqueIdsResponse.ulFirstSequenceId;
+			firstBranchId = _pMSG->allocateUniqueIdsResponse.ulFirstBranchId;
+			::ZeroMemory(_pMSG, MSG_UNION_SIZE);
+			return FALSE;
+		}
+			, _comm_wait
+			, _T("AllocateUniqueIds"));
+
+		return response;
+	}
+
+	/// <summary>Send the number of times each of a set of points was visited</summary>
+	/// <remarks>At most <c>VC_BUFFER_SIZE</c> counts can be sent at a time.</remarks>
+	bool ProfilerCommunication::SendVisitCounts(const VisitCount* pCounts, ULONG count)
+	{
+		if (!_hostCommunicationActive || count > VC_BUFFER_SIZE)
+			return false;
+
+		bool response = false;
+		RequestInformation(
+			[=]()
+		{
+			_pMSG->sendVisitCountsRequest.type = MSG_SendVisitCounts;
+			_pMSG->sendVisitCountsRequest.count = count;
+			memcpy(_pMSG->sendVisitCountsRequest.points, pCounts, count * sizeof(VisitCount));
+		},
+			[=, &response]()->BOOL
+		{
+			response = _pMSG->sendVisitCountsResponse.bResponse == TRUE;
+			::ZeroMemory(_pMSG, MSG_UNION_SIZE);
+			return FALSE;
+		}
+			, _comm_wait
+			, _T("SendVisitCounts"));
+
+		return response;
+	}
+
 	bool ProfilerCommunication::TrackProcess() {
 		Synchronization::CScopedLock<Synchronization::CMutex> lock(_mutexCommunication);
 
@@ -3,9 +3,11 @@
 #include "Synchronization.h"
 #include "SharedMemory.h"
 #include "Messages.h"
+#include "PointSpan.h"
 #include "Timer.h"
 
 #include <exception>
+#include <functional>
 
 #include <concurrent_unordered_map.h>
 
@@ -28,9 +30,16 @@ namespace Communication
 		bool Initialise(TCHAR* key, TCHAR *ns, TCHAR *processName);
 
 	public:
+		typedef std::function<void(SequencePointSpan, BranchPointSpan)> PointsReceived;
+
 		bool TrackAssembly(WCHAR* pModulePath, WCHAR* pAssemblyName);
-		bool GetPoints(mdToken functionToken, WCHAR* pModulePath, WCHAR* pAssemblyName, std::vector<SequencePoint> &seqPoints, std::vector<BranchPoint> &brPoints);
+		bool GetPoints(mdToken functionToken, WCHAR* pModulePath, WCHAR* pAssemblyName, const PointsReceived &pointsReceived);
 		bool TrackMethod(mdToken functionToken, WCHAR* pModulePath, WCHAR* pAssemblyName, ULONG &uniqueId);
+		bool ReportCoverageLevel(mdToken functionToken, WCHAR* pModulePath, WCHAR* pAssemblyName, ULONG level, ULONG probes,
+			ULONG originalSize, ULONG instrumentedSize);
+		bool AllocateUniqueIds(mdToken functionToken, WCHAR* pModulePath, WCHAR* pAssemblyName, ULONG sequencePoints,
+			ULONG branchPoints, ULONG pointsHash, ULONG &entryPointId, ULONG &firstSequenceId, ULONG &firstBranchId);
+		bool SendVisitCounts(const VisitCount* pCounts, ULONG count);
 		inline void AddTestEnterPoint(ULONG uniqueId) { AddVisitPointToBuffer(uniqueId, IT_MethodEnter); }
 		inline void AddTestLeavePoint(ULONG uniqueId) { AddVisitPointToBuffer(uniqueId, IT_MethodLeave); }
 		inline void AddTestTailcallPoint(ULONG uniqueId) { AddVisitPointToBuffer(uniqueId, IT_MethodTailcall); }
@@ -55,7 +64,7 @@ namespace Communication
 		void SendThreadVisitPoints(MSG_SendVisitPoints_Request* pVisitPoints);
 		void SendThreadVisitPointsInternal(MSG_SendVisitPoints_Request* pVisitPoints);
 		bool GetSequencePoints(mdToken functionToken, WCHAR* pModulePath, WCHAR* pAssemblyName, std::vector<SequencePoint> &points);
-		bool GetBranchPoints(mdToken functionToken, WCHAR* pModulePath, WCHAR* pAssemblyName, std::vector<BranchPoint> &points);
+		bool GetBranchPoints(mdToken functionToken, WCHAR* pModulePath, WCHAR* pAssemblyName, SequencePointSpan seqPoints, const PointsReceived &pointsReceived);
 		void SendRemainingVisitPoints(bool safemode);
 		void SendRemainingThreadBuffers();
 		MSG_SendVisitPoints_Request* AllocateVisitMap(DWORD osThreadID);
@@ -0,0 +1,68 @@
+#include "stdafx.h"
+#include "SwitchTables.h"
+
+#include <algorithm>
+
+namespace Instrumentation
+{
+	SwitchTables::SwitchTables() : m_nextSlot(0), m_blocks(new std::atomic<ULONG*>[SWITCH_TABLE_MAXIMUM_BLOCKS])
+	{
+		for (ULONG i = 0; i < SWITCH_TABLE_MAXIMUM_BLOCKS; i++)
+			m_blocks[i] = nullptr;
+	}
+
+	SwitchTables::~SwitchTables()
+	{
+		for (ULONG i = 0; i < SWITCH_TABLE_MAXIMUM_BLOCKS; i++)
+			delete[] m_blocks[i].load();
+	}
+
+	/// <summary>Add the table of a switch</summary>
+	/// <param name="ids">The id of the path of each index of the switch and then that of the default path.</param>
+	/// <param name="slot">Receives the slot of the first id.</param>
+	/// <returns>false if there is no room for the table (or it is larger than a block).</returns>
+	bool SwitchTables::Add(const std::vector<ULONG>& ids, ULONG& slot)
+	{
+		auto size = static_cast<ULONG>(ids.size());
+		if (size == 0 || size > SWITCH_TABLE_BLOCK_SIZE)
+			return false;
+
+		std::lock_guard<std::mutex> lock(m_mutex);
+		auto next = m_nextSlot;
+		if ((next % SWITCH_TABLE_BLOCK_SIZE) + size > SWITCH_TABLE_BLOCK_SIZE)
+			next = ((next / SWITCH_TABLE_BLOCK_SIZE) + 1) * SWITCH_TABLE_BLOCK_SIZE;
+
+		auto block = next / SWITCH_TABLE_BLOCK_SIZE;
+		if (block >= SWITCH_TABLE_MAXIMUM_BLOCKS)
+			return false;
+
+		auto pBlock = m_blocks[block].load();
+		if (pBlock == nullptr)
+		{
+			pBlock = new ULONG[SWITCH_TABLE_BLOCK_SIZE]();
+			m_blocks[block] = pBlock;
+		}
+
+		std::copy(ids.begin(), ids.end(), pBlock + (next % SWITCH_TABLE_BLOCK_SIZE));
+		slot = next;
+		m_nextSlot = next + size;
+		return true;
+	}
+
+	/// <summary>The address of the table that starts at a slot</summary>
+	const ULONG* SwitchTables::GetTable(ULONG slot) const
+	{
+		return m_blocks[slot / SWITCH_TABLE_BLOCK_SIZE].load() + (slot % SWITCH_TABLE_BLOCK_SIZE);
+	}
+
+	/// <summary>The id held in a slot</summary>
+	/// <returns>0 if the slot has not been allocated.</returns>
+	ULONG SwitchTables::GetId(ULONG slot) const
+	{
+		auto block = slot / SWITCH_TABLE_BLOCK_SIZE;
+		if (block >= SWITCH_TABLE_MAXIMUM_BLOCKS)
+			return 0;
+		auto pBlock = m_blocks[block].load();
+		return pBlock != nullptr ? pBlock[slot % SWITCH_TABLE_BLOCK_SIZE] : 0;
+	}
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// the slots are allocated in blocks, a table is never split across blocks
+#define SWITCH_TABLE_BLOCK_SIZE 4096
+#define SWITCH_TABLE_MAXIMUM_BLOCKS 4096
+
+namespace Instrumentation
+{
+	/// <summary>The tables of the switches that are probed once, before the switch</summary>
+	/// <remarks><para>A table holds the id of the path taken for each index of the switch, the default
+	/// path last; the probe passes the slot of the index it was given (see
+	/// <c>CoverageInstrumentation::InsertSwitchIndex</c>) or reads the id from the table itself.</para>
+	/// <para>The probes embed the addresses of the tables so they are never moved; a slot is only
+	/// read once the probe that uses it has been added, so reads take no lock.</para></remarks>
+	class SwitchTables
+	{
+	public:
+		SwitchTables();
+		~SwitchTables();
+
+	private:
+		SwitchTables(const SwitchTables&) = delete;
+		SwitchTables& operator = (const SwitchTables&) = delete;
+
+	public:
+		bool Add(const std::vector<ULONG>& ids, ULONG& slot);
+		const ULONG* GetTable(ULONG slot) const;
+		ULONG GetId(ULONG slot) const;
+
+	private:
+		std::mutex m_mutex;
+		ULONG m_nextSlot;
+		std::unique_ptr<std::atomic<ULONG*>[]> m_blocks;
+	};
+}
@@ -0,0 +1,68 @@
+﻿using System;
+using System.IO;
+using System.IO.MemoryMappedFiles;
+
+namespace OpenCover.Support.Weaving
+{
+    /// <summary>
+    /// Counts the visits of the points of the assemblies woven by OpenCover.Weaver, in the counter file 
+    /// named by the OpenCover_CounterFile environment variable
+    /// </summary>
+    /// <remarks>
+    /// The file is mapped into the process, so the counts are shared by every process using the file and 
+    /// are in the file when they exit; without a (valid) counter file the visits are ignored. The 
+    /// increments are not atomic, as with the profiler's inline counters, so a count may be low but a 
+    /// visited point is never reported as unvisited.
+    /// </remarks>
+    public static unsafe class Counters
+    {
+        private const string CounterFileVariable = "OpenCover_CounterFile";
+        private const uint Signature = 0x4356434F; // "OCVC"
+        private const uint Version = 1;
+        private const int HeaderSize = 16;
+
+        // held so the mapping lives as long as the process
+        private static readonly MemoryMappedFile CounterFile;
+        private static readonly MemoryMappedViewAccessor View;
+
+        private static readonly uint* Visits;
+        private static readonly uint Count;
+
+        static Counters()
+        {
+            var path = Environment.GetEnvironmentVariable(CounterFileVariable);
+            if (string.IsNullOrEmpty(path) || !File.Exists(path))
+                return;
+
+            try
+            {
+                CounterFile = MemoryMappedFile.CreateFromFile(path, FileMode.Open, null, 0, MemoryMappedFileAccess.ReadWrite);
+                View = CounterFile.CreateViewAccessor(0, 0, MemoryMappedFileAccess.ReadWrite);
+                byte* pView = null;
+                View.SafeMemoryMappedViewHandle.AcquirePointer(ref pView);
+                var header = (uint*)(pView + View.PointerOffset);
+                if (View.Capacity < HeaderSize || header[0] != Signature || header[1] != Version)
+                    return;
+
+                Count = Math.Min(header[2], (uint)((View.Capacity - HeaderSize) / sizeof(uint)));
+                Visits = header + (HeaderSize / sizeof(uint));
+            }
+            catch (IOException)
+            {
+            }
+            catch (UnauthorizedAccessException)
+            {
+            }
+        }
+
+        /// <summary>
+        /// Count a visit to a point
+        /// </summary>
+        /// <param name="uniqueId">the unique id of the point</param>
+        public static void Visit(uint uniqueId)
+        {
+            if (uniqueId < Count)
+                Visits[uniqueId]++;
+        }
+    }
+}
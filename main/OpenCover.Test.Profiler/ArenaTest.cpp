@@ -0,0 +1,109 @@
+#include "stdafx.h"
+#include "../OpenCover.Profiler/Method.h"
+
+using namespace Instrumentation;
+
+class ArenaTest : public ::testing::Test {
+	void SetUp() override
+	{
+
+	}
+
+	void TearDown() override
+	{
+
+	}
+};
+
+namespace
+{
+	struct Counted
+	{
+		explicit Counted(int* pCount) : m_pCount(pCount) { ++(*m_pCount); }
+		~Counted() { --(*m_pCount); }
+		int* m_pCount;
+	};
+}
+
+TEST_F(ArenaTest, AllocationsAreAligned)
+{
+	Arena arena;
+
+	arena.Allocate(1, 1);
+	auto p8 = arena.Allocate(8, 8);
+	arena.Allocate(3, 1);
+	auto p16 = arena.Allocate(16, 16);
+
+	ASSERT_EQ(0u, reinterpret_cast<uintptr_t>(p8) % 8);
+	ASSERT_EQ(0u, reinterpret_cast<uintptr_t>(p16) % 16);
+}
+
+TEST_F(ArenaTest, ResetRunsDestructorsOfCreatedObjects)
+{
+	int count = 0;
+	Arena arena;
+
+	for (int i = 0; i < 100; i++)
+	{
+		arena.Create<Counted>(&count);
+	}
+	ASSERT_EQ(100, count);
+
+	arena.Reset();
+
+	ASSERT_EQ(0, count);
+	ASSERT_EQ(0u, arena.GetBytesAllocated());
+}
+
+TEST_F(ArenaTest, LargeAllocationsAreSatisfied)
+{
+	Arena arena;
+
+	auto pSmall = static_cast<BYTE*>(arena.Allocate(16, 8));
+	auto pLarge = static_cast<BYTE*>(arena.Allocate(4 * 1024 * 1024, 8));
+	memset(pLarge, 0xAA, 4 * 1024 * 1024);
+	pSmall[0] = 0x55;
+
+	ASSERT_EQ(0x55, pSmall[0]);
+	ASSERT_GE(arena.GetBytesReserved(), static_cast<size_t>(4 * 1024 * 1024));
+}
+
+TEST_F(ArenaTest, ResetKeepsABlockForReuse)
+{
+	Arena arena;
+
+	auto pFirst = arena.Allocate(64, 8);
+	arena.Reset();
+	auto pSecond = arena.Allocate(64, 8);
+
+	ASSERT_EQ(pFirst, pSecond);
+}
+
+TEST_F(ArenaTest, PoolReusesArenasOnTheSameThread)
+{
+	auto pFirst = ArenaPool::Acquire();
+	auto pSecond = ArenaPool::Acquire();
+	ASSERT_NE(pFirst, pSecond);
+
+	ArenaPool::Release(pSecond);
+	ASSERT_EQ(pSecond, ArenaPool::Acquire());
+
+	ArenaPool::Release(pFirst);
+	ArenaPool::Release(pSecond);
+}
+
+TEST_F(ArenaTest, MethodsOnTheSameThreadReuseTheArena)
+{
+	BYTE data[] = { (0x02 << 2) + CorILMethod_TinyFormat,
+		CEE_NOP, CEE_RET };
+
+	Instruction* pFirst;
+	{
+		Method instrument(reinterpret_cast<IMAGE_COR_ILMETHOD*>(data));
+		pFirst = instrument.m_instructions[0];
+	}
+
+	Method instrument(reinterpret_cast<IMAGE_COR_ILMETHOD*>(data));
+	ASSERT_EQ(pFirst, instrument.m_instructions[0]);
+	ASSERT_EQ(CEE_NOP, instrument.m_instructions[0]->m_operation);
+}
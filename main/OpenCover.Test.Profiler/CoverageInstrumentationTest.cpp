@@ -0,0 +1,665 @@
+﻿#include "stdafx.h"
+#include "..\OpenCover.Profiler\Method.h"
+#include "..\OpenCover.Profiler\ProbePolicies.h"
+#include "ILCorpus.h"
+
+// NOTE: Using pseudo IL code to exercise the code and is not necessarily runnable IL
+using namespace Instrumentation;
+
+class CoverageInstrumentationTest : public ::testing::Test {
+	void SetUp() override
+	{
+
+	}
+
+	void TearDown() override
+	{
+
+	}
+};
+
+namespace
+{
+	void AddBranchCoverage(Method& instrument, std::vector<BranchPoint> points)
+	{
+		CoverageInstrumentation::AddBranchCoverage([&instrument](InstructionList& instructions, ULONG uniqueId)->Instruction*
+		{
+			return CoverageInstrumentation::InsertInjectedMethod(instrument, instructions, 0x06000001, uniqueId);
+		}, instrument, points, std::vector<SequencePoint>());
+	}
+
+	template<class Policy>
+	void AddSwitchCoverage(Method& instrument, const Policy& probe, std::vector<BranchPoint> points, SwitchTables& tables)
+	{
+		CoverageInstrumentation::AddBranchCoverage([&instrument, &probe](InstructionList& instructions, ULONG uniqueId)->Instruction*
+		{
+			return probe.Emit(instrument, instructions, uniqueId);
+		}, instrument, points, std::vector<SequencePoint>(), CoverageInstrumentation::DerivedBranchPoints(), false,
+			[&instrument, &probe, &tables](InstructionList& instructions, const std::vector<ULONG>& pathIds)
+		{
+			return CoverageInstrumentation::InsertSwitchProbe(probe, instrument, instructions, pathIds, tables);
+		});
+	}
+
+	void AddValueCoverage(Method& instrument, std::vector<BranchPoint> points, SwitchTables& tables)
+	{
+		CoverageInstrumentation::CallProbe probe(0x06000001);
+		CoverageInstrumentation::AddBranchCoverage([&instrument, &probe](InstructionList& instructions, ULONG uniqueId)->Instruction*
+		{
+			return probe.Emit(instrument, instructions, uniqueId);
+		}, instrument, points, std::vector<SequencePoint>(), CoverageInstrumentation::DerivedBranchPoints(), false,
+			CoverageInstrumentation::NoSwitchProbes(), [&instrument, &probe, &tables](InstructionList& instructions, const std::vector<ULONG>& pathIds)
+		{
+			return CoverageInstrumentation::InsertValueProbe(probe, instrument, instructions, pathIds, tables);
+		});
+	}
+}
+
+TEST_F(CoverageInstrumentationTest, CanInstrumentConditionalBranch)
+{
+	BYTE data[] = { (5 << 2) + CorILMethod_TinyFormat,
+		CEE_LDC_I4_0,
+		CEE_BRTRUE_S, 0x01,
+		CEE_NOP,
+		CEE_RET };
+
+	Method instrument(reinterpret_cast<IMAGE_COR_ILMETHOD*>(data));
+
+	std::vector<BranchPoint> points;
+	points.push_back(BranchPoint{ 2, 1, 1 });
+	points.push_back(BranchPoint{ 1, 1, 0 });
+
+	AddBranchCoverage(instrument, points);
+
+	ASSERT_EQ(10, instrument.GetNumberOfInstructions());
+
+	auto pBranch = instrument.m_instructions[1];
+	ASSERT_EQ(CEE_BRTRUE, pBranch->m_operation);
+	ASSERT_EQ(instrument.m_instructions[3], pBranch->m_branches[0]);
+	ASSERT_EQ(2, static_cast<int>(instrument.m_instructions[3]->m_operand));
+	ASSERT_EQ(instrument.m_instructions[9], instrument.m_instructions[5]->m_branches[0]);
+
+	ASSERT_EQ(instrument.m_instructions[6], instrument.m_instructions[2]->m_branches[0]);
+	ASSERT_EQ(1, static_cast<int>(instrument.m_instructions[6]->m_operand));
+	ASSERT_EQ(CEE_NOP, instrument.m_instructions[8]->m_operation);
+	ASSERT_EQ(CEE_RET, instrument.m_instructions[9]->m_operation);
+}
+
+TEST_F(CoverageInstrumentationTest, CanInstrumentConditionalBranchWithColdPaths)
+{
+	BYTE data[] = { (5 << 2) + CorILMethod_TinyFormat,
+		CEE_LDC_I4_0,
+		CEE_BRTRUE_S, 0x01,
+		CEE_NOP,
+		CEE_RET };
+
+	Method instrument(reinterpret_cast<IMAGE_COR_ILMETHOD*>(data));
+
+	std::vector<BranchPoint> points;
+	points.push_back(BranchPoint{ 2, 1, 1 });
+	points.push_back(BranchPoint{ 1, 1, 0 });
+
+	CoverageInstrumentation::AddBranchCoverage([&instrument](InstructionList& instructions, ULONG uniqueId)->Instruction*
+	{
+		return CoverageInstrumentation::InsertInjectedMethod(instrument, instructions, 0x06000001, uniqueId);
+	}, instrument, points, std::vector<SequencePoint>(), CoverageInstrumentation::DerivedBranchPoints(), true);
+
+	ASSERT_EQ(9, instrument.GetNumberOfInstructions());
+
+	// the fall through runs into its probe
+	auto pBranch = instrument.m_instructions[1];
+	ASSERT_EQ(CEE_BRTRUE, pBranch->m_operation);
+	ASSERT_EQ(1, static_cast<int>(instrument.m_instructions[2]->m_operand));
+	ASSERT_EQ(CEE_NOP, instrument.m_instructions[4]->m_operation);
+	ASSERT_EQ(CEE_RET, instrument.m_instructions[5]->m_operation);
+
+	// the taken path is probed after the end of the method
+	ASSERT_EQ(instrument.m_instructions[6], pBranch->m_branches[0]);
+	ASSERT_EQ(2, static_cast<int>(instrument.m_instructions[6]->m_operand));
+	ASSERT_EQ(CEE_BR, instrument.m_instructions[8]->m_operation);
+	ASSERT_EQ(instrument.m_instructions[5], instrument.m_instructions[8]->m_branches[0]);
+}
+
+TEST_F(CoverageInstrumentationTest, SkipsBranchesWithoutPoints)
+{
+	BYTE data[] = { (5 << 2) + CorILMethod_TinyFormat,
+		CEE_LDC_I4_0,
+		CEE_BRTRUE_S, 0x01,
+		CEE_NOP,
+		CEE_RET };
+
+	Method instrument(reinterpret_cast<IMAGE_COR_ILMETHOD*>(data));
+
+	std::vector<BranchPoint> points;
+	points.push_back(BranchPoint{ 1, 3, 0 });
+
+	AddBranchCoverage(instrument, points);
+
+	ASSERT_EQ(4, instrument.GetNumberOfInstructions());
+	ASSERT_EQ(instrument.m_instructions[3], instrument.m_instructions[1]->m_branches[0]);
+}
+
+TEST_F(CoverageInstrumentationTest, LeavesSwitchPathsWithoutPointsUninstrumented)
+{
+	auto data = ILCorpus::BuildSwitchMethod(3);
+	Method instrument(reinterpret_cast<IMAGE_COR_ILMETHOD*>(data.data()));
+	auto pSwitch = instrument.m_instructions[0];
+	auto pSecondTarget = pSwitch->m_branches[1];
+
+	std::vector<BranchPoint> points;
+	points.push_back(BranchPoint{ 10, 0, 0 });
+	points.push_back(BranchPoint{ 11, 0, 1 });
+	points.push_back(BranchPoint{ 13, 0, 3 });
+
+	AddBranchCoverage(instrument, points);
+
+	ASSERT_EQ(11, static_cast<int>(pSwitch->m_branches[0]->m_operand));
+	ASSERT_EQ(pSecondTarget, pSwitch->m_branches[1]);
+	ASSERT_EQ(13, static_cast<int>(pSwitch->m_branches[2]->m_operand));
+	ASSERT_EQ(instrument.m_instructions[2], pSwitch->m_branches[0]);
+}
+
+TEST_F(CoverageInstrumentationTest, CanInstrumentLargeSwitch)
+{
+	const ULONG targets = 500;
+	auto data = ILCorpus::BuildSwitchMethod(targets);
+	Method instrument(reinterpret_cast<IMAGE_COR_ILMETHOD*>(data.data()));
+	auto pSwitch = instrument.m_instructions[0];
+
+	std::vector<BranchPoint> points;
+	for (ULONG path = 0; path <= targets; path++)
+	{
+		points.push_back(BranchPoint{ 1000 + path, 0, static_cast<long>(path) });
+	}
+
+	AddBranchCoverage(instrument, points);
+
+	// per path: probe (2) and a jump back; plus the jump to and the probe of the default path
+	ASSERT_EQ(static_cast<int>(targets + 2 + (targets * 3) + 3), instrument.GetNumberOfInstructions());
+	for (ULONG path = 1; path <= targets; path++)
+	{
+		ASSERT_EQ(1000 + path, static_cast<ULONG>(pSwitch->m_branches[path - 1]->m_operand));
+	}
+}
+
+TEST_F(CoverageInstrumentationTest, CanInstrumentLargeSwitchWithASingleProbe)
+{
+	const ULONG targets = 500;
+	auto data = ILCorpus::BuildSwitchMethod(targets);
+	Method instrument(reinterpret_cast<IMAGE_COR_ILMETHOD*>(data.data()));
+	auto pSwitch = instrument.m_instructions[0];
+	auto pFirstTarget = pSwitch->m_branches[0];
+
+	std::vector<BranchPoint> points;
+	for (ULONG path = 0; path <= targets; path++)
+	{
+		points.push_back(BranchPoint{ 1000 + path, 0, static_cast<long>(path) });
+	}
+
+	SwitchTables tables;
+	AddSwitchCoverage(instrument, CoverageInstrumentation::CallProbe(0x06000001), points, tables);
+
+	// dup, dup, ldc.i4, blt.un, pop, ldc.i4 and then ldc.i4 tableId, add, call; whatever the number of paths
+	ASSERT_EQ(static_cast<int>(targets + 2 + 9), instrument.GetNumberOfInstructions());
+	ASSERT_EQ(pSwitch, instrument.m_instructions[9]);
+	ASSERT_EQ(pFirstTarget, pSwitch->m_branches[0]);
+
+	auto pInRange = instrument.m_instructions[3];
+	auto pTableId = instrument.m_instructions[6];
+	ASSERT_EQ(CEE_BLT_UN, pInRange->m_operation);
+	ASSERT_EQ(pTableId, pInRange->m_branches[0]);
+	ASSERT_EQ(static_cast<int>(targets), static_cast<int>(instrument.m_instructions[5]->m_operand));
+
+	auto tableId = static_cast<ULONG>(pTableId->m_operand);
+	ASSERT_EQ(static_cast<ULONG>(SWITCH_PROBE_FLAG), tableId & SWITCH_PROBE_FLAG);
+	auto slot = tableId & ~SWITCH_PROBE_FLAG;
+	for (ULONG path = 1; path <= targets; path++)
+	{
+		ASSERT_EQ(1000 + path, tables.GetId(slot + path - 1));
+	}
+	ASSERT_EQ(1000u, tables.GetId(slot + targets));
+}
+
+TEST_F(CoverageInstrumentationTest, CounterProbesOfASwitchReadItsTable)
+{
+	const ULONG targets = 3;
+	auto data = ILCorpus::BuildSwitchMethod(targets);
+	Method instrument(reinterpret_cast<IMAGE_COR_ILMETHOD*>(data.data()));
+
+	std::vector<BranchPoint> points;
+	points.push_back(BranchPoint{ 10, 0, 0 });
+	points.push_back(BranchPoint{ 12, 0, 2 });
+
+	ULONG counters[16] = {};
+	SwitchTables tables;
+	AddSwitchCoverage(instrument, CoverageInstrumentation::CounterProbe(counters), points, tables);
+
+	// the paths without a point are left out of the table
+	auto pTable = tables.GetTable(0);
+	ASSERT_EQ(0u, pTable[0]);
+	ASSERT_EQ(12u, pTable[1]);
+	ASSERT_EQ(0u, pTable[2]);
+	ASSERT_EQ(10u, pTable[3]);
+
+	ASSERT_EQ(CEE_LDC_I8, instrument.m_instructions[8]->m_operation);
+	ASSERT_EQ(reinterpret_cast<ULONGLONG>(pTable), static_cast<ULONGLONG>(instrument.m_instructions[8]->m_operand));
+	ASSERT_EQ(CEE_STIND_I4, instrument.m_instructions[instrument.GetNumberOfInstructions() - targets - 3]->m_operation);
+	ASSERT_EQ(CEE_SWITCH, instrument.m_instructions[instrument.GetNumberOfInstructions() - targets - 2]->m_operation);
+}
+
+TEST_F(CoverageInstrumentationTest, SwitchIsProbedPerPathWhenItHasNoTable)
+{
+	const ULONG targets = SWITCH_TABLE_BLOCK_SIZE;
+	auto data = ILCorpus::BuildSwitchMethod(targets);
+	Method instrument(reinterpret_cast<IMAGE_COR_ILMETHOD*>(data.data()));
+
+	std::vector<BranchPoint> points;
+	for (ULONG path = 0; path <= targets; path++)
+	{
+		points.push_back(BranchPoint{ 1000 + path, 0, static_cast<long>(path) });
+	}
+
+	SwitchTables tables;
+	AddSwitchCoverage(instrument, CoverageInstrumentation::CallProbe(0x06000001), points, tables);
+
+	ASSERT_EQ(static_cast<int>(targets + 2 + (targets * 3) + 3), instrument.GetNumberOfInstructions());
+	ASSERT_EQ(0u, tables.GetId(0));
+}
+
+TEST_F(CoverageInstrumentationTest, CompareAndBranchIsSplitAndProbedByItsValue)
+{
+	BYTE data[] = { (6 << 2) + CorILMethod_TinyFormat,
+		CEE_LDC_I4_0,
+		CEE_LDC_I4_1,
+		CEE_BLT_S, 0x01,
+		CEE_NOP,
+		CEE_RET };
+
+	Method instrument(reinterpret_cast<IMAGE_COR_ILMETHOD*>(data));
+	auto pBranch = instrument.m_instructions[2];
+
+	std::vector<BranchPoint> points;
+	points.push_back(BranchPoint{ 10, 2, 0 });
+	points.push_back(BranchPoint{ 11, 2, 1 });
+
+	SwitchTables tables;
+	AddValueCoverage(instrument, points, tables);
+
+	// clt, dup, ldc.i4 tableId, add, call, brtrue; the branch is not moved
+	ASSERT_EQ(10, instrument.GetNumberOfInstructions());
+	ASSERT_EQ(pBranch, instrument.m_instructions[2]);
+	ASSERT_EQ(CEE_CLT, pBranch->m_operation);
+	ASSERT_FALSE(pBranch->m_isBranch);
+	ASSERT_EQ(CEE_DUP, instrument.m_instructions[3]->m_operation);
+	ASSERT_EQ(CEE_BRTRUE, instrument.m_instructions[7]->m_operation);
+	ASSERT_EQ(instrument.m_instructions[9], instrument.m_instructions[7]->m_branches[0]);
+	ASSERT_EQ(1u, instrument.m_instructions[7]->m_branches.size());
+
+	auto tableId = static_cast<ULONG>(instrument.m_instructions[4]->m_operand);
+	ASSERT_EQ(10u, tables.GetId(tableId & ~SWITCH_PROBE_FLAG));
+	ASSERT_EQ(11u, tables.GetId((tableId & ~SWITCH_PROBE_FLAG) + 1));
+}
+
+TEST_F(CoverageInstrumentationTest, BranchOnACompareIsProbedByItsValue)
+{
+	BYTE data[] = { (8 << 2) + CorILMethod_TinyFormat,
+		CEE_LDC_I4_0,
+		CEE_LDC_I4_1,
+		0xFE, 0x01, // ceq
+		CEE_BRFALSE_S, 0x01,
+		CEE_NOP,
+		CEE_RET };
+
+	Method instrument(reinterpret_cast<IMAGE_COR_ILMETHOD*>(data));
+	auto pBranch = instrument.m_instructions[3];
+
+	std::vector<BranchPoint> points;
+	points.push_back(BranchPoint{ 10, 4, 0 });
+	points.push_back(BranchPoint{ 11, 4, 1 });
+
+	SwitchTables tables;
+	AddValueCoverage(instrument, points, tables);
+
+	ASSERT_EQ(10, instrument.GetNumberOfInstructions());
+	ASSERT_EQ(CEE_DUP, instrument.m_instructions[3]->m_operation);
+	ASSERT_EQ(pBranch, instrument.m_instructions[7]);
+	ASSERT_EQ(instrument.m_instructions[9], pBranch->m_branches[0]);
+	ASSERT_EQ(4, pBranch->m_origOffset);
+
+	// brfalse takes path 1 for a value of 0
+	auto slot = static_cast<ULONG>(instrument.m_instructions[4]->m_operand) & ~SWITCH_PROBE_FLAG;
+	ASSERT_EQ(11u, tables.GetId(slot));
+	ASSERT_EQ(10u, tables.GetId(slot + 1));
+}
+
+TEST_F(CoverageInstrumentationTest, BranchThatIsJumpedToIsProbedPerPath)
+{
+	BYTE data[] = { (9 << 2) + CorILMethod_TinyFormat,
+		CEE_LDC_I4_0,
+		CEE_BR_S, 0x02,
+		0xFE, 0x01, // ceq
+		CEE_BRFALSE_S, 0x01,
+		CEE_NOP,
+		CEE_RET };
+
+	Method instrument(reinterpret_cast<IMAGE_COR_ILMETHOD*>(data));
+
+	std::vector<BranchPoint> points;
+	points.push_back(BranchPoint{ 10, 5, 0 });
+	points.push_back(BranchPoint{ 11, 5, 1 });
+
+	SwitchTables tables;
+	AddValueCoverage(instrument, points, tables);
+
+	// the value may not be that of the compare, so a jump to the else probe, a probe and jump per path and the else probe
+	ASSERT_EQ(6 + 1 + 3 + 2, instrument.GetNumberOfInstructions());
+	ASSERT_EQ(0u, tables.GetId(0));
+}
+
+TEST_F(CoverageInstrumentationTest, BranchThatStartsATryIsProbedPerPath)
+{
+	BYTE data[] = {
+		0x00, 0x00, 0x00, 0x00,
+		0x00, 0x00, 0x00, 0x00,
+		0x00, 0x00, 0x00, 0x00,
+		CEE_LDC_I4_0,
+		CEE_LDC_I4_1,
+		0xFE, 0x01, // ceq
+		CEE_BRFALSE_S, 0x01, // try start
+		CEE_NOP,
+		CEE_LEAVE_S, 0x03,
+		CEE_NOP, // handler start
+		CEE_ENDFINALLY,
+		CEE_NOP,
+		CEE_RET,
+		0x00, 0x00, 0x00, // align
+		0x01, 0x0C, 0x00, 0x00,
+		0x02, 0x00, 0x04, 0x00, 0x05, 0x09, 0x00, 0x02, 0x00, 0x00, 0x00, 0x00,
+	};
+
+	auto pHeader = reinterpret_cast<IMAGE_COR_ILMETHOD_FAT*>(data);
+	pHeader->Flags = CorILMethod_FatFormat | CorILMethod_MoreSects;
+	pHeader->CodeSize = 13;
+	pHeader->Size = 3;
+
+	Method instrument(reinterpret_cast<IMAGE_COR_ILMETHOD*>(data));
+	auto pBranch = instrument.m_instructions[3];
+	ASSERT_EQ(pBranch, instrument.m_exceptions[0]->m_tryStart);
+
+	std::vector<BranchPoint> points;
+	points.push_back(BranchPoint{ 10, 4, 0 });
+	points.push_back(BranchPoint{ 11, 4, 1 });
+
+	SwitchTables tables;
+	AddValueCoverage(instrument, points, tables);
+
+	// a value probe would be put before the branch, i.e. outside the try block
+	ASSERT_EQ(0u, tables.GetId(0));
+	ASSERT_EQ(pBranch, instrument.m_instructions[3]);
+	ASSERT_EQ(pBranch, instrument.m_exceptions[0]->m_tryStart);
+	ASSERT_EQ(10 + 1 + 3 + 2, instrument.GetNumberOfInstructions());
+}
+
+TEST_F(CoverageInstrumentationTest, CanInstrumentFromPointsInPlace)
+{
+	BYTE data[] = { (5 << 2) + CorILMethod_TinyFormat,
+		CEE_LDC_I4_0,
+		CEE_BRTRUE_S, 0x01,
+		CEE_NOP,
+		CEE_RET };
+
+	Method instrument(reinterpret_cast<IMAGE_COR_ILMETHOD*>(data));
+
+	// as laid out in a chat buffer response (and out of order)
+	const BranchPoint branchPoints[] = { { 2, 1, 1 }, { 1, 1, 0 } };
+	const SequencePoint sequencePoints[] = { { 3, 0 }, { 4, 3 } };
+
+	CoverageInstrumentation::AddBranchCoverage([&instrument](InstructionList& instructions, ULONG uniqueId)->Instruction*
+	{
+		return CoverageInstrumentation::InsertInjectedMethod(instrument, instructions, 0x06000001, uniqueId);
+	}, instrument, BranchPointSpan(branchPoints, 2), SequencePointSpan(sequencePoints, 2));
+	CoverageInstrumentation::AddSequenceCoverage([&instrument](InstructionList& instructions, ULONG uniqueId)->Instruction*
+	{
+		return CoverageInstrumentation::InsertInjectedMethod(instrument, instructions, 0x06000001, uniqueId);
+	}, instrument, SequencePointSpan(sequencePoints, 2));
+
+	ASSERT_EQ(14, instrument.GetNumberOfInstructions());
+	ASSERT_EQ(3, static_cast<int>(instrument.m_instructions[0]->m_operand));
+	ASSERT_EQ(2, static_cast<int>(instrument.m_instructions[3]->m_branches[0]->m_operand));
+	ASSERT_EQ(4, static_cast<int>(instrument.m_instructions[10]->m_operand));
+	ASSERT_EQ(CEE_NOP, instrument.m_instructions[12]->m_operation);
+	ASSERT_EQ(2u, branchPoints[0].UniqueId);
+}
+
+TEST_F(CoverageInstrumentationTest, SequencePointsThatAlwaysExecuteTogetherShareAProbe)
+{
+	BYTE data[] = { (14 << 2) + CorILMethod_TinyFormat,
+		CEE_NOP,
+		CEE_LDC_I4_1,
+		CEE_STLOC_0,
+		CEE_LDLOC_0,
+		CEE_BRFALSE_S, 0x01,
+		CEE_NOP,
+		CEE_CALL, 0x02, 0x00, 0x00, 0x06,
+		CEE_NOP,
+		CEE_RET };
+
+	Method instrument(reinterpret_cast<IMAGE_COR_ILMETHOD*>(data));
+
+	const SequencePoint sequencePoints[] = { { 1, 0 }, { 2, 1 }, { 3, 3 }, { 4, 6 }, { 5, 7 }, { 6, 12 } };
+	std::vector<ULONG> mergedPoints;
+	auto probes = CoverageInstrumentation::MergeSequenceProbes(instrument, SequencePointSpan(sequencePoints, 6), mergedPoints);
+
+	// the conditional branch, the branch target and the call each start a new run
+	ASSERT_EQ((std::vector<ULONG> { 1 | MERGED_PROBE_FLAG, 1 | MERGED_PROBE_FLAG, 1 | MERGED_PROBE_FLAG, 4, 5, 6 }), probes);
+	ASSERT_EQ((std::vector<ULONG> { 1, 2, 1, 3 }), mergedPoints);
+
+	CoverageInstrumentation::AddSequenceCoverage([&instrument](InstructionList& instructions, ULONG uniqueId)->Instruction*
+	{
+		return CoverageInstrumentation::InsertInjectedMethod(instrument, instructions, 0x06000001, uniqueId);
+	}, instrument, SequencePointSpan(sequencePoints, 6), probes);
+
+	ASSERT_EQ(17, instrument.GetNumberOfInstructions());
+	ASSERT_EQ(1 | MERGED_PROBE_FLAG, static_cast<ULONG>(instrument.m_instructions[0]->m_operand));
+	ASSERT_EQ(CEE_NOP, instrument.m_instructions[2]->m_operation);
+	ASSERT_EQ(CEE_BRFALSE, instrument.m_instructions[6]->m_operation);
+	ASSERT_EQ(4, static_cast<int>(instrument.m_instructions[7]->m_operand));
+}
+
+TEST_F(CoverageInstrumentationTest, LoopBranchPathIsDerivedFromTheSequencePointOfTheLoopCondition)
+{
+	BYTE data[] = { (14 << 2) + CorILMethod_TinyFormat,
+		CEE_LDC_I4_0,
+		CEE_STLOC_0,
+		CEE_BR_S, 0x04,
+		CEE_LDLOC_0,
+		CEE_LDC_I4_1,
+		CEE_ADD,
+		CEE_STLOC_0,
+		CEE_LDLOC_0,
+		CEE_LDC_I4_S, 0x0A,
+		CEE_BLT_S, 0xF7,
+		CEE_RET };
+
+	Method instrument(reinterpret_cast<IMAGE_COR_ILMETHOD*>(data));
+
+	const SequencePoint sequencePoints[] = { { 1, 0 }, { 2, 4 }, { 3, 8 }, { 4, 13 } };
+	const BranchPoint branchPoints[] = { { 10, 11, 0 }, { 11, 11, 1 } };
+	std::vector<ULONG> mergedPoints;
+	auto probes = CoverageInstrumentation::MergeSequenceProbes(instrument, SequencePointSpan(sequencePoints, 4), mergedPoints);
+	auto derived = CoverageInstrumentation::DeriveBranchPoints(instrument, BranchPointSpan(branchPoints, 2), SequencePointSpan(sequencePoints, 4), probes);
+
+	// the loop condition is entered (point 3) as often as the branch is executed; the backward path is derived
+	ASSERT_EQ(1u, derived.size());
+	ASSERT_EQ(11u, derived[0].uniqueId);
+	ASSERT_EQ(3u, derived[0].nodeId);
+	ASSERT_EQ((std::vector<ULONG> { 10 }), derived[0].pathIds);
+	ASSERT_EQ((std::vector<ULONG> { 1, 2, 3 | COUNTED_PROBE_FLAG, 4 }), probes);
+
+	CoverageInstrumentation::AddBranchCoverage([&instrument](InstructionList& instructions, ULONG uniqueId)->Instruction*
+	{
+		return CoverageInstrumentation::InsertInjectedMethod(instrument, instructions, 0x06000001, uniqueId);
+	}, instrument, BranchPointSpan(branchPoints, 2), SequencePointSpan(sequencePoints, 4), derived);
+	CoverageInstrumentation::AddSequenceCoverage([&instrument](InstructionList& instructions, ULONG uniqueId)->Instruction*
+	{
+		return CoverageInstrumentation::InsertInjectedMethod(instrument, instructions, 0x06000001, uniqueId);
+	}, instrument, SequencePointSpan(sequencePoints, 4), probes);
+
+	auto it = std::find_if(instrument.m_instructions.begin(), instrument.m_instructions.end(),
+		[](Instruction* pInstruction) { return pInstruction->m_operation == CEE_BLT; });
+	ASSERT_NE(instrument.m_instructions.end(), it);
+	ASSERT_EQ(2, static_cast<int>((*it)->m_branches[0]->m_operand));
+	ASSERT_EQ(CEE_BR, (*(it + 1))->m_operation);
+	ASSERT_EQ(10 | COUNTED_PROBE_FLAG, static_cast<ULONG>((*(it + 2))->m_operand));
+	ASSERT_EQ(instrument.m_instructions.end(), std::find_if(instrument.m_instructions.begin(), instrument.m_instructions.end(),
+		[](Instruction* pInstruction) { return pInstruction->m_operation == CEE_LDC_I4 && pInstruction->m_operand == 11; }));
+}
+
+TEST_F(CoverageInstrumentationTest, InlineCounterProbesIncrementTheCounterOfThePoint)
+{
+	BYTE data[] = { (2 << 2) + CorILMethod_TinyFormat,
+		CEE_NOP,
+		CEE_RET };
+
+	Method instrument(reinterpret_cast<IMAGE_COR_ILMETHOD*>(data));
+
+	ULONG counters[4] = { 0 };
+	const SequencePoint sequencePoints[] = { { 1, 0 }, { 3, 1 } };
+	CoverageInstrumentation::AddSequenceCoverage([&instrument, &counters](InstructionList& instructions, ULONG uniqueId)->Instruction*
+	{
+		return CoverageInstrumentation::InsertCounterIncrement(instrument, instructions, counters + uniqueId);
+	}, instrument, SequencePointSpan(sequencePoints, 2));
+
+	const CanonicalName expected[] = { CEE_CONV_U, CEE_DUP, CEE_LDIND_U4, CEE_LDC_I4_1, CEE_ADD, CEE_STIND_I4, CEE_NOP };
+	ASSERT_EQ(16, instrument.GetNumberOfInstructions());
+	for (auto i = 0; i < 7; i++)
+	{
+		ASSERT_EQ(expected[i], instrument.m_instructions[i + 1]->m_operation);
+	}
+	ASSERT_EQ(reinterpret_cast<FPTR>(counters + 1), static_cast<FPTR>(instrument.m_instructions[0]->m_operand));
+	ASSERT_EQ(reinterpret_cast<FPTR>(counters + 3), static_cast<FPTR>(instrument.m_instructions[8]->m_operand));
+}
+
+TEST_F(CoverageInstrumentationTest, SetProbesSetTheCounterOfThePoint)
+{
+	BYTE data[] = { (2 << 2) + CorILMethod_TinyFormat,
+		CEE_NOP,
+		CEE_RET };
+
+	Method instrument(reinterpret_cast<IMAGE_COR_ILMETHOD*>(data));
+
+	ULONG counters[4] = { 0 };
+	const SequencePoint sequencePoints[] = { { 1, 0 }, { 3, 1 } };
+	const std::vector<ULONG> probes = { 1, 3 | MERGED_PROBE_FLAG };
+	ASSERT_TRUE(CoverageInstrumentation::AddCoverage(CoverageInstrumentation::SetProbe(counters), instrument, SequencePointSpan(sequencePoints, 2), BranchPointSpan(), probes));
+
+	const CanonicalName expected[] = { CEE_CONV_U, CEE_LDC_I4_1, CEE_STIND_I4, CEE_NOP };
+	ASSERT_EQ(10, instrument.GetNumberOfInstructions());
+	for (auto i = 0; i < 4; i++)
+	{
+		ASSERT_EQ(expected[i], instrument.m_instructions[i + 1]->m_operation);
+	}
+	ASSERT_EQ(reinterpret_cast<FPTR>(counters + 1), static_cast<FPTR>(instrument.m_instructions[0]->m_operand));
+	ASSERT_EQ(reinterpret_cast<FPTR>(counters + 3), static_cast<FPTR>(instrument.m_instructions[5]->m_operand));
+}
+
+TEST_F(CoverageInstrumentationTest, ProbesAreNotAddedToAMethodThatAlreadyHasThem)
+{
+	BYTE data[] = { (2 << 2) + CorILMethod_TinyFormat,
+		CEE_NOP,
+		CEE_RET };
+
+	Method instrument(reinterpret_cast<IMAGE_COR_ILMETHOD*>(data));
+
+	const SequencePoint sequencePoints[] = { { 1, 0 }, { 2, 1 } };
+	const std::vector<ULONG> probes = { 1, 2 };
+	CoverageInstrumentation::CallProbe probe(0x06000001);
+	ASSERT_TRUE(CoverageInstrumentation::AddCoverage(probe, instrument, SequencePointSpan(sequencePoints, 2), BranchPointSpan(), probes));
+
+	std::vector<BYTE> written(instrument.GetMethodSize());
+	instrument.WriteMethod(reinterpret_cast<IMAGE_COR_ILMETHOD*>(written.data()));
+	Method again(reinterpret_cast<IMAGE_COR_ILMETHOD*>(written.data()));
+	auto count = again.GetNumberOfInstructions();
+
+	ASSERT_FALSE(CoverageInstrumentation::AddCoverage(probe, again, SequencePointSpan(sequencePoints, 2), BranchPointSpan(), probes));
+	ASSERT_EQ(count, again.GetNumberOfInstructions());
+}
+
+TEST_F(CoverageInstrumentationTest, MethodWithinTheBudgetKeepsBranchCoverage)
+{
+	const SequencePoint sequencePoints[] = { { 1, 0 }, { 2, 4 }, { 3, 9 } };
+	const BranchPoint branchPoints[] = { { 4, 6, 0 }, { 5, 6, 1 } };
+	const std::vector<ULONG> probes = { 1, 2, 3 };
+	ULONG probeCount = 0;
+
+	ASSERT_EQ(CoverageInstrumentation::CL_Branch, CoverageInstrumentation::ChooseCoverageLevel(CoverageInstrumentation::ProbeBudget(), 20, 5,
+		SequencePointSpan(sequencePoints, 3), BranchPointSpan(branchPoints, 2), probes, CoverageInstrumentation::DerivedBranchPoints(), probeCount));
+	ASSERT_EQ(5u, probeCount);
+}
+
+TEST_F(CoverageInstrumentationTest, MethodOverTheProbeBudgetFallsBackToCoarserCoverage)
+{
+	const SequencePoint sequencePoints[] = { { 1, 0 }, { 2, 4 }, { 3, 9 } };
+	const BranchPoint branchPoints[] = { { 4, 6, 0 }, { 5, 6, 1 } };
+	const std::vector<ULONG> probes = { 1, 2, 3 };
+	CoverageInstrumentation::ProbeBudget budget;
+	ULONG probeCount = 0;
+
+	budget.maxProbes = 4;
+	ASSERT_EQ(CoverageInstrumentation::CL_Sequence, CoverageInstrumentation::ChooseCoverageLevel(budget, 20, 5,
+		SequencePointSpan(sequencePoints, 3), BranchPointSpan(branchPoints, 2), probes, CoverageInstrumentation::DerivedBranchPoints(), probeCount));
+	ASSERT_EQ(3u, probeCount);
+
+	budget.maxProbes = 2;
+	ASSERT_EQ(CoverageInstrumentation::CL_Entry, CoverageInstrumentation::ChooseCoverageLevel(budget, 20, 5,
+		SequencePointSpan(sequencePoints, 3), BranchPointSpan(branchPoints, 2), probes, CoverageInstrumentation::DerivedBranchPoints(), probeCount));
+	ASSERT_EQ(1u, probeCount);
+}
+
+TEST_F(CoverageInstrumentationTest, MergedAndDerivedPointsDoNotCountAgainstTheProbeBudget)
+{
+	const SequencePoint sequencePoints[] = { { 1, 0 }, { 2, 4 }, { 3, 9 } };
+	const BranchPoint branchPoints[] = { { 4, 6, 0 }, { 5, 6, 1 } };
+	const std::vector<ULONG> probes = { 1 | MERGED_PROBE_FLAG, 1 | MERGED_PROBE_FLAG, 3 };
+	CoverageInstrumentation::DerivedBranchPoints derived(1);
+	CoverageInstrumentation::ProbeBudget budget;
+	ULONG probeCount = 0;
+
+	budget.maxProbes = 3;
+	ASSERT_EQ(CoverageInstrumentation::CL_Branch, CoverageInstrumentation::ChooseCoverageLevel(budget, 20, 5,
+		SequencePointSpan(sequencePoints, 3), BranchPointSpan(branchPoints, 2), probes, derived, probeCount));
+	ASSERT_EQ(3u, probeCount);
+}
+
+TEST_F(CoverageInstrumentationTest, MethodOverTheCodeGrowthBudgetFallsBackToCoarserCoverage)
+{
+	const SequencePoint sequencePoints[] = { { 1, 0 }, { 2, 4 }, { 3, 9 } };
+	const BranchPoint branchPoints[] = { { 4, 6, 0 }, { 5, 6, 1 } };
+	const std::vector<ULONG> probes = { 1, 2, 3 };
+	CoverageInstrumentation::ProbeBudget budget;
+	ULONG probeCount = 0;
+
+	// 3 sequence probes add 15 bytes, the 2 branch probes (and their jumps) another 20
+	budget.maxCodeGrowth = 3.0;
+	ASSERT_EQ(CoverageInstrumentation::CL_Branch, CoverageInstrumentation::ChooseCoverageLevel(budget, 20, 5,
+		SequencePointSpan(sequencePoints, 3), BranchPointSpan(branchPoints, 2), probes, CoverageInstrumentation::DerivedBranchPoints(), probeCount));
+
+	budget.maxCodeGrowth = 2.0;
+	ASSERT_EQ(CoverageInstrumentation::CL_Sequence, CoverageInstrumentation::ChooseCoverageLevel(budget, 20, 5,
+		SequencePointSpan(sequencePoints, 3), BranchPointSpan(branchPoints, 2), probes, CoverageInstrumentation::DerivedBranchPoints(), probeCount));
+
+	budget.maxCodeGrowth = 1.5;
+	ASSERT_EQ(CoverageInstrumentation::CL_Entry, CoverageInstrumentation::ChooseCoverageLevel(budget, 20, 5,
+		SequencePointSpan(sequencePoints, 3), BranchPointSpan(branchPoints, 2), probes, CoverageInstrumentation::DerivedBranchPoints(), probeCount));
+}
+
+TEST_F(CoverageInstrumentationTest, EntryCoverageProbesTheFirstSequencePoint)
+{
+	const SequencePoint sequencePoints[] = { { 1, 5 }, { 2, 0 }, { 3, 9 } };
+
+	auto entry = CoverageInstrumentation::GetEntryPoint(SequencePointSpan(sequencePoints, 3));
+
+	ASSERT_EQ(1u, entry.size());
+	ASSERT_EQ(2u, entry[0].UniqueId);
+	ASSERT_EQ(0u, CoverageInstrumentation::GetEntryPoint(SequencePointSpan()).size());
+}
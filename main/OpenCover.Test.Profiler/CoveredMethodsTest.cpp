@@ -0,0 +1,131 @@
+#include "stdafx.h"
+#include "MockProfilerInfo.h"
+#include "ComBaseTest.h"
+#include "..\OpenCover.Profiler\CoveredMethods.h"
+
+using ::testing::_;
+using ::testing::Return;
+using ::testing::Invoke;
+
+using namespace Instrumentation;
+
+class CoveredMethodsTest : public ComBaseTest {
+public:
+	CoveredMethodsTest() : mockProfilerInfo_(nullptr)
+	{
+	}
+
+private:
+	void SetUp() override
+	{
+		CreateComObject(&mockProfilerInfo_);
+	}
+
+	void TearDown() override
+	{
+		ASSERT_EQ(0, mockProfilerInfo_->Release());
+	}
+
+protected:
+	CComObject<MockProfilerInfo> *mockProfilerInfo_;
+	const BYTE body_[2] = { (0x01 << 2) | CorILMethod_TinyFormat, CEE_RET };
+};
+
+TEST_F(CoveredMethodsTest, MethodIsPendingOnceAllItsPointsAreCovered)
+{
+	CoveredMethods methods;
+	ASSERT_TRUE(methods.Track(0x100, 0x06000001, body_, 2, { 1, 2, 3 }));
+	ASSERT_TRUE(methods.Track(0x100, 0x06000002, body_, 2, { 4 }));
+
+	ASSERT_FALSE(methods.PointCovered(1));
+	ASSERT_FALSE(methods.PointCovered(3));
+	ASSERT_FALSE(methods.PointCovered(3));
+	ASSERT_EQ(0u, methods.GetPendingCount());
+
+	ASSERT_TRUE(methods.PointCovered(2));
+	ASSERT_FALSE(methods.PointCovered(2));
+	ASSERT_EQ(1u, methods.GetPendingCount());
+}
+
+TEST_F(CoveredMethodsTest, PendingMethodsAreReJitedInASingleRequest)
+{
+	CoveredMethods methods;
+	methods.Track(0x100, 0x06000001, body_, 2, { 1, 2 });
+	methods.Track(0x200, 0x06000007, body_, 2, { 3 });
+	methods.Track(0x200, 0x06000008, body_, 2, { 4 });
+	methods.PointCovered(1);
+	methods.PointCovered(2);
+	methods.PointCovered(3);
+
+	std::vector<ModuleID> modules;
+	std::vector<mdMethodDef> tokens;
+	EXPECT_CALL(*mockProfilerInfo_, RequestReJIT(2, _, _))
+		.WillOnce(Invoke([&](ULONG cFunctions, ModuleID moduleIds[], mdMethodDef methodIds[])
+	{
+		modules.assign(moduleIds, moduleIds + cFunctions);
+		tokens.assign(methodIds, methodIds + cFunctions);
+		return S_OK;
+	}));
+
+	ASSERT_EQ(S_OK, methods.RequestReJIT(mockProfilerInfo_));
+	ASSERT_EQ((std::vector<ModuleID> { 0x100, 0x200 }), modules);
+	ASSERT_EQ((std::vector<mdMethodDef> { 0x06000001, 0x06000007 }), tokens);
+
+	// nothing is left to request
+	ASSERT_EQ(S_FALSE, methods.RequestReJIT(mockProfilerInfo_));
+}
+
+TEST_F(CoveredMethodsTest, MethodIsPendingInEveryModuleItIsLoadedInto)
+{
+	CoveredMethods methods;
+	ASSERT_TRUE(methods.Track(0x100, 0x06000001, body_, 2, { 1, 2 }));
+	ASSERT_TRUE(methods.Track(0x200, 0x06000001, body_, 2, { 1, 2 }));
+
+	ASSERT_FALSE(methods.PointCovered(1));
+	ASSERT_TRUE(methods.PointCovered(2));
+	ASSERT_EQ(2u, methods.GetPendingCount());
+
+	// a module loaded once the points are covered has nothing to wait for
+	ASSERT_TRUE(methods.Track(0x300, 0x06000001, body_, 2, { 1, 2 }));
+	ASSERT_EQ(3u, methods.GetPendingCount());
+
+	std::vector<ModuleID> modules;
+	EXPECT_CALL(*mockProfilerInfo_, RequestReJIT(3, _, _))
+		.WillOnce(Invoke([&](ULONG cFunctions, ModuleID moduleIds[], mdMethodDef methodIds[])
+	{
+		modules.assign(moduleIds, moduleIds + cFunctions);
+		return S_OK;
+	}));
+
+	ASSERT_EQ(S_OK, methods.RequestReJIT(mockProfilerInfo_));
+	ASSERT_EQ((std::vector<ModuleID> { 0x100, 0x200, 0x300 }), modules);
+}
+
+TEST_F(CoveredMethodsTest, ForgottenModulesAreNotReJited)
+{
+	CoveredMethods methods;
+	methods.Track(0x100, 0x06000001, body_, 2, { 1 });
+	methods.PointCovered(1);
+	methods.Forget(0x100);
+
+	LPCBYTE pBody = nullptr;
+	ULONG size = 0;
+	ASSERT_FALSE(methods.GetOriginalBody(0x100, 0x06000001, pBody, size));
+
+	EXPECT_CALL(*mockProfilerInfo_, RequestReJIT(_, _, _)).Times(0);
+	ASSERT_EQ(S_FALSE, methods.RequestReJIT(mockProfilerInfo_));
+}
+
+TEST_F(CoveredMethodsTest, OriginalBodyIsTheFirstOneTracked)
+{
+	const BYTE other[2] = { (0x01 << 2) | CorILMethod_TinyFormat, CEE_RET };
+	CoveredMethods methods;
+	ASSERT_TRUE(methods.Track(0x100, 0x06000001, body_, 2, { 1 }));
+	ASSERT_FALSE(methods.Track(0x100, 0x06000001, other, 2, { 1 }));
+
+	LPCBYTE pBody = nullptr;
+	ULONG size = 0;
+	ASSERT_TRUE(methods.GetOriginalBody(0x100, 0x06000001, pBody, size));
+	ASSERT_EQ(static_cast<LPCBYTE>(body_), pBody);
+	ASSERT_EQ(2u, size);
+}
@@ -0,0 +1,319 @@
+#include "stdafx.h"
+#include "ILCorpus.h"
+#include "..\OpenCover.Profiler\Operations.h"
+
+#include <random>
+
+namespace
+{
+	enum class RegionExit { Return, Leave, EndFinally };
+
+	class Generator
+	{
+	public:
+		explicit Generator(const ILCorpus::Options& options)
+			: m_options(options), m_random(options.seed), m_instructionCount(0) {}
+
+		ILCorpus::GeneratedMethod Generate();
+
+	private:
+		struct Clause { ULONG flags; int tryStart; int tryEnd; int filterStart; int handlerStart; int handlerEnd; };
+		struct Fixup { size_t at; size_t from; int label; };
+		struct Branch { long offset; ULONG paths; };
+
+		ULONG Random(ULONG range) { return range == 0 ? 0 : static_cast<ULONG>(m_random() % range); }
+
+		int NewLabel() { m_labels.push_back(-1); return static_cast<int>(m_labels.size() - 1); }
+		int MarkNewLabel() { auto label = NewLabel(); Mark(label); return label; }
+		void Mark(int label) { m_labels[label] = static_cast<long>(m_code.size()); }
+
+		void Append(ULONG value);
+		void StartInstruction();
+		void Emit(CanonicalName name);
+		void EmitBranch(CanonicalName name, int label);
+		void EmitSwitch(const std::vector<int>& labels);
+
+		void Region(ULONG budget, ULONG depth, RegionExit exit, int exitLabel);
+		void TryBlock(ULONG budget, ULONG depth);
+		void Layout(ILCorpus::GeneratedMethod& method);
+
+	private:
+		const ILCorpus::Options& m_options;
+		std::mt19937 m_random;
+		ULONG m_instructionCount;
+
+		std::vector<BYTE> m_code;
+		std::vector<long> m_labels;
+		std::vector<Fixup> m_fixups;
+		std::vector<Clause> m_clauses;
+		std::vector<long> m_instructionStarts;
+		std::vector<Branch> m_branches;
+	};
+
+	void Generator::Append(ULONG value)
+	{
+		for (auto i = 0; i < 4; i++)
+			m_code.push_back(static_cast<BYTE>(value >> (8 * i)));
+	}
+
+	void Generator::StartInstruction()
+	{
+		m_instructionStarts.push_back(static_cast<long>(m_code.size()));
+		m_instructionCount++;
+	}
+
+	void Generator::Emit(CanonicalName name)
+	{
+		StartInstruction();
+		auto& details = Instrumentation::Operations::GetOperationDetails(name);
+		if (details.length == 2)
+			m_code.push_back(details.op1);
+		m_code.push_back(details.op2);
+	}
+
+	void Generator::EmitBranch(CanonicalName name, int label)
+	{
+		if (name != CEE_BR && name != CEE_LEAVE)
+			m_branches.push_back({ static_cast<long>(m_code.size()), 2 });
+		Emit(name);
+		m_fixups.push_back({ m_code.size(), m_code.size() + 4, label });
+		Append(0);
+	}
+
+	void Generator::EmitSwitch(const std::vector<int>& labels)
+	{
+		m_branches.push_back({ static_cast<long>(m_code.size()), static_cast<ULONG>(labels.size() + 1) });
+		Emit(CEE_SWITCH);
+		Append(static_cast<ULONG>(labels.size()));
+		auto from = m_code.size() + (labels.size() * 4);
+		for (auto label : labels)
+		{
+			m_fixups.push_back({ m_code.size(), from, label });
+			Append(0);
+		}
+	}
+
+	/// <summary>Generate a block of (at least) <paramref name="budget"/> instructions</summary>
+	/// <remarks>The block is split into units; branches target the start of a unit of the same
+	/// block (or its exit instruction) so they never enter or leave a protected region.</remarks>
+	void Generator::Region(ULONG budget, ULONG depth, RegionExit exit, int exitLabel)
+	{
+		auto start = m_instructionCount;
+		std::vector<int> starts;
+		std::vector<std::pair<ULONG, int>> forwards;
+		ULONG unit = 0;
+
+		while (m_instructionCount - start < budget)
+		{
+			starts.push_back(MarkNewLabel());
+			for (auto it = forwards.begin(); it != forwards.end();)
+			{
+				if (it->first > unit) { ++it; continue; }
+				Mark(it->second);
+				it = forwards.erase(it);
+			}
+			unit++;
+
+			auto target = [&]()->int
+			{
+				if (Random(3) == 0)
+					return starts[Random(static_cast<ULONG>(starts.size()))];
+				auto label = NewLabel();
+				forwards.push_back(std::make_pair(unit + Random(8), label));
+				return label;
+			};
+
+			auto remaining = budget - (m_instructionCount - start);
+			auto choice = Random(100);
+			if (depth < m_options.tryDepth && remaining >= 16 && choice < 10)
+			{
+				TryBlock(remaining / 3, depth + 1);
+			}
+			else if (m_options.switchTargets > 0 && choice < 15)
+			{
+				std::vector<int> targets;
+				for (ULONG i = 0; i < m_options.switchTargets; i++)
+					targets.push_back(target());
+				Emit(CEE_LDC_I4_0);
+				EmitSwitch(targets);
+			}
+			else if (m_options.branchEvery > 0 && Random(m_options.branchEvery) < 2)
+			{
+				Emit(Random(2) == 0 ? CEE_LDC_I4_0 : CEE_LDC_I4_1);
+				if (m_options.compareBranches)
+				{
+					const CanonicalName compareBranches[] = { CEE_BEQ, CEE_BNE_UN, CEE_BGT, CEE_BLT_UN, CEE_BGE, CEE_CEQ, CEE_CLT };
+					auto name = compareBranches[Random(7)];
+					Emit(CEE_LDC_I4_1);
+					if (name == CEE_CEQ || name == CEE_CLT)
+					{
+						Emit(name);
+						EmitBranch(Random(2) == 0 ? CEE_BRTRUE : CEE_BRFALSE, target());
+					}
+					else
+					{
+						EmitBranch(name, target());
+					}
+				}
+				else
+				{
+					EmitBranch(Random(2) == 0 ? CEE_BRTRUE : CEE_BRFALSE, target());
+				}
+			}
+			else if (Random(2) == 0)
+			{
+				Emit(CEE_NOP);
+			}
+			else
+			{
+				Emit(CEE_LDC_I4_1);
+				Emit(CEE_POP);
+			}
+		}
+
+		for (auto& forward : forwards)
+			Mark(forward.second);
+
+		switch (exit)
+		{
+		case RegionExit::Return:
+			Emit(CEE_RET);
+			break;
+		case RegionExit::Leave:
+			EmitBranch(CEE_LEAVE, exitLabel);
+			break;
+		case RegionExit::EndFinally:
+			Emit(CEE_ENDFINALLY);
+			break;
+		}
+	}
+
+	void Generator::TryBlock(ULONG budget, ULONG depth)
+	{
+		auto after = NewLabel();
+		Clause clause = { COR_ILEXCEPTION_CLAUSE_FINALLY, MarkNewLabel(), -1, -1, -1, -1 };
+		Region(budget, depth, RegionExit::Leave, after);
+		clause.tryEnd = MarkNewLabel();
+
+		if (m_options.filters && Random(2) == 0)
+		{
+			clause.flags = COR_ILEXCEPTION_CLAUSE_FILTER;
+			clause.filterStart = MarkNewLabel();
+			Emit(CEE_POP);
+			Emit(CEE_LDC_I4_1);
+			Emit(CEE_ENDFILTER);
+			clause.handlerStart = MarkNewLabel();
+			Emit(CEE_POP);
+			Region(budget / 2, depth, RegionExit::Leave, after);
+		}
+		else
+		{
+			clause.handlerStart = MarkNewLabel();
+			Region(budget / 2, depth, RegionExit::EndFinally, -1);
+		}
+
+		clause.handlerEnd = MarkNewLabel();
+		m_clauses.push_back(clause);
+		Mark(after);
+	}
+
+	/// <summary>Write the header, code and exception handlers</summary>
+	void Generator::Layout(ILCorpus::GeneratedMethod& method)
+	{
+		for (const auto& fixup : m_fixups)
+		{
+			auto delta = static_cast<ULONG>(m_labels[fixup.label] - static_cast<long>(fixup.from));
+			for (auto i = 0; i < 4; i++)
+				m_code[fixup.at + i] = static_cast<BYTE>(delta >> (8 * i));
+		}
+
+		auto codeSize = static_cast<ULONG>(m_code.size());
+		if (m_clauses.empty() && codeSize < 64)
+		{
+			method.body.push_back(static_cast<BYTE>((codeSize << 2) | CorILMethod_TinyFormat));
+			method.body.insert(method.body.end(), m_code.begin(), m_code.end());
+			return;
+		}
+
+		method.body.resize(sizeof(IMAGE_COR_ILMETHOD_FAT));
+		auto pHeader = reinterpret_cast<IMAGE_COR_ILMETHOD_FAT*>(method.body.data());
+		pHeader->Flags = CorILMethod_FatFormat | (m_clauses.empty() ? 0 : CorILMethod_MoreSects);
+		pHeader->Size = 3;
+		pHeader->MaxStack = 8;
+		pHeader->CodeSize = codeSize;
+		method.body.insert(method.body.end(), m_code.begin(), m_code.end());
+		if (m_clauses.empty())
+			return;
+
+		m_code.clear();
+		while ((method.body.size() + m_code.size()) % 4 != 0)
+			m_code.push_back(0);
+		auto dataSize = static_cast<ULONG>(4 + (m_clauses.size() * 24));
+		Append(CorILMethod_Sect_EHTable | CorILMethod_Sect_FatFormat | (dataSize << 8));
+		for (const auto& clause : m_clauses)
+		{
+			Append(clause.flags);
+			Append(m_labels[clause.tryStart]);
+			Append(m_labels[clause.tryEnd] - m_labels[clause.tryStart]);
+			Append(m_labels[clause.handlerStart]);
+			Append(m_labels[clause.handlerEnd] - m_labels[clause.handlerStart]);
+			Append(clause.filterStart == -1 ? 0 : m_labels[clause.filterStart]);
+		}
+		method.body.insert(method.body.end(), m_code.begin(), m_code.end());
+	}
+
+	ILCorpus::GeneratedMethod Generator::Generate()
+	{
+		Region(m_options.instructions, 0, RegionExit::Return, -1);
+
+		ILCorpus::GeneratedMethod method;
+		method.instructionCount = m_instructionCount;
+		method.exceptionHandlerCount = static_cast<ULONG>(m_clauses.size());
+
+		ULONG uniqueId = 0;
+		auto every = m_options.sequencePointEvery == 0 ? 1 : m_options.sequencePointEvery;
+		for (size_t i = 0; i < m_instructionStarts.size(); i += every)
+			method.sequencePoints.push_back({ ++uniqueId, m_instructionStarts[i] });
+		for (const auto& branch : m_branches)
+		{
+			for (ULONG path = 0; path < branch.paths; path++)
+				method.branchPoints.push_back({ ++uniqueId, branch.offset, static_cast<long>(path) });
+		}
+
+		Layout(method);
+		return method;
+	}
+}
+
+namespace ILCorpus
+{
+	/// <summary>Generate a method; the same options (and seed) always generate the same method</summary>
+	GeneratedMethod Generate(const Options& options)
+	{
+		Generator generator(options);
+		return generator.Generate();
+	}
+
+	/// <summary>Build a fat method with a switch that targets every one of the instructions that follow it</summary>
+	std::vector<BYTE> BuildSwitchMethod(ULONG targets)
+	{
+		std::vector<BYTE> data(sizeof(IMAGE_COR_ILMETHOD_FAT));
+		auto append = [&data](ULONG value) { for (int i = 0; i < 4; i++) data.push_back(static_cast<BYTE>(value >> (8 * i))); };
+
+		data.push_back(CEE_SWITCH);
+		append(targets);
+		for (ULONG i = 0; i < targets; i++)
+		{
+			append(i);
+		}
+		data.insert(data.end(), targets, CEE_NOP);
+		data.push_back(CEE_RET);
+
+		auto pHeader = reinterpret_cast<IMAGE_COR_ILMETHOD_FAT*>(data.data());
+		pHeader->Flags = CorILMethod_FatFormat;
+		pHeader->Size = 3;
+		pHeader->MaxStack = 8;
+		pHeader->CodeSize = static_cast<DWORD>(data.size() - sizeof(IMAGE_COR_ILMETHOD_FAT));
+		return data;
+	}
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include "..\OpenCover.Profiler\Messages.h"
+
+#include <vector>
+
+/// <summary>Generates method bodies to exercise the rewriter with</summary>
+/// <remarks>The bodies are valid IL: every instruction is stack neutral (or balances the instruction
+/// before it), branches stay within the block they start in and try blocks are left with <c>leave</c>;
+/// they are meant to be read and rewritten, not executed.</remarks>
+namespace ILCorpus
+{
+	/// <summary>The shape of a generated method</summary>
+	struct Options
+	{
+		Options() : instructions(100), branchEvery(8), compareBranches(false), switchTargets(0), tryDepth(0), filters(false),
+			sequencePointEvery(3), seed(1) {}
+
+		// roughly how many instructions the method has
+		ULONG instructions;
+		// on average one conditional branch in every branchEvery instructions (0 for none)
+		ULONG branchEvery;
+		// the conditional branches compare two values (blt, or ceq and brfalse, etc.) rather than test one
+		bool compareBranches;
+		// the number of targets of each switch (0 for no switches)
+		ULONG switchTargets;
+		// how deeply try blocks are nested (0 for none)
+		ULONG tryDepth;
+		// use filter handlers as well as finally handlers
+		bool filters;
+		// a sequence point on every n-th instruction
+		ULONG sequencePointEvery;
+		ULONG seed;
+	};
+
+	/// <summary>A generated method and the points the host would supply for it</summary>
+	/// <remarks>Methods with less than 64 bytes of code and no exception handlers have 'Tiny' headers.</remarks>
+	struct GeneratedMethod
+	{
+		std::vector<BYTE> body;
+		std::vector<SequencePoint> sequencePoints;
+		std::vector<BranchPoint> branchPoints;
+		ULONG instructionCount;
+		ULONG exceptionHandlerCount;
+
+		IMAGE_COR_ILMETHOD* GetHeader() { return reinterpret_cast<IMAGE_COR_ILMETHOD*>(body.data()); }
+	};
+
+	GeneratedMethod Generate(const Options& options);
+	std::vector<BYTE> BuildSwitchMethod(ULONG targets);
+}
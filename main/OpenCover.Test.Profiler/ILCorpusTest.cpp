@@ -0,0 +1,187 @@
+#include "stdafx.h"
+#include "ILCorpus.h"
+#include "..\OpenCover.Profiler\Method.h"
+#include "..\OpenCover.Profiler\ProbePolicies.h"
+
+using namespace Instrumentation;
+
+class ILCorpusTest : public ::testing::Test {
+	void SetUp() override
+	{
+
+	}
+
+	void TearDown() override
+	{
+
+	}
+};
+
+namespace
+{
+	std::vector<ILCorpus::Options> GetShapes()
+	{
+		std::vector<ILCorpus::Options> shapes(4);
+		shapes[0].instructions = 500;
+		shapes[1].instructions = 500;
+		shapes[1].branchEvery = 2;
+		shapes[2].instructions = 500;
+		shapes[2].switchTargets = 64;
+		shapes[3].instructions = 2000;
+		shapes[3].tryDepth = 4;
+		shapes[3].filters = true;
+		return shapes;
+	}
+}
+
+TEST_F(ILCorpusTest, SmallMethodsHaveTinyHeaders)
+{
+	ILCorpus::Options options;
+	options.instructions = 10;
+	auto generated = ILCorpus::Generate(options);
+
+	ASSERT_EQ(CorILMethod_TinyFormat, generated.body[0] & 0x3);
+
+	Method method(generated.GetHeader());
+	ASSERT_EQ(generated.instructionCount, static_cast<ULONG>(method.GetNumberOfInstructions()));
+}
+
+TEST_F(ILCorpusTest, GeneratedMethodsAreReadAsGenerated)
+{
+	for (const auto& options : GetShapes())
+	{
+		auto generated = ILCorpus::Generate(options);
+
+		Method method(generated.GetHeader());
+		ASSERT_EQ(generated.instructionCount, static_cast<ULONG>(method.GetNumberOfInstructions()));
+		ASSERT_EQ(generated.exceptionHandlerCount, static_cast<ULONG>(method.GetNumberOfExceptions()));
+		ASSERT_FALSE(generated.branchPoints.empty());
+	}
+}
+
+TEST_F(ILCorpusTest, SameSeedGeneratesSameMethod)
+{
+	auto options = GetShapes()[3];
+	ASSERT_EQ(ILCorpus::Generate(options).body, ILCorpus::Generate(options).body);
+
+	ASSERT_LT(0u, ILCorpus::Generate(options).exceptionHandlerCount);
+
+	options.seed = 2;
+	ASSERT_NE(GetShapes()[3].seed, options.seed);
+	ASSERT_NE(ILCorpus::Generate(GetShapes()[3]).body, ILCorpus::Generate(options).body);
+}
+
+TEST_F(ILCorpusTest, InstrumentedMethodsCanBeWrittenAndReadBack)
+{
+	for (const auto& options : GetShapes())
+	{
+		auto generated = ILCorpus::Generate(options);
+		Method method(generated.GetHeader());
+
+		auto instrumentMethod = [&method](InstructionList& instructions, ULONG uniqueId)->Instruction*
+		{
+			return CoverageInstrumentation::InsertInjectedMethod(method, instructions, 0x06000001, uniqueId);
+		};
+		CoverageInstrumentation::AddBranchCoverage(instrumentMethod, method, generated.branchPoints, generated.sequencePoints);
+		CoverageInstrumentation::AddSequenceCoverage(instrumentMethod, method, generated.sequencePoints);
+		method.OptimizeEncoding();
+
+		auto size = method.GetMethodSize();
+		std::vector<BYTE> buffer(size);
+		method.WriteMethod(reinterpret_cast<IMAGE_COR_ILMETHOD*>(buffer.data()));
+
+		Method written(reinterpret_cast<IMAGE_COR_ILMETHOD*>(buffer.data()));
+		ASSERT_EQ(method.GetNumberOfInstructions(), written.GetNumberOfInstructions());
+		ASSERT_EQ(generated.exceptionHandlerCount, static_cast<ULONG>(written.GetNumberOfExceptions()));
+		ASSERT_LT(generated.instructionCount, static_cast<ULONG>(written.GetNumberOfInstructions()));
+	}
+}
+
+TEST_F(ILCorpusTest, ColdPathsAreKeptInTheirExceptionRegions)
+{
+	for (const auto& options : GetShapes())
+	{
+		auto generated = ILCorpus::Generate(options);
+		Method method(generated.GetHeader());
+
+		auto instrumentMethod = [&method](InstructionList& instructions, ULONG uniqueId)->Instruction*
+		{
+			return CoverageInstrumentation::InsertInjectedMethod(method, instructions, 0x06000001, uniqueId);
+		};
+		CoverageInstrumentation::AddBranchCoverage(instrumentMethod, method, generated.branchPoints, generated.sequencePoints,
+			CoverageInstrumentation::DerivedBranchPoints(), true);
+		method.OptimizeEncoding();
+
+		std::vector<BYTE> buffer(method.GetMethodSize());
+		method.WriteMethod(reinterpret_cast<IMAGE_COR_ILMETHOD*>(buffer.data()));
+		Method written(reinterpret_cast<IMAGE_COR_ILMETHOD*>(buffer.data()));
+		ASSERT_EQ(method.GetNumberOfInstructions(), written.GetNumberOfInstructions());
+
+		// only leave can take the code out of a region and a branch can only enter one at its start
+		auto regions = written.GetExceptionRegions();
+		for (auto pInstruction : written.m_instructions)
+		{
+			if (!pInstruction->m_isBranch || pInstruction->m_operation == CEE_LEAVE || pInstruction->m_operation == CEE_LEAVE_S)
+				continue;
+			for (auto pTarget : pInstruction->m_branches)
+			{
+				for (const auto& region : regions)
+				{
+					auto inRegion = [&region](const Instruction* pAt) { return pAt->m_offset >= region.first && pAt->m_offset < region.second; };
+					if (inRegion(pInstruction) != inRegion(pTarget))
+						ASSERT_EQ(region.first, pTarget->m_offset);
+				}
+			}
+		}
+	}
+}
+
+TEST_F(ILCorpusTest, ValueProbesAddNoJumps)
+{
+	ILCorpus::Options options;
+	options.instructions = 2000;
+	options.branchEvery = 2;
+	options.compareBranches = true;
+	options.tryDepth = 2;
+	auto generated = ILCorpus::Generate(options);
+	Method method(generated.GetHeader());
+
+	auto count = [](const Method& counted, CanonicalName name, CanonicalName shortName)
+	{
+		return std::count_if(counted.m_instructions.begin(), counted.m_instructions.end(),
+			[name, shortName](const Instruction* pInstruction) { return pInstruction->m_operation == name || pInstruction->m_operation == shortName; });
+	};
+	auto conditionals = [](const Method& counted)
+	{
+		return std::count_if(counted.m_instructions.begin(), counted.m_instructions.end(),
+			[](const Instruction* pInstruction) { return Operations::GetOperationDetails(pInstruction->m_operation).controlFlow == COND_BRANCH; });
+	};
+	auto jumps = count(method, CEE_BR, CEE_BR_S);
+	auto unsplit = count(method, CEE_BGE, CEE_BGE_S);
+	auto branches = conditionals(method);
+
+	SwitchTables tables;
+	CoverageInstrumentation::CallProbe probe(0x06000001);
+	auto instrumentMethod = [&method, &probe](InstructionList& instructions, ULONG uniqueId)->Instruction*
+	{
+		return probe.Emit(method, instructions, uniqueId);
+	};
+	auto instrumentValue = [&method, &probe, &tables](InstructionList& instructions, const std::vector<ULONG>& pathIds)
+	{
+		return CoverageInstrumentation::InsertValueProbe(probe, method, instructions, pathIds, tables);
+	};
+	CoverageInstrumentation::AddBranchCoverage(instrumentMethod, method, generated.branchPoints, generated.sequencePoints,
+		CoverageInstrumentation::DerivedBranchPoints(), false, CoverageInstrumentation::NoSwitchProbes(), instrumentValue);
+	method.OptimizeEncoding();
+
+	std::vector<BYTE> buffer(method.GetMethodSize());
+	method.WriteMethod(reinterpret_cast<IMAGE_COR_ILMETHOD*>(buffer.data()));
+	Method written(reinterpret_cast<IMAGE_COR_ILMETHOD*>(buffer.data()));
+	ASSERT_EQ(method.GetNumberOfInstructions(), written.GetNumberOfInstructions());
+	ASSERT_EQ(generated.exceptionHandlerCount, static_cast<ULONG>(written.GetNumberOfExceptions()));
+
+	// only the branches that cannot be split (bge) are given the jumps of the per path probes
+	ASSERT_LT(0, unsplit);
+	ASSERT_EQ(branches, conditionals(written));
+	ASSERT_EQ(jumps + (unsplit * 2), count(written, CEE_BR, CEE_BR_S));
+}
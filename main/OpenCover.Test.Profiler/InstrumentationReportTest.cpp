@@ -0,0 +1,77 @@
+#include "stdafx.h"
+#include "..\OpenCover.Profiler\InstrumentationReport.h"
+
+#include <sstream>
+
+using namespace Instrumentation;
+
+class InstrumentationReportTest : public ::testing::Test {
+	void SetUp() override
+	{
+
+	}
+
+	void TearDown() override
+	{
+
+	}
+
+protected:
+	static MethodCost CreateCost(mdToken functionToken, CoverageInstrumentation::CoverageLevel level, ULONG originalSize, ULONG instrumentedSize)
+	{
+		MethodCost cost;
+		cost.modulePath = L"c:\\module.dll";
+		cost.assemblyName = L"module";
+		cost.functionToken = functionToken;
+		cost.level = level;
+		cost.probes = 2;
+		cost.originalSize = originalSize;
+		cost.instrumentedSize = instrumentedSize;
+		return cost;
+	}
+};
+
+TEST_F(InstrumentationReportTest, CostsAreOrderedByTheBytesAdded)
+{
+	InstrumentationReport report;
+
+	report.Add(CreateCost(0x06000001, CoverageInstrumentation::CL_Branch, 10, 20));
+	report.Add(CreateCost(0x06000002, CoverageInstrumentation::CL_Branch, 10, 110));
+	report.Add(CreateCost(0x06000003, CoverageInstrumentation::CL_Sequence, 100, 150));
+
+	auto costs = report.GetCosts();
+
+	ASSERT_EQ(3u, costs.size());
+	ASSERT_EQ(0x06000002u, costs[0].functionToken);
+	ASSERT_EQ(0x06000003u, costs[1].functionToken);
+	ASSERT_EQ(0x06000001u, costs[2].functionToken);
+	ASSERT_EQ(100, costs[0].GetBytesAdded());
+}
+
+TEST_F(InstrumentationReportTest, DowngradesAreTakenOnce)
+{
+	InstrumentationReport report;
+
+	report.Add(CreateCost(0x06000001, CoverageInstrumentation::CL_Branch, 10, 20));
+	report.Add(CreateCost(0x06000002, CoverageInstrumentation::CL_Entry, 10, 20));
+
+	auto downgrades = report.TakeDowngrades();
+
+	ASSERT_EQ(1u, downgrades.size());
+	ASSERT_EQ(0x06000002u, downgrades[0].functionToken);
+	ASSERT_EQ(0u, report.TakeDowngrades().size());
+	ASSERT_EQ(2u, report.GetCosts().size());
+}
+
+TEST_F(InstrumentationReportTest, ReportHasALinePerMethod)
+{
+	InstrumentationReport report;
+
+	report.Add(CreateCost(0x0600000A, CoverageInstrumentation::CL_Sequence, 10, 25));
+
+	std::wostringstream out;
+	report.Write(out);
+
+	ASSERT_EQ(std::wstring(L"BytesAdded,OriginalSize,InstrumentedSize,Probes,Coverage,Token,Assembly,Module\n"
+		L"15,10,25,2,sequence,0x0600000a,\"module\",\"c:\\module.dll\"\n"), out.str());
+}
@@ -1,5 +1,6 @@
 #include "stdafx.h"
 #include "..\OpenCover.Profiler\Method.h"
+#include "ILCorpus.h"
 #include <memory>
 
 // NOTE: Using pseudo IL code to exercise the code and is not necessarily runnable IL
@@ -738,3 +739,359 @@ TEST_F(InstrumentationTest, CanIdentifyInstrumentedMethods)
 	ASSERT_FALSE(newInstrument.IsInstrumented(1, instructions)); // no instruction at offset 0
 
 }
+
+namespace
+{
+    std::vector<BYTE> InstrumentAndWrite(BYTE* data, bool batch)
+    {
+        long offsets[] = { 21, 0, 5, 1, 99, 10, 5, 15, 22, 18 };
+
+        Method instrument(reinterpret_cast<IMAGE_COR_ILMETHOD*>(data));
+
+        OriginalOffsetInstructionLists insertions;
+        ULONG uniqueId = 0;
+        for (auto offset : offsets)
+        {
+            InstructionList instructions;
+            instructions.push_back(instrument.CreateInstruction(CEE_LDC_I4, ++uniqueId));
+            instructions.push_back(instrument.CreateInstruction(CEE_CALL, 0x06000001));
+            if (batch)
+                insertions.emplace_back(offset, instructions);
+            else
+                instrument.InsertInstructionsAtOriginalOffset(offset, instructions);
+        }
+        if (batch)
+            instrument.InsertInstructionsAtOriginalOffsets(insertions);
+
+        std::vector<BYTE> buffer(instrument.GetMethodSize());
+        instrument.WriteMethod(reinterpret_cast<IMAGE_COR_ILMETHOD*>(buffer.data()));
+
+        std::unique_ptr<COR_IL_MAP[]> map(new COR_IL_MAP[instrument.GetILMapSize()]);
+        instrument.PopulateILMap(instrument.GetILMapSize(), map.get());
+        for (ULONG i = 0; i < instrument.GetILMapSize(); i++)
+        {
+            buffer.push_back(static_cast<BYTE>(map[i].newOffset));
+        }
+        return buffer;
+    }
+}
+
+TEST_F(InstrumentationTest, BatchInsertProducesSameMethodAsIndividualInserts)
+{
+    BYTE data[] = {
+        0x00, 0x00, 0x00, 0x00,
+        0x00, 0x00, 0x00, 0x00,
+        0x00, 0x00, 0x00, 0x00,
+        CEE_NOP,  
+        CEE_NOP,
+        CEE_NOP, 
+        CEE_LEAVE_S, 0X0A,
+        CEE_POP, 
+        CEE_NOP, 
+        CEE_NOP,
+        CEE_LEAVE_S, 0X05,
+        CEE_POP, 
+        CEE_NOP, 
+        CEE_NOP,
+        CEE_LEAVE_S, 0X00,
+        CEE_NOP, 
+        CEE_LEAVE_S, 0X03,
+        CEE_NOP, 
+        CEE_NOP, 
+        CEE_ENDFINALLY,
+        CEE_NOP, 
+        CEE_RET,
+        0x00, // align
+        0x01, 0x24, 0x00, 0x00,
+        0x00, 0x00, 0x01, 0x00, 0x04, 0x05, 0x00, 0x05, 0x00, 0x00, 0x00, 0x00,  
+        0x00, 0x00, 0x01, 0x00, 0x04, 0x0a, 0x00, 0x05, 0x00, 0x00, 0x00, 0x00,  
+        0x02, 0x00, 0x01, 0x00, 0x11, 0x12, 0x00, 0x03, 0x00, 0x00, 0x00, 0x00,  
+    };
+
+	auto pHeader = reinterpret_cast<IMAGE_COR_ILMETHOD_FAT*>(data);
+    pHeader->Flags = CorILMethod_FatFormat | CorILMethod_MoreSects;
+    pHeader->CodeSize = 23;
+    pHeader->Size = 3;
+
+    auto individual = InstrumentAndWrite(data, false);
+    auto batch = InstrumentAndWrite(data, true);
+
+    ASSERT_EQ(individual.size(), batch.size());
+    ASSERT_TRUE(individual == batch);
+}
+
+TEST_F(InstrumentationTest, BatchInsertMaintainsPointers)
+{
+    BYTE data[] = {(8 << 2) + CorILMethod_TinyFormat, 
+        CEE_BR_S, 0x05,
+        CEE_BR, 0x00, 0x00, 0x00, 0x00,
+        CEE_RET};
+
+    Method instrument(reinterpret_cast<IMAGE_COR_ILMETHOD*>(data));
+
+    OriginalOffsetInstructionLists insertions;
+    insertions.emplace_back(2, InstructionList{ instrument.CreateInstruction(CEE_NOP) });
+    insertions.emplace_back(7, InstructionList{ instrument.CreateInstruction(CEE_NOP) });
+
+    instrument.InsertInstructionsAtOriginalOffsets(insertions);
+
+    ASSERT_EQ(5, instrument.GetNumberOfInstructions());
+
+    ASSERT_EQ(CEE_NOP, instrument.m_instructions[1]->m_operation);
+    ASSERT_EQ(CEE_BR, instrument.m_instructions[2]->m_operation);
+    ASSERT_EQ(CEE_NOP, instrument.m_instructions[3]->m_operation);
+    ASSERT_EQ(CEE_RET, instrument.m_instructions[4]->m_operation);
+    ASSERT_EQ(instrument.m_instructions[3], instrument.m_instructions[0]->m_branches[0]);
+    ASSERT_EQ(instrument.m_instructions[3], instrument.m_instructions[2]->m_branches[0]);
+    ASSERT_EQ(12, instrument.m_instructions[4]->m_offset);
+}
+
+TEST_F(InstrumentationTest, InsertedBranchesKeepTheirTargets)
+{
+	BYTE data[] = { (3 << 2) + CorILMethod_TinyFormat,
+		CEE_NOP,
+		CEE_NOP,
+		CEE_RET };
+
+	Method instrument(reinterpret_cast<IMAGE_COR_ILMETHOD*>(data));
+
+	InstructionList instructions;
+	instructions.push_back(instrument.CreateInstruction(CEE_BR, 0));
+	instructions.push_back(instrument.CreateInstruction(CEE_NOP));
+	instructions.push_back(instrument.CreateInstruction(CEE_NOP));
+	instructions[0]->m_isBranch = true;
+	instructions[0]->m_branches.push_back(instructions[2]);
+
+	instrument.InsertInstructionsAtOffset(1, instructions);
+
+	ASSERT_EQ(6, instrument.GetNumberOfInstructions());
+	ASSERT_EQ(CEE_BR, instrument.m_instructions[1]->m_operation);
+	ASSERT_EQ(instrument.m_instructions[3], instrument.m_instructions[1]->m_branches[0]);
+}
+
+TEST_F(InstrumentationTest, InsertingInstructionsDoesNotMoveOriginalInstructions)
+{
+    BYTE data[] = {(5 << 2) + CorILMethod_TinyFormat, 
+        CEE_BR_S, 0x01,
+        CEE_NOP,
+        CEE_NOP,
+        CEE_RET};
+
+    Method instrument(reinterpret_cast<IMAGE_COR_ILMETHOD*>(data));
+    auto pBranch = instrument.m_instructions[0];
+    auto pTarget = instrument.m_instructions[2];
+
+    InstructionList instructions;
+    instructions.push_back(instrument.CreateInstruction(CEE_LDC_I4_1));
+    instructions.push_back(instrument.CreateInstruction(CEE_POP));
+    instrument.InsertInstructionsAtOriginalOffset(3, instructions);
+
+    ASSERT_EQ(6, instrument.GetNumberOfInstructions());
+    ASSERT_EQ(pTarget, instrument.m_instructions[4]);
+    ASSERT_EQ(CEE_NOP, pTarget->m_operation);
+    ASSERT_EQ(3, pTarget->m_origOffset);
+    ASSERT_EQ(8, pTarget->m_offset);
+    ASSERT_EQ(CEE_LDC_I4_1, instrument.m_instructions[2]->m_operation);
+    ASSERT_EQ(instrument.m_instructions[2], pBranch->m_branches[0]);
+}
+
+TEST_F(InstrumentationTest, CanResolveBranchesOfLargeMethods)
+{
+    auto data = ILCorpus::BuildSwitchMethod(60000);
+
+    Method instrument(reinterpret_cast<IMAGE_COR_ILMETHOD*>(data.data()));
+
+    ASSERT_EQ(60002, instrument.GetNumberOfInstructions());
+    ASSERT_EQ(60000, static_cast<int>(instrument.m_instructions[0]->m_branches.size()));
+    ASSERT_EQ(instrument.m_instructions[1], instrument.m_instructions[0]->m_branches[0]);
+    ASSERT_EQ(instrument.m_instructions[60000], instrument.m_instructions[0]->m_branches[59999]);
+}
+
+TEST_F(InstrumentationTest, CanLookupOperationsByEncoding)
+{
+    for (int name = 0; name < CANONICAL_NAME_COUNT; name++)
+    {
+        auto& details = Operations::GetOperationDetails(static_cast<CanonicalName>(name));
+        ASSERT_EQ(name, details.canonicalName);
+        if (details.op1 != STP1 && details.op1 != REFPRE)
+            continue;
+
+        auto& encoded = Operations::GetOperationDetails(details.op1, details.op2);
+        ASSERT_EQ(details.op1, encoded.op1);
+        ASSERT_EQ(details.op2, encoded.op2);
+    }
+
+    ASSERT_EQ(CEE_CALL, Operations::GetOperationDetails(REFPRE, 0x28).canonicalName);
+    ASSERT_EQ(CEE_CEQ, Operations::GetOperationDetails(STP1, 0x01).canonicalName);
+    ASSERT_EQ(CEE_ILLEGAL, Operations::GetOperationDetails(STP1, 0xF0).canonicalName);
+}
+
+namespace
+{
+    std::vector<BYTE> WriteMethod(Method& instrument)
+    {
+        std::vector<BYTE> buffer(instrument.GetMethodSize());
+        instrument.WriteMethod(reinterpret_cast<IMAGE_COR_ILMETHOD*>(buffer.data()));
+        return buffer;
+    }
+
+    void InsertProbesAtEveryOriginalOffset(Method& instrument)
+    {
+        std::vector<long> offsets;
+        for (auto it = instrument.m_instructions.begin(); it != instrument.m_instructions.end(); ++it)
+        {
+            if ((*it)->m_origOffset != -1)
+                offsets.push_back((*it)->m_origOffset);
+        }
+
+        OriginalOffsetInstructionLists insertions;
+        ULONG uniqueId = 0;
+        for (auto offset : offsets)
+        {
+            InstructionList instructions;
+            instructions.push_back(instrument.CreateInstruction(CEE_LDC_I4, ++uniqueId));
+            instructions.push_back(instrument.CreateInstruction(CEE_CALL, 0x06000001));
+            insertions.emplace_back(offset, instructions);
+        }
+        instrument.InsertInstructionsAtOriginalOffsets(insertions);
+    }
+}
+
+TEST_F(InstrumentationTest, OptimizeEncoding_UsesShortBranchesAndTinyHeader)
+{
+    BYTE data[] = {(8 << 2) + CorILMethod_TinyFormat, 
+        CEE_BR_S, 0x05,
+        CEE_BR, 0x00, 0x00, 0x00, 0x00,
+        CEE_RET};
+
+    Method original(reinterpret_cast<IMAGE_COR_ILMETHOD*>(data));
+    auto fat = WriteMethod(original);
+
+    Method instrument(reinterpret_cast<IMAGE_COR_ILMETHOD*>(data));
+    instrument.OptimizeEncoding();
+    auto compact = WriteMethod(instrument);
+
+    RecordProperty("FatSize", static_cast<int>(fat.size()));
+    RecordProperty("CompactSize", static_cast<int>(compact.size()));
+
+    ASSERT_EQ(23, static_cast<int>(fat.size()));
+    ASSERT_EQ(6, static_cast<int>(compact.size()));
+    ASSERT_EQ(CEE_BR_S, instrument.m_instructions[0]->m_operation);
+    ASSERT_EQ(CEE_BR_S, instrument.m_instructions[1]->m_operation);
+
+    auto pTiny = reinterpret_cast<COR_ILMETHOD_TINY*>(compact.data());
+    ASSERT_TRUE(pTiny->IsTiny());
+    ASSERT_EQ(5, static_cast<int>(pTiny->GetCodeSize()));
+    ASSERT_EQ(5, static_cast<int>(instrument.m_instructions[2]->m_offset + 1));
+
+    Method reread(reinterpret_cast<IMAGE_COR_ILMETHOD*>(compact.data()));
+    ASSERT_TRUE(fat == WriteMethod(reread));
+}
+
+TEST_F(InstrumentationTest, OptimizeEncoding_UsesSmallSections)
+{
+    BYTE data[] = {
+        0x00, 0x00, 0x00, 0x00,
+        0x00, 0x00, 0x00, 0x00,
+        0x00, 0x00, 0x00, 0x00,
+        CEE_NOP,  
+        CEE_NOP,
+        CEE_NOP, 
+        CEE_LEAVE_S, 0X0A,
+        CEE_POP, 
+        CEE_NOP, 
+        CEE_NOP,
+        CEE_LEAVE_S, 0X05,
+        CEE_POP, 
+        CEE_NOP, 
+        CEE_NOP,
+        CEE_LEAVE_S, 0X00,
+        CEE_NOP, 
+        CEE_LEAVE_S, 0X03,
+        CEE_NOP, 
+        CEE_NOP, 
+        CEE_ENDFINALLY,
+        CEE_NOP, 
+        CEE_RET,
+        0x00, // align
+        0x01, 0x24, 0x00, 0x00,
+        0x00, 0x00, 0x01, 0x00, 0x04, 0x05, 0x00, 0x05, 0x00, 0x00, 0x00, 0x00,  
+        0x00, 0x00, 0x01, 0x00, 0x04, 0x0a, 0x00, 0x05, 0x00, 0x00, 0x00, 0x00,  
+        0x02, 0x00, 0x01, 0x00, 0x11, 0x12, 0x00, 0x03, 0x00, 0x00, 0x00, 0x00,  
+    };
+
+	auto pHeader = reinterpret_cast<IMAGE_COR_ILMETHOD_FAT*>(data);
+    pHeader->Flags = CorILMethod_FatFormat | CorILMethod_MoreSects;
+    pHeader->CodeSize = 23;
+    pHeader->Size = 3;
+
+    Method original(reinterpret_cast<IMAGE_COR_ILMETHOD*>(data));
+    InsertProbesAtEveryOriginalOffset(original);
+    auto fat = WriteMethod(original);
+
+    Method instrument(reinterpret_cast<IMAGE_COR_ILMETHOD*>(data));
+    InsertProbesAtEveryOriginalOffset(instrument);
+    instrument.OptimizeEncoding();
+    auto compact = WriteMethod(instrument);
+
+    RecordProperty("FatSize", static_cast<int>(fat.size()));
+    RecordProperty("CompactSize", static_cast<int>(compact.size()));
+    ASSERT_LT(compact.size(), fat.size());
+
+    auto newMethod = reinterpret_cast<COR_ILMETHOD_FAT*>(compact.data());
+    ASSERT_TRUE(newMethod->IsFat());
+    ASSERT_EQ(CorILMethod_MoreSects, newMethod->GetFlags() & CorILMethod_MoreSects);
+    ASSERT_EQ(instrument.GetILMapSize(), original.GetILMapSize());
+
+    auto pSect = newMethod->GetSect();
+    ASSERT_FALSE(pSect->IsFat());
+    ASSERT_EQ(CorILMethod_Sect_EHTable, pSect->Kind());
+    ASSERT_EQ(40, static_cast<int>(pSect->DataSize())); // 36 (3 SMALL sections) + 4
+
+    Method reread(reinterpret_cast<IMAGE_COR_ILMETHOD*>(compact.data()));
+    ASSERT_EQ(3, reread.GetNumberOfExceptions());
+    ASSERT_TRUE(fat == WriteMethod(reread));
+}
+
+TEST_F(InstrumentationTest, UpdatingOffsetsWritesTheSameMethodAsRecalculatingThem)
+{
+    ILCorpus::Options options;
+    options.instructions = 2000;
+    options.branchEvery = 3;
+    options.switchTargets = 16;
+    options.tryDepth = 3;
+    options.filters = true;
+    auto generated = ILCorpus::Generate(options);
+
+    Method updated(generated.GetHeader());
+    Method recalculated(generated.GetHeader());
+    for (const auto& point : generated.sequencePoints)
+    {
+        InstructionList instructions;
+        instructions.push_back(updated.CreateInstruction(CEE_LDC_I4, point.UniqueId));
+        instructions.push_back(updated.CreateInstruction(CEE_CALL, 0x06000001));
+        updated.InsertInstructionsAtOriginalOffset(point.Offset, instructions);
+        recalculated.InsertInstructionsAtOriginalOffset(point.Offset, instructions);
+        recalculated.RecalculateOffsets();
+    }
+
+    // the current offsets are used to insert at the branches
+    for (size_t i = 0; i < updated.m_instructions.size(); i += 97)
+    {
+        auto offset = updated.m_instructions[i]->m_offset;
+        ASSERT_EQ(offset, recalculated.m_instructions[i]->m_offset);
+
+        InstructionList instructions;
+        instructions.push_back(updated.CreateInstruction(CEE_NOP));
+        updated.InsertInstructionsAtOffset(offset, instructions);
+        recalculated.InsertInstructionsAtOffset(offset, instructions);
+        recalculated.RecalculateOffsets();
+    }
+
+    ASSERT_TRUE(WriteMethod(recalculated) == WriteMethod(updated));
+
+    updated.OptimizeEncoding();
+    recalculated.OptimizeEncoding();
+    recalculated.RecalculateOffsets();
+    ASSERT_TRUE(WriteMethod(recalculated) == WriteMethod(updated));
+}
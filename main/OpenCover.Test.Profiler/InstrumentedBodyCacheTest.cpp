@@ -0,0 +1,94 @@
+#include "stdafx.h"
+#include "..\OpenCover.Profiler\InstrumentedBodyCache.h"
+
+using namespace Instrumentation;
+
+class InstrumentedBodyCacheTest : public ::testing::Test {
+	void SetUp() override
+	{
+
+	}
+
+	void TearDown() override
+	{
+
+	}
+
+protected:
+	const GUID mvid_ = { 0x12345678, 0x1234, 0x1234, { 1, 2, 3, 4, 5, 6, 7, 8 } };
+	const GUID otherMvid_ = { 0x12345678, 0x1234, 0x1234, { 1, 2, 3, 4, 5, 6, 7, 9 } };
+
+	static std::shared_ptr<InstrumentedBody> CreateBody(ModuleID moduleId)
+	{
+		auto body = std::make_shared<InstrumentedBody>();
+		body->moduleId = moduleId;
+		const BYTE tinyBody[2] = { (0x01 << 2) | CorILMethod_TinyFormat, 0x2A /* ret */ };
+		body->body.assign(tinyBody, tinyBody + 2);
+		return body;
+	}
+};
+
+TEST_F(InstrumentedBodyCacheTest, BodyIsNotAddedForAnUnknownModule)
+{
+	InstrumentedBodyCache cache;
+	ASSERT_FALSE(cache.Add(0x100, 0x06000001, CreateBody(0x100)));
+	ASSERT_EQ(nullptr, cache.Find(0x100, 0x06000001));
+	ASSERT_EQ(0u, cache.GetBodyCount());
+}
+
+TEST_F(InstrumentedBodyCacheTest, BodyIsFoundForTheModuleItWasAddedFor)
+{
+	InstrumentedBodyCache cache;
+	cache.AddModule(0x100, mvid_, L"c:\\app\\module.dll");
+	auto body = CreateBody(0x100);
+	ASSERT_TRUE(cache.Add(0x100, 0x06000001, body));
+
+	ASSERT_EQ(body, cache.Find(0x100, 0x06000001));
+	ASSERT_EQ(nullptr, cache.Find(0x100, 0x06000002));
+}
+
+TEST_F(InstrumentedBodyCacheTest, BodyIsSharedByModulesOfTheSameIdentity)
+{
+	InstrumentedBodyCache cache;
+	cache.AddModule(0x100, mvid_, L"c:\\app\\module.dll");
+	cache.AddModule(0x200, mvid_, L"c:\\app\\module.dll");
+	auto body = CreateBody(0x100);
+	cache.Add(0x100, 0x06000001, body);
+
+	ASSERT_EQ(body, cache.Find(0x200, 0x06000001));
+	ASSERT_EQ(1u, cache.GetBodyCount());
+}
+
+TEST_F(InstrumentedBodyCacheTest, BodyIsNotSharedByModulesOfADifferentIdentity)
+{
+	InstrumentedBodyCache cache;
+	cache.AddModule(0x100, mvid_, L"c:\\app\\module.dll");
+	cache.AddModule(0x200, mvid_, L"c:\\other\\module.dll");
+	cache.AddModule(0x300, otherMvid_, L"c:\\app\\module.dll");
+	cache.Add(0x100, 0x06000001, CreateBody(0x100));
+
+	ASSERT_EQ(nullptr, cache.Find(0x200, 0x06000001));
+	ASSERT_EQ(nullptr, cache.Find(0x300, 0x06000001));
+}
+
+TEST_F(InstrumentedBodyCacheTest, BodiesAreReleasedWhenTheLastModuleIsUnloaded)
+{
+	InstrumentedBodyCache cache;
+	cache.AddModule(0x100, mvid_, L"c:\\app\\module.dll");
+	cache.AddModule(0x200, mvid_, L"c:\\app\\module.dll");
+	std::weak_ptr<InstrumentedBody> body;
+	{
+		auto added = CreateBody(0x100);
+		body = added;
+		cache.Add(0x100, 0x06000001, added);
+	}
+
+	ASSERT_FALSE(cache.RemoveModule(0x100));
+	ASSERT_NE(nullptr, cache.Find(0x200, 0x06000001));
+	ASSERT_FALSE(body.expired());
+
+	ASSERT_TRUE(cache.RemoveModule(0x200));
+	ASSERT_FALSE(cache.RemoveModule(0x200));
+	ASSERT_EQ(0u, cache.GetBodyCount());
+	ASSERT_TRUE(body.expired());
+}
@@ -0,0 +1,173 @@
+#include "stdafx.h"
+#include "..\OpenCover.Profiler\Method.h"
+#include "..\OpenCover.Profiler\MethodCache.h"
+
+using namespace Instrumentation;
+
+class MethodCacheTest : public ::testing::Test {
+	void SetUp() override
+	{
+
+	}
+
+	void TearDown() override
+	{
+
+	}
+};
+
+namespace
+{
+	struct InstrumentedMethod
+	{
+		std::vector<BYTE> body;
+		std::vector<COR_IL_MAP> map;
+	};
+
+	InstrumentedMethod Instrument(BYTE* pData, ULONG uniqueId)
+	{
+		Method instrument(reinterpret_cast<IMAGE_COR_ILMETHOD*>(pData));
+		InstructionList instructions;
+		instructions.push_back(instrument.CreateInstruction(CEE_LDC_I4, uniqueId));
+		instructions.push_back(instrument.CreateInstruction(CEE_CALL, 0x06000001));
+		instrument.InsertInstructionsAtOriginalOffset(0, instructions);
+		instrument.OptimizeEncoding();
+
+		InstrumentedMethod result;
+		result.body.resize(instrument.GetMethodSize());
+		instrument.WriteMethod(reinterpret_cast<IMAGE_COR_ILMETHOD*>(result.body.data()));
+		result.map.resize(instrument.GetILMapSize());
+		instrument.PopulateILMap(static_cast<ULONG>(result.map.size()), result.map.data());
+		return result;
+	}
+
+	MethodCacheKey BuildKey(mdToken functionToken, const BYTE* pOriginal, ULONG originalSize, ULONG uniqueId)
+	{
+		MethodCacheKey key;
+		memset(&key, 0, sizeof(key));
+		key.moduleVersionId.Data1 = 0x0C0FFEE0;
+		key.functionToken = functionToken;
+		key.originalSize = originalSize;
+		key.originalHash = MethodCache::Hash(pOriginal, originalSize);
+		key.instrumentationHash = MethodCache::Hash(&uniqueId, sizeof(uniqueId));
+		return key;
+	}
+}
+
+TEST_F(MethodCacheTest, CanFindInstrumentedMethodAfterReattaching)
+{
+	BYTE data[] = { (3 << 2) + CorILMethod_TinyFormat,
+		CEE_NOP,
+		CEE_NOP,
+		CEE_RET };
+	auto key = BuildKey(0x06000002, data, sizeof(data), 42);
+	auto expected = Instrument(data, 42);
+
+	const ULONG merged[] = { 42, 43, 42, 44 };
+	MethodCacheCost cost;
+	cost.level = 1;
+	cost.probes = 3;
+	cost.originalSize = 3;
+
+	std::vector<BYTE> block(256 * 1024);
+	{
+		MethodCache cache;
+		ASSERT_TRUE(cache.Attach(block.data(), block.size()));
+		ASSERT_TRUE(cache.Add(key, expected.body.data(), static_cast<ULONG>(expected.body.size()),
+			expected.map.data(), static_cast<ULONG>(expected.map.size()), merged, 4, cost));
+	}
+
+	// as another process would see it
+	MethodCache cache;
+	ASSERT_TRUE(cache.Attach(block.data(), block.size()));
+
+	const BYTE* pBody; ULONG bodySize;
+	const COR_IL_MAP* pMap; ULONG mapSize;
+	ASSERT_TRUE(cache.Find(key, pBody, bodySize, pMap, mapSize));
+	ASSERT_EQ(expected.body, std::vector<BYTE>(pBody, pBody + bodySize));
+	ASSERT_EQ(expected.map.size(), mapSize);
+	ASSERT_EQ(0, memcmp(expected.map.data(), pMap, mapSize * sizeof(COR_IL_MAP)));
+
+	const ULONG* pMerged; ULONG mergedSize;
+	MethodCacheCost cachedCost;
+	ASSERT_TRUE(cache.Find(key, pBody, bodySize, pMap, mapSize, pMerged, mergedSize, cachedCost));
+	ASSERT_EQ(4u, mergedSize);
+	ASSERT_EQ(0, memcmp(merged, pMerged, sizeof(merged)));
+	ASSERT_EQ(1u, cachedCost.level);
+	ASSERT_EQ(3u, cachedCost.probes);
+	ASSERT_EQ(3u, cachedCost.originalSize);
+
+	// the cached body is a valid method
+	Method cached(reinterpret_cast<IMAGE_COR_ILMETHOD*>(const_cast<BYTE*>(pBody)));
+	ASSERT_EQ(5, cached.GetNumberOfInstructions());
+	ASSERT_EQ(42, static_cast<int>(cached.m_instructions[0]->m_operand));
+
+	auto otherPoints = BuildKey(0x06000002, data, sizeof(data), 43);
+	ASSERT_FALSE(cache.Find(otherPoints, pBody, bodySize, pMap, mapSize));
+
+	data[1] = CEE_POP;
+	auto otherIL = BuildKey(0x06000002, data, sizeof(data), 42);
+	ASSERT_FALSE(cache.Find(otherIL, pBody, bodySize, pMap, mapSize));
+}
+
+TEST_F(MethodCacheTest, OldestMethodsAreEvictedWhenFull)
+{
+	BYTE data[] = { (3 << 2) + CorILMethod_TinyFormat,
+		CEE_NOP,
+		CEE_NOP,
+		CEE_RET };
+	auto method = Instrument(data, 1);
+	auto recordSize = MethodCache::GetRecordSize(static_cast<ULONG>(method.body.size()), static_cast<ULONG>(method.map.size()));
+
+	std::vector<BYTE> block(64 * 1024);
+	MethodCache cache;
+	ASSERT_TRUE(cache.Attach(block.data(), block.size()));
+
+	// write the ring around more than twice
+	auto count = static_cast<ULONG>((2 * block.size()) / recordSize) + 10;
+	for (ULONG token = 0; token < count; token++)
+	{
+		ASSERT_TRUE(cache.Add(BuildKey(0x06000000 + token, data, sizeof(data), 1), method.body.data(),
+			static_cast<ULONG>(method.body.size()), method.map.data(), static_cast<ULONG>(method.map.size())));
+	}
+
+	const BYTE* pBody; ULONG bodySize;
+	const COR_IL_MAP* pMap; ULONG mapSize;
+	ASSERT_FALSE(cache.Find(BuildKey(0x06000000, data, sizeof(data), 1), pBody, bodySize, pMap, mapSize));
+	ASSERT_FALSE(cache.Find(BuildKey(0x06000000 + (count / 2), data, sizeof(data), 1), pBody, bodySize, pMap, mapSize));
+	ASSERT_TRUE(cache.Find(BuildKey(0x06000000 + count - 1, data, sizeof(data), 1), pBody, bodySize, pMap, mapSize));
+	ASSERT_EQ(method.body, std::vector<BYTE>(pBody, pBody + bodySize));
+}
+
+TEST_F(MethodCacheTest, IgnoresDamagedOrIncompatibleCaches)
+{
+	BYTE data[] = { (3 << 2) + CorILMethod_TinyFormat,
+		CEE_NOP,
+		CEE_NOP,
+		CEE_RET };
+	auto key = BuildKey(0x06000002, data, sizeof(data), 42);
+	auto method = Instrument(data, 42);
+
+	std::vector<BYTE> block(64 * 1024);
+	MethodCache cache;
+	ASSERT_TRUE(cache.Attach(block.data(), block.size()));
+	ASSERT_TRUE(cache.Add(key, method.body.data(), static_cast<ULONG>(method.body.size()),
+		method.map.data(), static_cast<ULONG>(method.map.size())));
+
+	const BYTE* pBody; ULONG bodySize;
+	const COR_IL_MAP* pMap; ULONG mapSize;
+	ASSERT_TRUE(cache.Find(key, pBody, bodySize, pMap, mapSize));
+
+	// a body that was not completely written
+	const_cast<BYTE*>(pBody)[bodySize - 1] ^= 0xFF;
+	ASSERT_FALSE(cache.Find(key, pBody, bodySize, pMap, mapSize));
+	const_cast<BYTE*>(pBody)[bodySize - 1] ^= 0xFF;
+	ASSERT_TRUE(cache.Find(key, pBody, bodySize, pMap, mapSize));
+
+	// a cache written by another version (or for another size) is reformatted
+	block[4] ^= 0xFF;
+	ASSERT_TRUE(cache.Attach(block.data(), block.size()));
+	ASSERT_FALSE(cache.Find(key, pBody, bodySize, pMap, mapSize));
+
+	ASSERT_FALSE(cache.Attach(block.data(), 1024));
+}
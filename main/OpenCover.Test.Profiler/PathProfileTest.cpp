@@ -0,0 +1,525 @@
+#include "stdafx.h"
+#include "ILCorpus.h"
+#include "..\OpenCover.Profiler\Method.h"
+#include "..\OpenCover.Profiler\ProbePolicies.h"
+#include "..\OpenCover.Profiler\PathProfile.h"
+
+#include <sstream>
+
+using namespace Instrumentation;
+
+class PathProfileTest : public ::testing::Test {
+	void SetUp() override
+	{
+
+	}
+
+	void TearDown() override
+	{
+
+	}
+};
+
+namespace
+{
+	// if (a) {} else {}
+	BYTE diamond[] = { (8 << 2) + CorILMethod_TinyFormat,
+		CEE_LDARG_0,
+		CEE_BRFALSE_S, 0x03,
+		CEE_NOP,
+		CEE_BR_S, 0x01,
+		CEE_NOP,
+		CEE_RET };
+
+	// while (a != 0) { a--; if (b) {} }, with the test of a at the bottom of the loop
+	BYTE loop[] = { (16 << 2) + CorILMethod_TinyFormat,
+		CEE_LDARG_0,
+		CEE_BRFALSE_S, 0x0C,
+		CEE_LDARG_0,
+		CEE_LDC_I4_1,
+		CEE_SUB,
+		CEE_STARG_S, 0x00,
+		CEE_LDARG_1,
+		CEE_BRFALSE_S, 0x01,
+		CEE_NOP,
+		CEE_LDARG_0,
+		CEE_BRTRUE_S, 0xF4,
+		CEE_RET };
+
+	// switch (a) { case 0: case 1: case 2: default: }, cases 1 and 2 share a target
+	BYTE switched[] = { (23 << 2) + CorILMethod_TinyFormat,
+		CEE_LDARG_0,
+		CEE_SWITCH, 0x03, 0x00, 0x00, 0x00,
+			0x02, 0x00, 0x00, 0x00,
+			0x03, 0x00, 0x00, 0x00,
+			0x03, 0x00, 0x00, 0x00,
+		CEE_BR_S, 0x02,
+		CEE_NOP,
+		CEE_NOP,
+		CEE_RET };
+
+	/// <summary>Run an instrumented method, as far as the few instructions the tests use go</summary>
+	/// <param name="visits">Receives the ids passed to the call probes.</param>
+	/// <returns>false if the method runs something it cannot or does not return.</returns>
+	bool RunMethod(Method& method, std::vector<LONG> args, std::vector<ULONG>& visits)
+	{
+		struct Value
+		{
+			LONGLONG value;
+			bool isNative;
+		};
+		std::vector<Value> stack;
+		std::vector<LONG> locals(16, 0);
+		auto pop = [&stack]() { auto value = stack.back(); stack.pop_back(); return value; };
+		auto push = [&stack](LONGLONG value, bool isNative) { stack.push_back(Value{ isNative ? value : static_cast<LONG>(value), isNative }); };
+
+		auto& instructions = method.m_instructions;
+		auto indexOf = [&instructions](Instruction* pInstruction)
+		{
+			return static_cast<size_t>(std::find(instructions.begin(), instructions.end(), pInstruction) - instructions.begin());
+		};
+
+		size_t index = 0;
+		for (int steps = 0; steps < 10000 && index < instructions.size(); steps++)
+		{
+			auto pInstruction = instructions[index++];
+			auto operand = pInstruction->m_operand;
+			switch (pInstruction->m_operation)
+			{
+			case CEE_NOP:
+				break;
+			case CEE_LDARG_0: case CEE_LDARG_1:
+				push(args[pInstruction->m_operation - CEE_LDARG_0], false);
+				break;
+			case CEE_STARG_S:
+				args[static_cast<size_t>(operand)] = static_cast<LONG>(pop().value);
+				break;
+			case CEE_LDC_I4_0: case CEE_LDC_I4_1: case CEE_LDC_I4_2:
+				push(pInstruction->m_operation - CEE_LDC_I4_0, false);
+				break;
+			case CEE_LDC_I4_S:
+				push(static_cast<signed char>(operand), false);
+				break;
+			case CEE_LDC_I4:
+				push(static_cast<LONG>(operand), false);
+				break;
+			case CEE_LDC_I8:
+				push(static_cast<LONGLONG>(operand), true);
+				break;
+			case CEE_LDLOC_S: case CEE_LDLOC:
+				push(locals[static_cast<size_t>(operand)], false);
+				break;
+			case CEE_STLOC_S: case CEE_STLOC:
+				locals[static_cast<size_t>(operand)] = static_cast<LONG>(pop().value);
+				break;
+			case CEE_ADD: case CEE_SUB: case CEE_SHL:
+			{
+				auto right = pop();
+				auto left = pop();
+				auto isNative = left.isNative || right.isNative;
+				auto value = pInstruction->m_operation == CEE_ADD ? left.value + right.value
+					: pInstruction->m_operation == CEE_SUB ? left.value - right.value : left.value << right.value;
+				push(value, isNative);
+				break;
+			}
+			case CEE_CONV_U:
+			{
+				auto value = pop();
+				push(value.isNative ? value.value : static_cast<LONGLONG>(static_cast<ULONG>(value.value)), true);
+				break;
+			}
+			case CEE_DUP:
+				stack.push_back(stack.back());
+				break;
+			case CEE_LDIND_U4:
+				push(static_cast<LONGLONG>(*reinterpret_cast<ULONG*>(pop().value)), false);
+				break;
+			case CEE_STIND_I4:
+			{
+				auto value = pop();
+				*reinterpret_cast<ULONG*>(pop().value) = static_cast<ULONG>(value.value);
+				break;
+			}
+			case CEE_CALL:
+				visits.push_back(static_cast<ULONG>(pop().value));
+				break;
+			case CEE_BR:
+				index = indexOf(pInstruction->m_branches[0]);
+				break;
+			case CEE_BRTRUE: case CEE_BRFALSE:
+				if ((pop().value != 0) == (pInstruction->m_operation == CEE_BRTRUE))
+					index = indexOf(pInstruction->m_branches[0]);
+				break;
+			case CEE_SWITCH:
+			{
+				auto value = static_cast<ULONG>(pop().value);
+				if (value < pInstruction->m_branches.size())
+					index = indexOf(pInstruction->m_branches[value]);
+				break;
+			}
+			case CEE_RET:
+				return stack.empty();
+			default:
+				return false;
+			}
+		}
+		return false;
+	}
+
+	bool RunMethod(Method& method, std::vector<LONG> args)
+	{
+		std::vector<ULONG> visits;
+		return RunMethod(method, args, visits);
+	}
+
+	/// <summary>What the register ends up as along a path, which should be its number</summary>
+	ULONG SumIncrements(const PathGraph& graph, const std::vector<ULONG>& edges)
+	{
+		ULONG sum = 0;
+		for (auto edge : edges)
+			sum += static_cast<ULONG>(graph.GetEdges()[edge].increment);
+		return sum;
+	}
+
+	void AssertEveryPathIsNumberedOnce(const PathGraph& graph)
+	{
+		std::vector<std::vector<ULONG>> paths;
+		for (ULONG path = 0; path < graph.GetPathCount(); path++)
+		{
+			std::vector<ULONG> edges;
+			ASSERT_TRUE(graph.DecodePath(path, edges));
+			ASSERT_EQ(path, SumIncrements(graph, edges));
+			paths.push_back(edges);
+		}
+		std::sort(paths.begin(), paths.end());
+		ASSERT_EQ(paths.end(), std::adjacent_find(paths.begin(), paths.end()));
+	}
+
+	std::vector<BYTE> GetBlockOffsets(const PathGraph& graph, ULONG path)
+	{
+		std::vector<ULONG> edges;
+		graph.DecodePath(path, edges);
+		std::vector<BYTE> offsets;
+		for (auto edge : edges)
+		{
+			if (graph.GetEdges()[edge].to != graph.GetExit())
+				offsets.push_back(static_cast<BYTE>(graph.GetBlocks()[graph.GetEdges()[edge].to].offset));
+		}
+		return offsets;
+	}
+
+	ULONG FindPath(const PathGraph& graph, const std::vector<BYTE>& offsets, PathEdgeKind first, PathEdgeKind last)
+	{
+		for (ULONG path = 0; path < graph.GetPathCount(); path++)
+		{
+			std::vector<ULONG> edges;
+			graph.DecodePath(path, edges);
+			if (GetBlockOffsets(graph, path) == offsets && graph.GetEdges()[edges.front()].kind == first
+				&& graph.GetEdges()[edges.back()].kind == last)
+				return path;
+		}
+		return graph.GetPathCount();
+	}
+}
+
+TEST_F(PathProfileTest, NumbersThePathsOfADiamond)
+{
+	Method method(reinterpret_cast<IMAGE_COR_ILMETHOD*>(diamond));
+	PathGraph graph;
+
+	ASSERT_TRUE(graph.Build(method, DEFAULT_MAX_PATHS_PER_METHOD));
+
+	ASSERT_EQ(2u, graph.GetPathCount());
+	ASSERT_EQ(4u, graph.GetBlocks().size());
+	ASSERT_TRUE(graph.GetBackEdges().empty());
+	AssertEveryPathIsNumberedOnce(graph);
+	ASSERT_EQ((std::vector<BYTE>{ 0, 3, 7 }), GetBlockOffsets(graph, 0));
+	ASSERT_EQ((std::vector<BYTE>{ 0, 6, 7 }), GetBlockOffsets(graph, 1));
+}
+
+TEST_F(PathProfileTest, MovesTheRegisterOnlyOffTheSpanningTree)
+{
+	Method method(reinterpret_cast<IMAGE_COR_ILMETHOD*>(diamond));
+	PathGraph graph;
+	ASSERT_TRUE(graph.Build(method, DEFAULT_MAX_PATHS_PER_METHOD));
+
+	// set on entry, counted at the ret and moved on one of the ways of the branch
+	ASSERT_EQ(3u, graph.GetProbeCount());
+	auto moved = std::count_if(graph.GetEdges().begin(), graph.GetEdges().end(),
+		[&graph](const PathEdge& edge) { return edge.increment != 0 && edge.to != graph.GetExit(); });
+	ASSERT_EQ(1, moved);
+}
+
+TEST_F(PathProfileTest, BreaksLoopsAtTheirBackEdges)
+{
+	Method method(reinterpret_cast<IMAGE_COR_ILMETHOD*>(loop));
+	PathGraph graph;
+
+	ASSERT_TRUE(graph.Build(method, DEFAULT_MAX_PATHS_PER_METHOD));
+
+	ASSERT_EQ(1u, graph.GetBackEdges().size());
+	ASSERT_EQ(12, graph.GetBlocks()[graph.GetBackEdges()[0].from].offset);
+	ASSERT_EQ(3, graph.GetBlocks()[graph.GetBackEdges()[0].to].offset);
+
+	// from the entry: straight to the ret, or twice around the if to the ret or to the back edge,
+	// and the same four from the header of the loop
+	ASSERT_EQ(9u, graph.GetPathCount());
+	AssertEveryPathIsNumberedOnce(graph);
+}
+
+TEST_F(PathProfileTest, EachTargetOfASwitchIsAPathOfItsOwn)
+{
+	Method method(reinterpret_cast<IMAGE_COR_ILMETHOD*>(switched));
+	PathGraph graph;
+
+	ASSERT_TRUE(graph.Build(method, DEFAULT_MAX_PATHS_PER_METHOD));
+
+	ASSERT_EQ(4u, graph.GetPathCount());
+	AssertEveryPathIsNumberedOnce(graph);
+}
+
+TEST_F(PathProfileTest, DoesNotNumberMethodsWithMorePathsThanTheLimit)
+{
+	Method method(reinterpret_cast<IMAGE_COR_ILMETHOD*>(loop));
+	PathGraph graph;
+
+	ASSERT_FALSE(graph.Build(method, 8));
+	ASSERT_TRUE(graph.Build(method, 9));
+}
+
+TEST_F(PathProfileTest, DoesNotNumberMethodsWithExceptionHandlers)
+{
+	ILCorpus::Options options;
+	options.instructions = 200;
+	options.tryDepth = 1;
+	auto generated = ILCorpus::Generate(options);
+	Method method(generated.GetHeader());
+	PathGraph graph;
+
+	ASSERT_NE(0u, generated.exceptionHandlerCount);
+	ASSERT_FALSE(graph.Build(method, DEFAULT_MAX_PATHS_PER_METHOD));
+}
+
+TEST_F(PathProfileTest, CountsThePathsThatRun)
+{
+	Method method(reinterpret_cast<IMAGE_COR_ILMETHOD*>(diamond));
+	PathGraph graph;
+	ASSERT_TRUE(graph.Build(method, DEFAULT_MAX_PATHS_PER_METHOD));
+	ULONG counters[2] = { 0 };
+
+	AddPathProfile(method, graph, PathProbe(0, counters));
+
+	ASSERT_TRUE(RunMethod(method, { 1 }));
+	ASSERT_TRUE(RunMethod(method, { 1 }));
+	ASSERT_TRUE(RunMethod(method, { 0 }));
+	ASSERT_EQ(2u, counters[0]);
+	ASSERT_EQ(1u, counters[1]);
+}
+
+TEST_F(PathProfileTest, CountsAPathForEachTimeRoundALoop)
+{
+	Method method(reinterpret_cast<IMAGE_COR_ILMETHOD*>(loop));
+	PathGraph graph;
+	ASSERT_TRUE(graph.Build(method, DEFAULT_MAX_PATHS_PER_METHOD));
+	std::vector<ULONG> counters(graph.GetPathCount(), 0);
+
+	AddPathProfile(method, graph, PathProbe(0, counters.data()));
+
+	ASSERT_TRUE(RunMethod(method, { 3, 1 }));
+	ASSERT_TRUE(RunMethod(method, { 0, 1 }));
+
+	ASSERT_EQ(1u, counters[FindPath(graph, { 0, 3, 11, 12 }, PE_Entry, PE_LoopExit)]);
+	ASSERT_EQ(1u, counters[FindPath(graph, { 3, 11, 12 }, PE_LoopEntry, PE_LoopExit)]);
+	ASSERT_EQ(1u, counters[FindPath(graph, { 3, 11, 12, 15 }, PE_LoopEntry, PE_Edge)]);
+	ASSERT_EQ(1u, counters[FindPath(graph, { 0, 15 }, PE_Entry, PE_Edge)]);
+	ASSERT_EQ(4u, std::accumulate(counters.begin(), counters.end(), 0u));
+}
+
+TEST_F(PathProfileTest, CountsTheTargetsOfASwitch)
+{
+	Method method(reinterpret_cast<IMAGE_COR_ILMETHOD*>(switched));
+	PathGraph graph;
+	ASSERT_TRUE(graph.Build(method, DEFAULT_MAX_PATHS_PER_METHOD));
+	std::vector<ULONG> counters(graph.GetPathCount(), 0);
+
+	AddPathProfile(method, graph, PathProbe(0, counters.data()));
+
+	for (LONG value : { 0, 1, 2, 3, 7, 7 })
+		ASSERT_TRUE(RunMethod(method, { value }));
+
+	// cases 1 and 2 take the same blocks by different edges
+	ASSERT_EQ(1u, counters[FindPath(graph, { 0, 20, 21, 22 }, PE_Entry, PE_Edge)]);
+	ASSERT_EQ(3u, counters[FindPath(graph, { 0, 18, 22 }, PE_Entry, PE_Edge)]);
+	ASSERT_EQ(2, std::count(counters.begin(), counters.end(), 1u) - 1);
+	ASSERT_EQ(6u, std::accumulate(counters.begin(), counters.end(), 0u));
+}
+
+TEST_F(PathProfileTest, CoverageCanBeAddedAfterThePathProbes)
+{
+	Method method(reinterpret_cast<IMAGE_COR_ILMETHOD*>(loop));
+	std::vector<SequencePoint> seqPoints{ { 1, 0 }, { 2, 3 }, { 3, 11 }, { 4, 15 } };
+	std::vector<BranchPoint> brPoints{ { 10, 1, 0 }, { 11, 1, 1 }, { 12, 9, 0 }, { 13, 9, 1 }, { 14, 13, 0 }, { 15, 13, 1 } };
+	PathGraph graph;
+	ASSERT_TRUE(graph.Build(method, DEFAULT_MAX_PATHS_PER_METHOD));
+	std::vector<ULONG> counters(graph.GetPathCount(), 0);
+
+	AddPathProfile(method, graph, PathProbe(0, counters.data()));
+	std::vector<ULONG> mergedPoints;
+	CoverageInstrumentation::AddCoverage(CoverageInstrumentation::CallProbe(0x06000001), method, seqPoints, brPoints,
+		std::vector<ULONG>{ 1, 2, 3, 4 }, CoverageInstrumentation::DerivedBranchPoints(), false, nullptr, nullptr);
+
+	std::vector<ULONG> visits;
+	ASSERT_TRUE(RunMethod(method, { 2, 0 }, visits));
+
+	ASSERT_EQ(1u, counters[FindPath(graph, { 0, 3, 12 }, PE_Entry, PE_LoopExit)]);
+	ASSERT_EQ(1u, counters[FindPath(graph, { 3, 12, 15 }, PE_LoopEntry, PE_Edge)]);
+	ASSERT_EQ(2u, std::accumulate(counters.begin(), counters.end(), 0u));
+	std::sort(visits.begin(), visits.end());
+	ASSERT_EQ((std::vector<ULONG>{ 1, 2, 2, 4, 10, 13, 13, 14, 15 }), visits);
+}
+
+TEST_F(PathProfileTest, ProbesAfterThePathRegisterAreFoundWhenTheMethodIsReadBack)
+{
+	Method method(reinterpret_cast<IMAGE_COR_ILMETHOD*>(loop));
+	std::vector<SequencePoint> seqPoints{ { 1, 0 }, { 2, 3 }, { 3, 11 }, { 4, 15 } };
+	PathGraph graph;
+	ASSERT_TRUE(graph.Build(method, DEFAULT_MAX_PATHS_PER_METHOD));
+	ULONG counters[9] = { 0 };
+	AddPathProfile(method, graph, PathProbe(0, counters));
+	CoverageInstrumentation::AddCoverage(CoverageInstrumentation::CallProbe(0x06000001), method, seqPoints, BranchPointSpan(),
+		std::vector<ULONG>{ 1, 2, 3, 4 });
+	std::vector<BYTE> body(method.GetMethodSize());
+	method.WriteMethod(reinterpret_cast<IMAGE_COR_ILMETHOD*>(body.data()));
+
+	Method readBack(reinterpret_cast<IMAGE_COR_ILMETHOD*>(body.data()));
+	InstructionList probe;
+	CoverageInstrumentation::CallProbe(0x06000001).Emit(readBack, probe, 1);
+	long offset = 0;
+
+	ASSERT_FALSE(readBack.IsInstrumented(0, probe));
+	ASSERT_TRUE(FindPathSetEnd(readBack, offset));
+	ASSERT_TRUE(readBack.IsInstrumented(offset, probe));
+}
+
+TEST_F(PathProfileTest, OriginalMethodsDoNotStartWithThePathRegister)
+{
+	Method method(reinterpret_cast<IMAGE_COR_ILMETHOD*>(loop));
+	long offset = 0;
+
+	ASSERT_FALSE(FindPathSetEnd(method, offset));
+}
+
+TEST_F(PathProfileTest, RegisterIsAddedToTheLocals)
+{
+	std::vector<BYTE> signature;
+	USHORT index;
+
+	ASSERT_TRUE(AppendLocal(nullptr, 0, ELEMENT_TYPE_I4, signature, index));
+	ASSERT_EQ((std::vector<BYTE>{ IMAGE_CEE_CS_CALLCONV_LOCAL_SIG, 1, ELEMENT_TYPE_I4 }), signature);
+	ASSERT_EQ(0, index);
+
+	BYTE one[] = { IMAGE_CEE_CS_CALLCONV_LOCAL_SIG, 1, ELEMENT_TYPE_STRING };
+	ASSERT_TRUE(AppendLocal(one, sizeof(one), ELEMENT_TYPE_I4, signature, index));
+	ASSERT_EQ((std::vector<BYTE>{ IMAGE_CEE_CS_CALLCONV_LOCAL_SIG, 2, ELEMENT_TYPE_STRING, ELEMENT_TYPE_I4 }), signature);
+	ASSERT_EQ(1, index);
+
+	BYTE notLocals[] = { 0x06, ELEMENT_TYPE_I4 };
+	ASSERT_FALSE(AppendLocal(notLocals, sizeof(notLocals), ELEMENT_TYPE_I4, signature, index));
+}
+
+TEST_F(PathProfileTest, RegisterCanTakeALongerCount)
+{
+	std::vector<BYTE> many{ IMAGE_CEE_CS_CALLCONV_LOCAL_SIG, 0x7F };
+	many.insert(many.end(), 0x7F, ELEMENT_TYPE_STRING);
+	std::vector<BYTE> signature;
+	USHORT index;
+
+	ASSERT_TRUE(AppendLocal(many.data(), static_cast<ULONG>(many.size()), ELEMENT_TYPE_I4, signature, index));
+
+	ASSERT_EQ(0x7F, index);
+	ASSERT_EQ(many.size() + 2, signature.size());
+	ASSERT_EQ(0x80, signature[1]);
+	ASSERT_EQ(0x80, signature[2]);
+	ASSERT_EQ(ELEMENT_TYPE_I4, signature.back());
+}
+
+TEST_F(PathProfileTest, InstrumentedMethodCanBeWritten)
+{
+	Method method(reinterpret_cast<IMAGE_COR_ILMETHOD*>(loop));
+	PathGraph graph;
+	ASSERT_TRUE(graph.Build(method, DEFAULT_MAX_PATHS_PER_METHOD));
+	ULONG counters[9] = { 0 };
+
+	AddPathProfile(method, graph, PathProbe(300, counters));
+	method.SetLocalVarSigToken(0x11000001);
+
+	std::vector<BYTE> buffer(method.GetMethodSize());
+	method.WriteMethod(reinterpret_cast<IMAGE_COR_ILMETHOD*>(buffer.data()));
+	Method written(reinterpret_cast<IMAGE_COR_ILMETHOD*>(buffer.data()));
+
+	ASSERT_EQ(0x11000001u, written.GetLocalVarSigToken());
+	ASSERT_EQ(method.GetNumberOfInstructions(), written.GetNumberOfInstructions());
+	ASSERT_EQ(CEE_STLOC, written.m_instructions[1]->m_operation);
+	ASSERT_EQ(300u, written.m_instructions[1]->m_operand);
+}
+
+TEST_F(PathProfileTest, MethodsInstrumentedAgainShareTheirCounters)
+{
+	Method method(reinterpret_cast<IMAGE_COR_ILMETHOD*>(diamond));
+	auto graph = std::make_shared<PathGraph>();
+	ASSERT_TRUE(graph->Build(method, DEFAULT_MAX_PATHS_PER_METHOD));
+	PathProfile profile;
+
+	auto pCounters = profile.Add(L"C:\\module.dll", L"module", 0x06000001, graph);
+
+	ASSERT_EQ(pCounters, profile.Add(L"C:\\module.dll", L"module", 0x06000001, graph));
+	ASSERT_NE(pCounters, profile.Add(L"C:\\module.dll", L"module", 0x06000002, graph));
+}
+
+TEST_F(PathProfileTest, WritesThePathsThatRan)
+{
+	Method method(reinterpret_cast<IMAGE_COR_ILMETHOD*>(loop));
+	auto graph = std::make_shared<PathGraph>();
+	ASSERT_TRUE(graph->Build(method, DEFAULT_MAX_PATHS_PER_METHOD));
+	PathProfile profile;
+	auto pCounters = profile.Add(L"C:\\module.dll", L"module", 0x06000001, graph);
+	profile.Add(L"C:\\module.dll", L"module", 0x06000002, graph);
+
+	pCounters[FindPath(*graph, { 0, 3, 11, 12 }, PE_Entry, PE_LoopExit)] = 1;
+	pCounters[FindPath(*graph, { 3, 11, 12 }, PE_LoopEntry, PE_LoopExit)] = 5;
+	pCounters[FindPath(*graph, { 3, 12, 15 }, PE_LoopEntry, PE_Edge)] = 2;
+
+	std::wostringstream out;
+	profile.Write(out);
+
+	std::wostringstream expected;
+	expected << L"M,0x06000001,9,3,\"module\",\"C:\\module.dll\"" << std::endl
+		<< L"P," << FindPath(*graph, { 3, 11, 12 }, PE_LoopEntry, PE_LoopExit) << L",5,~0003>000B>000C~" << std::endl
+		<< L"P," << FindPath(*graph, { 3, 12, 15 }, PE_LoopEntry, PE_Edge) << L",2,~0003>000C>000F" << std::endl
+		<< L"P," << FindPath(*graph, { 0, 3, 11, 12 }, PE_Entry, PE_LoopExit) << L",1,0000>0003>000B>000C~" << std::endl
+		<< L"M,0x06000002,9,0,\"module\",\"C:\\module.dll\"" << std::endl;
+	ASSERT_EQ(expected.str(), out.str());
+}
+
+TEST_F(PathProfileTest, NumbersEveryPathOfTheCorpus)
+{
+	ILCorpus::Options options;
+	options.instructions = 60;
+	for (ULONG seed = 1; seed <= 20; seed++)
+	{
+		options.seed = seed;
+		options.compareBranches = (seed % 2) == 0;
+		options.switchTargets = (seed % 5) == 0 ? 4 : 0;
+		auto generated = ILCorpus::Generate(options);
+		Method method(generated.GetHeader());
+		PathGraph graph;
+		if (!graph.Build(method, DEFAULT_MAX_PATHS_PER_METHOD))
+			continue;
+
+		AssertEveryPathIsNumberedOnce(graph);
+		std::vector<ULONG> counters(graph.GetPathCount(), 0);
+		AddPathProfile(method, graph, PathProbe(0, counters.data()));
+		std::vector<BYTE> buffer(method.GetMethodSize());
+		method.WriteMethod(reinterpret_cast<IMAGE_COR_ILMETHOD*>(buffer.data()));
+	}
+}
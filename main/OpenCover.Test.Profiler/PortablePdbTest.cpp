@@ -0,0 +1,598 @@
+#include "stdafx.h"
+#include "..\OpenCover.Profiler\Inflate.h"
+#include "..\OpenCover.Profiler\LocalPoints.h"
+#include "..\OpenCover.Profiler\PortablePdb.h"
+#include "..\OpenCover.Weaver\Metadata.h"
+#include "..\OpenCover.Weaver\PeImage.h"
+
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <sstream>
+
+using namespace Instrumentation;
+using namespace Weaving;
+
+namespace
+{
+	// the column of the name of a field (not one the weaver reads)
+	const uint32_t Field_Name = 1;
+
+	void AppendCompressed(std::vector<BYTE>& blob, ULONG value)
+	{
+		if (value < 0x80)
+			blob.push_back(static_cast<BYTE>(value));
+		else if (value < 0x4000)
+		{
+			blob.push_back(static_cast<BYTE>(0x80 | (value >> 8)));
+			blob.push_back(static_cast<BYTE>(value));
+		}
+		else
+		{
+			blob.push_back(static_cast<BYTE>(0xC0 | (value >> 24)));
+			blob.push_back(static_cast<BYTE>(value >> 16));
+			blob.push_back(static_cast<BYTE>(value >> 8));
+			blob.push_back(static_cast<BYTE>(value));
+		}
+	}
+
+	void AppendSigned(std::vector<BYTE>& blob, LONG value)
+	{
+		ULONG sign = value < 0 ? 1 : 0;
+		if (value >= -64 && value < 64)
+			AppendCompressed(blob, ((static_cast<ULONG>(value) & 0x3F) << 1) | sign);
+		else if (value >= -8192 && value < 8192)
+			AppendCompressed(blob, ((static_cast<ULONG>(value) & 0x1FFF) << 1) | sign);
+		else
+			AppendCompressed(blob, ((static_cast<ULONG>(value) & 0x0FFFFFFF) << 1) | sign);
+	}
+
+	void AppendUInt16(std::vector<BYTE>& data, ULONG value)
+	{
+		data.push_back(static_cast<BYTE>(value));
+		data.push_back(static_cast<BYTE>(value >> 8));
+	}
+
+	void AppendUInt32(std::vector<BYTE>& data, ULONG value)
+	{
+		AppendUInt16(data, value & 0xFFFF);
+		AppendUInt16(data, value >> 16);
+	}
+
+	/// <summary>A standalone portable PDB with the documents "src/0.cs", "src/1.cs"... and a method for each
+	/// blob of sequence points given, the methods are in the document given (0 if each blob names its own)</summary>
+	std::vector<BYTE> BuildPdb(ULONG documents, const std::vector<std::vector<BYTE>>& methods, ULONG methodDocument = 1)
+	{
+		std::vector<BYTE> blobs(1, 0);
+		auto addBlob = [&blobs](const std::vector<BYTE>& blob)
+		{
+			auto index = static_cast<ULONG>(blobs.size());
+			AppendCompressed(blobs, static_cast<ULONG>(blob.size()));
+			blobs.insert(blobs.end(), blob.begin(), blob.end());
+			return index;
+		};
+
+		auto folder = addBlob(std::vector<BYTE>{ 's', 'r', 'c' });
+		std::vector<ULONG> names;
+		for (ULONG document = 0; document < documents; document++)
+		{
+			auto file = std::to_string(document) + ".cs";
+			std::vector<BYTE> name(1, '/');
+			AppendCompressed(name, folder);
+			AppendCompressed(name, addBlob(std::vector<BYTE>(file.begin(), file.end())));
+			names.push_back(addBlob(name));
+		}
+		std::vector<ULONG> pointBlobs;
+		for (auto& method : methods)
+			pointBlobs.push_back(method.empty() ? 0 : addBlob(method));
+		while (blobs.size() % 4 != 0)
+			blobs.push_back(0);
+
+		auto blobIndexSize = blobs.size() < 0x10000 ? 2 : 4;
+		auto appendBlobIndex = [blobIndexSize](std::vector<BYTE>& data, ULONG index)
+		{
+			if (blobIndexSize == 2)
+				AppendUInt16(data, index);
+			else
+				AppendUInt32(data, index);
+		};
+
+		std::vector<BYTE> tables;
+		AppendUInt32(tables, 0);
+		tables.push_back(2);
+		tables.push_back(0);
+		tables.push_back(blobIndexSize == 2 ? 0 : 0x04);
+		tables.push_back(1);
+		AppendUInt32(tables, 0);  // the Document and MethodDebugInformation tables
+		AppendUInt32(tables, (1 << (0x30 - 32)) | (1 << (0x31 - 32)));
+		AppendUInt32(tables, 0);
+		AppendUInt32(tables, 0);
+		AppendUInt32(tables, documents);
+		AppendUInt32(tables, static_cast<ULONG>(methods.size()));
+		for (auto name : names)
+		{
+			appendBlobIndex(tables, name);
+			AppendUInt16(tables, 0);
+			appendBlobIndex(tables, 0);
+			AppendUInt16(tables, 0);
+		}
+		for (auto pointBlob : pointBlobs)
+		{
+			AppendUInt16(tables, methodDocument);
+			appendBlobIndex(tables, pointBlob);
+		}
+		while (tables.size() % 4 != 0)
+			tables.push_back(0);
+
+		std::vector<BYTE> pdbStream(32, 0);
+
+		const char version[] = "PDB v1.0\0\0\0";
+		std::vector<BYTE> pdb;
+		AppendUInt32(pdb, 0x424A5342);
+		AppendUInt16(pdb, 1);
+		AppendUInt16(pdb, 1);
+		AppendUInt32(pdb, 0);
+		AppendUInt32(pdb, 12);
+		pdb.insert(pdb.end(), version, version + 12);
+		AppendUInt16(pdb, 0);
+		AppendUInt16(pdb, 3);
+
+		// the stream headers are 16 + 12 + 16 bytes
+		auto offset = static_cast<ULONG>(pdb.size()) + 44;
+		std::pair<const char*, const std::vector<BYTE>*> streams[] = { { "#Pdb", &pdbStream }, { "#~", &tables }, { "#Blob", &blobs } };
+		for (auto& stream : streams)
+		{
+			AppendUInt32(pdb, offset);
+			AppendUInt32(pdb, static_cast<ULONG>(stream.second->size()));
+			std::string name(stream.first);
+			pdb.insert(pdb.end(), name.begin(), name.end());
+			pdb.insert(pdb.end(), 4 - (name.size() % 4), 0);
+			offset += static_cast<ULONG>(stream.second->size());
+		}
+		for (auto& stream : streams)
+			pdb.insert(pdb.end(), stream.second->begin(), stream.second->end());
+		return pdb;
+	}
+
+	std::wstring Widen(const std::string& value)
+	{
+		return std::wstring(value.begin(), value.end());
+	}
+}
+
+class PortablePdbTest : public ::testing::Test {
+	void SetUp() override
+	{
+
+	}
+
+	void TearDown() override
+	{
+
+	}
+
+protected:
+	// see Samples\SymbolSample.cs
+	static std::vector<BYTE> ReadSample(const char* name)
+	{
+		std::string path(__FILE__);
+		path = path.substr(0, path.find_last_of("\\/") + 1) + "Samples/" + name;
+		std::ifstream in(path, std::ios::binary);
+		EXPECT_TRUE(static_cast<bool>(in)) << path;
+		return std::vector<BYTE>(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+	}
+
+	static std::string Describe(const std::vector<PdbSequencePoint>& points)
+	{
+		std::ostringstream out;
+		for (auto& point : points)
+		{
+			out << point.offset << ":";
+			if (point.IsHidden())
+				out << "hidden ";
+			else
+				out << point.startLine << ":" << point.startColumn << ":" << point.endLine << ":" << point.endColumn << " ";
+		}
+		return out.str();
+	}
+
+	static std::string Describe(const LocalPoints& points)
+	{
+		std::ostringstream out;
+		out << "seq";
+		for (auto& point : points.seqPoints)
+			out << " " << point.Offset;
+		out << " br";
+		for (auto& point : points.brPoints)
+			out << " " << point.Offset << ":" << point.Path;
+		return out.str();
+	}
+
+	/// <summary>The points of a method of SymbolSample.dll, as the host finds them</summary>
+	static std::string FindSamplePoints(mdMethodDef functionToken, const char* lambdaField = nullptr)
+	{
+		PeImage image(ReadSample("SymbolSample.dll"));
+		Metadata metadata(image.GetData(image.GetMetadataRva(), image.GetMetadataSize()), image.GetMetadataSize());
+		auto pdbData = ReadSample("SymbolSample.pdb");
+		PortablePdb pdb;
+		EXPECT_TRUE(pdb.Open(pdbData.data(), static_cast<ULONG>(pdbData.size())));
+		std::vector<PdbSequencePoint> pdbPoints;
+		EXPECT_TRUE(pdb.GetSequencePoints(functionToken, pdbPoints));
+
+		auto rva = metadata.GetValue(TBL_MethodDef, functionToken & 0x00FFFFFF, MethodDef_RVA);
+		auto pHeader = image.GetData(rva, 12);
+		auto size = (pHeader[0] & 3) == CorILMethod_TinyFormat ? 1 + (pHeader[0] >> 2) : 12 + ReadUInt32(pHeader + 4);
+		Method method(reinterpret_cast<IMAGE_COR_ILMETHOD*>(const_cast<uint8_t*>(image.GetData(rva, size))));
+
+		LocalPoints points;
+		FindLocalPoints(method, pdbPoints, [&](mdToken fieldToken, std::wstring& name)
+		{
+			if ((fieldToken & 0xFF000000) != 0x04000000)
+				return false;
+			name = lambdaField != nullptr ? Widen(lambdaField) : Widen(metadata.GetString(metadata.GetValue(TBL_Field, fieldToken & 0x00FFFFFF, Field_Name)));
+			return true;
+		}, points);
+		return Describe(points);
+	}
+};
+
+TEST_F(PortablePdbTest, Inflate_DecompressesStoredBlocks)
+{
+	BYTE data[] = { 0x01, 0x0F, 0x00, 0xF0, 0xFF, 0x73, 0x65, 0x71, 0x75, 0x65, 0x6E, 0x63, 0x65, 0x20, 0x70, 0x6F, 0x69, 0x6E, 0x74, 0x73 };
+	std::vector<BYTE> output;
+
+	ASSERT_TRUE(Inflate(data, sizeof(data), 15, output));
+	ASSERT_EQ("sequence points", std::string(output.begin(), output.end()));
+}
+
+TEST_F(PortablePdbTest, Inflate_DecompressesFixedHuffmanBlocks)
+{
+	BYTE data[] = { 0x2B, 0x4E, 0x2D, 0x2C, 0x4D, 0xCD, 0x4B, 0x4E, 0x55, 0x28, 0xC8, 0xCF, 0xCC, 0x2B, 0x29, 0x06, 0x00 };
+	std::vector<BYTE> output;
+
+	ASSERT_TRUE(Inflate(data, sizeof(data), 15, output));
+	ASSERT_EQ("sequence points", std::string(output.begin(), output.end()));
+}
+
+TEST_F(PortablePdbTest, Inflate_DecompressesDynamicHuffmanBlocks)
+{
+	BYTE data[] = { 0x25, 0xCE, 0xC9, 0x11, 0x04, 0x31, 0x0C, 0x02, 0xC0, 0x94, 0xAC, 0xD3, 0x12, 0xE4, 0x9F, 0xD7, 0x32, 0xDE,
+		0x37, 0xD0, 0xC5, 0xC1, 0xA1, 0xE1, 0x32, 0x61, 0x5C, 0x0C, 0xAD, 0xE1, 0xF4, 0xC2, 0x32, 0x1A, 0xC1, 0x5C, 0xD8, 0x61, 0x27,
+		0x92, 0x63, 0x30, 0x63, 0xA0, 0xE8, 0x2A, 0x3B, 0xF3, 0xA2, 0x79, 0x5D, 0x7B, 0xD7, 0x3E, 0x94, 0xB2, 0x5D, 0xC2, 0x96, 0x84,
+		0x08, 0x09, 0xF7, 0x48, 0x30, 0xFF, 0x84, 0x0A, 0x09, 0xDB, 0x9F, 0x90, 0x29, 0x62, 0xED, 0x11, 0x21, 0x62, 0x53, 0x44, 0x1D,
+		0x19, 0xF3, 0x11, 0x25, 0xC2, 0xAF, 0x88, 0x19, 0x11, 0x95, 0x22, 0xFC, 0x11, 0xB3, 0x22, 0xFA, 0x7F, 0xA2, 0x44, 0xD8, 0x23,
+		0xA6, 0x45, 0x74, 0x8B, 0xF8, 0x01 };
+	std::ostringstream expected;
+	for (auto i = 0; i < 40; i++)
+		expected << (i * i % 97) << ":" << (i * 7 % 13) << ";";
+	std::vector<BYTE> output;
+
+	ASSERT_TRUE(Inflate(data, sizeof(data), static_cast<ULONG>(expected.str().size()), output));
+	ASSERT_EQ(expected.str(), std::string(output.begin(), output.end()));
+}
+
+TEST_F(PortablePdbTest, Inflate_Fails_WhenTheDataIsTruncated_OrNotTheSizeExpected)
+{
+	BYTE data[] = { 0x2B, 0x4E, 0x2D, 0x2C, 0x4D, 0xCD, 0x4B, 0x4E, 0x55, 0x28, 0xC8, 0xCF, 0xCC, 0x2B, 0x29, 0x06, 0x00 };
+	BYTE badType[] = { 0x07 };
+	std::vector<BYTE> output;
+
+	ASSERT_FALSE(Inflate(data, sizeof(data) - 4, 15, output));
+	ASSERT_FALSE(Inflate(data, sizeof(data), 16, output));
+	ASSERT_FALSE(Inflate(badType, sizeof(badType), 0, output));
+}
+
+TEST_F(PortablePdbTest, FindPortablePdb_FindsThePathOfThePdb_TheModuleWasBuiltWith)
+{
+	auto image = ReadSample("SymbolSample.dll");
+	PdbLocation location;
+
+	ASSERT_TRUE(FindPortablePdb(image.data(), static_cast<ULONG>(image.size()), location));
+	ASSERT_EQ(PDB_FILE, location.kind);
+	ASSERT_EQ("C:/Samples/obj/Debug/net8.0/SymbolSample.pdb", location.path);
+}
+
+TEST_F(PortablePdbTest, FindPortablePdb_FindsAnEmbeddedPdb)
+{
+	auto image = ReadSample("SymbolSample.Embedded.dll");
+	PdbLocation location;
+	std::vector<BYTE> pdbData;
+	PortablePdb pdb;
+
+	ASSERT_TRUE(FindPortablePdb(image.data(), static_cast<ULONG>(image.size()), location));
+	ASSERT_EQ(PDB_EMBEDDED, location.kind);
+	ASSERT_TRUE(Inflate(location.pData, location.size, location.uncompressedSize, pdbData));
+	ASSERT_TRUE(pdb.Open(pdbData.data(), static_cast<ULONG>(pdbData.size())));
+	// the class of the lambda has 3 methods
+	ASSERT_EQ(7, pdb.GetMethodCount());
+}
+
+TEST_F(PortablePdbTest, FindPortablePdb_Fails_WhenTheModuleHasNoDebugDirectory)
+{
+	auto image = ReadSample("WeaverSample.dll");
+	PdbLocation location;
+
+	ASSERT_FALSE(FindPortablePdb(image.data(), static_cast<ULONG>(image.size()), location));
+	ASSERT_EQ(PDB_NONE, location.kind);
+}
+
+TEST_F(PortablePdbTest, GetSequencePoints_DecodesTheHiddenPoints_AndThePointsThatGoBackwards)
+{
+	auto pdbData = ReadSample("SymbolSample.pdb");
+	PortablePdb pdb;
+	std::vector<PdbSequencePoint> points;
+
+	ASSERT_TRUE(pdb.Open(pdbData.data(), static_cast<ULONG>(pdbData.size())));
+	ASSERT_TRUE(pdb.GetSequencePoints(0x06000001, points));
+
+	ASSERT_EQ("0:13:9:13:10 1:14:13:14:27 3:15:13:15:20 4:15:35:15:41 8:hidden 10:15:22:15:31 14:16:13:16:14 15:17:17:17:34 "
+		"28:hidden 32:18:21:18:29 36:19:13:19:14 37:hidden 41:15:32:15:34 47:20:13:20:26 52:21:9:21:10 ", Describe(points));
+	ASSERT_EQ(1, points[0].document);
+}
+
+TEST_F(PortablePdbTest, GetSequencePoints_AreTheSame_WhenThePdbIsEmbedded)
+{
+	auto pdbData = ReadSample("SymbolSample.pdb");
+	auto image = ReadSample("SymbolSample.Embedded.dll");
+	PdbLocation location;
+	std::vector<BYTE> embeddedData;
+	PortablePdb pdb, embedded;
+	ASSERT_TRUE(FindPortablePdb(image.data(), static_cast<ULONG>(image.size()), location));
+	ASSERT_TRUE(Inflate(location.pData, location.size, location.uncompressedSize, embeddedData));
+	ASSERT_TRUE(pdb.Open(pdbData.data(), static_cast<ULONG>(pdbData.size())));
+	ASSERT_TRUE(embedded.Open(embeddedData.data(), static_cast<ULONG>(embeddedData.size())));
+
+	for (mdMethodDef token = 0x06000001; token <= 0x06000007; token++)
+	{
+		std::vector<PdbSequencePoint> points, embeddedPoints;
+		ASSERT_TRUE(pdb.GetSequencePoints(token, points));
+		ASSERT_TRUE(embedded.GetSequencePoints(token, embeddedPoints));
+		ASSERT_EQ(Describe(points), Describe(embeddedPoints)) << token;
+	}
+}
+
+TEST_F(PortablePdbTest, GetSequencePoints_Fails_ForAMethodThatIsNotInThePdb)
+{
+	auto pdbData = ReadSample("SymbolSample.pdb");
+	PortablePdb pdb;
+	std::vector<PdbSequencePoint> points;
+	ASSERT_TRUE(pdb.Open(pdbData.data(), static_cast<ULONG>(pdbData.size())));
+
+	ASSERT_FALSE(pdb.GetSequencePoints(0x06000100, points));
+	ASSERT_FALSE(pdb.GetSequencePoints(0x02000001, points));
+
+	// the default constructor has no points
+	ASSERT_TRUE(pdb.GetSequencePoints(0x06000004, points));
+	ASSERT_TRUE(points.empty());
+}
+
+TEST_F(PortablePdbTest, GetSequencePoints_FollowsTheDocumentRecords)
+{
+	std::vector<BYTE> blob;
+	AppendCompressed(blob, 0);  // local signature
+	AppendCompressed(blob, 2);  // initial document
+	AppendCompressed(blob, 0);  // offset 0, line 10 col 5 - line 10 col 20
+	AppendCompressed(blob, 0);
+	AppendCompressed(blob, 15);
+	AppendCompressed(blob, 10);
+	AppendCompressed(blob, 5);
+	AppendCompressed(blob, 0);  // document 1
+	AppendCompressed(blob, 1);
+	AppendCompressed(blob, 4);  // offset 4, line 3 col 1 - line 5 col 2
+	AppendCompressed(blob, 2);
+	AppendSigned(blob, 1);
+	AppendSigned(blob, -7);
+	AppendSigned(blob, -4);
+	AppendCompressed(blob, 200);  // offset 204, hidden
+	AppendCompressed(blob, 0);
+	AppendCompressed(blob, 0);
+	auto pdbData = BuildPdb(2, std::vector<std::vector<BYTE>>{ blob }, 0);
+	PortablePdb pdb;
+	std::vector<PdbSequencePoint> points;
+
+	ASSERT_TRUE(pdb.Open(pdbData.data(), static_cast<ULONG>(pdbData.size())));
+	ASSERT_TRUE(pdb.GetSequencePoints(0x06000001, points));
+
+	ASSERT_EQ("0:10:5:10:20 4:3:1:5:2 204:hidden ", Describe(points));
+	ASSERT_EQ(2, points[0].document);
+	ASSERT_EQ(1, points[1].document);
+	ASSERT_EQ(1, points[2].document);
+}
+
+TEST_F(PortablePdbTest, GetDocumentName_JoinsTheParts)
+{
+	auto pdbData = BuildPdb(2, std::vector<std::vector<BYTE>>());
+	PortablePdb pdb;
+	std::string name;
+
+	ASSERT_TRUE(pdb.Open(pdbData.data(), static_cast<ULONG>(pdbData.size())));
+	ASSERT_TRUE(pdb.GetDocumentName(2, name));
+	ASSERT_EQ("src/1.cs", name);
+	ASSERT_FALSE(pdb.GetDocumentName(3, name));
+}
+
+TEST_F(PortablePdbTest, Open_Fails_WhenTheMetadataIsNotAPdb)
+{
+	PeImage image(ReadSample("WeaverSample.dll"));
+	PortablePdb pdb;
+	BYTE empty[32] = {};
+
+	ASSERT_FALSE(pdb.Open(image.GetData(image.GetMetadataRva(), image.GetMetadataSize()), image.GetMetadataSize()));
+	ASSERT_FALSE(pdb.Open(empty, sizeof(empty)));
+}
+
+// the expected points are those the host (CecilSymbolManager) finds in Samples\SymbolSample.dll
+TEST_F(PortablePdbTest, FindLocalPoints_FindsThePointsTheHostDoes)
+{
+	ASSERT_EQ("seq 0 1 3 4 10 14 15 32 36 41 47 52 br 30:0 30:1 45:0 45:1", FindSamplePoints(0x06000001));
+	ASSERT_EQ("seq 0 1 25 33 41 49 68 br 6:0 6:1 6:2 6:3 51:0 51:1", FindSamplePoints(0x06000002));
+	ASSERT_EQ("seq 0 1 41 br", FindSamplePoints(0x06000003));
+}
+
+TEST_F(PortablePdbTest, FindLocalPoints_KeepsTheBranch_WhenTheFieldTestedDoesNotHoldALambda)
+{
+	ASSERT_EQ("seq 0 1 41 br 8:0 8:1", FindSamplePoints(0x06000003, "cache"));
+}
+
+TEST_F(PortablePdbTest, FindLocalPoints_AddsAnEntryPoint_WhenThereIsNoPointAtTheStart)
+{
+	BYTE data[] = { (3 << 2) + CorILMethod_TinyFormat,
+		CEE_NOP, CEE_NOP, CEE_RET };
+	Method method(reinterpret_cast<IMAGE_COR_ILMETHOD*>(data));
+	std::vector<PdbSequencePoint> pdbPoints = { { 1, 10, 1, 10, 5, 1 } };
+	LocalPoints points;
+
+	FindLocalPoints(method, pdbPoints, FieldNameResolver(), points);
+
+	ASSERT_EQ("seq 0 1 br", Describe(points));
+	ASSERT_TRUE(points.hasEntryPoint);
+	ASSERT_EQ(1, points.GetSequencePointCount());
+}
+
+TEST_F(PortablePdbTest, FindLocalPoints_LeavesOutEmptyBranches_AndThePointsInThem)
+{
+	BYTE data[] = { (6 << 2) + CorILMethod_TinyFormat,
+		CEE_LDARG_0,
+		CEE_BRTRUE_S, 0x02,
+		CEE_NOP, CEE_NOP,
+		CEE_RET };
+	Method method(reinterpret_cast<IMAGE_COR_ILMETHOD*>(data));
+	std::vector<PdbSequencePoint> pdbPoints = { { 0, 10, 1, 10, 5, 1 }, { 3, 11, 1, 11, 5, 1 }, { 5, 12, 1, 12, 5, 1 } };
+	LocalPoints points;
+
+	FindLocalPoints(method, pdbPoints, FieldNameResolver(), points);
+
+	ASSERT_EQ("seq 0 5 br", Describe(points));
+}
+
+TEST_F(PortablePdbTest, FindLocalPoints_FindsNoPoints_WhenEveryPointIsHidden)
+{
+	BYTE data[] = { (2 << 2) + CorILMethod_TinyFormat,
+		CEE_NOP, CEE_RET };
+	Method method(reinterpret_cast<IMAGE_COR_ILMETHOD*>(data));
+	std::vector<PdbSequencePoint> pdbPoints = { { 0, PDB_HIDDEN_LINE, 0, PDB_HIDDEN_LINE, 0, 1 } };
+	LocalPoints points;
+
+	FindLocalPoints(method, pdbPoints, FieldNameResolver(), points);
+
+	ASSERT_TRUE(points.seqPoints.empty());
+	ASSERT_TRUE(points.brPoints.empty());
+}
+
+TEST_F(PortablePdbTest, HashLocalPoints_ChangesWithTheOffsets_AndThePaths)
+{
+	LocalPoints points;
+	points.hasEntryPoint = true;
+	points.seqPoints = { { 0, 0 }, { 0, 4 } };
+	points.brPoints = { { 0, 8, 0 }, { 0, 8, 1 } };
+	auto hash = HashLocalPoints(points);
+
+	// the entry point is the host's, not one of the points it is checking
+	points.seqPoints[0].Offset = 2;
+	ASSERT_EQ(hash, HashLocalPoints(points));
+	points.seqPoints[1].Offset = 5;
+	ASSERT_NE(hash, HashLocalPoints(points));
+	points.seqPoints[1].Offset = 4;
+	points.brPoints[1].Path = 2;
+	ASSERT_NE(hash, HashLocalPoints(points));
+}
+
+// the host hashes the same points to the same value, see ProfilerCommunicationTests.PointsHash_IsTheHashTheProfilerComputes
+TEST_F(PortablePdbTest, HashLocalPoints_IsTheHashTheHostComputes)
+{
+	LocalPoints points;
+	points.hasEntryPoint = false;
+	for (auto offset : { 0, 1, 3, 4, 10, 14, 15, 32, 36, 41, 47, 52 })
+		points.seqPoints.push_back({ 0, offset });
+	points.brPoints = { { 0, 30, 0 }, { 0, 30, 1 }, { 0, 45, 0 }, { 0, 45, 1 } };
+
+	ASSERT_EQ(0xD79E546B, HashLocalPoints(points));
+}
+
+TEST_F(PortablePdbTest, AssignUniqueIds_GivesTheEntryPointItsOwnId)
+{
+	LocalPoints points;
+	points.hasEntryPoint = true;
+	points.seqPoints = { { 0, 0 }, { 0, 4 }, { 0, 6 } };
+	points.brPoints = { { 0, 8, 0 }, { 0, 8, 1 } };
+
+	AssignUniqueIds(points, 30, 10, 20);
+
+	ASSERT_EQ(30, points.seqPoints[0].UniqueId);
+	ASSERT_EQ(10, points.seqPoints[1].UniqueId);
+	ASSERT_EQ(11, points.seqPoints[2].UniqueId);
+	ASSERT_EQ(20, points.brPoints[0].UniqueId);
+	ASSERT_EQ(21, points.brPoints[1].UniqueId);
+}
+
+TEST_F(PortablePdbTest, IsCachedDelegateFieldName_MatchesTheNamesTheCompilerGives)
+{
+	ASSERT_TRUE(IsCachedDelegateFieldName(L"<>9__2_0"));
+	ASSERT_TRUE(IsCachedDelegateFieldName(L"<>9__12_104"));
+	ASSERT_FALSE(IsCachedDelegateFieldName(L"<>9"));
+	ASSERT_FALSE(IsCachedDelegateFieldName(L"<>9__2_"));
+	ASSERT_FALSE(IsCachedDelegateFieldName(L"<>9__2_0x"));
+	ASSERT_FALSE(IsCachedDelegateFieldName(L"cache"));
+}
+
+// NOTE: This times decoding the sequence points of every method of a large generated PDB; it is disabled
+// so that it does not slow down the normal run, to run it
+//   OpenCover.Test.Profiler.exe --gtest_also_run_disabled_tests --gtest_filter=PortablePdbTest.DISABLED_*
+TEST_F(PortablePdbTest, DISABLED_DecodeTheSequencePoints_OfALargePdb)
+{
+	typedef std::chrono::steady_clock Clock;
+	const ULONG methodCount = 100000;
+	const ULONG pointsPerMethod = 40;
+
+	std::vector<std::vector<BYTE>> methods;
+	for (ULONG i = 0; i < methodCount; i++)
+	{
+		std::vector<BYTE> blob;
+		AppendCompressed(blob, 0);
+		for (ULONG point = 0; point < pointsPerMethod; point++)
+		{
+			AppendCompressed(blob, point == 0 ? 0 : 1 + (point * 7 % 23));
+			if (point % 5 == 4)
+			{
+				AppendCompressed(blob, 0);
+				AppendCompressed(blob, 0);
+				continue;
+			}
+			AppendCompressed(blob, point % 3);
+			AppendSigned(blob, 10 + static_cast<LONG>(point % 11));
+			if (point == 0)
+			{
+				AppendCompressed(blob, 10 + i);
+				AppendCompressed(blob, 9);
+			}
+			else
+			{
+				AppendSigned(blob, (point % 4 == 0) ? -3 : 2);
+				AppendSigned(blob, static_cast<LONG>(point % 9) - 4);
+			}
+		}
+		methods.push_back(blob);
+	}
+	auto pdbData = BuildPdb(1, methods);
+
+	auto start = Clock::now();
+	PortablePdb pdb;
+	ASSERT_TRUE(pdb.Open(pdbData.data(), static_cast<ULONG>(pdbData.size())));
+	auto opened = Clock::now();
+
+	size_t points = 0;
+	std::vector<PdbSequencePoint> sequencePoints;
+	for (ULONG i = 1; i <= methodCount; i++)
+	{
+		ASSERT_TRUE(pdb.GetSequencePoints(0x06000000 | i, sequencePoints));
+		points += sequencePoints.size();
+	}
+	auto decoded = Clock::now();
+
+	ASSERT_EQ(methodCount * pointsPerMethod, points);
+	std::cout << pdbData.size() << " bytes, " << methodCount << " methods, " << points << " points" << std::endl
+		<< "  open " << std::chrono::duration_cast<std::chrono::microseconds>(opened - start).count() << " us"
+		<< ", decode " << static_cast<double>(std::chrono::duration_cast<std::chrono::nanoseconds>(decoded - opened).count()) / points
+		<< " ns/point" << std::endl;
+}
@@ -0,0 +1,101 @@
+#include "stdafx.h"
+#include "..\OpenCover.Profiler\PreparedMethods.h"
+
+#include <thread>
+
+using namespace Instrumentation;
+
+class PreparedMethodsTest : public ::testing::Test {
+	void SetUp() override
+	{
+
+	}
+
+	void TearDown() override
+	{
+
+	}
+};
+
+namespace
+{
+	std::unique_ptr<PreparedMethod> Prepare(ULONG lastUniqueId)
+	{
+		std::unique_ptr<PreparedMethod> method(new PreparedMethod());
+		method->lastUniqueId = lastUniqueId;
+		return method;
+	}
+}
+
+TEST_F(PreparedMethodsTest, CanTakePublishedMethod)
+{
+	PreparedMethodTable table(10);
+
+	ASSERT_TRUE(table.Publish(0x06000003, Prepare(3)));
+	ASSERT_FALSE(table.IsTaken(0x06000003));
+
+	auto method = table.Take(0x06000003);
+	ASSERT_NE(nullptr, method.get());
+	ASSERT_EQ(3u, method->lastUniqueId);
+	ASSERT_TRUE(table.IsTaken(0x06000003));
+
+	ASSERT_EQ(nullptr, table.Take(0x06000003).get());
+	ASSERT_EQ(nullptr, table.Take(0x06000004).get());
+}
+
+TEST_F(PreparedMethodsTest, MethodsPublishedAfterTheyAreTakenAreDiscarded)
+{
+	PreparedMethodTable table(10);
+
+	ASSERT_EQ(nullptr, table.Take(0x06000001).get());
+	ASSERT_FALSE(table.Publish(0x06000001, Prepare(1)));
+	ASSERT_EQ(nullptr, table.Take(0x06000001).get());
+}
+
+TEST_F(PreparedMethodsTest, IgnoresTokensOutsideTheTable)
+{
+	PreparedMethodTable table(10);
+
+	ASSERT_FALSE(table.Publish(0x06000000, Prepare(0)));
+	ASSERT_FALSE(table.Publish(0x0600000B, Prepare(11)));
+	ASSERT_FALSE(table.Publish(0x02000001, Prepare(1)));
+	ASSERT_TRUE(table.IsTaken(0x0600000B));
+	ASSERT_EQ(nullptr, table.Take(0x0600000B).get());
+}
+
+TEST_F(PreparedMethodsTest, EachMethodIsTakenAtMostOnceWhenRacing)
+{
+	const ULONG count = 20000;
+	PreparedMethodTable table(count);
+
+	ULONG published = 0;
+	std::thread publisher([&]()
+	{
+		for (ULONG row = 1; row <= count; row++)
+		{
+			if (table.Publish(mdtMethodDef | row, Prepare(row)))
+				published++;
+		}
+	});
+
+	ULONG taken = 0;
+	bool matched = true;
+	std::thread taker([&]()
+	{
+		for (ULONG row = count; row >= 1; row--)
+		{
+			auto method = table.Take(mdtMethodDef | row);
+			if (method)
+			{
+				taken++;
+				matched = matched && method->lastUniqueId == row;
+			}
+		}
+	});
+
+	publisher.join();
+	taker.join();
+
+	ASSERT_EQ(published, taken);
+	ASSERT_TRUE(matched);
+}
@@ -56,7 +56,7 @@ TEST_F(RegressionTest, CanHandleOptimizedCode_Issue663)
 
 	// act
 	InstructionList instructions;
-	CoverageInstrumentation::InsertInjectedMethod(instructions, 0x020FACED, 0x00);
+	CoverageInstrumentation::InsertInjectedMethod(instrument, instructions, 0x020FACED, 0x00);
 	instrument.InsertInstructionsAtOriginalOffset(0x0, instructions);
 	instrument.InsertInstructionsAtOriginalOffset(0xA, instructions);
 	instrument.InsertInstructionsAtOriginalOffset(0xB, instructions);
@@ -0,0 +1,43 @@
+// The source of SymbolSample.dll (with SymbolSample.pdb) and SymbolSample.Embedded.dll, the assemblies
+// read by PortablePdbTest.cpp; a library built for net8.0 without optimization, the way the code being
+// covered usually is, once with a portable PDB and once with the PDB embedded.
+
+using System;
+using System.Linq;
+
+namespace OpenCover.Test.Profiler.Samples
+{
+    public class SymbolSample
+    {
+        public int Count(string[] values)
+        {
+            var count = 0;
+            foreach (var value in values)
+            {
+                if (value == "x")
+                    count++;
+            }
+            return count;
+        }
+
+        public string Describe(int value)
+        {
+            switch (value)
+            {
+                case 0:
+                    return "none";
+                case 1:
+                    return "one";
+                case 2:
+                    return "two";
+                default:
+                    return value < 0 ? "negative" : "many";
+            }
+        }
+
+        public int CountLong(string[] values)
+        {
+            return values.Count(value => value.Length > 3);
+        }
+    }
+}
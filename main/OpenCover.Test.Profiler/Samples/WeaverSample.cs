@@ -0,0 +1,19 @@
+// The source of WeaverSample.dll, the assembly woven by WeaverTest.cpp; a library built for net8.0
+// with optimization enabled, so that the tokens and offsets the tests use do not depend on the compiler's mood.
+
+namespace OpenCover.Test.Profiler.Samples
+{
+    public class WeaverSample
+    {
+        public int Count(string[] values)
+        {
+            var count = 0;
+            foreach (var value in values)
+            {
+                if (value == "x")
+                    count++;
+            }
+            return count;
+        }
+    }
+}
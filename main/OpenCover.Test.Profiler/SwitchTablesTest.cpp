@@ -0,0 +1,78 @@
+#include "stdafx.h"
+#include "..\OpenCover.Profiler\SwitchTables.h"
+
+using namespace Instrumentation;
+
+class SwitchTablesTest : public ::testing::Test {
+	void SetUp() override
+	{
+
+	}
+
+	void TearDown() override
+	{
+
+	}
+};
+
+TEST_F(SwitchTablesTest, CanReadTheIdsOfATable)
+{
+	SwitchTables tables;
+	ULONG slot;
+
+	ASSERT_TRUE(tables.Add(std::vector<ULONG>{ 101, 0, 102 }, slot));
+
+	auto pTable = tables.GetTable(slot);
+	ASSERT_EQ(101u, pTable[0]);
+	ASSERT_EQ(0u, pTable[1]);
+	ASSERT_EQ(102u, pTable[2]);
+	ASSERT_EQ(101u, tables.GetId(slot));
+	ASSERT_EQ(102u, tables.GetId(slot + 2));
+}
+
+TEST_F(SwitchTablesTest, TablesDoNotOverlap)
+{
+	SwitchTables tables;
+	ULONG first, second;
+
+	ASSERT_TRUE(tables.Add(std::vector<ULONG>{ 1, 2 }, first));
+	ASSERT_TRUE(tables.Add(std::vector<ULONG>{ 3, 4, 5 }, second));
+
+	ASSERT_EQ(first + 2, second);
+	ASSERT_EQ(2u, tables.GetId(first + 1));
+	ASSERT_EQ(3u, tables.GetId(second));
+}
+
+TEST_F(SwitchTablesTest, UnallocatedSlotsHaveNoId)
+{
+	SwitchTables tables;
+	ULONG slot;
+
+	ASSERT_EQ(0u, tables.GetId(0));
+
+	ASSERT_TRUE(tables.Add(std::vector<ULONG>{ 1, 2 }, slot));
+	ASSERT_EQ(0u, tables.GetId(slot + 2));
+	ASSERT_EQ(0u, tables.GetId(SWITCH_TABLE_BLOCK_SIZE * SWITCH_TABLE_MAXIMUM_BLOCKS));
+}
+
+TEST_F(SwitchTablesTest, TableThatDoesNotFitStartsTheNextBlock)
+{
+	SwitchTables tables;
+	ULONG first, second;
+
+	ASSERT_TRUE(tables.Add(std::vector<ULONG>(SWITCH_TABLE_BLOCK_SIZE - 1, 7), first));
+	ASSERT_TRUE(tables.Add(std::vector<ULONG>{ 8, 9 }, second));
+
+	ASSERT_EQ(0u, first);
+	ASSERT_EQ(static_cast<ULONG>(SWITCH_TABLE_BLOCK_SIZE), second);
+	ASSERT_EQ(9u, tables.GetTable(second)[1]);
+}
+
+TEST_F(SwitchTablesTest, TableLargerThanABlockIsRefused)
+{
+	SwitchTables tables;
+	ULONG slot;
+
+	ASSERT_FALSE(tables.Add(std::vector<ULONG>(SWITCH_TABLE_BLOCK_SIZE + 1, 7), slot));
+	ASSERT_FALSE(tables.Add(std::vector<ULONG>(), slot));
+}
@@ -0,0 +1,169 @@
+#include "../OpenCover.Weaver/stdafx.h"
+#include "../OpenCover.Weaver/CounterFile.h"
+#include "../OpenCover.Weaver/Metadata.h"
+#include "../OpenCover.Weaver/PointsFile.h"
+
+#include <gtest/gtest.h>
+
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#include <random>
+#include <sstream>
+
+// NOTE: These only need the file formats of the weaver, not the rewriter or the cor headers, so they are
+// also built (with the weaver's CMakeLists.txt) and run on other platforms; hence no precompiled header
+using namespace Weaving;
+
+class WeaverFormatsTest : public ::testing::Test {
+	void SetUp() override
+	{
+
+	}
+
+	void TearDown() override
+	{
+
+	}
+
+protected:
+	// a file of the test's own under gtest's temporary directory; the random part keeps runs of the
+	// tests side by side (e.g. by ctest -j) from sharing it
+	static std::string GetTempFilePath()
+	{
+		std::random_device random;
+		std::ostringstream path;
+		path << ::testing::TempDir() << ::testing::UnitTest::GetInstance()->current_test_info()->name()
+			<< "_" << std::hex << random() << random() << ".bin";
+		return path.str();
+	}
+
+	// see Samples\WeaverSample.cs
+	static std::vector<uint8_t> ReadSample()
+	{
+		std::string path(__FILE__);
+		path = path.substr(0, path.find_last_of("\\/") + 1) + "Samples/WeaverSample.dll";
+		std::ifstream in(path, std::ios::binary);
+		EXPECT_TRUE(static_cast<bool>(in)) << path;
+		return std::vector<uint8_t>(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+	}
+
+	static Metadata ReadMetadata(const PeImage& image)
+	{
+		return Metadata(image.GetData(image.GetMetadataRva(), image.GetMetadataSize()), image.GetMetadataSize());
+	}
+};
+
+TEST_F(WeaverFormatsTest, ReadPoints_GroupsThePointsByMethod_InOffsetOrder)
+{
+	std::istringstream in(
+		"# a comment\n"
+		"method 0x06000002\n"
+		"seq 2 0x10\n"
+		"seq 1 0\n"
+		"\n"
+		"method 100663297\n"
+		"branch 4 8 1\n"
+		"branch 3 8 0\n");
+
+	auto methods = ReadPoints(in);
+
+	ASSERT_EQ(2, methods.size());
+	ASSERT_EQ(0x06000002, methods[0].functionToken);
+	ASSERT_EQ(2, methods[0].seqPoints.size());
+	ASSERT_EQ(1, methods[0].seqPoints[0].UniqueId);
+	ASSERT_EQ(0x10, methods[0].seqPoints[1].Offset);
+	ASSERT_EQ(0x06000001, methods[1].functionToken);
+	ASSERT_EQ(2, methods[1].brPoints.size());
+	ASSERT_EQ(0, methods[1].brPoints[0].Path);
+	ASSERT_EQ(3, methods[1].brPoints[0].UniqueId);
+}
+
+TEST_F(WeaverFormatsTest, ReadPoints_Throws_WhenALineIsMalformed)
+{
+	std::istringstream noMethod("seq 1 0\n");
+	std::istringstream noPath("method 0x06000001\nbranch 1 0\n");
+
+	ASSERT_THROW(ReadPoints(noMethod), std::runtime_error);
+	ASSERT_THROW(ReadPoints(noPath), std::runtime_error);
+}
+
+TEST_F(WeaverFormatsTest, Metadata_IsUnchanged_WhenWrittenAgain)
+{
+	PeImage image(ReadSample());
+	auto metadata = ReadMetadata(image);
+
+	auto written = metadata.Write();
+	Metadata reread(written.data(), static_cast<uint32_t>(written.size()));
+
+	for (auto table = 0; table < TBL_Count; table++)
+		ASSERT_EQ(metadata.GetRowCount(static_cast<TableId>(table)), reread.GetRowCount(static_cast<TableId>(table)));
+	ASSERT_EQ(metadata.GetValue(TBL_MethodDef, 1, MethodDef_RVA), reread.GetValue(TBL_MethodDef, 1, MethodDef_RVA));
+	ASSERT_EQ("Count", reread.GetString(reread.GetValue(TBL_MethodDef, 1, MethodDef_Name)));
+	ASSERT_EQ(metadata.GetBlob(metadata.GetValue(TBL_MethodDef, 1, MethodDef_Signature)),
+		reread.GetBlob(reread.GetValue(TBL_MethodDef, 1, MethodDef_Signature)));
+}
+
+TEST_F(WeaverFormatsTest, Metadata_WidensTheIndexes_WhenATableOutgrowsThem)
+{
+	PeImage image(ReadSample());
+	auto metadata = ReadMetadata(image);
+	auto name = metadata.AddString("Type");
+	auto typeRefs = metadata.GetRowCount(TBL_TypeRef);
+
+	// MemberRef.Class (a MemberRefParent, 3 bit tag) goes to 4 bytes above 2^13 TypeRef rows
+	for (uint32_t i = typeRefs; i < 0x2100; i++)
+		metadata.AddRow(TBL_TypeRef, { 0, name, 0 });
+
+	auto written = metadata.Write();
+	Metadata reread(written.data(), static_cast<uint32_t>(written.size()));
+
+	ASSERT_EQ(0x2100, reread.GetRowCount(TBL_TypeRef));
+	ASSERT_EQ("Type", reread.GetString(reread.GetValue(TBL_TypeRef, 0x2100, TypeRef_TypeName)));
+	ASSERT_EQ(metadata.GetValue(TBL_MemberRef, 1, MemberRef_Class), reread.GetValue(TBL_MemberRef, 1, MemberRef_Class));
+	ASSERT_EQ("Count", reread.GetString(reread.GetValue(TBL_MethodDef, 1, MethodDef_Name)));
+}
+
+TEST_F(WeaverFormatsTest, Metadata_Throws_WhenARowIsAddedToASortedTable)
+{
+	PeImage image(ReadSample());
+	auto metadata = ReadMetadata(image);
+
+	ASSERT_THROW(metadata.AddRow(TBL_CustomAttribute, { 0, 0, 0 }), std::invalid_argument);
+}
+
+TEST_F(WeaverFormatsTest, PeImage_Throws_WhenTheImageIsNotManaged)
+{
+	std::vector<uint8_t> notAnImage(0x100, 0);
+
+	ASSERT_THROW(PeImage image(notAnImage), BadImageException);
+}
+
+TEST_F(WeaverFormatsTest, PrepareCounterFile_GrowsTheFile_AndKeepsTheCounters)
+{
+	auto path = GetTempFilePath();
+	uint32_t count = 0;
+
+	ASSERT_TRUE(PrepareCounterFile(path, 2));
+	ASSERT_TRUE(ReadCounterFile(path, count));
+	ASSERT_EQ(2, count);
+
+	{
+		std::fstream file(path, std::ios::binary | std::ios::in | std::ios::out);
+		file.seekp(COUNTER_FILE_HEADER_SIZE + 4);
+		file.write("\x07\0\0\0", 4);
+	}
+
+	ASSERT_TRUE(PrepareCounterFile(path, 4));
+	ASSERT_TRUE(PrepareCounterFile(path, 3));
+	ASSERT_TRUE(ReadCounterFile(path, count));
+	ASSERT_EQ(4, count);
+
+	std::ifstream in(path, std::ios::binary);
+	std::vector<uint8_t> content((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+	in.close();
+	std::remove(path.c_str());
+	ASSERT_EQ(COUNTER_FILE_HEADER_SIZE + (4 * sizeof(uint32_t)), content.size());
+	ASSERT_EQ(7, ReadUInt32(&content[COUNTER_FILE_HEADER_SIZE + 4]));
+	ASSERT_EQ(0, ReadUInt32(&content[COUNTER_FILE_HEADER_SIZE + 12]));
+}
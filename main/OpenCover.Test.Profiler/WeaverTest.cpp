@@ -0,0 +1,127 @@
+#include "stdafx.h"
+#include "..\OpenCover.Profiler\Method.h"
+#include "..\OpenCover.Weaver\AssemblyWeaver.h"
+#include "..\OpenCover.Weaver\PointsFile.h"
+
+#include <fstream>
+#include <iterator>
+#include <sstream>
+
+using namespace Weaving;
+
+class WeaverTest : public ::testing::Test {
+	void SetUp() override
+	{
+
+	}
+
+	void TearDown() override
+	{
+
+	}
+
+protected:
+	// see Samples\WeaverSample.cs
+	static std::vector<uint8_t> ReadSample()
+	{
+		std::string path(__FILE__);
+		path = path.substr(0, path.find_last_of("\\/") + 1) + "Samples/WeaverSample.dll";
+		std::ifstream in(path, std::ios::binary);
+		EXPECT_TRUE(static_cast<bool>(in)) << path;
+		return std::vector<uint8_t>(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+	}
+
+	static SupportAssembly CreateSupport()
+	{
+		SupportAssembly support;
+		support.name = "OpenCover.Support";
+		support.majorVersion = 4;
+		support.publicKey = { 0x00, 0x24, 0x00, 0x00 };
+		return support;
+	}
+
+	static Metadata ReadMetadata(const PeImage& image)
+	{
+		return Metadata(image.GetData(image.GetMetadataRva(), image.GetMetadataSize()), image.GetMetadataSize());
+	}
+
+	static std::vector<uint8_t> GetBody(const PeImage& image, uint32_t rva)
+	{
+		auto pBody = image.GetData(rva, 12);
+		auto codeSize = ReadUInt32(pBody + 4);
+		pBody = image.GetData(rva, 12 + codeSize);
+		return std::vector<uint8_t>(pBody + 12, pBody + 12 + codeSize);
+	}
+
+	// the points of WeaverSample.Count: the foreach loop and the if
+	static MethodPoints CreateCountPoints()
+	{
+		std::istringstream in("method 0x06000001\nseq 1 0\nbranch 2 21 0\nbranch 3 21 1\nbranch 4 35 0\nbranch 5 35 1\n");
+		return ReadPoints(in)[0];
+	}
+};
+
+TEST_F(WeaverTest, WeaveMethod_CallsVisit_WithTheIdOfEachPoint)
+{
+	PeImage original(ReadSample());
+	AssemblyWeaver weaver(original.GetImage(), CreateSupport());
+	auto points = CreateCountPoints();
+
+	ASSERT_TRUE(weaver.WeaveMethod(points.functionToken, points.seqPoints, points.brPoints));
+	PeImage woven(weaver.Write());
+
+	auto metadata = ReadMetadata(woven);
+	auto rva = metadata.GetValue(TBL_MethodDef, 1, MethodDef_RVA);
+	ASSERT_EQ(original.GetNextSectionRva(), rva);
+	auto body = GetBody(woven, rva);
+	auto visit = weaver.GetVisitMethod();
+	ASSERT_EQ(0x0A000000, visit & 0xFF000000);
+
+	// ldc.i4 1, call Visit
+	ASSERT_EQ(CEE_LDC_I4, body[0]);
+	ASSERT_EQ(1, ReadUInt32(&body[1]));
+	ASSERT_EQ(CEE_CALL, body[5]);
+	ASSERT_EQ(visit, ReadUInt32(&body[6]));
+	auto calls = 0;
+	for (size_t i = 0; i + 5 <= body.size(); i++)
+	{
+		if (body[i] == CEE_CALL && ReadUInt32(&body[i + 1]) == visit)
+			calls++;
+	}
+	ASSERT_EQ(5, calls);
+
+	auto row = visit & 0x00FFFFFF;
+	ASSERT_EQ("Visit", metadata.GetString(metadata.GetValue(TBL_MemberRef, row, MemberRef_Name)));
+	auto typeRef = metadata.GetValue(TBL_MemberRef, row, MemberRef_Class) >> 3;
+	ASSERT_EQ("Counters", metadata.GetString(metadata.GetValue(TBL_TypeRef, typeRef, TypeRef_TypeName)));
+	auto assemblyRef = metadata.GetValue(TBL_TypeRef, typeRef, TypeRef_ResolutionScope) >> 2;
+	ASSERT_EQ("OpenCover.Support", metadata.GetString(metadata.GetValue(TBL_AssemblyRef, assemblyRef, AssemblyRef_Name)));
+	ASSERT_EQ(CreateSupport().publicKey, metadata.GetBlob(metadata.GetValue(TBL_AssemblyRef, assemblyRef, AssemblyRef_PublicKeyOrToken)));
+
+	// the method that was not woven keeps its body
+	ASSERT_EQ(ReadMetadata(original).GetValue(TBL_MethodDef, 2, MethodDef_RVA), metadata.GetValue(TBL_MethodDef, 2, MethodDef_RVA));
+}
+
+TEST_F(WeaverTest, AssemblyWeaver_ReusesTheReferences_OfAnAssemblyWovenBefore)
+{
+	AssemblyWeaver first(ReadSample(), CreateSupport());
+	auto once = first.Write();
+	auto onceMetadata = ReadMetadata(PeImage(once));
+
+	AssemblyWeaver second(once, CreateSupport());
+	auto twice = second.Write();
+	auto twiceMetadata = ReadMetadata(PeImage(twice));
+
+	ASSERT_EQ(first.GetVisitMethod(), second.GetVisitMethod());
+	ASSERT_EQ(onceMetadata.GetRowCount(TBL_AssemblyRef), twiceMetadata.GetRowCount(TBL_AssemblyRef));
+	ASSERT_EQ(onceMetadata.GetRowCount(TBL_TypeRef), twiceMetadata.GetRowCount(TBL_TypeRef));
+	ASSERT_EQ(onceMetadata.GetRowCount(TBL_MemberRef), twiceMetadata.GetRowCount(TBL_MemberRef));
+}
+
+TEST_F(WeaverTest, WeaveMethod_Throws_WhenThereIsNoMethodWithTheToken)
+{
+	AssemblyWeaver weaver(ReadSample(), CreateSupport());
+
+	ASSERT_THROW(weaver.WeaveMethod(0x06000100, SequencePointSpan(), BranchPointSpan()), BadImageException);
+	ASSERT_THROW(weaver.WeaveMethod(0x02000001, SequencePointSpan(), BranchPointSpan()), BadImageException);
+}
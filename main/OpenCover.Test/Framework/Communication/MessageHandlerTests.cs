@@ -526,6 +526,160 @@ namespace OpenCover.Test.Framework.Communication
             Assert.AreEqual(false, response.track);
         }
 
+        [Test]
+        public void Handles_MSG_ReportCoverageLevel()
+        {
+            // arrange 
+            Container.GetMock<IMarshalWrapper>()
+                .Setup(x => x.PtrToStructure<MSG_ReportCoverageLevel_Request>(It.IsAny<IntPtr>()))
+                .Returns(new MSG_ReportCoverageLevel_Request { level = 1, probes = 10 });
+
+            // act
+            Instance.StandardMessage(MSG_Type.MSG_ReportCoverageLevel, _mockCommunicationBlock.Object, (i, block) => { }, block => { });
+
+            // assert
+            Container.GetMock<IProfilerCommunication>()
+                .Verify(x => x.ReportCoverageLevel(It.IsAny<string>(), It.IsAny<string>(), It.IsAny<int>(), 1, 10, It.IsAny<uint>(), It.IsAny<uint>()), Times.Once());
+        }
+
+        [Test]
+        public void ExceptionDuring_MSG_ReportCoverageLevel_ReturnsDoneAsFalse()
+        {
+            // arrange 
+            Container.GetMock<IMarshalWrapper>()
+                .Setup(x => x.PtrToStructure<MSG_ReportCoverageLevel_Request>(It.IsAny<IntPtr>()))
+                .Returns(new MSG_ReportCoverageLevel_Request());
+
+            var response = new MSG_ReportCoverageLevel_Response { done = true };
+            Container.GetMock<IMarshalWrapper>()
+                .Setup(x => x.StructureToPtr(It.IsAny<MSG_ReportCoverageLevel_Response>(), It.IsAny<IntPtr>(), It.IsAny<bool>()))
+                .Callback<MSG_ReportCoverageLevel_Response, IntPtr, bool>((msg, ptr, b) => { response = msg; });
+
+            Container.GetMock<IProfilerCommunication>()
+                .Setup(x => x.ReportCoverageLevel(It.IsAny<string>(), It.IsAny<string>(), It.IsAny<int>(), It.IsAny<uint>(), It.IsAny<uint>(), It.IsAny<uint>(), It.IsAny<uint>()))
+                .Throws<NullReferenceException>();
+
+            // act
+            Instance.StandardMessage(MSG_Type.MSG_ReportCoverageLevel, _mockCommunicationBlock.Object,
+                (i, block) => { },
+                block => { });
+
+            // assert
+            Assert.AreEqual(false, response.done);
+        }
+
+        [Test]
+        public void Handles_MSG_AllocateUniqueIds()
+        {
+            // arrange 
+            Container.GetMock<IMarshalWrapper>()
+                .Setup(x => x.PtrToStructure<MSG_AllocateUniqueIds_Request>(It.IsAny<IntPtr>()))
+                .Returns(new MSG_AllocateUniqueIds_Request { functionToken = 1, sequencePoints = 3, branchPoints = 2, pointsHash = 42 });
+
+            var response = new MSG_AllocateUniqueIds_Response();
+            Container.GetMock<IMarshalWrapper>()
+                .Setup(x => x.StructureToPtr(It.IsAny<MSG_AllocateUniqueIds_Response>(), It.IsAny<IntPtr>(), It.IsAny<bool>()))
+                .Callback<MSG_AllocateUniqueIds_Response, IntPtr, bool>((msg, ptr, b) => { response = msg; });
+
+            uint entryPointId = 7, firstSequenceId = 1, firstBranchId = 4;
+            Container.GetMock<IProfilerCommunication>()
+                .Setup(x => x.AllocateUniqueIds(It.IsAny<string>(), It.IsAny<string>(), It.IsAny<string>(), 1, 3, 2, 42,
+                    out entryPointId, out firstSequenceId, out firstBranchId))
+                .Returns(true);
+
+            // act
+            Instance.StandardMessage(MSG_Type.MSG_AllocateUniqueIds, _mockCommunicationBlock.Object, (i, block) => { }, block => { });
+
+            // assert
+            Assert.IsTrue(response.allocated);
+            Assert.AreEqual(7, response.entryPointId);
+            Assert.AreEqual(1, response.firstSequenceId);
+            Assert.AreEqual(4, response.firstBranchId);
+        }
+
+        [Test]
+        public void ExceptionDuring_MSG_AllocateUniqueIds_ReturnsAllocatedAsFalse()
+        {
+            // arrange 
+            Container.GetMock<IMarshalWrapper>()
+                .Setup(x => x.PtrToStructure<MSG_AllocateUniqueIds_Request>(It.IsAny<IntPtr>()))
+                .Returns(new MSG_AllocateUniqueIds_Request());
+
+            var response = new MSG_AllocateUniqueIds_Response { allocated = true };
+            Container.GetMock<IMarshalWrapper>()
+                .Setup(x => x.StructureToPtr(It.IsAny<MSG_AllocateUniqueIds_Response>(), It.IsAny<IntPtr>(), It.IsAny<bool>()))
+                .Callback<MSG_AllocateUniqueIds_Response, IntPtr, bool>((msg, ptr, b) => { response = msg; });
+
+            uint id;
+            Container.GetMock<IProfilerCommunication>()
+                .Setup(x => x.AllocateUniqueIds(It.IsAny<string>(), It.IsAny<string>(), It.IsAny<string>(), It.IsAny<int>(), It.IsAny<uint>(), It.IsAny<uint>(), It.IsAny<uint>(),
+                    out id, out id, out id))
+                .Throws<NullReferenceException>();
+
+            // act
+            Instance.StandardMessage(MSG_Type.MSG_AllocateUniqueIds, _mockCommunicationBlock.Object,
+                (i, block) => { },
+                block => { });
+
+            // assert
+            Assert.AreEqual(false, response.allocated);
+        }
+
+        [Test]
+        public void Handles_MSG_SendVisitCounts()
+        {
+            // arrange 
+            Container.GetMock<IMarshalWrapper>()
+                .Setup(x => x.PtrToStructure<MSG_SendVisitCounts_Request>(It.IsAny<IntPtr>()))
+                .Returns(new MSG_SendVisitCounts_Request { count = 2 });
+            Container.GetMock<IMarshalWrapper>()
+                .Setup(x => x.PtrToStructure<MSG_VisitCount>(It.IsAny<IntPtr>()))
+                .Returns(new MSG_VisitCount { uniqueId = 5, visits = 100 });
+
+            var response = new MSG_SendVisitCounts_Response();
+            Container.GetMock<IMarshalWrapper>()
+                .Setup(x => x.StructureToPtr(It.IsAny<MSG_SendVisitCounts_Response>(), It.IsAny<IntPtr>(), It.IsAny<bool>()))
+                .Callback<MSG_SendVisitCounts_Response, IntPtr, bool>((msg, ptr, b) => { response = msg; });
+
+            Container.GetMock<IProfilerCommunication>()
+                .Setup(x => x.AddVisitCount(It.IsAny<uint>(), It.IsAny<uint>()))
+                .Returns(true);
+
+            // act
+            Instance.StandardMessage(MSG_Type.MSG_SendVisitCounts, _mockCommunicationBlock.Object, (i, block) => { }, block => { });
+
+            // assert
+            Container.GetMock<IProfilerCommunication>()
+                .Verify(x => x.AddVisitCount(5, 100), Times.Exactly(2));
+            Assert.AreEqual(true, response.done);
+        }
+
+        [Test]
+        public void ExceptionDuring_MSG_SendVisitCounts_ReturnsDoneAsFalse()
+        {
+            // arrange 
+            Container.GetMock<IMarshalWrapper>()
+                .Setup(x => x.PtrToStructure<MSG_SendVisitCounts_Request>(It.IsAny<IntPtr>()))
+                .Returns(new MSG_SendVisitCounts_Request { count = 1 });
+
+            var response = new MSG_SendVisitCounts_Response { done = true };
+            Container.GetMock<IMarshalWrapper>()
+                .Setup(x => x.StructureToPtr(It.IsAny<MSG_SendVisitCounts_Response>(), It.IsAny<IntPtr>(), It.IsAny<bool>()))
+                .Callback<MSG_SendVisitCounts_Response, IntPtr, bool>((msg, ptr, b) => { response = msg; });
+
+            Container.GetMock<IProfilerCommunication>()
+                .Setup(x => x.AddVisitCount(It.IsAny<uint>(), It.IsAny<uint>()))
+                .Throws<NullReferenceException>();
+
+            // act
+            Instance.StandardMessage(MSG_Type.MSG_SendVisitCounts, _mockCommunicationBlock.Object,
+                (i, block) => { },
+                block => { });
+
+            // assert
+            Assert.AreEqual(false, response.done);
+        }
+
         [Test]
         public void Unsupported_MSG_Type_Throws_Exception()
         {
@@ -1,4 +1,5 @@
-﻿using Mono.Cecil;
+﻿using System.Linq;
+using Mono.Cecil;
 using Moq;
 using NUnit.Framework;
 using OpenCover.Framework;
@@ -434,5 +435,130 @@ namespace OpenCover.Test.Framework.Service
             // assert
             Assert.AreEqual(expected, response);
         }
+
+        [Test]
+        public void ReportCoverageLevel_IsAccepted_AndLooksUpTheClass()
+        {
+            // arrange
+            Container.GetMock<IPersistance>().Setup(x => x.GetClassFullName(It.IsAny<string>(), It.IsAny<int>())).Returns("Namespace.Class");
+
+            // action
+            var response = Instance.ReportCoverageLevel("moduleName", "assemblyName", 0x06000001, 1, 100, 200, 1200);
+
+            // assert
+            Assert.IsTrue(response);
+            Container.GetMock<IPersistance>().Verify(x => x.GetClassFullName("moduleName", 0x06000001), Times.Once());
+        }
+
+        [Test]
+        public void AddVisitCount_AddsTheVisitsToThePoint()
+        {
+            // arrange
+            InstrumentationPoint.Clear();
+            var point = new SequencePoint();
+
+            // action
+            var response = Instance.AddVisitCount(point.UniqueSequencePoint, 1000);
+
+            // assert
+            Assert.IsTrue(response);
+            Assert.AreEqual(1000, InstrumentationPoint.GetVisitCount(point.UniqueSequencePoint));
+        }
+
+        [Test]
+        public void AddVisitCount_Fails_ForAnUnknownPoint()
+        {
+            // arrange
+            InstrumentationPoint.Clear();
+
+            // action
+            var response = Instance.AddVisitCount(1000000, 1);
+
+            // assert
+            Assert.IsFalse(response);
+        }
+
+        private void SetupPointsForAllocation(InstrumentationPoint[] points, BranchPoint[] branches, bool instrumentClass = true)
+        {
+            Container.GetMock<IPersistance>()
+                .Setup(x => x.GetSequencePointsForFunction(It.IsAny<string>(), It.IsAny<int>(), out points))
+                .Returns(true);
+            Container.GetMock<IPersistance>()
+                .Setup(x => x.GetBranchPointsForFunction(It.IsAny<string>(), It.IsAny<int>(), out branches))
+                .Returns(branches.Length > 0);
+            Container.GetMock<IFilter>()
+               .Setup(x => x.InstrumentClass(It.IsAny<string>(), It.IsAny<string>(), It.IsAny<string>()))
+               .Returns(instrumentClass);
+        }
+
+        [Test]
+        public void AllocateUniqueIds_Returns_TheFirstIds_When_ThePointsAreTheSame()
+        {
+            // arrange
+            var seqPoints = new[] { new SequencePoint { Offset = 2, UniqueSequencePoint = 10 }, new SequencePoint { Offset = 5, UniqueSequencePoint = 11 } };
+            var branches = new[] { new BranchPoint { Offset = 3, Path = 0, UniqueSequencePoint = 12 }, new BranchPoint { Offset = 3, Path = 1, UniqueSequencePoint = 13 } };
+            var entryPoint = new InstrumentationPoint { UniqueSequencePoint = 14 };
+            SetupPointsForAllocation(new[] { entryPoint }.Concat(seqPoints).ToArray(), branches);
+
+            // act
+            uint entryPointId, firstSequenceId, firstBranchId;
+            var result = Instance.AllocateUniqueIds("processName", "moduleName", "moduleName", 1, 2, 2, PointsHash.Compute(seqPoints, branches),
+                out entryPointId, out firstSequenceId, out firstBranchId);
+
+            // assert
+            Assert.IsTrue(result);
+            Assert.AreEqual(14, entryPointId);
+            Assert.AreEqual(10, firstSequenceId);
+            Assert.AreEqual(12, firstBranchId);
+        }
+
+        [Test]
+        public void AllocateUniqueIds_Returns_False_When_ThePointsAreNotTheSame()
+        {
+            // arrange
+            var seqPoints = new[] { new SequencePoint { Offset = 0, UniqueSequencePoint = 10 }, new SequencePoint { Offset = 5, UniqueSequencePoint = 11 } };
+            SetupPointsForAllocation(seqPoints, new BranchPoint[0]);
+            var hash = PointsHash.Compute(seqPoints, new BranchPoint[0]);
+
+            // act
+            uint entryPointId, firstSequenceId, firstBranchId;
+            var wrongHash = Instance.AllocateUniqueIds("processName", "moduleName", "moduleName", 1, 2, 0, hash + 1,
+                out entryPointId, out firstSequenceId, out firstBranchId);
+            var wrongCount = Instance.AllocateUniqueIds("processName", "moduleName", "moduleName", 1, 2, 1, hash,
+                out entryPointId, out firstSequenceId, out firstBranchId);
+
+            // assert
+            Assert.IsFalse(wrongHash);
+            Assert.IsFalse(wrongCount);
+        }
+
+        [Test]
+        public void AllocateUniqueIds_Returns_False_When_Not_Tracking_Class()
+        {
+            // arrange
+            var seqPoints = new[] { new SequencePoint { Offset = 0, UniqueSequencePoint = 10 } };
+            SetupPointsForAllocation(seqPoints, new BranchPoint[0], false);
+
+            // act
+            uint entryPointId, firstSequenceId, firstBranchId;
+            var result = Instance.AllocateUniqueIds("processName", "moduleName", "moduleName", 1, 1, 0, PointsHash.Compute(seqPoints, new BranchPoint[0]),
+                out entryPointId, out firstSequenceId, out firstBranchId);
+
+            // assert
+            Assert.IsFalse(result);
+            InstrumentationPoint[] points;
+            Container.GetMock<IPersistance>()
+                 .Verify(x => x.GetSequencePointsForFunction(It.IsAny<string>(), It.IsAny<int>(), out points), Times.Never());
+        }
+
+        [Test]
+        public void PointsHash_IsTheHashTheProfilerComputes()
+        {
+            // see HashLocalPoints_IsTheHashTheHostComputes (PortablePdbTest.cpp)
+            var seqPoints = new[] { 0, 1, 3, 4, 10, 14, 15, 32, 36, 41, 47, 52 }.Select(offset => new SequencePoint { Offset = offset });
+            var branches = new[] { 30, 30, 45, 45 }.Select((offset, index) => new BranchPoint { Offset = offset, Path = index % 2 });
+
+            Assert.AreEqual(0xD79E546B, PointsHash.Compute(seqPoints, branches));
+        }
     }
 }
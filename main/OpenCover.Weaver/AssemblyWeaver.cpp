@@ -0,0 +1,163 @@
+#include "stdafx.h"
+#include "AssemblyWeaver.h"
+#include "..\OpenCover.Profiler\Method.h"
+#include "..\OpenCover.Profiler\ProbePolicies.h"
+
+namespace Weaving
+{
+	namespace
+	{
+		const char* VISIT_NAMESPACE = "OpenCover.Support.Weaving";
+		const char* VISIT_TYPE = "Counters";
+		const char* VISIT_METHOD = "Visit";
+
+		// DEFAULT, 1 parameter, returns void, takes uint32
+		const std::vector<uint8_t> VisitSignature = { 0x00, 0x01, 0x01, 0x09 };
+
+		const uint32_t ASSEMBLY_FLAGS_PUBLIC_KEY = 0x0001;
+
+		const uint16_t METHOD_IMPL_CODE_TYPE_MASK = 0x0003;
+		const uint16_t METHOD_IMPL_UNMANAGED = 0x0004;
+		const uint16_t METHOD_IMPL_INTERNAL_CALL = 0x1000;
+
+		const uint32_t TOKEN_TYPE_MASK = 0xFF000000;
+		const uint32_t TOKEN_METHOD_DEF = 0x06000000;
+		const uint32_t TOKEN_MEMBER_REF = 0x0A000000;
+
+		const char* SECTION_NAME = ".cover";
+
+		Metadata ReadMetadata(const PeImage& image)
+		{
+			return Metadata(image.GetData(image.GetMetadataRva(), image.GetMetadataSize()), image.GetMetadataSize());
+		}
+	}
+
+	/// <summary>Read the identity of the support assembly from its image, so that the reference matches the
+	/// assembly that will be loaded</summary>
+	SupportAssembly ReadSupportAssembly(const PeImage& image)
+	{
+		auto metadata = ReadMetadata(image);
+		if (metadata.GetRowCount(TBL_Assembly) != 1)
+			throw BadImageException("the support image is not an assembly");
+
+		SupportAssembly support;
+		support.name = metadata.GetString(metadata.GetValue(TBL_Assembly, 1, Assembly_Name));
+		support.culture = metadata.GetString(metadata.GetValue(TBL_Assembly, 1, Assembly_Culture));
+		support.majorVersion = static_cast<uint16_t>(metadata.GetValue(TBL_Assembly, 1, Assembly_MajorVersion));
+		support.minorVersion = static_cast<uint16_t>(metadata.GetValue(TBL_Assembly, 1, Assembly_MinorVersion));
+		support.buildNumber = static_cast<uint16_t>(metadata.GetValue(TBL_Assembly, 1, Assembly_BuildNumber));
+		support.revisionNumber = static_cast<uint16_t>(metadata.GetValue(TBL_Assembly, 1, Assembly_RevisionNumber));
+		support.publicKey = metadata.GetBlob(metadata.GetValue(TBL_Assembly, 1, Assembly_PublicKey));
+		return support;
+	}
+
+	/// <exception cref="BadImageException">The image cannot be woven.</exception>
+	AssemblyWeaver::AssemblyWeaver(std::vector<uint8_t> image, const SupportAssembly& support)
+		: m_image(std::move(image)), m_metadata(ReadMetadata(m_image))
+	{
+		m_sectionRva = m_image.GetNextSectionRva();
+
+		auto assemblyRef = FindOrAddAssemblyRef(support);
+		auto typeRef = FindOrAddTypeRef((assemblyRef << 2) | ResolutionScope_AssemblyRef, VISIT_NAMESPACE, VISIT_TYPE);
+		m_visitMethod = TOKEN_MEMBER_REF | FindOrAddMemberRef((typeRef << 3) | MemberRefParent_TypeRef, VISIT_METHOD, VisitSignature);
+	}
+
+	uint32_t AssemblyWeaver::FindOrAddAssemblyRef(const SupportAssembly& support)
+	{
+		for (uint32_t row = 1; row <= m_metadata.GetRowCount(TBL_AssemblyRef); row++)
+		{
+			if (m_metadata.GetString(m_metadata.GetValue(TBL_AssemblyRef, row, AssemblyRef_Name)) == support.name)
+				return row;
+		}
+
+		return m_metadata.AddRow(TBL_AssemblyRef, {
+			support.majorVersion, support.minorVersion, support.buildNumber, support.revisionNumber,
+			support.publicKey.empty() ? 0 : ASSEMBLY_FLAGS_PUBLIC_KEY,
+			support.publicKey.empty() ? 0 : m_metadata.AddBlob(support.publicKey),
+			m_metadata.AddString(support.name),
+			support.culture.empty() ? 0 : m_metadata.AddString(support.culture),
+			0 });
+	}
+
+	uint32_t AssemblyWeaver::FindOrAddTypeRef(uint32_t resolutionScope, const std::string& typeNamespace, const std::string& name)
+	{
+		for (uint32_t row = 1; row <= m_metadata.GetRowCount(TBL_TypeRef); row++)
+		{
+			if (m_metadata.GetValue(TBL_TypeRef, row, TypeRef_ResolutionScope) == resolutionScope
+				&& m_metadata.GetString(m_metadata.GetValue(TBL_TypeRef, row, TypeRef_TypeName)) == name
+				&& m_metadata.GetString(m_metadata.GetValue(TBL_TypeRef, row, TypeRef_TypeNamespace)) == typeNamespace)
+				return row;
+		}
+
+		return m_metadata.AddRow(TBL_TypeRef, { resolutionScope, m_metadata.AddString(name), m_metadata.AddString(typeNamespace) });
+	}
+
+	uint32_t AssemblyWeaver::FindOrAddMemberRef(uint32_t parent, const std::string& name, const std::vector<uint8_t>& signature)
+	{
+		for (uint32_t row = 1; row <= m_metadata.GetRowCount(TBL_MemberRef); row++)
+		{
+			if (m_metadata.GetValue(TBL_MemberRef, row, MemberRef_Class) == parent
+				&& m_metadata.GetString(m_metadata.GetValue(TBL_MemberRef, row, MemberRef_Name)) == name
+				&& m_metadata.GetBlob(m_metadata.GetValue(TBL_MemberRef, row, MemberRef_Signature)) == signature)
+				return row;
+		}
+
+		return m_metadata.AddRow(TBL_MemberRef, { parent, m_metadata.AddString(name), m_metadata.AddBlob(signature) });
+	}
+
+	/// <summary>Add the probes for the points to a method</summary>
+	/// <returns>false if the method has no IL body, or already has the probes, in which case it is unchanged.</returns>
+	/// <remarks>Each point has its own probe; the sequence probes are not merged, nor any branch paths derived,
+	/// as the counter file is not expanded by the host afterwards.</remarks>
+	bool AssemblyWeaver::WeaveMethod(mdMethodDef functionToken, SequencePointSpan seqPoints, BranchPointSpan brPoints)
+	{
+		auto row = functionToken & ~TOKEN_TYPE_MASK;
+		if ((functionToken & TOKEN_TYPE_MASK) != TOKEN_METHOD_DEF || row == 0 || row > m_metadata.GetRowCount(TBL_MethodDef))
+			throw BadImageException("there is no method with the token of the points");
+
+		auto rva = m_metadata.GetValue(TBL_MethodDef, row, MethodDef_RVA);
+		auto implFlags = m_metadata.GetValue(TBL_MethodDef, row, MethodDef_ImplFlags);
+		if (rva == 0 || (implFlags & (METHOD_IMPL_CODE_TYPE_MASK | METHOD_IMPL_UNMANAGED | METHOD_IMPL_INTERNAL_CALL)) != 0)
+			return false;
+
+		// make sure the body is in the image before it is read
+		auto pBody = m_image.GetData(rva, 1);
+		if ((pBody[0] & (CorILMethod_FormatMask >> 1)) == CorILMethod_TinyFormat)
+			m_image.GetData(rva, 1 + (pBody[0] >> 2));
+		else
+			m_image.GetData(rva, 12 + ReadUInt32(m_image.GetData(rva, 12) + 4));
+
+		Instrumentation::Method method(reinterpret_cast<IMAGE_COR_ILMETHOD*>(const_cast<uint8_t*>(pBody)));
+		method.IncrementStackSize(2);
+
+		std::vector<ULONG> probes;
+		probes.reserve(seqPoints.size());
+		for (const auto& point : seqPoints)
+			probes.push_back(point.UniqueId);
+		if (!CoverageInstrumentation::AddCoverage(CoverageInstrumentation::CallProbe(m_visitMethod), method, seqPoints, brPoints, probes))
+			return false;
+		method.OptimizeEncoding();
+
+		// fat headers (and sections) are 4 byte aligned
+		auto offset = Align(static_cast<uint32_t>(m_bodies.size()), 4);
+		m_bodies.resize(offset + method.GetMethodSize());
+		method.WriteMethod(reinterpret_cast<IMAGE_COR_ILMETHOD*>(&m_bodies[offset]));
+		m_metadata.SetValue(TBL_MethodDef, row, MethodDef_RVA, m_sectionRva + offset);
+		return true;
+	}
+
+	/// <summary>The woven image</summary>
+	/// <remarks>Called once, after every method has been woven.</remarks>
+	std::vector<uint8_t> AssemblyWeaver::Write()
+	{
+		auto section = m_bodies;
+		section.resize(Align(static_cast<uint32_t>(section.size()), 4), 0);
+		auto metadataOffset = static_cast<uint32_t>(section.size());
+		auto metadata = m_metadata.Write();
+		section.insert(section.end(), metadata.begin(), metadata.end());
+
+		m_image.AddSection(SECTION_NAME, section);
+		m_image.SetMetadata(m_sectionRva + metadataOffset, static_cast<uint32_t>(metadata.size()));
+		return m_image.GetImage();
+	}
+}
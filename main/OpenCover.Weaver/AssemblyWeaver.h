@@ -0,0 +1,60 @@
+#pragma once
+
+#include "Metadata.h"
+#include "..\OpenCover.Profiler\PointSpan.h"
+
+namespace Weaving
+{
+	/// <summary>The identity of the assembly hosting the method the probes call (<c>OpenCover.Support</c>)</summary>
+	struct SupportAssembly
+	{
+		SupportAssembly() : majorVersion(0), minorVersion(0), buildNumber(0), revisionNumber(0) {}
+
+		std::string name;
+		std::string culture;
+		uint16_t majorVersion;
+		uint16_t minorVersion;
+		uint16_t buildNumber;
+		uint16_t revisionNumber;
+		std::vector<uint8_t> publicKey;
+	};
+
+	SupportAssembly ReadSupportAssembly(const PeImage& image);
+
+	/// <summary>Instrument the methods of an assembly in the file, rather than as each is compiled, so that the
+	/// profiler (and host) are not needed when it is run</summary>
+	/// <remarks><para>The probes call <c>OpenCover.Support.Weaving.Counters.Visit(uint)</c> with the unique id of
+	/// the point, which counts the visit in a memory mapped counter file (see <c>PrepareCounterFile</c>); a
+	/// reference to it is added to the metadata.</para>
+	/// <para>The rewritten bodies, and the metadata, are added to the image in a new section, and the
+	/// <c>MethodDef</c> rows pointed at them; the original bodies are left where they are.</para></remarks>
+	class AssemblyWeaver
+	{
+	public:
+		AssemblyWeaver(std::vector<uint8_t> image, const SupportAssembly& support);
+
+	private:
+		AssemblyWeaver(const AssemblyWeaver&) = delete;
+		AssemblyWeaver& operator = (const AssemblyWeaver&) = delete;
+
+	public:
+		bool WeaveMethod(mdMethodDef functionToken, SequencePointSpan seqPoints, BranchPointSpan brPoints);
+		std::vector<uint8_t> Write();
+
+		mdMemberRef GetVisitMethod() const { return m_visitMethod; }
+
+	private:
+		uint32_t FindOrAddAssemblyRef(const SupportAssembly& support);
+		uint32_t FindOrAddTypeRef(uint32_t resolutionScope, const std::string& typeNamespace, const std::string& name);
+		uint32_t FindOrAddMemberRef(uint32_t parent, const std::string& name, const std::vector<uint8_t>& signature);
+
+	private:
+		PeImage m_image;
+		Metadata m_metadata;
+		mdMemberRef m_visitMethod;
+
+		// the rewritten bodies, each at its RVA less that of the new section
+		std::vector<uint8_t> m_bodies;
+		uint32_t m_sectionRva;
+	};
+}
@@ -0,0 +1,53 @@
+#include "stdafx.h"
+#include "CounterFile.h"
+#include "PeImage.h"
+
+#include <fstream>
+#include <vector>
+
+namespace Weaving
+{
+	/// <summary>Read the number of counters in a counter file</summary>
+	/// <returns>false if there is no counter file at the path.</returns>
+	bool ReadCounterFile(const std::string& path, uint32_t& count)
+	{
+		std::ifstream in(path, std::ios::binary);
+		uint8_t header[COUNTER_FILE_HEADER_SIZE];
+		if (!in.read(reinterpret_cast<char*>(header), sizeof(header))
+			|| ReadUInt32(header) != COUNTER_FILE_SIGNATURE || ReadUInt32(header + 4) != COUNTER_FILE_VERSION)
+			return false;
+		count = ReadUInt32(header + 8);
+		return true;
+	}
+
+	/// <summary>Make sure there is a counter file with (at least) a counter for each unique id below
+	/// <paramref name="count"/></summary>
+	/// <remarks>The counters of an existing file are kept, so that the assemblies woven from the same points
+	/// can share a file; it is only grown, with the new counters zeroed.</remarks>
+	bool PrepareCounterFile(const std::string& path, uint32_t count)
+	{
+		uint32_t existing;
+		if (!ReadCounterFile(path, existing))
+		{
+			std::ofstream out(path, std::ios::binary | std::ios::trunc);
+			existing = 0;
+			uint8_t header[COUNTER_FILE_HEADER_SIZE] = {};
+			WriteUInt32(header, COUNTER_FILE_SIGNATURE);
+			WriteUInt32(header + 4, COUNTER_FILE_VERSION);
+			if (!out.write(reinterpret_cast<const char*>(header), sizeof(header)))
+				return false;
+		}
+		if (existing >= count)
+			return true;
+
+		std::fstream file(path, std::ios::binary | std::ios::in | std::ios::out);
+		std::vector<char> counters((count - existing) * sizeof(uint32_t), 0);
+		uint8_t newCount[4];
+		WriteUInt32(newCount, count);
+		file.seekp(COUNTER_FILE_HEADER_SIZE + (static_cast<std::streamoff>(existing) * sizeof(uint32_t)));
+		file.write(counters.data(), counters.size());
+		file.seekp(8);
+		file.write(reinterpret_cast<const char*>(newCount), sizeof(newCount));
+		return static_cast<bool>(file);
+	}
+}
@@ -0,0 +1,18 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+namespace Weaving
+{
+	/// <summary>The file the probes of woven assemblies count the visits of each point in, through a memory mapping
+	/// (see <c>OpenCover.Support.Weaving.Counters</c>)</summary>
+	/// <remarks>The file is a 16 byte header, <c>COUNTER_FILE_SIGNATURE</c>, <c>COUNTER_FILE_VERSION</c>, the number
+	/// of counters and a reserved word, followed by a 32 bit counter per unique id; all little endian.</remarks>
+	const uint32_t COUNTER_FILE_SIGNATURE = 0x4356434F; // "OCVC"
+	const uint32_t COUNTER_FILE_VERSION = 1;
+	const uint32_t COUNTER_FILE_HEADER_SIZE = 16;
+
+	bool PrepareCounterFile(const std::string& path, uint32_t count);
+	bool ReadCounterFile(const std::string& path, uint32_t& count);
+}
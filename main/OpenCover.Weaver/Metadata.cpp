@@ -0,0 +1,479 @@
+#include "stdafx.h"
+#include "Metadata.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+
+namespace Weaving
+{
+	namespace
+	{
+		const uint32_t METADATA_SIGNATURE = 0x424A5342;
+
+		const uint8_t HEAP_STRING_4 = 0x01;
+		const uint8_t HEAP_GUID_4 = 0x02;
+		const uint8_t HEAP_BLOB_4 = 0x04;
+
+		// column types; a simple index is COL_Index + the table, a coded index COL_Coded + the coded index
+		enum : uint8_t { COL_UInt16, COL_UInt32, COL_String, COL_Guid, COL_Blob, COL_Index = 0x40, COL_Coded = 0x80 };
+
+		enum : uint8_t { CI_TypeDefOrRef, CI_HasConstant, CI_HasCustomAttribute, CI_HasFieldMarshal, CI_HasDeclSecurity,
+			CI_MemberRefParent, CI_HasSemantics, CI_MethodDefOrRef, CI_MemberForwarded, CI_Implementation,
+			CI_CustomAttributeType, CI_ResolutionScope, CI_TypeOrMethodDef, CI_Count };
+
+		const uint8_t NOT_USED = 0xFF;
+
+		struct CodedIndex
+		{
+			uint8_t tagBits;
+			std::vector<uint8_t> tables;
+		};
+
+		// ECMA-335 II.24.2.6
+		const CodedIndex CodedIndexes[CI_Count] = {
+			{ 2, { TBL_TypeDef, TBL_TypeRef, TBL_TypeSpec } },
+			{ 2, { TBL_Field, TBL_Param, TBL_Property } },
+			{ 5, { TBL_MethodDef, TBL_Field, TBL_TypeRef, TBL_TypeDef, TBL_Param, TBL_InterfaceImpl, TBL_MemberRef, TBL_Module,
+				TBL_DeclSecurity, TBL_Property, TBL_Event, TBL_StandAloneSig, TBL_ModuleRef, TBL_TypeSpec, TBL_Assembly,
+				TBL_AssemblyRef, TBL_File, TBL_ExportedType, TBL_ManifestResource, TBL_GenericParam, TBL_GenericParamConstraint,
+				TBL_MethodSpec } },
+			{ 1, { TBL_Field, TBL_Param } },
+			{ 2, { TBL_TypeDef, TBL_MethodDef, TBL_Assembly } },
+			{ 3, { TBL_TypeDef, TBL_TypeRef, TBL_ModuleRef, TBL_MethodDef, TBL_TypeSpec } },
+			{ 1, { TBL_Event, TBL_Property } },
+			{ 1, { TBL_MethodDef, TBL_MemberRef } },
+			{ 1, { TBL_Field, TBL_MethodDef } },
+			{ 2, { TBL_File, TBL_AssemblyRef, TBL_ExportedType } },
+			{ 3, { NOT_USED, NOT_USED, TBL_MethodDef, TBL_MemberRef, NOT_USED } },
+			{ 2, { TBL_Module, TBL_ModuleRef, TBL_AssemblyRef, TBL_TypeRef } },
+			{ 1, { TBL_TypeDef, TBL_MethodDef } },
+		};
+
+#define IDX(table) static_cast<uint8_t>(COL_Index + (table))
+#define CODED(index) static_cast<uint8_t>(COL_Coded + (index))
+
+		// ECMA-335 II.22, the columns of each table
+		const std::vector<uint8_t> Schema[TBL_Count] = {
+			/* Module */ { COL_UInt16, COL_String, COL_Guid, COL_Guid, COL_Guid },
+			/* TypeRef */ { CODED(CI_ResolutionScope), COL_String, COL_String },
+			/* TypeDef */ { COL_UInt32, COL_String, COL_String, CODED(CI_TypeDefOrRef), IDX(TBL_Field), IDX(TBL_MethodDef) },
+			/* FieldPtr */ { IDX(TBL_Field) },
+			/* Field */ { COL_UInt16, COL_String, COL_Blob },
+			/* MethodPtr */ { IDX(TBL_MethodDef) },
+			/* MethodDef */ { COL_UInt32, COL_UInt16, COL_UInt16, COL_String, COL_Blob, IDX(TBL_Param) },
+			/* ParamPtr */ { IDX(TBL_Param) },
+			/* Param */ { COL_UInt16, COL_UInt16, COL_String },
+			/* InterfaceImpl */ { IDX(TBL_TypeDef), CODED(CI_TypeDefOrRef) },
+			/* MemberRef */ { CODED(CI_MemberRefParent), COL_String, COL_Blob },
+			/* Constant */ { COL_UInt16, CODED(CI_HasConstant), COL_Blob },
+			/* CustomAttribute */ { CODED(CI_HasCustomAttribute), CODED(CI_CustomAttributeType), COL_Blob },
+			/* FieldMarshal */ { CODED(CI_HasFieldMarshal), COL_Blob },
+			/* DeclSecurity */ { COL_UInt16, CODED(CI_HasDeclSecurity), COL_Blob },
+			/* ClassLayout */ { COL_UInt16, COL_UInt32, IDX(TBL_TypeDef) },
+			/* FieldLayout */ { COL_UInt32, IDX(TBL_Field) },
+			/* StandAloneSig */ { COL_Blob },
+			/* EventMap */ { IDX(TBL_TypeDef), IDX(TBL_Event) },
+			/* EventPtr */ { IDX(TBL_Event) },
+			/* Event */ { COL_UInt16, COL_String, CODED(CI_TypeDefOrRef) },
+			/* PropertyMap */ { IDX(TBL_TypeDef), IDX(TBL_Property) },
+			/* PropertyPtr */ { IDX(TBL_Property) },
+			/* Property */ { COL_UInt16, COL_String, COL_Blob },
+			/* MethodSemantics */ { COL_UInt16, IDX(TBL_MethodDef), CODED(CI_HasSemantics) },
+			/* MethodImpl */ { IDX(TBL_TypeDef), CODED(CI_MethodDefOrRef), CODED(CI_MethodDefOrRef) },
+			/* ModuleRef */ { COL_String },
+			/* TypeSpec */ { COL_Blob },
+			/* ImplMap */ { COL_UInt16, CODED(CI_MemberForwarded), COL_String, IDX(TBL_ModuleRef) },
+			/* FieldRVA */ { COL_UInt32, IDX(TBL_Field) },
+			/* EncLog */ { COL_UInt32, COL_UInt32 },
+			/* EncMap */ { COL_UInt32 },
+			/* Assembly */ { COL_UInt32, COL_UInt16, COL_UInt16, COL_UInt16, COL_UInt16, COL_UInt32, COL_Blob, COL_String, COL_String },
+			/* AssemblyProcessor */ { COL_UInt32 },
+			/* AssemblyOS */ { COL_UInt32, COL_UInt32, COL_UInt32 },
+			/* AssemblyRef */ { COL_UInt16, COL_UInt16, COL_UInt16, COL_UInt16, COL_UInt32, COL_Blob, COL_String, COL_String, COL_Blob },
+			/* AssemblyRefProcessor */ { COL_UInt32, IDX(TBL_AssemblyRef) },
+			/* AssemblyRefOS */ { COL_UInt32, COL_UInt32, COL_UInt32, IDX(TBL_AssemblyRef) },
+			/* File */ { COL_UInt32, COL_String, COL_Blob },
+			/* ExportedType */ { COL_UInt32, COL_UInt32, COL_String, COL_String, CODED(CI_Implementation) },
+			/* ManifestResource */ { COL_UInt32, COL_UInt32, COL_String, CODED(CI_Implementation) },
+			/* NestedClass */ { IDX(TBL_TypeDef), IDX(TBL_TypeDef) },
+			/* GenericParam */ { COL_UInt16, COL_UInt16, CODED(CI_TypeOrMethodDef), COL_String },
+			/* MethodSpec */ { CODED(CI_MethodDefOrRef), COL_Blob },
+			/* GenericParamConstraint */ { IDX(TBL_GenericParam), CODED(CI_TypeDefOrRef) },
+		};
+
+#undef IDX
+#undef CODED
+
+		// the tables whose rows refer to others by position, or that must stay sorted
+		bool CanAppendRows(TableId table)
+		{
+			switch (table)
+			{
+			case TBL_TypeRef:
+			case TBL_MemberRef:
+			case TBL_StandAloneSig:
+			case TBL_ModuleRef:
+			case TBL_TypeSpec:
+			case TBL_AssemblyRef:
+			case TBL_MethodSpec:
+				return true;
+			default:
+				return false;
+			}
+		}
+
+		uint32_t Read(const uint8_t*& p, uint32_t size)
+		{
+			auto value = size == 2 ? ReadUInt16(p) : ReadUInt32(p);
+			p += size;
+			return value;
+		}
+
+		void Append(std::vector<uint8_t>& data, uint32_t value, uint32_t size)
+		{
+			for (uint32_t i = 0; i < size; i++)
+				data.push_back(static_cast<uint8_t>(value >> (i * 8)));
+		}
+
+		void Pad(std::vector<uint8_t>& data)
+		{
+			data.resize(Align(static_cast<uint32_t>(data.size()), 4), 0);
+		}
+	}
+
+	/// <summary>Read the metadata of an assembly</summary>
+	/// <exception cref="BadImageException">The metadata is malformed or not that of an assembly.</exception>
+	Metadata::Metadata(const uint8_t* pMetadata, uint32_t size)
+	{
+		if (size < 20 || ReadUInt32(pMetadata) != METADATA_SIGNATURE)
+			throw BadImageException("the metadata signature is missing");
+
+		auto versionLength = ReadUInt32(pMetadata + 12);
+		if (versionLength > size - 20)
+			throw BadImageException("the metadata header is truncated");
+		m_version.assign(reinterpret_cast<const char*>(pMetadata + 16), strnlen(reinterpret_cast<const char*>(pMetadata + 16), versionLength));
+
+		auto streamCount = ReadUInt16(pMetadata + 16 + versionLength + 2);
+		auto pHeader = pMetadata + 16 + versionLength + 4;
+		std::vector<uint8_t> tables;
+		for (auto i = 0; i < streamCount; i++)
+		{
+			if (pHeader + 9 > pMetadata + size)
+				throw BadImageException("the metadata stream headers are truncated");
+			auto offset = ReadUInt32(pHeader);
+			auto streamSize = ReadUInt32(pHeader + 4);
+			Stream stream;
+			stream.name.assign(reinterpret_cast<const char*>(pHeader + 8), strnlen(reinterpret_cast<const char*>(pHeader + 8), 32));
+			pHeader += 8 + Align(static_cast<uint32_t>(stream.name.size() + 1), 4);
+
+			if (offset > size || streamSize > size - offset)
+				throw BadImageException("a metadata stream is outside of the metadata");
+			if (stream.name == "#-")
+				throw BadImageException("unoptimized (edit and continue) metadata is not supported");
+			if (stream.name == "#~")
+				tables.assign(pMetadata + offset, pMetadata + offset + streamSize);
+			else
+				stream.data.assign(pMetadata + offset, pMetadata + offset + streamSize);
+			m_streams.push_back(stream);
+		}
+
+		if (tables.empty())
+			throw BadImageException("the metadata has no tables");
+		for (auto heap : { "#Strings", "#Blob" })
+		{
+			if (std::none_of(m_streams.begin(), m_streams.end(), [heap](const Stream& stream) { return stream.name == heap; }))
+			{
+				Stream stream;
+				stream.name = heap;
+				stream.data.push_back(0);
+				m_streams.push_back(stream);
+			}
+		}
+		ReadTables(tables);
+	}
+
+	void Metadata::ReadTables(const std::vector<uint8_t>& tables)
+	{
+		if (tables.size() < 24)
+			throw BadImageException("the metadata tables are truncated");
+
+		m_tablesMajorVersion = tables[4];
+		m_tablesMinorVersion = tables[5];
+		m_heapSizes = tables[6];
+		m_validTables = ReadUInt32(&tables[8]) | (static_cast<uint64_t>(ReadUInt32(&tables[12])) << 32);
+		m_sortedTables = ReadUInt32(&tables[16]) | (static_cast<uint64_t>(ReadUInt32(&tables[20])) << 32);
+		if ((m_validTables >> TBL_Count) != 0)
+			throw BadImageException("the metadata has tables that are not those of an assembly");
+
+		auto p = &tables[24];
+		auto end = tables.data() + tables.size();
+		m_rowCounts.fill(0);
+		for (auto table = 0; table < TBL_Count; table++)
+		{
+			if ((m_validTables & (1ull << table)) == 0)
+				continue;
+			if (p + 4 > end)
+				throw BadImageException("the metadata tables are truncated");
+			m_rowCounts[table] = Read(p, 4);
+		}
+		if ((m_heapSizes & 0x40) != 0)
+			p += 4;
+
+		for (auto table = 0; table < TBL_Count; table++)
+		{
+			const auto& columns = Schema[table];
+			uint32_t rowSize = 0;
+			for (auto column : columns)
+				rowSize += GetColumnSize(column, m_heapSizes, m_rowCounts);
+			if (static_cast<uint64_t>(rowSize) * m_rowCounts[table] > static_cast<uint64_t>(end - p))
+				throw BadImageException("the metadata tables are truncated");
+
+			auto& rows = m_rows[table];
+			rows.reserve(m_rowCounts[table] * columns.size());
+			for (uint32_t row = 0; row < m_rowCounts[table]; row++)
+			{
+				for (auto column : columns)
+					rows.push_back(Read(p, GetColumnSize(column, m_heapSizes, m_rowCounts)));
+			}
+		}
+	}
+
+	uint32_t Metadata::GetValue(TableId table, uint32_t row, int column) const
+	{
+		assert(row >= 1 && row <= m_rowCounts[table]);
+		return m_rows[table][((row - 1) * Schema[table].size()) + column];
+	}
+
+	void Metadata::SetValue(TableId table, uint32_t row, int column, uint32_t value)
+	{
+		assert(row >= 1 && row <= m_rowCounts[table]);
+		m_rows[table][((row - 1) * Schema[table].size()) + column] = value;
+	}
+
+	/// <summary>Append a row to a table that need not be sorted, e.g. a <c>TypeRef</c> or <c>MemberRef</c></summary>
+	/// <returns>The row added.</returns>
+	uint32_t Metadata::AddRow(TableId table, const std::vector<uint32_t>& values)
+	{
+		if (!CanAppendRows(table) || values.size() != Schema[table].size())
+			throw std::invalid_argument("rows can only be appended to the tables that need not be sorted");
+		m_rows[table].insert(m_rows[table].end(), values.begin(), values.end());
+		return ++m_rowCounts[table];
+	}
+
+	Metadata::Stream& Metadata::GetStream(const char* name)
+	{
+		return const_cast<Stream&>(static_cast<const Metadata*>(this)->GetStream(name));
+	}
+
+	const Metadata::Stream& Metadata::GetStream(const char* name) const
+	{
+		for (const auto& stream : m_streams)
+		{
+			if (stream.name == name)
+				return stream;
+		}
+		throw BadImageException(std::string("the metadata has no ") + name + " stream");
+	}
+
+	std::string Metadata::GetString(uint32_t index) const
+	{
+		const auto& strings = GetStream("#Strings").data;
+		if (index >= strings.size())
+			throw BadImageException("a string is outside of the strings heap");
+		auto pString = reinterpret_cast<const char*>(&strings[index]);
+		return std::string(pString, strnlen(pString, strings.size() - index));
+	}
+
+	/// <remarks>The length of a blob is compressed (ECMA-335 II.23.2).</remarks>
+	std::vector<uint8_t> Metadata::GetBlob(uint32_t index) const
+	{
+		const auto& blobs = GetStream("#Blob").data;
+		if (index >= blobs.size())
+			throw BadImageException("a blob is outside of the blob heap");
+		auto p = &blobs[index];
+		auto available = static_cast<uint32_t>(blobs.size() - index);
+		uint32_t length, lengthSize;
+		if ((p[0] & 0x80) == 0)
+		{
+			length = p[0];
+			lengthSize = 1;
+		}
+		else if ((p[0] & 0xC0) == 0x80 && available >= 2)
+		{
+			length = ((p[0] & 0x3F) << 8) | p[1];
+			lengthSize = 2;
+		}
+		else if ((p[0] & 0xE0) == 0xC0 && available >= 4)
+		{
+			length = ((p[0] & 0x1F) << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+			lengthSize = 4;
+		}
+		else
+			throw BadImageException("a blob is malformed");
+
+		if (length > available - lengthSize)
+			throw BadImageException("a blob is outside of the blob heap");
+		return std::vector<uint8_t>(p + lengthSize, p + lengthSize + length);
+	}
+
+	uint32_t Metadata::AddString(const std::string& value)
+	{
+		auto& strings = GetStream("#Strings").data;
+		auto index = static_cast<uint32_t>(strings.size());
+		strings.insert(strings.end(), value.begin(), value.end());
+		strings.push_back(0);
+		return index;
+	}
+
+	uint32_t Metadata::AddBlob(const std::vector<uint8_t>& value)
+	{
+		auto& blobs = GetStream("#Blob").data;
+		auto index = static_cast<uint32_t>(blobs.size());
+		auto length = static_cast<uint32_t>(value.size());
+		if (length < 0x80)
+			blobs.push_back(static_cast<uint8_t>(length));
+		else if (length < 0x4000)
+		{
+			blobs.push_back(static_cast<uint8_t>(0x80 | (length >> 8)));
+			blobs.push_back(static_cast<uint8_t>(length));
+		}
+		else
+		{
+			blobs.push_back(static_cast<uint8_t>(0xC0 | (length >> 24)));
+			blobs.push_back(static_cast<uint8_t>(length >> 16));
+			blobs.push_back(static_cast<uint8_t>(length >> 8));
+			blobs.push_back(static_cast<uint8_t>(length));
+		}
+		blobs.insert(blobs.end(), value.begin(), value.end());
+		return index;
+	}
+
+	/// <summary>The heaps whose indexes are 4 bytes; a heap that has grown past 64K needs them</summary>
+	uint8_t Metadata::GetHeapSizes() const
+	{
+		uint8_t heapSizes = m_heapSizes & (HEAP_STRING_4 | HEAP_GUID_4 | HEAP_BLOB_4);
+		for (const auto& stream : m_streams)
+		{
+			if (stream.name == "#Strings" && stream.data.size() > 0xFFFF)
+				heapSizes |= HEAP_STRING_4;
+			else if (stream.name == "#GUID" && stream.data.size() / 16 > 0xFFFF)
+				heapSizes |= HEAP_GUID_4;
+			else if (stream.name == "#Blob" && stream.data.size() > 0xFFFF)
+				heapSizes |= HEAP_BLOB_4;
+		}
+		return heapSizes;
+	}
+
+	/// <summary>The size of a column; an index is 2 bytes unless it can refer to a row (or heap offset) that does
+	/// not fit (ECMA-335 II.24.2.6)</summary>
+	uint32_t Metadata::GetColumnSize(uint8_t columnType, uint8_t heapSizes, const std::array<uint32_t, 64>& rowCounts)
+	{
+		switch (columnType)
+		{
+		case COL_UInt16:
+			return 2;
+		case COL_UInt32:
+			return 4;
+		case COL_String:
+			return (heapSizes & HEAP_STRING_4) != 0 ? 4 : 2;
+		case COL_Guid:
+			return (heapSizes & HEAP_GUID_4) != 0 ? 4 : 2;
+		case COL_Blob:
+			return (heapSizes & HEAP_BLOB_4) != 0 ? 4 : 2;
+		default:
+			break;
+		}
+
+		if (columnType < COL_Coded)
+			return rowCounts[columnType - COL_Index] > 0xFFFF ? 4 : 2;
+
+		const auto& codedIndex = CodedIndexes[columnType - COL_Coded];
+		uint32_t maxRows = 0;
+		for (auto table : codedIndex.tables)
+		{
+			if (table != NOT_USED)
+				maxRows = std::max(maxRows, rowCounts[table]);
+		}
+		return maxRows < (1u << (16 - codedIndex.tagBits)) ? 2 : 4;
+	}
+
+	std::vector<uint8_t> Metadata::WriteTables() const
+	{
+		auto heapSizes = GetHeapSizes();
+		auto validTables = m_validTables;
+		for (auto table = 0; table < TBL_Count; table++)
+		{
+			if (m_rowCounts[table] != 0)
+				validTables |= 1ull << table;
+		}
+
+		std::vector<uint8_t> tables;
+		Append(tables, 0, 4);
+		tables.push_back(m_tablesMajorVersion);
+		tables.push_back(m_tablesMinorVersion);
+		tables.push_back(heapSizes);
+		tables.push_back(1);
+		Append(tables, static_cast<uint32_t>(validTables), 4);
+		Append(tables, static_cast<uint32_t>(validTables >> 32), 4);
+		Append(tables, static_cast<uint32_t>(m_sortedTables), 4);
+		Append(tables, static_cast<uint32_t>(m_sortedTables >> 32), 4);
+		for (auto table = 0; table < TBL_Count; table++)
+		{
+			if ((validTables & (1ull << table)) != 0)
+				Append(tables, m_rowCounts[table], 4);
+		}
+
+		for (auto table = 0; table < TBL_Count; table++)
+		{
+			const auto& columns = Schema[table];
+			const auto& rows = m_rows[table];
+			for (size_t i = 0; i < rows.size(); i++)
+				Append(tables, rows[i], GetColumnSize(columns[i % columns.size()], heapSizes, m_rowCounts));
+		}
+		Pad(tables);
+		return tables;
+	}
+
+	/// <summary>Write the metadata, with the streams in their original order</summary>
+	std::vector<uint8_t> Metadata::Write() const
+	{
+		std::vector<std::vector<uint8_t>> streams;
+		for (const auto& stream : m_streams)
+		{
+			streams.push_back(stream.name == "#~" ? WriteTables() : stream.data);
+			Pad(streams.back());
+		}
+
+		auto versionLength = Align(static_cast<uint32_t>(m_version.size() + 1), 4);
+		uint32_t headerSize = 16 + versionLength + 4;
+		for (const auto& stream : m_streams)
+			headerSize += 8 + Align(static_cast<uint32_t>(stream.name.size() + 1), 4);
+
+		std::vector<uint8_t> metadata;
+		Append(metadata, METADATA_SIGNATURE, 4);
+		Append(metadata, 1, 2);
+		Append(metadata, 1, 2);
+		Append(metadata, 0, 4);
+		Append(metadata, versionLength, 4);
+		metadata.insert(metadata.end(), m_version.begin(), m_version.end());
+		metadata.resize(16 + versionLength, 0);
+		Append(metadata, 0, 2);
+		Append(metadata, static_cast<uint32_t>(m_streams.size()), 2);
+
+		auto offset = headerSize;
+		for (size_t i = 0; i < m_streams.size(); i++)
+		{
+			Append(metadata, offset, 4);
+			Append(metadata, static_cast<uint32_t>(streams[i].size()), 4);
+			metadata.insert(metadata.end(), m_streams[i].name.begin(), m_streams[i].name.end());
+			metadata.push_back(0);
+			Pad(metadata);
+			offset += static_cast<uint32_t>(streams[i].size());
+		}
+
+		for (const auto& stream : streams)
+			metadata.insert(metadata.end(), stream.begin(), stream.end());
+		return metadata;
+	}
+}
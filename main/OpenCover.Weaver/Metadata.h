@@ -0,0 +1,125 @@
+#pragma once
+
+#include "PeImage.h"
+
+#include <array>
+
+namespace Weaving
+{
+	/// <summary>The metadata tables of an assembly (ECMA-335 II.22)</summary>
+	enum TableId
+	{
+		TBL_Module = 0x00,
+		TBL_TypeRef = 0x01,
+		TBL_TypeDef = 0x02,
+		TBL_FieldPtr = 0x03,
+		TBL_Field = 0x04,
+		TBL_MethodPtr = 0x05,
+		TBL_MethodDef = 0x06,
+		TBL_ParamPtr = 0x07,
+		TBL_Param = 0x08,
+		TBL_InterfaceImpl = 0x09,
+		TBL_MemberRef = 0x0A,
+		TBL_Constant = 0x0B,
+		TBL_CustomAttribute = 0x0C,
+		TBL_FieldMarshal = 0x0D,
+		TBL_DeclSecurity = 0x0E,
+		TBL_ClassLayout = 0x0F,
+		TBL_FieldLayout = 0x10,
+		TBL_StandAloneSig = 0x11,
+		TBL_EventMap = 0x12,
+		TBL_EventPtr = 0x13,
+		TBL_Event = 0x14,
+		TBL_PropertyMap = 0x15,
+		TBL_PropertyPtr = 0x16,
+		TBL_Property = 0x17,
+		TBL_MethodSemantics = 0x18,
+		TBL_MethodImpl = 0x19,
+		TBL_ModuleRef = 0x1A,
+		TBL_TypeSpec = 0x1B,
+		TBL_ImplMap = 0x1C,
+		TBL_FieldRVA = 0x1D,
+		TBL_EncLog = 0x1E,
+		TBL_EncMap = 0x1F,
+		TBL_Assembly = 0x20,
+		TBL_AssemblyProcessor = 0x21,
+		TBL_AssemblyOS = 0x22,
+		TBL_AssemblyRef = 0x23,
+		TBL_AssemblyRefProcessor = 0x24,
+		TBL_AssemblyRefOS = 0x25,
+		TBL_File = 0x26,
+		TBL_ExportedType = 0x27,
+		TBL_ManifestResource = 0x28,
+		TBL_NestedClass = 0x29,
+		TBL_GenericParam = 0x2A,
+		TBL_MethodSpec = 0x2B,
+		TBL_GenericParamConstraint = 0x2C,
+		TBL_Count = 0x2D,
+	};
+
+	// the columns read or written by the weaver
+	enum { TypeRef_ResolutionScope = 0, TypeRef_TypeName = 1, TypeRef_TypeNamespace = 2 };
+	enum { MethodDef_RVA = 0, MethodDef_ImplFlags = 1, MethodDef_Flags = 2, MethodDef_Name = 3, MethodDef_Signature = 4 };
+	enum { MemberRef_Class = 0, MemberRef_Name = 1, MemberRef_Signature = 2 };
+	enum { Assembly_HashAlgId = 0, Assembly_MajorVersion = 1, Assembly_MinorVersion = 2, Assembly_BuildNumber = 3,
+		Assembly_RevisionNumber = 4, Assembly_Flags = 5, Assembly_PublicKey = 6, Assembly_Name = 7, Assembly_Culture = 8 };
+	enum { AssemblyRef_MajorVersion = 0, AssemblyRef_MinorVersion = 1, AssemblyRef_BuildNumber = 2, AssemblyRef_RevisionNumber = 3,
+		AssemblyRef_Flags = 4, AssemblyRef_PublicKeyOrToken = 5, AssemblyRef_Name = 6, AssemblyRef_Culture = 7, AssemblyRef_HashValue = 8 };
+
+	/// <summary>The tags of the coded indexes the weaver builds</summary>
+	enum { ResolutionScope_AssemblyRef = 2, MemberRefParent_TypeRef = 1 };
+
+	/// <summary>The metadata (ECMA-335 II.24) of an assembly, with its tables decoded into rows of column values
+	/// so that rows can be added, and the metadata written again, whatever that does to the size of the
+	/// indexes</summary>
+	/// <remarks><para>Rows are 1-based, as are the rows of metadata tokens. Rows can only be appended to the
+	/// tables that need not be sorted; every existing token stays valid.</para>
+	/// <para>Only the optimized (<c>#~</c>) tables stream of an assembly is supported.</para></remarks>
+	class Metadata
+	{
+	public:
+		Metadata(const uint8_t* pMetadata, uint32_t size);
+
+	public:
+		uint32_t GetRowCount(TableId table) const { return m_rowCounts[table]; }
+		uint32_t GetValue(TableId table, uint32_t row, int column) const;
+		void SetValue(TableId table, uint32_t row, int column, uint32_t value);
+		uint32_t AddRow(TableId table, const std::vector<uint32_t>& values);
+
+		std::string GetString(uint32_t index) const;
+		std::vector<uint8_t> GetBlob(uint32_t index) const;
+		uint32_t AddString(const std::string& value);
+		uint32_t AddBlob(const std::vector<uint8_t>& value);
+
+		std::vector<uint8_t> Write() const;
+
+	private:
+		struct Stream
+		{
+			std::string name;
+			std::vector<uint8_t> data;
+		};
+
+		void ReadTables(const std::vector<uint8_t>& tables);
+		std::vector<uint8_t> WriteTables() const;
+		Stream& GetStream(const char* name);
+		const Stream& GetStream(const char* name) const;
+
+		uint8_t GetHeapSizes() const;
+		static uint32_t GetColumnSize(uint8_t columnType, uint8_t heapSizes, const std::array<uint32_t, 64>& rowCounts);
+
+	private:
+		std::string m_version;
+		std::vector<Stream> m_streams;
+
+		uint8_t m_tablesMajorVersion;
+		uint8_t m_tablesMinorVersion;
+		uint8_t m_heapSizes;
+		uint64_t m_validTables;
+		uint64_t m_sortedTables;
+		std::array<uint32_t, 64> m_rowCounts;
+
+		// the column values of each table, row after row
+		std::array<std::vector<uint32_t>, TBL_Count> m_rows;
+	};
+}
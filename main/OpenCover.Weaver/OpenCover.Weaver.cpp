@@ -0,0 +1,97 @@
+// OpenCover.Weaver.cpp : weave the coverage probes into an assembly offline, so that it can be run without the
+// profiler; the visits are counted in a memory mapped counter file.
+
+#include "stdafx.h"
+#include "AssemblyWeaver.h"
+#include "CounterFile.h"
+#include "PointsFile.h"
+
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <map>
+
+namespace
+{
+	void Usage()
+	{
+		std::cerr << "Usage:" << std::endl
+			<< "    -input:<assembly>           the assembly to weave" << std::endl
+			<< "    -output:<assembly>          where to write the woven assembly" << std::endl
+			<< "    -points:<file>              the points of the methods of the assembly (see PointsFile.h)" << std::endl
+			<< "    -support:<assembly>         OpenCover.Support.dll, which must be deployed with the woven assembly" << std::endl
+			<< "    -counters:<file>            the counter file, created (or grown) to hold a counter per point;" << std::endl
+			<< "                                name it in OpenCover_CounterFile when the woven assembly is run" << std::endl;
+	}
+
+	std::vector<uint8_t> ReadFile(const std::string& path)
+	{
+		std::ifstream in(path, std::ios::binary);
+		if (!in)
+			throw std::runtime_error("unable to read " + path);
+		return std::vector<uint8_t>(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	std::map<std::string, std::string> arguments;
+	for (auto i = 1; i < argc; i++)
+	{
+		std::string argument(argv[i]);
+		auto separator = argument.find(':');
+		if (argument[0] != '-' || separator == std::string::npos)
+		{
+			Usage();
+			return 1;
+		}
+		arguments[argument.substr(1, separator - 1)] = argument.substr(separator + 1);
+	}
+	for (auto required : { "input", "output", "points", "support", "counters" })
+	{
+		if (arguments[required].empty())
+		{
+			Usage();
+			return 1;
+		}
+	}
+
+	try
+	{
+		std::ifstream pointsFile(arguments["points"]);
+		if (!pointsFile)
+			throw std::runtime_error("unable to read " + arguments["points"]);
+		auto methods = Weaving::ReadPoints(pointsFile);
+
+		auto support = Weaving::ReadSupportAssembly(Weaving::PeImage(ReadFile(arguments["support"])));
+		Weaving::AssemblyWeaver weaver(ReadFile(arguments["input"]), support);
+
+		uint32_t counters = 0;
+		auto woven = 0;
+		for (const auto& method : methods)
+		{
+			for (const auto& point : method.seqPoints)
+				counters = std::max(counters, point.UniqueId + 1);
+			for (const auto& point : method.brPoints)
+				counters = std::max(counters, point.UniqueId + 1);
+			if (weaver.WeaveMethod(method.functionToken, method.seqPoints, method.brPoints))
+				woven++;
+		}
+
+		auto image = weaver.Write();
+		std::ofstream out(arguments["output"], std::ios::binary | std::ios::trunc);
+		if (!out.write(reinterpret_cast<const char*>(image.data()), image.size()))
+			throw std::runtime_error("unable to write " + arguments["output"]);
+		if (!Weaving::PrepareCounterFile(arguments["counters"], counters))
+			throw std::runtime_error("unable to write " + arguments["counters"]);
+
+		std::cout << "Woven " << woven << " of " << methods.size() << " methods into " << arguments["output"] << std::endl;
+		return 0;
+	}
+	catch (const std::exception& ex)
+	{
+		std::cerr << "Unable to weave " << arguments["input"] << ": " << ex.what() << std::endl;
+		return 1;
+	}
+}
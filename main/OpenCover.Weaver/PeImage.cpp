@@ -0,0 +1,224 @@
+#include "stdafx.h"
+#include "PeImage.h"
+
+#include <algorithm>
+#include <cstring>
+
+namespace Weaving
+{
+	namespace
+	{
+		const uint16_t PE32_MAGIC = 0x10b;
+		const uint16_t PE32PLUS_MAGIC = 0x20b;
+
+		const int DIRECTORY_SECURITY = 4;
+		const int DIRECTORY_DEBUG = 6;
+		const int DIRECTORY_CLI_HEADER = 14;
+
+		const uint32_t SECTION_HEADER_SIZE = 40;
+		const uint32_t DEBUG_DIRECTORY_SIZE = 28;
+		const uint32_t CLI_HEADER_SIZE = 72;
+
+		const uint32_t SCN_CNT_INITIALIZED_DATA = 0x00000040;
+		const uint32_t SCN_MEM_READ = 0x40000000;
+
+		const uint32_t COMIMAGE_FLAGS_STRONGNAMESIGNED = 0x00000008;
+	}
+
+	/// <summary>Read the headers of a managed image</summary>
+	/// <exception cref="BadImageException">The image is not a managed PE file or, as it has been compiled ahead
+	/// of time (ReadyToRun/NGen), its IL would not be run.</exception>
+	PeImage::PeImage(std::vector<uint8_t> image) : m_image(std::move(image))
+	{
+		ReadHeaders();
+	}
+
+	void PeImage::ReadHeaders()
+	{
+		if (m_image.size() < 0x40 || m_image[0] != 'M' || m_image[1] != 'Z')
+			throw BadImageException("not a PE file");
+
+		auto peHeader = ReadUInt32(&m_image[0x3C]);
+		if (peHeader > m_image.size() - 24 || memcmp(&m_image[peHeader], "PE\0\0", 4) != 0)
+			throw BadImageException("not a PE file");
+
+		m_coffHeader = peHeader + 4;
+		m_numberOfSections = ReadUInt16(&m_image[m_coffHeader + 2]);
+		auto sizeOfOptionalHeader = ReadUInt16(&m_image[m_coffHeader + 16]);
+		m_optionalHeader = m_coffHeader + 20;
+		m_sectionHeaders = m_optionalHeader + sizeOfOptionalHeader;
+		if (m_sectionHeaders + (m_numberOfSections * SECTION_HEADER_SIZE) > m_image.size())
+			throw BadImageException("the section headers are truncated");
+
+		switch (ReadUInt16(&m_image[m_optionalHeader]))
+		{
+		case PE32_MAGIC:
+			m_numberOfDirectories = ReadUInt32(&m_image[m_optionalHeader + 92]);
+			m_directories = m_optionalHeader + 96;
+			break;
+		case PE32PLUS_MAGIC:
+			m_numberOfDirectories = ReadUInt32(&m_image[m_optionalHeader + 108]);
+			m_directories = m_optionalHeader + 112;
+			break;
+		default:
+			throw BadImageException("unknown optional header");
+		}
+		m_sectionAlignment = ReadUInt32(&m_image[m_optionalHeader + 32]);
+		m_fileAlignment = ReadUInt32(&m_image[m_optionalHeader + 36]);
+
+		if (m_numberOfDirectories <= DIRECTORY_CLI_HEADER || ReadUInt32(&m_image[GetDirectory(DIRECTORY_CLI_HEADER)]) == 0)
+			throw BadImageException("not a managed image");
+
+		m_cliHeader = RvaToOffset(ReadUInt32(&m_image[GetDirectory(DIRECTORY_CLI_HEADER)]), CLI_HEADER_SIZE);
+		if (ReadUInt32(&m_image[m_cliHeader + 64]) != 0)
+			throw BadImageException("the image has been compiled ahead of time so its IL would not be run");
+	}
+
+	PeImage::Section PeImage::ReadSection(int index) const
+	{
+		auto pHeader = &m_image[m_sectionHeaders + (index * SECTION_HEADER_SIZE)];
+		Section section;
+		section.virtualSize = ReadUInt32(pHeader + 8);
+		section.virtualAddress = ReadUInt32(pHeader + 12);
+		section.sizeOfRawData = ReadUInt32(pHeader + 16);
+		section.pointerToRawData = ReadUInt32(pHeader + 20);
+		return section;
+	}
+
+	uint32_t PeImage::RvaToOffset(uint32_t rva, uint32_t size) const
+	{
+		for (auto i = 0; i < m_numberOfSections; i++)
+		{
+			auto section = ReadSection(i);
+			if (rva >= section.virtualAddress && rva - section.virtualAddress <= section.sizeOfRawData
+				&& size <= section.sizeOfRawData - (rva - section.virtualAddress))
+			{
+				auto offset = section.pointerToRawData + (rva - section.virtualAddress);
+				if (offset > m_image.size() || size > m_image.size() - offset)
+					break;
+				return offset;
+			}
+		}
+		throw BadImageException("an RVA is outside of the image");
+	}
+
+	/// <summary>The (file) data at an RVA</summary>
+	const uint8_t* PeImage::GetData(uint32_t rva, uint32_t size) const
+	{
+		return &m_image[RvaToOffset(rva, size)];
+	}
+
+	/// <summary>The RVA a section added now would be given, after every existing section</summary>
+	uint32_t PeImage::GetNextSectionRva() const
+	{
+		uint32_t rva = 0;
+		for (auto i = 0; i < m_numberOfSections; i++)
+		{
+			auto section = ReadSection(i);
+			rva = std::max(rva, Align(section.virtualAddress + std::max(section.virtualSize, section.sizeOfRawData), m_sectionAlignment));
+		}
+		return rva;
+	}
+
+	/// <summary>Add a read only section, at <c>GetNextSectionRva</c>, to the end of the image</summary>
+	/// <remarks>Any data after the existing sections, e.g. an Authenticode signature (which would no
+	/// longer be valid), is dropped.</remarks>
+	void PeImage::AddSection(const char* name, const std::vector<uint8_t>& data)
+	{
+		RemoveCertificates();
+		MakeRoomForSectionHeader();
+
+		auto rva = GetNextSectionRva();
+		uint32_t pointerToRawData = 0;
+		for (auto i = 0; i < m_numberOfSections; i++)
+		{
+			auto section = ReadSection(i);
+			pointerToRawData = std::max(pointerToRawData, section.pointerToRawData + section.sizeOfRawData);
+		}
+		pointerToRawData = Align(pointerToRawData, m_fileAlignment);
+		auto sizeOfRawData = Align(static_cast<uint32_t>(data.size()), m_fileAlignment);
+
+		m_image.resize(pointerToRawData);
+		m_image.insert(m_image.end(), data.begin(), data.end());
+		m_image.resize(pointerToRawData + sizeOfRawData);
+
+		auto pHeader = &m_image[m_sectionHeaders + (m_numberOfSections * SECTION_HEADER_SIZE)];
+		memset(pHeader, 0, SECTION_HEADER_SIZE);
+		strncpy(reinterpret_cast<char*>(pHeader), name, 8);
+		WriteUInt32(pHeader + 8, static_cast<uint32_t>(data.size()));
+		WriteUInt32(pHeader + 12, rva);
+		WriteUInt32(pHeader + 16, sizeOfRawData);
+		WriteUInt32(pHeader + 20, pointerToRawData);
+		WriteUInt32(pHeader + 36, SCN_CNT_INITIALIZED_DATA | SCN_MEM_READ);
+
+		WriteUInt16(&m_image[m_coffHeader + 2], ++m_numberOfSections);
+		WriteUInt32(&m_image[m_optionalHeader + 8], ReadUInt32(&m_image[m_optionalHeader + 8]) + sizeOfRawData);
+		WriteUInt32(&m_image[m_optionalHeader + 56], Align(rva + static_cast<uint32_t>(data.size()), m_sectionAlignment));
+		WriteUInt32(&m_image[m_optionalHeader + 64], 0);
+	}
+
+	/// <summary>Point the CLI header at new metadata</summary>
+	/// <remarks>The strong name signature is no longer valid so the image is no longer marked as signed.</remarks>
+	void PeImage::SetMetadata(uint32_t rva, uint32_t size)
+	{
+		WriteUInt32(&m_image[m_cliHeader + 8], rva);
+		WriteUInt32(&m_image[m_cliHeader + 12], size);
+		WriteUInt32(&m_image[m_cliHeader + 16], ReadUInt32(&m_image[m_cliHeader + 16]) & ~COMIMAGE_FLAGS_STRONGNAMESIGNED);
+	}
+
+	/// <summary>Make sure there is room in the headers for one more section header</summary>
+	/// <remarks>The headers are usually a single file alignment unit, which the compilers fill with three
+	/// section headers, so the raw data of the sections is moved down the file (but not in memory).</remarks>
+	void PeImage::MakeRoomForSectionHeader()
+	{
+		auto needed = m_sectionHeaders + ((m_numberOfSections + 1) * SECTION_HEADER_SIZE);
+		auto firstRawData = static_cast<uint32_t>(m_image.size());
+		auto firstVirtualAddress = UINT32_MAX;
+		for (auto i = 0; i < m_numberOfSections; i++)
+		{
+			auto section = ReadSection(i);
+			if (section.sizeOfRawData != 0)
+				firstRawData = std::min(firstRawData, section.pointerToRawData);
+			firstVirtualAddress = std::min(firstVirtualAddress, section.virtualAddress);
+		}
+
+		auto sizeOfHeaders = Align(needed, m_fileAlignment);
+		if (sizeOfHeaders > firstVirtualAddress)
+			throw BadImageException("there is no room for another section header");
+
+		if (needed > firstRawData)
+		{
+			auto shift = Align(needed - firstRawData, m_fileAlignment);
+			m_image.insert(m_image.begin() + firstRawData, shift, 0);
+			for (auto i = 0; i < m_numberOfSections; i++)
+			{
+				auto pHeader = &m_image[m_sectionHeaders + (i * SECTION_HEADER_SIZE)];
+				if (ReadUInt32(pHeader + 16) != 0 && ReadUInt32(pHeader + 20) >= firstRawData)
+					WriteUInt32(pHeader + 20, ReadUInt32(pHeader + 20) + shift);
+			}
+
+			if (m_numberOfDirectories > DIRECTORY_DEBUG && ReadUInt32(&m_image[GetDirectory(DIRECTORY_DEBUG) + 4]) != 0)
+			{
+				auto debugDirectorySize = ReadUInt32(&m_image[GetDirectory(DIRECTORY_DEBUG) + 4]);
+				auto debugDirectory = RvaToOffset(ReadUInt32(&m_image[GetDirectory(DIRECTORY_DEBUG)]), debugDirectorySize);
+				for (uint32_t entry = 0; entry + DEBUG_DIRECTORY_SIZE <= debugDirectorySize; entry += DEBUG_DIRECTORY_SIZE)
+				{
+					auto pPointerToRawData = &m_image[debugDirectory + entry + 24];
+					if (ReadUInt32(pPointerToRawData) >= firstRawData)
+						WriteUInt32(pPointerToRawData, ReadUInt32(pPointerToRawData) + shift);
+				}
+			}
+		}
+
+		WriteUInt32(&m_image[m_optionalHeader + 60], std::max(sizeOfHeaders, ReadUInt32(&m_image[m_optionalHeader + 60])));
+		ReadHeaders();
+	}
+
+	void PeImage::RemoveCertificates()
+	{
+		if (m_numberOfDirectories <= DIRECTORY_SECURITY)
+			return;
+		WriteUInt32(&m_image[GetDirectory(DIRECTORY_SECURITY)], 0);
+		WriteUInt32(&m_image[GetDirectory(DIRECTORY_SECURITY) + 4], 0);
+	}
+}
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace Weaving
+{
+	/// <summary>The image (or its metadata) is not one that can be woven</summary>
+	class BadImageException : public std::runtime_error
+	{
+	public:
+		explicit BadImageException(const std::string& message) : std::runtime_error(message) {}
+	};
+
+	inline uint16_t ReadUInt16(const uint8_t* p) { return static_cast<uint16_t>(p[0] | (p[1] << 8)); }
+	inline uint32_t ReadUInt32(const uint8_t* p) { return p[0] | (p[1] << 8) | (p[2] << 16) | (static_cast<uint32_t>(p[3]) << 24); }
+	inline void WriteUInt16(uint8_t* p, uint16_t value) { p[0] = static_cast<uint8_t>(value); p[1] = static_cast<uint8_t>(value >> 8); }
+	inline void WriteUInt32(uint8_t* p, uint32_t value) { WriteUInt16(p, static_cast<uint16_t>(value)); WriteUInt16(p + 2, static_cast<uint16_t>(value >> 16)); }
+	inline uint32_t Align(uint32_t value, uint32_t alignment) { return (value + alignment - 1) & ~(alignment - 1); }
+
+	/// <summary>A managed PE (PE32 or PE32+) file, read and written with portable code</summary>
+	/// <remarks><para>Only what weaving needs is exposed: the RVAs of the method bodies and the metadata, and a
+	/// way to add a section for the rewritten bodies and metadata. Nothing already in the image is moved in
+	/// memory so every RVA in it stays valid.</para>
+	/// <para>All values are little endian and read byte by byte, so the host's layout and byte order do not
+	/// matter.</para></remarks>
+	class PeImage
+	{
+	public:
+		explicit PeImage(std::vector<uint8_t> image);
+
+	public:
+		const std::vector<uint8_t>& GetImage() const { return m_image; }
+
+		const uint8_t* GetData(uint32_t rva, uint32_t size) const;
+		uint32_t GetMetadataRva() const { return ReadUInt32(&m_image[m_cliHeader + 8]); }
+		uint32_t GetMetadataSize() const { return ReadUInt32(&m_image[m_cliHeader + 12]); }
+
+		uint32_t GetNextSectionRva() const;
+		void AddSection(const char* name, const std::vector<uint8_t>& data);
+		void SetMetadata(uint32_t rva, uint32_t size);
+
+	private:
+		struct Section
+		{
+			uint32_t virtualSize;
+			uint32_t virtualAddress;
+			uint32_t sizeOfRawData;
+			uint32_t pointerToRawData;
+		};
+
+		void ReadHeaders();
+		Section ReadSection(int index) const;
+		uint32_t RvaToOffset(uint32_t rva, uint32_t size) const;
+		uint32_t GetDirectory(int index) const { return m_directories + (index * 8); }
+		void MakeRoomForSectionHeader();
+		void RemoveCertificates();
+
+	private:
+		std::vector<uint8_t> m_image;
+
+		// file offsets of the headers
+		uint32_t m_coffHeader;
+		uint32_t m_optionalHeader;
+		uint32_t m_directories;
+		uint32_t m_sectionHeaders;
+		uint32_t m_cliHeader;
+
+		uint16_t m_numberOfSections;
+		uint32_t m_numberOfDirectories;
+		uint32_t m_sectionAlignment;
+		uint32_t m_fileAlignment;
+	};
+}
@@ -0,0 +1,74 @@
+#include "stdafx.h"
+#include "PointsFile.h"
+
+#include <algorithm>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+
+namespace Weaving
+{
+	namespace
+	{
+		bool ReadNumber(std::istringstream& line, unsigned long& value)
+		{
+			std::string text;
+			if (!(line >> text))
+				return false;
+			char* pEnd;
+			value = strtoul(text.c_str(), &pEnd, 0);
+			return *pEnd == '\0';
+		}
+	}
+
+	std::vector<MethodPoints> ReadPoints(std::istream& in)
+	{
+		std::vector<MethodPoints> methods;
+		std::string text;
+		for (auto lineNumber = 1; std::getline(in, text); lineNumber++)
+		{
+			std::istringstream line(text);
+			std::string kind;
+			if (!(line >> kind) || kind[0] == '#')
+				continue;
+
+			unsigned long values[3] = { 0, 0, 0 };
+			auto count = kind == "method" ? 1 : kind == "seq" ? 2 : kind == "branch" ? 3 : 0;
+			auto valid = count != 0 && (kind == "method" || !methods.empty());
+			for (auto i = 0; valid && i < count; i++)
+				valid = ReadNumber(line, values[i]);
+			std::string rest;
+			if (!valid || (line >> rest))
+				throw std::runtime_error("line " + std::to_string(lineNumber) + " of the points is malformed: " + text);
+
+			if (kind == "method")
+			{
+				MethodPoints method;
+				method.functionToken = static_cast<mdMethodDef>(values[0]);
+				methods.push_back(method);
+			}
+			else if (kind == "seq")
+			{
+				SequencePoint point = { static_cast<ULONG>(values[0]), static_cast<long>(values[1]) };
+				methods.back().seqPoints.push_back(point);
+			}
+			else
+			{
+				BranchPoint point = { static_cast<ULONG>(values[0]), static_cast<long>(values[1]), static_cast<long>(values[2]) };
+				methods.back().brPoints.push_back(point);
+			}
+		}
+
+		for (auto& method : methods)
+		{
+			std::stable_sort(method.seqPoints.begin(), method.seqPoints.end(),
+				[](const SequencePoint& left, const SequencePoint& right) { return left.Offset < right.Offset; });
+			std::stable_sort(method.brPoints.begin(), method.brPoints.end(),
+				[](const BranchPoint& left, const BranchPoint& right)
+			{
+				return left.Offset < right.Offset || (left.Offset == right.Offset && left.Path < right.Path);
+			});
+		}
+		return methods;
+	}
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include "../OpenCover.Profiler/Messages.h"
+
+#include <istream>
+#include <vector>
+
+namespace Weaving
+{
+	/// <summary>The points of a method, ordered by offset (and path)</summary>
+	struct MethodPoints
+	{
+		mdMethodDef functionToken;
+		std::vector<SequencePoint> seqPoints;
+		std::vector<BranchPoint> brPoints;
+	};
+
+	/// <summary>Read the points of the methods of an assembly, as precomputed by the host</summary>
+	/// <remarks><para>The file is text, a line per method or point; the points follow their method:</para>
+	/// <code>
+	/// # comment
+	/// method &lt;token&gt;
+	/// seq &lt;uniqueId&gt; &lt;offset&gt;
+	/// branch &lt;uniqueId&gt; &lt;offset&gt; &lt;path&gt;
+	/// </code>
+	/// <para>Numbers are decimal, or hexadecimal with a <c>0x</c> prefix.</para></remarks>
+	/// <exception cref="std::runtime_error">A line is malformed.</exception>
+	std::vector<MethodPoints> ReadPoints(std::istream& in);
+}
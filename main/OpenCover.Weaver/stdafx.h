@@ -0,0 +1,58 @@
+// stdafx.h : include file for standard system include files,
+// or project specific include files that are used frequently, but
+// are changed infrequently
+//
+
+#pragma once
+
+#ifdef _WIN32
+
+#include "targetver.h"
+
+#define _CRT_SECURE_NO_WARNINGS
+
+#include <stdio.h>
+#include <tchar.h>
+#include <crtdbg.h>
+
+// without ATL the rewriter's traces are only defined for debug builds (see ReleaseTrace.h)
+#define ATLTRACE(...) ((void)0)
+
+#pragma pack(push)
+#pragma pack(4)
+
+#include <cor.h>
+#include <corprof.h>
+#include <corhlpr.h>
+
+#pragma pack(pop)
+
+#else
+
+// only the file formats (PeImage, Metadata, CounterFile and PointsFile) are built elsewhere, see
+// CMakeLists.txt; these are the types they share with the profiler
+#include <cstdint>
+
+typedef int BOOL;
+typedef uint32_t DWORD;
+typedef int32_t LONG;
+typedef uint32_t ULONG;
+typedef wchar_t WCHAR;
+typedef uint32_t mdToken;
+typedef mdToken mdMethodDef;
+
+#endif
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <memory>
+
+#ifdef UNICODE
+#define tstring std::wstring
+#else
+#define tstring std::string
+#endif
+
+#include <inttypes.h>